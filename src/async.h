@@ -404,14 +404,15 @@ public:
 
 	void Done(T t)
 	{
-		{
-			AutoLock _(&lock_);
+		AutoLock _(&lock_);
 
-			result_ = t;
-			INVARIANT(!done_);
-			done_ = true;
-		}
+		result_ = t;
+		INVARIANT(!done_);
+		done_ = true;
 
+		/*
+		 * Under the lock, the waiter might be gone with us the moment it is let go
+		 */
 		cond_.Broadcast();
 	}
 
@@ -419,7 +420,7 @@ public:
 	{
 		AutoLock _(&lock_);
 
-		if (!done_) {
+		while (!done_) {
 			cond_.Wait(&lock_);
 			/*
 			 * Wait until processing is finished
@@ -438,6 +439,57 @@ private:
 	bool done_;
 };
 
+// ................................................................................. AsyncDrain ....
+
+/**
+ * Counts work in flight for a teardown to wait on. Whoever takes the count to zero wakes
+ * the waiter, and is not to touch the owner after Done.
+ */
+class AsyncDrain
+{
+public:
+
+	AsyncDrain() : lock_(/*isRecursive=*/ false), n_(0) {}
+
+	~AsyncDrain()
+	{
+		INVARIANT(!n_);
+	}
+
+	void Add()
+	{
+		AutoLock _(&lock_);
+		n_++;
+	}
+
+	void Done()
+	{
+		AutoLock _(&lock_);
+
+		INVARIANT(n_);
+
+		if (!--n_) {
+			/* same as AsyncWait::Done, the owner can go once we let go */
+			cond_.Broadcast();
+		}
+	}
+
+	void Wait()
+	{
+		AutoLock _(&lock_);
+
+		while (n_) {
+			cond_.Wait(&lock_);
+		}
+	}
+
+private:
+
+	PThreadMutex lock_;
+	WaitCondition cond_;
+	size_t n_;
+};
+
 } // namespace {
 
 #endif
@@ -10,7 +10,7 @@ BBlocks::Start()
 }
 
 void
-BBlocks::Start(const uint32_t ncores)
+BBlocks::Start(const uint32_t ncores, const bool workStealing, const bool reactor)
 {
 	/*
 	 * Prime up the GetHz function
@@ -22,7 +22,7 @@ BBlocks::Start(const uint32_t ncores)
 	 */
 	ThreadCtx::Init(/*tinst=*/ NULL);
 
-	NonBlockingThreadPool::Instance().Start(ncores);
+	NonBlockingThreadPool::Instance().Start(ncores, workStealing, reactor);
 }
 
 void
@@ -13,7 +13,8 @@ class BBlocks
 {
 public:
 
-	static void Start(const uint32_t ncores);
+	static void Start(const uint32_t ncores, const bool workStealing = false,
+			  const bool reactor = false);
 	static void Start();
 
 	static void Shutdown();
@@ -22,45 +23,58 @@ public:
 
 	static void Wakeup();
 
-	#define TP_SCHEDULE(n)									\
-	template<class _OBJ_, TDEF(T,n)>							\
-	static void Schedule(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))		\
-	{											\
-		NonBlockingThreadPool::Instance().Schedule(obj, fn, TARG(t,n));			\
-	}											\
-												\
-	template<class _OBJ_, TDEF(T,n)>							\
-	static void ScheduleIn(const uint32_t msec, _OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), \
-			       TPARAM(T,t,n))							\
-	{											\
-		NonBlockingThreadPool::Instance().ScheduleIn(msec, obj, fn, TARG(t,n));		\
-	}											\
-												\
-	template<class _OBJ_, TDEF(T, n)>							\
-	static void Yield(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))		\
-	{											\
-		NonBlockingThreadPool::Instance().Yield(obj, fn, TARG(t,n));			\
-	}											\
-	
-
-	TP_SCHEDULE(1) // void Schedule<T1>(...)
-	TP_SCHEDULE(2) // void Schedule<T1,T2>(...)
-	TP_SCHEDULE(3) // void Schedule<T1,T2,T3>(...)
-	TP_SCHEDULE(4) // void Schedule<T1,T2,T3,T4>(...)
+	template<class _OBJ_, class... Params, class... Args>
+	static void Schedule(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		NonBlockingThreadPool::Instance().Schedule(obj, fn, std::forward<Args>(args)...);
+	}
+
+	template<class _OBJ_, class... Params, class... Args>
+	static TimerHandle ScheduleIn(const uint32_t msec, _OBJ_ * obj,
+				      void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		return NonBlockingThreadPool::Instance().ScheduleIn(msec, obj, fn,
+								    std::forward<Args>(args)...);
+	}
+
+	template<class _OBJ_, class... Params, class... Args>
+	static TimerHandle ScheduleInMicroSec(const uint64_t usec, _OBJ_ * obj,
+					      void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		return NonBlockingThreadPool::Instance().ScheduleInMicroSec(
+					usec, obj, fn, std::forward<Args>(args)...);
+	}
+
+	template<class _OBJ_, class... Params, class... Args>
+	static void Yield(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		NonBlockingThreadPool::Instance().Yield(obj, fn, std::forward<Args>(args)...);
+	}
+
+	/**
+	 * Schedule a closure. Closures of up to CLOSURE_INLINE_SIZE bytes are kept inline in
+	 * the routine (see Closure).
+	 */
+	template<class F, class = EnableIfClosure<F> >
+	static void Schedule(F && f)
+	{
+		NonBlockingThreadPool::Instance().Schedule(std::forward<F>(f));
+	}
+
+	template<class F, class = EnableIfClosure<F> >
+	static void Yield(F && f)
+	{
+		NonBlockingThreadPool::Instance().Yield(std::forward<F>(f));
+	}
 
 	static void Schedule(ThreadRoutine * r);
 
-	#define TP_SCHEDULE_BARRIER(n)								\
-	template<class _OBJ_, TDEF(T,n)>							\
-	static void ScheduleBarrier(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))	\
-	{											\
-		NonBlockingThreadPool::Instance().ScheduleBarrier(obj, fn, TARG(t,n));		\
-	}											\
-
-	TP_SCHEDULE_BARRIER(1) // void ScheduleBarrier<T1>(...)
-	TP_SCHEDULE_BARRIER(2) // void ScheduleBarrier<T1,T2>(...)
-	TP_SCHEDULE_BARRIER(3) // void ScheduleBarrier<T1,T2,T3>(...)
-	TP_SCHEDULE_BARRIER(4) // void ScheduleBarrier<T1,T2,T3,T4>(...)
+	template<class _OBJ_, class... Params, class... Args>
+	static void ScheduleBarrier(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		NonBlockingThreadPool::Instance().ScheduleBarrier(obj, fn,
+								  std::forward<Args>(args)...);
+	}
 
 	static void ScheduleBarrier(ThreadRoutine * r);
 
@@ -68,12 +68,44 @@ public:
 		return IOBuffer(shared_ptr<uint8_t>((uint8_t *) ptr, MappedDalloc(size)), size);
 	}
 
+	/**
+	 * Wrap memory owned by a custom allocator, dalloc is invoked with the pointer once
+	 * the last reference to the buffer is gone
+	 */
+	template<class Dalloc>
+	static IOBuffer Attach(uint8_t * ptr, const size_t size, const Dalloc & dalloc)
+	{
+		return IOBuffer(shared_ptr<uint8_t>(ptr, dalloc), size);
+	}
+
 	/*
 	 * Create/destroy
 	 */
 	IOBuffer() : size_(0), off_(0) {}
+	IOBuffer(const IOBuffer &) = default;
 	virtual ~IOBuffer() {}
 
+	/*
+	 * Moving hands the reference over without touching the count
+	 */
+	IOBuffer(IOBuffer && rhs)
+		: data_(std::move(rhs.data_)), size_(rhs.size_), off_(rhs.off_)
+	{
+		rhs.size_ = rhs.off_ = 0;
+	}
+
+	IOBuffer & operator=(const IOBuffer &) = default;
+
+	IOBuffer & operator=(IOBuffer && rhs)
+	{
+		data_ = std::move(rhs.data_);
+		size_ = rhs.size_;
+		off_ = rhs.off_;
+		rhs.size_ = rhs.off_ = 0;
+
+		return *this;
+	}
+
 	uint8_t * operator->() { return data_.get() + off_; }
 	operator bool() const { return data_.get(); }
 
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <inttypes.h>
-#include <list>
 
 #include "schd/thread-ctx.h"
 #include "util.h"
@@ -11,6 +10,15 @@ namespace bblocks {
 
 //.................................................................................. BufferPool ....
 
+/**
+ * Per thread pool of fixed size blocks. The blocks are carved into size classes (see
+ * SizeClass), the block for T comes from the smallest class T fits in along with the
+ * owner word at the end of the block. Blocks are 64 B aligned unless T asks for 512 B or
+ * 4 KiB alignment with alignas. Objects larger than SizeClass::MAX_SIZE are not pooled.
+ *
+ * Blocks can be freed on any thread, they always go back to the thread that allocated
+ * them (see FreeList).
+ */
 class BufferPool : public Singleton<BufferPool>
 {
 public:
@@ -20,38 +28,67 @@ public:
 	{
 		INVARIANT(ThreadCtx::pool_);
 
-		void * ptr = NULL;
-		const size_t size = Math::Roundup(sizeof(T), 512);
-		const size_t id = (size / 512) - 1;
+		static_assert(alignof(T) <= SizeClass::MAX_ALIGN, "Unsupported alignment");
 
-		if (id >= SLAB_DEPTH || ThreadCtx::pool_[id].empty()) {
-			int status = posix_memalign(&ptr, 512, size);
-			INVARIANT(status != -1);
-			ThreadCtx::statHits_.Update(-1);
+		const size_t cls = Class<T>();
+		const size_t tier = SizeClass::Tier(alignof(T));
+
+		if (cls >= SizeClass::NCLASSES) {
+			void * ptr = NULL;
+			int status = posix_memalign(&ptr, SizeClass::Align(cls, tier), sizeof(T));
+			INVARIANT(!status);
 			return ptr;
 		}
 
-		ThreadCtx::statHits_.Update(id);
+		FreeList & pool = ThreadCtx::pool_->lists_[SizeClass::Index(cls, tier)];
 
-		uint8_t * data = ThreadCtx::pool_[id].front();
-		ThreadCtx::pool_[id].pop_front();
-		return data;
+		return pool.Alloc(SizeClass::Size(cls), SizeClass::Align(cls, tier));
 	}
 
+	/**
+	 * Free list that serves T on this thread, for the free, in-use and high-water stats
+	 */
 	template<class T>
-	static void Dalloc(T * t)
+	static const FreeList & Pool()
 	{
 		INVARIANT(ThreadCtx::pool_);
 
-		const size_t size = Math::Roundup(sizeof(T), 512);
-		const size_t id = (size / 512) - 1;
+		static_assert(Class<T>() < SizeClass::NCLASSES, "Not pooled");
+
+		const size_t tier = SizeClass::Tier(alignof(T));
+
+		return ThreadCtx::pool_->lists_[SizeClass::Index(Class<T>(), tier)];
+	}
+
+	template<class T>
+	static void Dalloc(T * t)
+	{
+		const size_t cls = Class<T>();
+		const size_t tier = SizeClass::Tier(alignof(T));
 
-		if (id >= SLAB_DEPTH) {
+		if (cls >= SizeClass::NCLASSES) {
 			::free((void *) t);
 			return;
 		}
 
-		ThreadCtx::pool_[id].push_back((uint8_t *) t);
+		FreeList * owner = FreeList::Owner(t, SizeClass::Size(cls));
+
+		if (ThreadCtx::pool_
+		    && owner == &ThreadCtx::pool_->lists_[SizeClass::Index(cls, tier)]) {
+			owner->Dalloc(t);
+			return;
+		}
+
+		owner->RemoteDalloc(t);
+	}
+
+	/**
+	 * Size class of T, including the owner word
+	 */
+	template<class T>
+	static constexpr size_t Class()
+	{
+		return SizeClass::Class(sizeof(T) + sizeof(FreeList *));
 	}
 };
 
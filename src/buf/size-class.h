@@ -0,0 +1,95 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+namespace bblocks {
+
+//................................................................................... SizeClass ....
+
+/**
+ * Size classes for the buffer pool.
+ *
+ * Sizes up to 64 B are spaced 16 B apart. Every power of two after that is split in four,
+ * so the classes grow in steps of at most 1.25x all the way up to MAX_SIZE :
+ *
+ * 16 32 48 64 | 80 96 112 128 | 160 192 224 256 | 320 384 448 512 | ... | 40K 48K 56K 64K
+ *
+ * Each class is kept in one of the alignment tiers. Blocks are cache line (64 B) aligned
+ * by default. Types that ask for more with alignas(512) or alignas(4096) get blocks from
+ * a separate tier, so the default tier never pays for the larger alignment.
+ */
+struct SizeClass
+{
+	static const size_t MIN_SIZE = 16;
+	static const size_t MAX_SIZE = 64 * 1024;
+	static const size_t NCLASSES = 44;
+
+	static const size_t DEFAULT_ALIGN = 64;
+	static const size_t MAX_ALIGN = 4096;
+	static const size_t NTIERS = 3; // 64, 512, 4096
+
+	/**
+	 * Size class for the given size, NCLASSES if it is too big to be pooled
+	 */
+	static constexpr size_t Class(const size_t size)
+	{
+		return size <= 64 ? (size ? (size - 1) / 16 : 0)
+			: size > MAX_SIZE ? NCLASSES
+			: 4 + (Log2(size - 1) - 6) * 4
+			    + ((size - 1 - (1ULL << Log2(size - 1))) >> (Log2(size - 1) - 2));
+	}
+
+	/**
+	 * Size of the blocks in a class
+	 */
+	static constexpr size_t Size(const size_t cls)
+	{
+		return cls < 4 ? (cls + 1) * 16
+			: (1ULL << (6 + (cls - 4) / 4))
+			  + (((cls - 4) % 4) + 1) * (1ULL << (4 + (cls - 4) / 4));
+	}
+
+	/**
+	 * Alignment tier for the requested alignment
+	 */
+	static constexpr size_t Tier(const size_t align)
+	{
+		return align <= DEFAULT_ALIGN ? 0 : align <= 512 ? 1 : 2;
+	}
+
+	/**
+	 * Alignment of the blocks of a class in a tier. Blocks smaller than a cache line are
+	 * aligned to their size, so they never straddle a cache line.
+	 */
+	static constexpr size_t Align(const size_t cls, const size_t tier)
+	{
+		return tier == 2 ? 4096 : tier == 1 ? 512
+			: Size(cls) >= DEFAULT_ALIGN ? DEFAULT_ALIGN
+			: (Size(cls) & -Size(cls));
+	}
+
+	/**
+	 * Index of the free list for a class in a tier
+	 */
+	static constexpr size_t Index(const size_t cls, const size_t tier)
+	{
+		return tier * NCLASSES + cls;
+	}
+
+	static const size_t NPOOLS = NCLASSES * NTIERS;
+
+private:
+
+	static constexpr size_t Log2(const size_t n)
+	{
+		return 63 - __builtin_clzll(n);
+	}
+};
+
+static_assert(SizeClass::Class(SizeClass::MAX_SIZE) == SizeClass::NCLASSES - 1,
+	      "Size class table is inconsistent");
+static_assert(SizeClass::Size(SizeClass::NCLASSES - 1) == SizeClass::MAX_SIZE,
+	      "Size class table is inconsistent");
+
+}
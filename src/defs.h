@@ -74,10 +74,12 @@
 
 #define MSEC_TO_SEC(x) ((x) / (double) 1000)
 #define MSEC_TO_NSEC(x) ((x) * 1000 * 1000)
+#define MSEC_TO_MICROSEC(x) ((x) * 1000)
 #define SEC_TO_MSEC(x) ((x) * 1000)
 #define SEC_TO_MICROSEC(x) ((x) * 1000 * 1000)
 #define NSEC_TO_MSEC(x) ((x) / (double) 1000000)
 #define NSEC_TO_MICROSEC(x) ((x) / (double) 1000)
+#define MICROSEC_TO_NSEC(x) ((x) * 1000)
 
 /*
  * Compile helpers
@@ -38,48 +38,76 @@ io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events,
 LinuxAioProcessor::LinuxAioProcessor(const size_t nrthreads, const size_t nreqs)
 	: log_("/linuxaioprocessor")
 	, lock_("/linuxaioprocessor")
+	, nrthreads_(nrthreads)
+	, nreqs_(nreqs)
+	, shared_(false)
+	, nextCtx_(0)
+	, statBatch_("/linuxaioprocessor/batch", "iocbs", PerfCounter::COUNTER)
+	, statReap_("/linuxaioprocessor/reap", "events", PerfCounter::COUNTER)
+	, statOverflow_("/linuxaioprocessor/overflow", "ops", PerfCounter::COUNTER)
 {
-	Guard _(&lock_);
+	INVARIANT(nrthreads_);
 
 	/*
-	 * Start polling threads
+	 * A batch for every pool thread there can be, they are bound to a context on first
+	 * use from the thread
 	 */
-	for (size_t i = 0; i < nrthreads; ++i) {
-		aio_context_t ctx;
-		InitAioCtx(ctx, nreqs);
-		ctxs_.push_back(ctx);
+	for (size_t i = 0; i < SysConf::NumCores(); ++i) {
+		batches_.push_back(new Batch(this));
 	}
 }
 
-void
-LinuxAioProcessor::InitAioCtx(aio_context_t & ctx, const size_t nreqs)
+LinuxAioProcessor::~LinuxAioProcessor()
 {
-	memset(&ctx, /*ch=*/ 0, sizeof(aio_context_t));
-	long status = io_setup(nreqs, &ctx);
-	INVARIANT(status != -1);
+	Guard _(&lock_);
 
-	INFO(log_) << "Starting aio thread ";
+	INFO(log_) << statBatch_;
+	INFO(log_) << statReap_;
+	INFO(log_) << statOverflow_;
 
-	PollThread * th = new PollThread(lock_, ctx, ops_);
-	INVARIANT(th);
+	auto dump = [this] (Op * op) {
+		ERROR(log_) << "Op in flight at shutdown. op: " << (uint64_t) op
+			    << " off: " << op->off_
+			    << " size: " << op->size_;
+	};
 
-	aioths_.push_back(th);
-	th->StartBlockingThread();
-}
+	for (auto b : batches_) {
+		INVARIANT(!b->n_ && !b->armed_);
 
-LinuxAioProcessor::~LinuxAioProcessor()
-{
-	Guard _(&lock_);
+		if (b->worker_) {
+			WorkerCtx * w = b->worker_;
+			w->ops_.ForEach(dump);
+			INVARIANT(!w->noverflow_);
+
+			const aio_context_t ctx = w->ctx_;
+			const int efd = w->efd_;
+
+			/*
+			 * The reactor owns the context from here on
+			 */
+			w->reactor_->Remove(efd, w);
+
+			long status = io_destroy(ctx);
+			INVARIANT(status != -1);
+			::close(efd);
+		}
+
+		delete b;
+	}
+	batches_.clear();
+
+	for (auto ctx : ctxs_) {
+		ctx->ops_.ForEach(dump);
+		INVARIANT(!ctx->noverflow_);
+	}
 
 	/* 
 	 * close aio context
 	 */
-	for (auto it = ctxs_.begin(); it != ctxs_.end(); ++it) {
-		aio_context_t & ctx = *it;
-		long status = io_destroy(ctx);
+	for (auto ctx : ctxs_) {
+		long status = io_destroy(ctx->ctx_);
 		INVARIANT(status != -1);
 	}
-	ctxs_.clear();
 
 	/*
 	 * stop and destroy threads
@@ -92,6 +120,70 @@ LinuxAioProcessor::~LinuxAioProcessor()
 		INFO(log_) << "Destroyed aio thread.";
 	}
 	aioths_.clear();
+
+	for (auto ctx : ctxs_) {
+		delete ctx;
+	}
+	ctxs_.clear();
+}
+
+void
+LinuxAioProcessor::StartSharedCtxs()
+{
+	Guard _(&lock_);
+
+	if (shared_) {
+		return;
+	}
+
+	/*
+	 * Start polling threads
+	 */
+	for (size_t i = 0; i < nrthreads_; ++i) {
+		AioCtx * ctx = new AioCtx(nreqs_);
+		ctxs_.push_back(ctx);
+
+		INFO(log_) << "Starting aio thread ";
+
+		PollThread * th = new PollThread(this, *ctx);
+		INVARIANT(th);
+
+		aioths_.push_back(th);
+		th->StartBlockingThread();
+	}
+
+	shared_.store(true, memory_order_release);
+}
+
+LinuxAioProcessor::AioCtx *
+LinuxAioProcessor::SharedCtx()
+{
+	if (!shared_.load(memory_order_acquire)) {
+		StartSharedCtxs();
+	}
+
+	return ctxs_[nextCtx_.fetch_add(1, memory_order_relaxed) % ctxs_.size()];
+}
+
+void
+LinuxAioProcessor::InitBatch(Batch & b, const uint32_t id)
+{
+	ASSERT(!b.ctx_);
+
+	if (!NonBlockingThreadPool::Instance().IsReactor()) {
+		/*
+		 * The threads are spread across the shared contexts
+		 */
+		if (!shared_.load(memory_order_acquire)) {
+			StartSharedCtxs();
+		}
+
+		b.ctx_ = ctxs_[id % ctxs_.size()];
+		return;
+	}
+
+	b.worker_ = new WorkerCtx(this, nreqs_);
+	b.ctx_ = b.worker_;
 }
 
 void
@@ -109,79 +201,512 @@ LinuxAioProcessor::UnregisterHandle(CHandle *, const AsyncProcessor::UnregisterD
 int
 LinuxAioProcessor::Write(Op * op)
 {
-	ASSERT(op->buf_.Ptr());
-	ASSERT(op->size_);
+	return Submit(op, op->iovcnt_ ? IOCB_CMD_PWRITEV : IOCB_CMD_PWRITE);
+}
+
+int
+LinuxAioProcessor::Read(Op * op)
+{
+	return Submit(op, op->iovcnt_ ? IOCB_CMD_PREADV : IOCB_CMD_PREAD);
+}
+
+int
+LinuxAioProcessor::Sync(Op * op)
+{
+	return Submit(op, IOCB_CMD_FDSYNC);
+}
+
+int
+LinuxAioProcessor::Submit(Op * op, const uint16_t opcode)
+{
+	ASSERT(opcode == IOCB_CMD_FDSYNC || op->buf_.Ptr());
+	ASSERT(opcode == IOCB_CMD_FDSYNC || op->size_);
 
 	iocb & cb = op->iocb_;
 
 	memset(&cb, 0, sizeof(iocb));
 	cb.aio_fildes = op->fd_;
-	cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb.aio_lio_opcode = opcode;
 	cb.aio_reqprio = 0;
-	cb.aio_buf = (u_int64_t) op->buf_.Ptr();
-	cb.aio_nbytes = op->size_;
 	cb.aio_offset = op->off_;
 	cb.aio_data = (u_int64_t) op;
 
+	if (opcode == IOCB_CMD_FDSYNC) {
+		/* no data */
+	} else if (op->iovcnt_) {
+		cb.aio_buf = (u_int64_t) op->iov_;
+		cb.aio_nbytes = op->iovcnt_;
+	} else {
+		cb.aio_buf = (u_int64_t) op->buf_.Ptr();
+		cb.aio_nbytes = op->size_;
+	}
+
 	op->piocb_[0] = &cb;
 
-	{
-		Guard _(&lock_);
-		ops_.Push(op);
+	DEBUG(log_) << "Submit: opcode:" << opcode
+		    << " op:" << (uint64_t) op
+		    << " off: " << op->off_
+		    << " size: " << op->size_;
+
+	NonBlockingThread * th = NonBlockingThread::current_;
+
+	if (!th || op->blocking_) {
+		/*
+		 * Not one of the pool threads, there is no routine end to flush at. Or the
+		 * thread is about to block on the op, and would neither get to the routine end
+		 * nor reap it.
+		 */
+		Admit(*SharedCtx(), op->piocb_, /*n=*/ 1);
+		return 1;
 	}
 
-	DEBUG(log_) << "io_submit: PWRITE op:" << (uint64_t) op
-	            << " off: " << op->off_
-		    << " size: " << op->size_;
+	Batch & b = *batches_[th->Id()];
 
-	aio_context_t & ctx = ctxs_[rand() % ctxs_.size()];
-	long status = io_submit(ctx, /*n=*/ 1, op->piocb_);
+	if (!b.ctx_) {
+		InitBatch(b, th->Id());
+	}
 
-	if (status != 1) {
-		ERROR(log_) << "Failed to submit io. PWRITE op: " << (uint64_t) op
-			    << " strerror: " << strerror(errno);
+	if (b.worker_) {
+		cb.aio_flags = IOCB_FLAG_RESFD;
+		cb.aio_resfd = b.worker_->efd_;
 	}
 
-	return status;
+	ASSERT(b.n_ < MAX_BATCH);
+	b.iocbs_[b.n_++] = &cb;
+
+	if (b.n_ == MAX_BATCH) {
+		FlushBatch(b);
+	} else {
+		th->AtRoutineEnd(&b);
+	}
+
+	/*
+	 * Same as io_submit, the number of ops submitted
+	 */
+	return 1;
 }
 
-int
-LinuxAioProcessor::Read(Op * op)
+void
+LinuxAioProcessor::Flush()
 {
-	ASSERT(op->buf_.Ptr());
-	ASSERT(op->size_);
+	NonBlockingThread * th = NonBlockingThread::current_;
 
-	iocb & cb = op->iocb_;
+	if (th) {
+		FlushBatch(*batches_[th->Id()]);
+	}
+}
 
-	memset(&cb, 0, sizeof(iocb));
-	cb.aio_fildes = op->fd_;
-	cb.aio_lio_opcode = IOCB_CMD_PREAD;
-	cb.aio_reqprio = 0;
-	cb.aio_buf = (u_int64_t) op->buf_.Ptr();
-	cb.aio_nbytes = op->size_;
-	cb.aio_offset = op->off_;
-	cb.aio_data = (u_int64_t) op;
+void
+LinuxAioProcessor::FlushBatch(Batch & b)
+{
+	if (!b.n_) {
+		return;
+	}
 
-	op->piocb_[0] = &cb;
+	statBatch_.Update(b.n_);
+
+	/*
+	 * The batch is reset before calling out, the handlers of the refused ops might
+	 * submit more
+	 */
+	iocb * iocbs[MAX_BATCH];
+	const size_t n = b.n_;
+
+	memcpy(iocbs, b.iocbs_, n * sizeof(iocb *));
+	b.n_ = 0;
+
+	Admit(*b.ctx_, iocbs, n);
+}
+
+LinuxAioProcessor::AioCtx *
+LinuxAioProcessor::CallerCtx()
+{
+	NonBlockingThread * th = NonBlockingThread::current_;
+
+	if (!th) {
+		if (!shared_.load(memory_order_acquire)) {
+			StartSharedCtxs();
+		}
+
+		/*
+		 * The one the next op goes to
+		 */
+		return ctxs_[nextCtx_.load(memory_order_relaxed) % ctxs_.size()];
+	}
+
+	Batch & b = *batches_[th->Id()];
+
+	if (!b.ctx_) {
+		InitBatch(b, th->Id());
+	}
+
+	return b.ctx_;
+}
+
+void
+LinuxAioProcessor::Admit(AioCtx & ctx, iocb ** iocbs, const size_t n)
+{
+	/*
+	 * Nobody gets ahead of the ops held back already
+	 */
+	const size_t m = ctx.noverflow_.load() ? 0 : ctx.Admit(n);
+
+	for (size_t i = m; i < n; ++i) {
+		Enqueue(ctx, (Op *) iocbs[i]->aio_data);
+	}
+
+	SubmitAdmitted(ctx, iocbs, m);
+
+	if (m < n) {
+		/*
+		 * The ops in flight might have completed before the rest were queued, with
+		 * nobody left to pick them up
+		 */
+		Drain(ctx);
+	}
+}
+
+bool
+LinuxAioProcessor::SubmitAdmitted(AioCtx & ctx, iocb ** iocbs, const size_t n)
+{
+	if (!n) {
+		return false;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		ctx.ops_.Add((Op *) iocbs[i]->aio_data);
+	}
+
+	/*
+	 * io_submit can take a part of the batch, and refuses the first iocb it could
+	 * not take. Keep going past the refused ones.
+	 */
+	vector<pair<Op *, int> > failed;
+	vector<Op *> refused;
+	size_t done = 0;
+
+	while (done < n) {
+		long status = io_submit(ctx.ctx_, n - done, iocbs + done);
+
+		if (status > 0) {
+			done += status;
+			continue;
+		}
+
+		/*
+		 * Before the logger gets a chance to clobber it. None taken and no error
+		 * means the kernel could not take it right now.
+		 */
+		const int err = status < 0 ? errno : EAGAIN;
+
+		Op * op = (Op *) iocbs[done]->aio_data;
+		++done;
+
+		if (err == EAGAIN) {
+			refused.push_back(op);
+			continue;
+		}
+
+		ERROR(log_) << "Failed to submit io. op: " << (uint64_t) op
+			    << " strerror: " << strerror(err);
+
+		failed.push_back(make_pair(op, -err));
+	}
+
+	/*
+	 * The kernel is out of room for now. The refused ops go back to the head of the
+	 * line for the completions of the ones in flight to pick up. With none in flight
+	 * there is nothing to wait for.
+	 */
+	if (!refused.empty() && ctx.inflight_.load() > refused.size() + failed.size()) {
+		for (auto op : refused) {
+			ctx.ops_.Remove(op);
+		}
+
+		{
+			Guard _(&ctx.lock_);
+
+			for (auto it = refused.rbegin(); it != refused.rend(); ++it) {
+				ctx.overflow_.Unpop(*it);
+			}
+
+			ctx.noverflow_ += refused.size();
+		}
+
+		ctx.inflight_ -= refused.size();
+	} else {
+		for (auto op : refused) {
+			ERROR(log_) << "Failed to submit io. op: " << (uint64_t) op
+				    << " strerror: " << strerror(EAGAIN);
+
+			failed.push_back(make_pair(op, -EAGAIN));
+		}
+
+		refused.clear();
+	}
+
+	for (auto & f : failed) {
+		ctx.ops_.Remove(f.first);
+		ctx.inflight_--;
+	}
+
+	/*
+	 * Same as Complete. The ops in flight might also have completed before the refused
+	 * ones were put back, with nobody left to pick them up.
+	 */
+	if (ctx.noverflow_.load() && (!failed.empty() || !ctx.inflight_.load())) {
+		Drain(ctx);
+	}
+
+	if (ctx.nwaiters_.load()) {
+		WakeWaiters(ctx);
+	}
+
+	for (auto & f : failed) {
+		f.first->ch_.Interrupt(f.second, f.first);
+	}
+
+	return !refused.empty();
+}
+
+void
+LinuxAioProcessor::Drain(AioCtx & ctx)
+{
+	while (true) {
+		iocb * iocbs[MAX_BATCH];
+		size_t n = 0;
+
+		{
+			Guard _(&ctx.lock_);
+
+			while (n < MAX_BATCH && !ctx.overflow_.IsEmpty() && ctx.Admit(/*n=*/ 1)) {
+				Op * op = ctx.overflow_.Pop();
+				ctx.noverflow_--;
+				iocbs[n++] = &op->iocb_;
+			}
+		}
+
+		if (!n) {
+			break;
+		}
+
+		if (SubmitAdmitted(ctx, iocbs, n)) {
+			/*
+			 * No use hammering the kernel, the next completion goes on from here
+			 */
+			break;
+		}
+	}
+}
+
+void
+LinuxAioProcessor::Enqueue(AioCtx & ctx, Op * op)
+{
+	Guard _(&ctx.lock_);
+
+	ctx.overflow_.Push(op);
+	ctx.noverflow_++;
+
+	statOverflow_.Update(1);
+}
+
+size_t
+LinuxAioProcessor::Credits()
+{
+	AioCtx * ctx = CallerCtx();
+	size_t n = ctx->Free();
+
+	NonBlockingThread * th = NonBlockingThread::current_;
+
+	if (th) {
+		/*
+		 * Spoken for by the ops batched up
+		 */
+		n -= std::min(n, batches_[th->Id()]->n_);
+	}
+
+	return n;
+}
+
+void
+LinuxAioProcessor::WaitCredits(const Fn<int> & ch)
+{
+	AioCtx * ctx = CallerCtx();
 
 	{
-		Guard _(&lock_);
-		ops_.Push(op);
+		Guard _(&ctx->lock_);
+
+		ctx->waiters_.push_back(ch);
+		ctx->nwaiters_++;
 	}
 
-	DEBUG(log_) << "io_submit: PREAD op:" << (uint64_t) op
-		    << " off: " << op->off_
-		    << " size: " << op->size_;
+	/*
+	 * The ops might have completed before we got in line
+	 */
+	WakeWaiters(*ctx);
+}
 
-	aio_context_t & ctx = ctxs_[rand() % ctxs_.size()];
-	long status = io_submit(ctx, /*n=*/ 1, op->piocb_);
+void
+LinuxAioProcessor::WakeWaiters(AioCtx & ctx)
+{
+	vector<Fn<int> > waiters;
 
-	if (status != 1) {
-	    ERROR(log_) << "Failed to submit io. PREAD op: " << (uint64_t) op
-		        << " strerror: " << strerror(errno);
+	{
+		Guard _(&ctx.lock_);
+
+		if (ctx.Free() < std::max<size_t>(ctx.nreqs_ / 4, 1)) {
+			return;
+		}
+
+		waiters.swap(ctx.waiters_);
+		ctx.nwaiters_ = 0;
 	}
 
-	return status;
+	for (auto & ch : waiters) {
+		ch.Wakeup(int(ctx.Free()));
+	}
+}
+
+void
+LinuxAioProcessor::Complete(AioCtx & ctx, const io_event & ev)
+{
+	DEBUG(log_) << "Event: data:" << ev.data
+		    << " res:" << ev.res;
+
+	Op * op = (Op *) ev.data;
+	INVARIANT(&op->iocb_ == ((iocb *) ev.obj));
+
+	ctx.ops_.Remove(op);
+	ctx.inflight_--;
+
+	/*
+	 * Room for the ops held back
+	 */
+	if (ctx.noverflow_.load()) {
+		Drain(ctx);
+	}
+
+	if (ctx.nwaiters_.load()) {
+		WakeWaiters(ctx);
+	}
+
+	/*
+	 * Callback interrupt
+	 */
+	op->ch_.Interrupt(int(ev.res), op);
+}
+
+void
+LinuxAioProcessor::Reap(AioCtx & ctx)
+{
+	AioRing * ring = (AioRing *) ctx.ctx_;
+
+	if (ring->magic_ != AIO_RING_MAGIC || ring->incompatFeatures_) {
+		/*
+		 * Not a ring layout we know of, let the kernel hand out the events
+		 */
+		io_event events[DEFAULT_MAX_EVENTS];
+		timespec timeout = { 0, 0 };
+		long n;
+
+		while ((n = io_getevents(ctx.ctx_, /*min_nr=*/ 0, DEFAULT_MAX_EVENTS, events,
+					 &timeout)) > 0) {
+			statReap_.Update(n);
+
+			for (long i = 0; i < n; ++i) {
+				Complete(ctx, events[i]);
+			}
+		}
+
+		return;
+	}
+
+	while (true) {
+		unsigned head = ring->head_;
+		const unsigned tail = __atomic_load_n(&ring->tail_, __ATOMIC_ACQUIRE);
+
+		if (head == tail) {
+			break;
+		}
+
+		statReap_.Update((tail + ring->nr_ - head) % ring->nr_);
+
+		while (head != tail) {
+			const io_event ev = ring->events_[head];
+
+			/*
+			 * Hand the slot back before calling out, the handler might submit more
+			 */
+			head = (head + 1) % ring->nr_;
+			__atomic_store_n(&ring->head_, head, __ATOMIC_RELEASE);
+
+			Complete(ctx, ev);
+		}
+	}
+}
+
+size_t
+LinuxAioProcessor::InFlight() const
+{
+	size_t n = 0;
+
+	for (auto b : batches_) {
+		if (b->worker_) {
+			n += b->worker_->ops_.Count();
+		}
+	}
+
+	for (auto ctx : ctxs_) {
+		n += ctx->ops_.Count();
+	}
+
+	return n;
+}
+
+// .................................................................. LinuxAioProcessor::AioCtx ....
+
+LinuxAioProcessor::AioCtx::AioCtx(const size_t nreqs)
+	: ctx_(0)
+	, nreqs_(nreqs)
+	/* room for what the context can take, with slack for a short probe */
+	, ops_(2 * nreqs)
+	, inflight_(0)
+	, lock_("/linuxaioprocessor/ctx")
+	, noverflow_(0)
+	, nwaiters_(0)
+{
+	long status = io_setup(nreqs, &ctx_);
+	INVARIANT(status != -1);
+}
+
+// ............................................................... LinuxAioProcessor::WorkerCtx ....
+
+LinuxAioProcessor::WorkerCtx::WorkerCtx(LinuxAioProcessor * aio, const size_t nreqs)
+	: AioCtx(nreqs)
+	, aio_(aio)
+	, efd_(-1)
+	, reactor_(NULL)
+{
+	efd_ = eventfd(/*initval=*/ 0, EFD_NONBLOCK | EFD_CLOEXEC);
+	INVARIANT(efd_ != -1);
+
+	/*
+	 * Called from the pool thread, we get its own reactor
+	 */
+	reactor_ = NonBlockingThreadPool::Instance().PickReactor();
+
+	bool ok = reactor_->Add(efd_, EPOLLIN, this);
+	INVARIANT(ok);
+}
+
+void
+LinuxAioProcessor::WorkerCtx::HandleEvent(const uint32_t events)
+{
+	uint64_t val;
+	ssize_t status = ::read(efd_, &val, sizeof(val));
+	(void) status;
+
+	aio_->Reap(*this);
 }
 
 // .............................................................. LinuxAioProcessor::PollThread ....
@@ -194,8 +719,9 @@ LinuxAioProcessor::PollThread::ThreadMain()
 	DisableThreadCancellation();
 
 	while (true) {
-		long status = io_getevents(ctx_, /*min_nr=*/ 1, sizeof(events) / sizeof(io_event),
-					   events, /*timeout=*/ NULL);
+		long status = io_getevents(ctx_.ctx_, /*min_nr=*/ 1,
+					   sizeof(events) / sizeof(io_event), events,
+					   /*timeout=*/ NULL);
 
 		if (status == 0) {
 			// no events returned
@@ -222,23 +748,7 @@ LinuxAioProcessor::PollThread::ThreadMain()
 		DEBUG(log_) << "Got events. status:" << status;
 
 		for (size_t i = 0; i < size_t(status); ++i) {
-			const io_event & ev = events[i];
-
-			DEBUG(log_) << "Event: data:" << ev.data
-				    << " res:" << ev.res;
-
-			Op * op = (Op *) ev.data;
-			INVARIANT(&op->iocb_ == ((iocb *) ev.obj));
-
-			{
-				Guard _(&lock_);
-				ops_.Unlink(op);
-			}
-
-			/*
-			 * Callback interrupt
-			 */
-			op->ch_.Interrupt(int(ev.res), op);
+			aio_->Complete(ctx_, events[i]);
 		}
 
 	}
@@ -255,6 +765,14 @@ SpinningDevice::SpinningDevice(const string & devPath,
 	, nsectors_(nsectors)
 	, aio_(aio)
 	, fd_(-1)
+	, registered_(false)
+	, elevator_(false)
+	, windowUs_(DEFAULT_MERGE_WINDOW_US)
+	, maxRequestSize_(DEFAULT_MAX_REQUEST_SIZE)
+	, lock_(log_)
+	, pendingBytes_(0)
+	, plugged_(false)
+	, statMerged_(log_ + "/merged", "requests", PerfCounter::COUNTER)
 {
 	ASSERT(aio);
 	ASSERT(nsectors);
@@ -265,6 +783,29 @@ SpinningDevice::SpinningDevice(const string & devPath,
 
 SpinningDevice::~SpinningDevice()
 {
+	if (elevator_) {
+		{
+			Guard _(&lock_);
+			INVARIANT(reads_.IsEmpty() && writes_.IsEmpty());
+
+			if (plugged_ && timer_.Cancel()) {
+				plugged_ = false;
+				timers_.Done();
+			}
+		}
+
+		/*
+		 * The timer might have fired already, Expire has to be done with us
+		 */
+		timers_.Wait();
+
+		INFO(log_) << statMerged_;
+	}
+
+	if (registered_) {
+		aio_->UnregisterFile(fd_);
+	}
+
 	aio_ = NULL;
 	close(fd_);
 }
@@ -273,17 +814,50 @@ int
 SpinningDevice::OpenDevice()
 {
 	fd_ = ::open(devPath_.c_str(), O_RDWR|O_CREAT|O_DIRECT, 0777);
+
+	if (fd_ != -1) {
+		registered_ = aio_->RegisterFile(fd_);
+	}
+
 	return fd_;
 }
 
+void
+SpinningDevice::EnableElevator(const uint32_t windowUs, const size_t maxRequestSize)
+{
+	INVARIANT(maxRequestSize >= SECTOR_SIZE);
+
+	elevator_ = true;
+	windowUs_ = windowUs;
+	maxRequestSize_ = maxRequestSize;
+}
+
 int
 SpinningDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
 		      const Fn<int> & cb)
+{
+	/*
+	 * The caller holds on to its reference, the op gets one of its own
+	 */
+	return Write(IOBuffer(buf), off, nblks, cb);
+}
+
+int
+SpinningDevice::Write(IOBuffer && buf, const diskoff_t off, const size_t nblks,
+		      const Fn<int> & cb)
 {
 	INVARIANT((off + nblks) <= nsectors_);
 
-	Op * op = new Op(fd_, buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE,
-			 intr_fn(this, &SpinningDevice::WriteDone), cb);
+	if (elevator_) {
+		PendingIO * io = new (BufferPool::Alloc<PendingIO>())
+					PendingIO(std::move(buf), off * SECTOR_SIZE,
+						  nblks * SECTOR_SIZE, cb);
+		return Queue(/*write=*/ true, io);
+	}
+
+	Op * op = new (BufferPool::Alloc<Op>()) Op(fd_, std::move(buf), off * SECTOR_SIZE,
+						   nblks * SECTOR_SIZE,
+						   intr_fn(this, &SpinningDevice::WriteDone), cb);
 
 	int status = aio_->Write(op);
 	return status;
@@ -292,10 +866,36 @@ SpinningDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nb
 int
 SpinningDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks)
 {
-    AsyncWait<int> waiter;
+	INVARIANT((off + nblks) <= nsectors_);
 
-    Write(buf, off, nblks, intr_fn(&waiter, &AsyncWait<int>::Done));
-    return waiter.Wait();
+	if (elevator_) {
+		/*
+		 * The requests held so far go first. The write itself is not held, nobody
+		 * would be around to let it go if we are blocking the thread the timer is on.
+		 */
+		Unplug();
+	}
+
+	/*
+	 * Same for the ops the thread has batched up, the routine is not going to end
+	 * while we wait
+	 */
+	aio_->Flush();
+
+	AsyncWait<int> waiter;
+
+	Op * op = new (BufferPool::Alloc<Op>()) Op(fd_, buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE,
+						   intr_fn(this, &SpinningDevice::WriteDone),
+						   intr_fn(&waiter, &AsyncWait<int>::Done));
+	op->blocking_ = true;
+
+	int status = aio_->Write(op);
+	if (status != 1) {
+		delete op;
+		return -1;
+	}
+
+	return waiter.Wait();
 }
 
 int
@@ -304,22 +904,265 @@ SpinningDevice::Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
 {
 	INVARIANT((off + nblks) <= nsectors_);
 
-	Op * op = new Op(fd_, buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE,
-	                intr_fn(this, &SpinningDevice::WriteDone), cb);
+	if (elevator_) {
+		PendingIO * io = new (BufferPool::Alloc<PendingIO>())
+					PendingIO(buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE, cb);
+		return Queue(/*write=*/ false, io);
+	}
+
+	Op * op = new (BufferPool::Alloc<Op>()) Op(fd_, buf, off * SECTOR_SIZE, nblks * SECTOR_SIZE,
+						   intr_fn(this, &SpinningDevice::WriteDone), cb);
 
 	int status = aio_->Read(op);
 	return status;
 }
 
+int
+SpinningDevice::Flush(const Fn<int> & ch)
+{
+	if (elevator_) {
+		/*
+		 * Writes held back are not completed yet, they are not covered but there is
+		 * no reason to keep them waiting
+		 */
+		Unplug();
+	}
+
+	Op * op = new (BufferPool::Alloc<Op>()) Op(fd_, IOBuffer(), /*off=*/ 0, /*size=*/ 0,
+						   intr_fn(this, &SpinningDevice::WriteDone), ch);
+
+	int status = aio_->Sync(op);
+	if (status != 1) {
+		delete op;
+	}
+
+	return status;
+}
+
 __interrupt__ void
 SpinningDevice::WriteDone(int res, AioProcessor::Op * op)
 {
 	Op * wop = (Op *) op;
-
-	wop->clientch_.Wakeup(res);
+	Fn<int> ch = wop->clientch_;
 
 	/*
-	 * we don't track the ops
+	 * we don't track the ops. The op goes back to the pool, and lets go of the buffer,
+	 * before the client hears of it so the next IO it issues can reuse both.
 	 */
 	delete wop;
+
+	ch.Wakeup(res);
+}
+
+//..................................................................... SpinningDevice elevator ....
+
+int
+SpinningDevice::Queue(const bool write, PendingIO * io)
+{
+	bool unplug = false;
+
+	{
+		Guard _(&lock_);
+
+		Hold(write ? writes_ : reads_, io);
+		pendingBytes_ += io->size_;
+
+		if (pendingBytes_ >= maxRequestSize_) {
+			/*
+			 * Enough to fill an op, no point in waiting any longer
+			 */
+			unplug = true;
+		} else if (!plugged_) {
+			plugged_ = true;
+			timers_.Add();
+			timer_ = BBlocks::ScheduleInMicroSec(windowUs_, this,
+							     &SpinningDevice::Expire);
+		}
+	}
+
+	if (unplug) {
+		Unplug();
+	}
+
+	/*
+	 * Same as the processor, the number of ops submitted
+	 */
+	return 1;
+}
+
+void
+SpinningDevice::Unplug()
+{
+	pending_list_t reads;
+	pending_list_t writes;
+
+	{
+		Guard _(&lock_);
+
+		reads.Swap(reads_);
+		writes.Swap(writes_);
+		pendingBytes_ = 0;
+
+		if (plugged_) {
+			/*
+			 * No-op if the timer has fired, Expire is done with it then
+			 */
+			if (timer_.Cancel()) {
+				timers_.Done();
+			}
+
+			plugged_ = false;
+		}
+	}
+
+	Dispatch(/*write=*/ true, writes);
+	Dispatch(/*write=*/ false, reads);
+}
+
+void
+SpinningDevice::Expire()
+{
+	Unplug();
+
+	/*
+	 * The destructor might be waiting on this, we are not to touch anything after
+	 */
+	timers_.Done();
+}
+
+void
+SpinningDevice::Hold(pending_list_t & pending, PendingIO * io)
+{
+	ASSERT(lock_.IsOwner());
+
+	/*
+	 * Requests mostly come in ascending order, look for the spot from the highest
+	 * offset down. Equal offsets keep the order they came in.
+	 */
+	PendingIO * pos = pending.Head();
+	while (pos && pos->off_ > io->off_) {
+		pos = pos->next_;
+	}
+
+	pending.InsertAfter(pos, io);
+}
+
+void
+SpinningDevice::Dispatch(const bool write, pending_list_t & pending)
+{
+	/*
+	 * Walk the requests in offset order and cut them in to runs of adjacent requests.
+	 * Overlapping requests are not merged, a vectored op can't tell which of the
+	 * overlapping writes should land last.
+	 */
+	vector<PendingIO *> ios;
+	size_t size = 0;
+
+	while (!pending.IsEmpty()) {
+		PendingIO * io = pending.Pop();
+
+		if (!ios.empty()) {
+			const PendingIO * last = ios.back();
+			const bool adjacent = last->off_ + last->size_ == io->off_;
+
+			if (!adjacent || size + io->size_ > maxRequestSize_ || ios.size() == IOV_MAX) {
+				Issue(write, ios);
+				ios.clear();
+				size = 0;
+			}
+		}
+
+		ios.push_back(io);
+		size += io->size_;
+	}
+
+	if (!ios.empty()) {
+		Issue(write, ios);
+	}
+}
+
+void
+SpinningDevice::Issue(const bool write, vector<PendingIO *> & ios)
+{
+	ASSERT(!ios.empty());
+
+	statMerged_.Update(ios.size());
+
+	if (ios.size() == 1) {
+		/*
+		 * Nothing to merge with, send it as is
+		 */
+		PendingIO * io = ios[0];
+
+		Op * op = new (BufferPool::Alloc<Op>()) Op(fd_, std::move(io->buf_), io->off_,
+							   io->size_,
+							   intr_fn(this, &SpinningDevice::WriteDone),
+							   io->ch_);
+		delete io;
+
+		int status = write ? aio_->Write(op) : aio_->Read(op);
+		if (status != 1) {
+			op->clientch_.Wakeup(/*status=*/ -1);
+			delete op;
+		}
+
+		return;
+	}
+
+	MergedOp * op = new MergedOp(fd_, ios, intr_fn(this, &SpinningDevice::MergedDone));
+
+	DEBUG(log_) << "Merged " << op->ios_.size() << " requests. off: " << op->off_
+		    << " size: " << op->size_;
+
+	int status = write ? aio_->Write(op) : aio_->Read(op);
+	if (status != 1) {
+		MergedDone(/*res=*/ -1, op);
+	}
+}
+
+__interrupt__ void
+SpinningDevice::MergedDone(int res, AioProcessor::Op * op)
+{
+	MergedOp * mop = (MergedOp *) op;
+
+	/*
+	 * Split the result across the requests. On a short op every request gets what
+	 * made it of its own range.
+	 */
+	size_t pos = 0;
+
+	for (auto io : mop->ios_) {
+		int status = res;
+
+		if (res >= 0) {
+			const size_t done = size_t(res) > pos ? size_t(res) - pos : 0;
+			status = int(std::min(done, io->size_));
+		}
+
+		pos += io->size_;
+
+		io->ch_.Wakeup(status);
+		delete io;
+	}
+
+	delete mop;
+}
+
+//.................................................................... SpinningDevice::MergedOp ....
+
+SpinningDevice::MergedOp::MergedOp(fd_t fd, vector<PendingIO *> & ios,
+				   const Fn2<int, AioProcessor::Op*> & opch)
+	: AioProcessor::Op(fd, ios[0]->buf_, ios[0]->off_, /*size=*/ 0, opch)
+	, ios_(ios)
+{
+	iovs_.resize(ios_.size());
+
+	for (size_t i = 0; i < ios_.size(); ++i) {
+		iovs_[i].iov_base = ios_[i]->buf_.Ptr();
+		iovs_[i].iov_len = ios_[i]->size_;
+		size_ += ios_[i]->size_;
+	}
+
+	iov_ = &iovs_[0];
+	iovcnt_ = iovs_.size();
 }
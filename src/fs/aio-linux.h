@@ -2,12 +2,17 @@
 #define _FS_AIO_LINUX_H_
 
 #include <linux/aio_abi.h>
+#include <sys/uio.h>
+#include <climits>
 
 #include "async.h"
 #include "logger.h"
 #include "inlist.hpp"
 #include "buf/buffer.h"
+#include "buf/bufpool.h"
 #include "schd/thread.h"
+#include "schd/thread-pool.h"
+#include "perf/perf-counter.h"
 
 namespace bblocks {
 
@@ -29,7 +34,23 @@ public:
 	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t size,
 			 const Fn<int> & ch) = 0;
 
+	/**
+	 * Make the writes completed so far durable, ch gets 0 once they are
+	 */
+	virtual int Flush(const Fn<int> & ch) = 0;
+
 	virtual disksize_t GetDeviceSize() = 0;
+
+	//.... optional ....//
+
+	/**
+	 * Same as above, the device takes the buffer over instead of sharing it
+	 */
+	virtual int Write(IOBuffer && buf, const diskoff_t off, const size_t size,
+			  const Fn<int> & h)
+	{
+		return Write(static_cast<const IOBuffer &>(buf), off, size, h);
+	}
 };
 
 //................................................................................ AioProcessor ....
@@ -48,12 +69,63 @@ public:
 
 	virtual int Read(Op * op) = 0;
 
+	/**
+	 * fdatasync op->fd_, the buffer and offset are not used
+	 */
+	virtual int Sync(Op * op) = 0;
+
+	//.... optional ....//
+
+	/**
+	 * Allocate a buffer the processor can do IO from most efficiently
+	 */
+	virtual IOBuffer AllocBuffer(const size_t size)
+	{
+		return IOBuffer::Alloc(size);
+	}
+
+	/**
+	 * Pin the fd with the processor so it is not looked up on every op
+	 *
+	 * @return	true if the fd is registered
+	 */
+	virtual bool RegisterFile(const fd_t fd)
+	{
+		return false;
+	}
+
+	virtual void UnregisterFile(const fd_t fd) {}
+
+	/**
+	 * Send the ops the calling thread has queued up so far to the device right away,
+	 * instead of when the current routine returns
+	 */
+	virtual void Flush() {}
+
+	/**
+	 * Ops the calling thread can submit before the processor starts holding them back
+	 */
+	virtual size_t Credits()
+	{
+		return SIZE_MAX;
+	}
+
+	/**
+	 * Call ch with the credits once the calling thread has a fair amount of them again,
+	 * right away if it has
+	 */
+	virtual void WaitCredits(const Fn<int> & ch)
+	{
+		Fn<int> fn(ch);
+		fn.Wakeup(INT_MAX);
+	}
+
 	struct Op : public InListElement<Op>
 	{
-		Op(const fd_t fd, const IOBuffer & buf, const diskoff_t off,
+		Op(const fd_t fd, IOBuffer buf, const diskoff_t off,
 		   const size_t size, const Fn2<int, Op*> & ch)
-			: fd_(fd), buf_(buf), off_(off)
-			, size_(size), ch_(ch)
+			: fd_(fd), buf_(std::move(buf)), off_(off)
+			, size_(size), ch_(ch), iov_(NULL), iovcnt_(0), blocking_(false), slot_(0)
 		{}
 
 		fd_t fd_;
@@ -61,19 +133,177 @@ public:
 		diskoff_t off_;
 		size_t size_;
 		CompletionHandler2<int, Op*> ch_;
+		const iovec * iov_;	// Vectored op if set, buf_ is the first segment
+		int iovcnt_;
+		bool blocking_;		// Submitter blocks until it completes
 		iocb iocb_;
 		iocb * piocb_[1];
+		uint32_t slot_;		// Private to the processor
 	};
 };
 
 //........................................................................... LinuxAioProcessor ....
 
+/**
+ * @class LinuxAioProcessor
+ *
+ * AioProcessor over the kernel aio interface. Ops submitted from the pool threads are
+ * queued per thread and sent with a single io_submit when the submitting routine returns
+ * or the batch fills up. Ops submitted from elsewhere are sent right away.
+ *
+ * When the pool runs in reactor mode every pool thread gets an aio context of its own.
+ * The kernel signals the completions on an eventfd polled by the thread's reactor, and
+ * the thread reaps them straight off the completion ring mapped in to user space. The
+ * completion handler runs on the thread that submitted the op, no poll thread is
+ * involved. In this mode the processor has to go away before the pool is shut down.
+ *
+ * Ops from outside the pool, and from the pool threads when not in reactor mode, go to a
+ * set of shared contexts reaped by dedicated poll threads. These are started on first use.
+ * So do the ops a pool thread blocks on, they are sent right away and reaped by somebody
+ * else.
+ *
+ * A context is never handed more ops than it was set up for. The ones it has no room for
+ * are held back in order and submitted as the ops in flight complete, so a burst is
+ * neither refused nor spun on. Credits tells the caller how much room is left, and
+ * WaitCredits lets it hold off until there is some.
+ */
 class LinuxAioProcessor : public AioProcessor
 {
 public:
 
 	static const size_t DEFAULT_NRTHREADS = 2; // ~1GBps
 	static const size_t DEFAULT_MAX_EVENTS = 1024;
+	static const size_t MAX_BATCH = 64;
+
+	//.... class InFlightOps ....//
+
+	/**
+	 * Ops in flight on an aio context. The submitters claim a slot and the reaper
+	 * releases it with a single atomic each, nobody takes a lock on the IO path. The
+	 * table is sized well above what the context can have in flight, so a free slot
+	 * turns up within a few probes.
+	 */
+	class InFlightOps
+	{
+	public:
+
+		InFlightOps(const size_t size)
+			: slots_(new atomic<Op *>[size])
+			, size_(size)
+			, next_(0)
+		{
+			for (size_t i = 0; i < size_; ++i) {
+				slots_[i] = NULL;
+			}
+		}
+
+		~InFlightOps()
+		{
+			INVARIANT(!Count());
+			delete[] slots_;
+		}
+
+		void Add(Op * op)
+		{
+			while (true) {
+				const uint32_t slot = next_.fetch_add(1, memory_order_relaxed) % size_;
+
+				Op * expected = NULL;
+				if (slots_[slot].compare_exchange_strong(expected, op)) {
+					op->slot_ = slot;
+					return;
+				}
+
+				Cpu::Relax();
+			}
+		}
+
+		void Remove(Op * op)
+		{
+			ASSERT(slots_[op->slot_] == op);
+			slots_[op->slot_].store(NULL, memory_order_release);
+		}
+
+		/**
+		 * Walk the ops in flight. This is a snapshot, meant for shutdown and debugging.
+		 */
+		template<class F>
+		void ForEach(const F & f) const
+		{
+			for (size_t i = 0; i < size_; ++i) {
+				Op * op = slots_[i].load(memory_order_acquire);
+				if (op) f(op);
+			}
+		}
+
+		size_t Count() const
+		{
+			size_t n = 0;
+			ForEach([&n] (Op *) { ++n; });
+			return n;
+		}
+
+	private:
+
+		atomic<Op *> * slots_;
+		const size_t size_;
+		atomic<uint32_t> next_;
+	};
+
+	//.... struct AioCtx ....//
+
+	/**
+	 * Aio context with admission control. Ops are handed to the kernel only as long as
+	 * the context has room for them, the rest wait in the overflow queue and go out as
+	 * the completions come in.
+	 */
+	struct AioCtx
+	{
+		AioCtx(const size_t nreqs);
+
+		virtual ~AioCtx() {}
+
+		/**
+		 * Claim credits for up to n ops
+		 *
+		 * @return	number of ops admitted
+		 */
+		size_t Admit(const size_t n)
+		{
+			size_t inflight = inflight_.load(memory_order_relaxed);
+
+			while (true) {
+				const size_t m = std::min(n, nreqs_ - std::min(inflight, nreqs_));
+
+				if (!m) {
+					return 0;
+				}
+
+				if (inflight_.compare_exchange_weak(inflight, inflight + m)) {
+					return m;
+				}
+			}
+		}
+
+		/**
+		 * Credits not claimed or spoken for by the overflow queue
+		 */
+		size_t Free() const
+		{
+			const size_t used = inflight_.load() + noverflow_.load();
+			return used < nreqs_ ? nreqs_ - used : 0;
+		}
+
+		aio_context_t ctx_;
+		const size_t nreqs_;
+		InFlightOps ops_;
+		atomic<size_t> inflight_;	// Handed to the kernel
+		SpinMutex lock_;		// Protects the overflow queue and waiters
+		InList<Op> overflow_;
+		atomic<size_t> noverflow_;
+		vector<Fn<int> > waiters_;	// Waiting for credits
+		atomic<size_t> nwaiters_;
+	};
 
 	//.... class PollThread ....//
 
@@ -81,9 +311,9 @@ public:
 	{
 	public:
 
-		PollThread(SpinMutex & lock, aio_context_t & ctx, InList<Op> & ops)
+		PollThread(LinuxAioProcessor * aio, AioCtx & ctx)
 		    : Thread("/linuxaioprocessor/th/" + STR(this))
-		    , lock_(lock), ctx_(ctx), ops_(ops)
+		    , aio_(aio), ctx_(ctx)
 		{
 		}
 
@@ -98,9 +328,8 @@ public:
 
 	private:
 
-		SpinMutex & lock_;
-		aio_context_t ctx_;
-		InList<Op> & ops_;
+		LinuxAioProcessor * aio_;
+		AioCtx & ctx_;
 	};
 
 	//.... create/destroy ....//
@@ -113,6 +342,15 @@ public:
 
 	virtual int Write(Op * op);
 	virtual int Read(Op * op);
+	virtual int Sync(Op * op);
+	virtual void Flush();
+	virtual size_t Credits();
+	virtual void WaitCredits(const Fn<int> & ch);
+
+	/**
+	 * Number of ops in flight across the contexts, a snapshot for debugging
+	 */
+	size_t InFlight() const;
 
 	//.... AsyncProcessor ....//
 
@@ -121,13 +359,104 @@ public:
 
 private:
 
-	void InitAioCtx(aio_context_t & ctx, const size_t nreqs);
+	/*
+	 * Layout of the completion ring the kernel maps at the address of an aio context
+	 */
+	struct AioRing
+	{
+		unsigned id_;
+		unsigned nr_;			// Number of io_events
+		unsigned head_;			// Next event to consume
+		unsigned tail_;			// Next event the kernel fills
+		unsigned magic_;
+		unsigned compatFeatures_;
+		unsigned incompatFeatures_;
+		unsigned headerLength_;
+		io_event events_[0];
+	};
+
+	static const unsigned AIO_RING_MAGIC = 0xa10a10a1;
+
+	/*
+	 * Context of a pool thread in reactor mode, the completions are signalled on the
+	 * eventfd polled by the thread's reactor. The reactor owns it once removed.
+	 */
+	struct WorkerCtx : AioCtx, ReactorHandle
+	{
+		WorkerCtx(LinuxAioProcessor * aio, const size_t nreqs);
+
+		virtual void HandleEvent(const uint32_t events) override;
+
+		LinuxAioProcessor * aio_;
+		int efd_;
+		Reactor * reactor_;
+	};
+
+	/*
+	 * Ops queued by a pool thread, only ever touched by that thread
+	 */
+	struct Batch : NonBlockingThread::RoutineEndHook
+	{
+		Batch(LinuxAioProcessor * aio)
+			: aio_(aio), ctx_(NULL), worker_(NULL), n_(0)
+		{}
+
+		virtual void RoutineEnd() override
+		{
+			aio_->FlushBatch(*this);
+		}
+
+		LinuxAioProcessor * aio_;
+		AioCtx * ctx_;			// Context the batch is submitted on
+		WorkerCtx * worker_;		// Same as ctx_ in reactor mode
+		iocb * iocbs_[MAX_BATCH];
+		size_t n_;
+	};
+
+	void StartSharedCtxs();
+	AioCtx * SharedCtx();
+	void InitBatch(Batch & b, const uint32_t id);
+	int Submit(Op * op, const uint16_t opcode);
+	void FlushBatch(Batch & b);
+
+	/* Context the calling thread submits to */
+	AioCtx * CallerCtx();
+
+	/* Admit what the context can take and queue up the rest */
+	void Admit(AioCtx & ctx, iocb ** iocbs, const size_t n);
+
+	/*
+	 * Hand admitted iocbs to the kernel
+	 *
+	 * @return	true if the kernel was out of room and some went back to the overflow queue
+	 */
+	bool SubmitAdmitted(AioCtx & ctx, iocb ** iocbs, const size_t n);
+
+	/* Submit from the overflow queue what the context has room for */
+	void Drain(AioCtx & ctx);
+
+	void Enqueue(AioCtx & ctx, Op * op);
+	void WakeWaiters(AioCtx & ctx);
+
+	/* Deliver a completion */
+	void Complete(AioCtx & ctx, const io_event & ev);
+
+	/* Deliver the completions on the ring without entering the kernel */
+	void Reap(AioCtx & ctx);
 
 	string log_;
 	SpinMutex lock_;
-	vector<aio_context_t> ctxs_;
+	const size_t nrthreads_;
+	const size_t nreqs_;
+	atomic<bool> shared_;		// Shared contexts are started
+	vector<AioCtx *> ctxs_;		// Shared contexts
 	vector<PollThread *> aioths_;
-	InList<Op> ops_;
+	vector<Batch *> batches_;	// Indexed by pool thread id
+	atomic<uint32_t> nextCtx_;	// Context for the next op from outside the pool
+
+	PerfCounter statBatch_;
+	PerfCounter statReap_;
+	PerfCounter statOverflow_;
 };
 
 //.............................................................................. SpinningDevice ....
@@ -139,6 +468,8 @@ public:
 	//.... static members ....//
 
 	static const uint64_t SECTOR_SIZE = 512; // 512 bytes
+	static const uint32_t DEFAULT_MERGE_WINDOW_US = 100;
+	static const size_t DEFAULT_MAX_REQUEST_SIZE = 512 * 1024; // 512 KiB
 
 	//.... callback defs ....//
 
@@ -154,13 +485,25 @@ public:
 
 	int OpenDevice();
 
+	/**
+	 * Put an elevator in front of the device. Requests are held for up to windowUs and
+	 * then sent in offset order, runs of adjacent requests going out as single vectored
+	 * ops of up to maxRequestSize bytes. The requests are let go early once that many
+	 * bytes are waiting. Must be called before any IO is issued.
+	 */
+	void EnableElevator(const uint32_t windowUs = DEFAULT_MERGE_WINDOW_US,
+			    const size_t maxRequestSize = DEFAULT_MAX_REQUEST_SIZE);
+
 	//.... BlockDevice override ....//
 
 	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
 		          const Fn<int> & ch);
+	virtual int Write(IOBuffer && buf, const diskoff_t off, const size_t nblks,
+			  const Fn<int> & ch);
 	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks);
 	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
 			 const Fn<int> & ch);
+	virtual int Flush(const Fn<int> & ch);
 
 	virtual disksize_t GetDeviceSize()
 	{
@@ -169,20 +512,63 @@ public:
 
 private:
 
-	struct Op : AioProcessor::Op
+	/*
+	 * Ops and held requests come from the buffer pool of the thread issuing them, the
+	 * steady state IO path does not touch the heap
+	 */
+	struct Op : AioProcessor::Op, BufferPoolObject<Op>
 	{
-		Op(fd_t fd, const IOBuffer & buf, const diskoff_t off, const size_t size,
+		Op(fd_t fd, IOBuffer buf, const diskoff_t off, const size_t size,
 		   const Fn2<int, AioProcessor::Op*> & opch, const Fn<int> & clientch)
-			: AioProcessor::Op(fd, buf, off, size, opch)
+			: AioProcessor::Op(fd, std::move(buf), off, size, opch)
 			, clientch_(clientch)
 		{}
 
 		Fn<int> clientch_;
 	};
 
+	/*
+	 * Request held by the elevator, linked in to the queue of its direction
+	 */
+	struct PendingIO : BufferPoolObject<PendingIO>, InListElement<PendingIO>
+	{
+		PendingIO(IOBuffer buf, const diskoff_t off, const size_t size,
+			  const Fn<int> & ch)
+			: buf_(std::move(buf)), off_(off), size_(size), ch_(ch)
+		{}
+
+		IOBuffer buf_;
+		diskoff_t off_;		// Bytes
+		size_t size_;		// Bytes
+		Fn<int> ch_;
+	};
+
+	/*
+	 * Run of adjacent requests sent as one vectored op
+	 */
+	struct MergedOp : AioProcessor::Op
+	{
+		MergedOp(fd_t fd, vector<PendingIO *> & ios, const Fn2<int, AioProcessor::Op*> & opch);
+
+		vector<PendingIO *> ios_;
+		vector<iovec> iovs_;
+	};
+
+	typedef InList<PendingIO> pending_list_t;	// Pops in offset order
+
+	//.... elevator ....//
+
+	int Queue(const bool write, PendingIO * io);
+	void Unplug();
+	void Expire();
+	void Hold(pending_list_t & pending, PendingIO * io);
+	void Dispatch(const bool write, pending_list_t & pending);
+	void Issue(const bool write, vector<PendingIO *> & ios);
+
 	//.... completion handlers ....//
 
 	__interrupt__ void WriteDone(int res, AioProcessor::Op * op);
+	__interrupt__ void MergedDone(int res, AioProcessor::Op * op);
 
 	//.... private members ....//
 
@@ -191,6 +577,21 @@ private:
 	const uint64_t nsectors_;
 	AioProcessor * aio_;
 	fd_t fd_;
+	bool registered_;
+
+	/* elevator */
+	bool elevator_;
+	uint32_t windowUs_;
+	size_t maxRequestSize_;
+	SpinMutex lock_;
+	pending_list_t reads_;		// Held reads by offset
+	pending_list_t writes_;		// Held writes by offset
+	size_t pendingBytes_;
+	bool plugged_;			// Timer is armed to let the requests go
+	TimerHandle timer_;
+	AsyncDrain timers_;		// Armed and not done expiring
+
+	PerfCounter statMerged_;
 };
 
 
@@ -0,0 +1,537 @@
+#include <algorithm>
+
+#include "bblocks.h"
+#include "fs/cached-block-device.h"
+
+using namespace bblocks;
+
+//........................................................................... CachedBlockDevice ....
+
+CachedBlockDevice::CachedBlockDevice(BlockDevice * dev, const size_t capacity)
+	: log_("/cachedblockdevice/" + STR(this))
+	, dev_(dev)
+	, npages_((dev->GetDeviceSize() + PAGE_SIZE - 1) / PAGE_SIZE)
+	, raLock_(log_ + "/ra")
+	, raExpect_(UINT64_MAX)
+	, raNext_(0)
+	, raWindow_(0)
+	, statHits_(log_ + "/hits", "pages", PerfCounter::COUNTER)
+	, statMisses_(log_ + "/misses", "pages", PerfCounter::COUNTER)
+	, statEvictions_(log_ + "/evictions", "pages", PerfCounter::COUNTER)
+	, statReadAhead_(log_ + "/readahead", "pages", PerfCounter::COUNTER)
+{
+	ASSERT(dev_);
+
+	const size_t c = std::max<size_t>(capacity / PAGE_SIZE / NSHARDS, 1);
+
+	for (size_t i = 0; i < NSHARDS; ++i) {
+		shards_.push_back(new Shard(log_ + "/shard/" + STR(i), c));
+	}
+
+	INFO(log_) << "CachedBlockDevice: capacity: " << c * NSHARDS << " pages";
+}
+
+CachedBlockDevice::~CachedBlockDevice()
+{
+	/*
+	 * Read-ahead is nobody's to wait for but ours
+	 */
+	loads_.Wait();
+
+	for (auto s : shards_) {
+		for (auto & it : s->pages_) {
+			Page * page = it.second;
+
+			INVARIANT(page->state_ != Page::LOADING);
+
+			Unlink(*s, page);
+			delete page;
+		}
+
+		s->pages_.clear();
+		delete s;
+	}
+
+	shards_.clear();
+
+	INFO(log_) << statHits_;
+	INFO(log_) << statMisses_;
+	INFO(log_) << statEvictions_;
+	INFO(log_) << statReadAhead_;
+}
+
+int
+CachedBlockDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			 const Fn<int> & ch)
+{
+	Invalidate(off, nblks);
+
+	WriteCtx * ctx = new WriteCtx(off, nblks, ch);
+	int status = dev_->Write(buf, off, nblks, intr_fn(this, &CachedBlockDevice::WriteDone, ctx));
+
+	if (status != 1) {
+		delete ctx;
+	}
+
+	return status;
+}
+
+int
+CachedBlockDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks)
+{
+	Invalidate(off, nblks);
+	int status = dev_->Write(buf, off, nblks);
+	Invalidate(off, nblks);
+
+	return status;
+}
+
+__interrupt__ void
+CachedBlockDevice::WriteDone(int status, WriteCtx * ctx)
+{
+	/*
+	 * Pages read while the write was on the way may have the old data
+	 */
+	Invalidate(ctx->off_, ctx->nblks_);
+
+	ctx->ch_.Wakeup(status);
+	delete ctx;
+}
+
+int
+CachedBlockDevice::Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			const Fn<int> & ch)
+{
+	ASSERT(nblks);
+
+	ReadCtx * ctx = new ReadCtx(buf, off * SpinningDevice::SECTOR_SIZE,
+				    nblks * SpinningDevice::SECTOR_SIZE, ch);
+
+	INVARIANT(ctx->off_ + ctx->size_ <= dev_->GetDeviceSize());
+
+	const uint64_t first = ctx->off_ / PAGE_SIZE;
+	const uint64_t last = (ctx->off_ + ctx->size_ - 1) / PAGE_SIZE;
+
+	vector<uint64_t> misses;
+
+	for (uint64_t pageno = first; pageno <= last; ++pageno) {
+		IOBuffer page;
+
+		switch (Lookup(pageno, ctx, page)) {
+		case HIT:
+			statHits_.Update(1);
+			CopyOut(ctx, pageno, page);
+			break;
+		case WAIT:
+			statMisses_.Update(1);
+			break;
+		case MISS:
+			statMisses_.Update(1);
+			misses.push_back(pageno);
+			break;
+		}
+	}
+
+	Load(misses);
+	ReadAhead(first, ctx->off_ + ctx->size_);
+
+	if (--ctx->pending_ == 0) {
+		/*
+		 * All hits, the caller is not expecting the completion before we return
+		 */
+		BBlocks::Schedule(this, &CachedBlockDevice::ReadDone, ctx);
+	}
+
+	return 1;
+}
+
+void
+CachedBlockDevice::CopyOut(ReadCtx * ctx, const uint64_t pageno, IOBuffer & page)
+{
+	const diskoff_t start = pageno * PAGE_SIZE;
+	const diskoff_t from = std::max(start, ctx->off_);
+	const diskoff_t to = std::min(start + PAGE_SIZE, ctx->off_ + ctx->size_);
+
+	ASSERT(from < to);
+
+	memcpy(ctx->buf_.Ptr() + (from - ctx->off_), page.Ptr() + (from - start), to - from);
+}
+
+void
+CachedBlockDevice::Release(ReadCtx * ctx)
+{
+	if (--ctx->pending_ == 0) {
+		ReadDone(ctx);
+	}
+}
+
+void
+CachedBlockDevice::ReadDone(ReadCtx * ctx)
+{
+	ctx->ch_.Wakeup(ctx->error_ ? -1 : int(ctx->size_));
+	delete ctx;
+}
+
+//....................................................................... CachedBlockDevice ARC ....
+
+CachedBlockDevice::LookupResult
+CachedBlockDevice::Lookup(const uint64_t pageno, ReadCtx * ctx, IOBuffer & buf)
+{
+	Shard & s = ShardOf(pageno);
+
+	Guard _(&s.lock_);
+
+	auto it = s.pages_.find(pageno);
+
+	if (it == s.pages_.end()) {
+		Page * page = new Page(pageno);
+		s.pages_.insert(make_pair(pageno, page));
+
+		if (ctx) {
+			ctx->pending_++;
+			page->waiters_.push_back(ctx);
+		}
+
+		return MISS;
+	}
+
+	Page * page = it->second;
+
+	switch (page->state_) {
+	case Page::T1:
+	case Page::T2:
+		if (ctx) {
+			/*
+			 * Seen again, to the MRU end of T2
+			 */
+			Unlink(s, page);
+
+			s.t2_.Push(page);
+			s.nt2_++;
+			page->state_ = Page::T2;
+			buf = page->buf_;
+		}
+		return HIT;
+
+	case Page::LOADING:
+		if (ctx) {
+			ctx->pending_++;
+			page->waiters_.push_back(ctx);
+		}
+		return WAIT;
+
+	case Page::B1:
+		Unlink(s, page);
+
+		if (ctx) {
+			/*
+			 * T1 was evicted from too early, let it grow
+			 */
+			const size_t delta = std::max<size_t>(s.nb2_ / std::max<size_t>(s.nb1_, 1), 1);
+			s.p_ = std::min(s.c_, s.p_ + delta);
+			page->ghost_ = Page::B1;
+		}
+		break;
+
+	case Page::B2:
+		Unlink(s, page);
+
+		if (ctx) {
+			/*
+			 * T2 was evicted from too early, let it grow
+			 */
+			const size_t delta = std::max<size_t>(s.nb1_ / std::max<size_t>(s.nb2_, 1), 1);
+			s.p_ -= std::min(s.p_, delta);
+			page->ghost_ = Page::B2;
+		}
+		break;
+	}
+
+	page->state_ = Page::LOADING;
+
+	if (ctx) {
+		ctx->pending_++;
+		page->waiters_.push_back(ctx);
+	}
+
+	return MISS;
+}
+
+void
+CachedBlockDevice::Insert(Shard & s, Page * page)
+{
+	ASSERT(page->state_ == Page::LOADING);
+
+	if (page->ghost_ != Page::LOADING) {
+		/*
+		 * Evicted not long ago, it is a frequent page
+		 */
+		Replace(s, /*fromB2=*/ page->ghost_ == Page::B2);
+
+		s.t2_.Push(page);
+		s.nt2_++;
+		page->state_ = Page::T2;
+		return;
+	}
+
+	if (s.nt1_ + s.nb1_ >= s.c_) {
+		if (s.nt1_ < s.c_) {
+			s.nb1_--;
+			Erase(s, s.b1_.Pop());
+			Replace(s, /*fromB2=*/ false);
+		} else {
+			/*
+			 * T1 alone fills the cache, the page is gone without a ghost
+			 */
+			s.nt1_--;
+			Erase(s, s.t1_.Pop());
+			statEvictions_.Update(1);
+		}
+	} else if (s.nt1_ + s.nt2_ + s.nb1_ + s.nb2_ >= s.c_) {
+		if (s.nt1_ + s.nt2_ + s.nb1_ + s.nb2_ >= 2 * s.c_ && s.nb2_) {
+			s.nb2_--;
+			Erase(s, s.b2_.Pop());
+		}
+
+		Replace(s, /*fromB2=*/ false);
+	}
+
+	s.t1_.Push(page);
+	s.nt1_++;
+	page->state_ = Page::T1;
+}
+
+void
+CachedBlockDevice::Replace(Shard & s, const bool fromB2)
+{
+	if (s.nt1_ + s.nt2_ < s.c_) {
+		/*
+		 * There is room still
+		 */
+		return;
+	}
+
+	Page * victim;
+
+	if (s.nt1_ && (s.nt1_ > s.p_ || (fromB2 && s.nt1_ == s.p_) || !s.nt2_)) {
+		victim = s.t1_.Pop();
+		s.nt1_--;
+		s.b1_.Push(victim);
+		s.nb1_++;
+		victim->state_ = Page::B1;
+	} else {
+		victim = s.t2_.Pop();
+		s.nt2_--;
+		s.b2_.Push(victim);
+		s.nb2_++;
+		victim->state_ = Page::B2;
+	}
+
+	victim->buf_.Reset();
+
+	statEvictions_.Update(1);
+}
+
+void
+CachedBlockDevice::Unlink(Shard & s, Page * page)
+{
+	switch (page->state_) {
+	case Page::T1: s.t1_.Unlink(page); s.nt1_--; break;
+	case Page::T2: s.t2_.Unlink(page); s.nt2_--; break;
+	case Page::B1: s.b1_.Unlink(page); s.nb1_--; break;
+	case Page::B2: s.b2_.Unlink(page); s.nb2_--; break;
+	default: DEADEND
+	}
+}
+
+void
+CachedBlockDevice::Erase(Shard & s, Page * page)
+{
+	ASSERT(!page->next_ && !page->prev_);
+
+	s.pages_.erase(page->pageno_);
+	delete page;
+}
+
+void
+CachedBlockDevice::Invalidate(const diskoff_t off, const size_t nblks)
+{
+	const uint64_t first = (off * SpinningDevice::SECTOR_SIZE) / PAGE_SIZE;
+	const uint64_t last = ((off + nblks) * SpinningDevice::SECTOR_SIZE - 1) / PAGE_SIZE;
+
+	for (uint64_t pageno = first; pageno <= last; ++pageno) {
+		Shard & s = ShardOf(pageno);
+
+		Guard _(&s.lock_);
+
+		auto it = s.pages_.find(pageno);
+		if (it == s.pages_.end()) {
+			continue;
+		}
+
+		Page * page = it->second;
+
+		switch (page->state_) {
+		case Page::LOADING:
+			page->stale_ = true;
+			break;
+		case Page::T1:
+		case Page::T2:
+			Unlink(s, page);
+			Erase(s, page);
+			break;
+		default:
+			/*
+			 * Ghosts have no data to go stale
+			 */
+			break;
+		}
+	}
+}
+
+//........................................................................ CachedBlockDevice IO ....
+
+void
+CachedBlockDevice::Load(const vector<uint64_t> & pagenos)
+{
+	size_t i = 0;
+
+	while (i < pagenos.size()) {
+		size_t n = 1;
+
+		while (i + n < pagenos.size() && pagenos[i + n] == pagenos[i] + n
+		       && n < MAX_FETCH_PAGES) {
+			++n;
+		}
+
+		LoadRun(pagenos[i], n);
+		i += n;
+	}
+}
+
+void
+CachedBlockDevice::LoadRun(const uint64_t first, const size_t npages)
+{
+	const diskoff_t start = first * PAGE_SIZE;
+	const diskoff_t end = std::min<diskoff_t>((first + npages) * PAGE_SIZE,
+						  dev_->GetDeviceSize());
+
+	Fetch * f = new Fetch(first, npages, end - start, IOBuffer::Alloc(npages * PAGE_SIZE));
+
+	loads_.Add();
+
+	int status = dev_->Read(f->buf_, start / SpinningDevice::SECTOR_SIZE,
+				f->size_ / SpinningDevice::SECTOR_SIZE,
+				intr_fn(this, &CachedBlockDevice::LoadDone, f));
+
+	if (status != 1) {
+		ERROR(log_) << "Error reading from device. off: " << start << " size: " << f->size_;
+		LoadDone(/*status=*/ -1, f);
+	}
+}
+
+__interrupt__ void
+CachedBlockDevice::LoadDone(int status, Fetch * f)
+{
+	const bool ok = status >= 0 && size_t(status) == f->size_;
+
+	for (size_t i = 0; i < f->npages_; ++i) {
+		const uint64_t pageno = f->first_ + i;
+		IOBuffer page = IOBuffer::Attach(f->buf_.Ptr() + i * PAGE_SIZE, PAGE_SIZE,
+						 SliceDalloc(f->buf_));
+		vector<ReadCtx *> waiters;
+
+		{
+			Shard & s = ShardOf(pageno);
+
+			Guard _(&s.lock_);
+
+			auto it = s.pages_.find(pageno);
+			INVARIANT(it != s.pages_.end());
+
+			Page * p = it->second;
+			INVARIANT(p->state_ == Page::LOADING);
+
+			waiters.swap(p->waiters_);
+
+			if (ok && !p->stale_) {
+				p->buf_ = page;
+				Insert(s, p);
+			} else {
+				Erase(s, p);
+			}
+		}
+
+		for (auto ctx : waiters) {
+			if (ok) {
+				CopyOut(ctx, pageno, page);
+			} else {
+				ctx->error_ = true;
+			}
+
+			Release(ctx);
+		}
+	}
+
+	delete f;
+
+	/*
+	 * The destructor might be waiting on this, we are not to touch anything after
+	 */
+	loads_.Done();
+}
+
+void
+CachedBlockDevice::ReadAhead(const uint64_t first, const diskoff_t end)
+{
+	const uint64_t last = (end - 1) / PAGE_SIZE;
+	uint64_t from;
+	uint64_t to;
+
+	{
+		Guard _(&raLock_);
+
+		const bool seq = first == raExpect_;
+		raExpect_ = end / PAGE_SIZE;
+
+		if (!seq) {
+			raWindow_ = 0;
+			raNext_ = 0;
+			return;
+		}
+
+		raWindow_ = raWindow_ ? std::min<size_t>(raWindow_ * 2, size_t(MAX_READ_AHEAD_PAGES))
+				      : size_t(MIN_READ_AHEAD_PAGES);
+
+		if (raNext_ > last + 1 + raWindow_ / 2) {
+			/*
+			 * Far enough ahead still
+			 */
+			return;
+		}
+
+		from = std::max(raNext_, last + 1);
+		to = std::min(last + 1 + raWindow_, npages_);
+
+		if (from >= to) {
+			return;
+		}
+
+		raNext_ = to;
+	}
+
+	vector<uint64_t> misses;
+
+	for (uint64_t pageno = from; pageno < to; ++pageno) {
+		IOBuffer page;
+
+		if (Lookup(pageno, /*ctx=*/ NULL, page) == MISS) {
+			misses.push_back(pageno);
+		}
+	}
+
+	if (!misses.empty()) {
+		statReadAhead_.Update(misses.size());
+		Load(misses);
+	}
+}
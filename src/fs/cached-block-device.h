@@ -0,0 +1,235 @@
+#ifndef _FS_CACHED_BLOCK_DEVICE_H_
+#define _FS_CACHED_BLOCK_DEVICE_H_
+
+#include <atomic>
+#include <vector>
+#include <tr1/unordered_map>
+
+#include "fs/aio-linux.h"
+
+namespace bblocks {
+
+//........................................................................... CachedBlockDevice ....
+
+/**
+ * @class CachedBlockDevice
+ *
+ * Page cache in front of a BlockDevice. The device is cached in 4 KiB pages, the cache is
+ * split in shards by page number and every shard runs ARC over its share of the capacity,
+ * so a scan does not flush out the pages that are read over and over.
+ *
+ * A read copies the pages it finds out of the cache and reads the rest from the device,
+ * runs of missing pages with a single IO. The pages are kept as slices of the buffer they
+ * were read into. A miss on a page somebody is already reading waits for that read instead
+ * of issuing another one.
+ *
+ * Reads continuing where the last one left off grow a read-ahead window, a read elsewhere
+ * collapses it.
+ *
+ * Writes go to the device. The pages they touch are dropped before the write is issued and
+ * once again when it is done, a read of a page racing with the write is not cached.
+ *
+ * Completions are never called before Read returns.
+ */
+class CachedBlockDevice : public CHandle, public BlockDevice
+{
+public:
+
+	static const size_t PAGE_SIZE = 4096;
+	static const size_t NSHARDS = 16;
+	static const size_t MAX_FETCH_PAGES = 32;	// 128 KiB
+	static const size_t MIN_READ_AHEAD_PAGES = 4;
+	static const size_t MAX_READ_AHEAD_PAGES = 64;	// 256 KiB
+
+	/**
+	 * @param	capacity	Bytes of data to cache
+	 */
+	CachedBlockDevice(BlockDevice * dev, const size_t capacity);
+	virtual ~CachedBlockDevice();
+
+	//.... BlockDevice override ....//
+
+	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			  const Fn<int> & ch) override;
+	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks) override;
+	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			 const Fn<int> & ch) override;
+
+	virtual int Flush(const Fn<int> & ch) override
+	{
+		return dev_->Flush(ch);
+	}
+
+	virtual disksize_t GetDeviceSize() override
+	{
+		return dev_->GetDeviceSize();
+	}
+
+private:
+
+	struct ReadCtx;
+
+	/*
+	 * Cached page, or the ghost of a page recently evicted
+	 */
+	struct Page : InListElement<Page>
+	{
+		enum State
+		{
+			LOADING = 0,	// Being read from the device
+			T1,		// Seen once recently
+			T2,		// Seen at least twice recently
+			B1,		// Ghost evicted from T1
+			B2,		// Ghost evicted from T2
+		};
+
+		Page(const uint64_t pageno)
+			: pageno_(pageno), state_(LOADING), ghost_(LOADING), stale_(false)
+		{}
+
+		const uint64_t pageno_;
+		State state_;
+		State ghost_;			// Ghost list the page was loaded from, if any
+		bool stale_;			// Written while loading, not to be cached
+		IOBuffer buf_;
+		vector<ReadCtx *> waiters_;	// Reads waiting for the page to load
+	};
+
+	typedef tr1::unordered_map<uint64_t, Page *> page_map_t;
+
+	/*
+	 * ARC over a share of the pages
+	 */
+	struct Shard
+	{
+		Shard(const string & log, const size_t capacity)
+			: lock_(log), c_(capacity), p_(0), nt1_(0), nt2_(0), nb1_(0), nb2_(0)
+		{}
+
+		SpinMutex lock_;
+		page_map_t pages_;
+		InList<Page> t1_, t2_, b1_, b2_;
+		const size_t c_;		// Pages
+		size_t p_;			// Target size of T1
+		size_t nt1_, nt2_, nb1_, nb2_;
+	};
+
+	/*
+	 * Read in progress
+	 */
+	struct ReadCtx
+	{
+		ReadCtx(const IOBuffer & buf, const diskoff_t off, const size_t size,
+			const Fn<int> & ch)
+			: buf_(buf), off_(off), size_(size), ch_(ch), pending_(1), error_(false)
+		{}
+
+		IOBuffer buf_;
+		const diskoff_t off_;		// Bytes
+		const size_t size_;		// Bytes
+		Fn<int> ch_;
+		atomic<size_t> pending_;	// Pages to come + one held by Read
+		atomic<bool> error_;
+	};
+
+	/*
+	 * Run of pages read with one IO
+	 */
+	struct Fetch
+	{
+		Fetch(const uint64_t first, const size_t npages, const size_t size,
+		      const IOBuffer & buf)
+			: first_(first), npages_(npages), size_(size), buf_(buf)
+		{}
+
+		const uint64_t first_;
+		const size_t npages_;
+		const size_t size_;		// Bytes read, short of the pages at the device end
+		IOBuffer buf_;
+	};
+
+	struct WriteCtx
+	{
+		WriteCtx(const diskoff_t off, const size_t nblks, const Fn<int> & ch)
+			: off_(off), nblks_(nblks), ch_(ch)
+		{}
+
+		const diskoff_t off_;
+		const size_t nblks_;
+		Fn<int> ch_;
+	};
+
+	/*
+	 * Keep the buffer a page is sliced from alive
+	 */
+	struct SliceDalloc
+	{
+		SliceDalloc(const IOBuffer & buf) : buf_(buf) {}
+
+		void operator()(uint8_t *) {}
+
+		IOBuffer buf_;
+	};
+
+	enum LookupResult
+	{
+		HIT = 0,
+		WAIT,		// Somebody is reading it already
+		MISS,		// Caller has to read it
+	};
+
+	Shard & ShardOf(const uint64_t pageno)
+	{
+		return *shards_[pageno % NSHARDS];
+	}
+
+	//.... cache ....//
+
+	/**
+	 * Look the page up for ctx, or for read-ahead if ctx is NULL. A read-ahead hit
+	 * does not count as an access.
+	 */
+	LookupResult Lookup(const uint64_t pageno, ReadCtx * ctx, IOBuffer & buf);
+	void Insert(Shard & s, Page * page);
+	void Replace(Shard & s, const bool fromB2);
+	void Unlink(Shard & s, Page * page);
+	void Erase(Shard & s, Page * page);
+	void Invalidate(const diskoff_t off, const size_t nblks);
+
+	//.... IO ....//
+
+	void Load(const vector<uint64_t> & pagenos);
+	void LoadRun(const uint64_t first, const size_t npages);
+	void ReadAhead(const uint64_t first, const diskoff_t end);
+	void CopyOut(ReadCtx * ctx, const uint64_t pageno, IOBuffer & page);
+	void Release(ReadCtx * ctx);
+	void ReadDone(ReadCtx * ctx);
+
+	//.... completion handlers ....//
+
+	__interrupt__ void LoadDone(int status, Fetch * f);
+	__interrupt__ void WriteDone(int status, WriteCtx * ctx);
+
+	//.... members ....//
+
+	const string log_;
+	BlockDevice * dev_;
+	const uint64_t npages_;		// Pages on the device
+	vector<Shard *> shards_;
+	AsyncDrain loads_;		// Device reads in flight
+
+	/* read-ahead */
+	SpinMutex raLock_;
+	uint64_t raExpect_;		// Page the next sequential read starts at
+	uint64_t raNext_;		// First page not read ahead yet
+	size_t raWindow_;		// Pages
+
+	PerfCounter statHits_;
+	PerfCounter statMisses_;
+	PerfCounter statEvictions_;
+	PerfCounter statReadAhead_;
+};
+
+} // namespace bblocks {
+
+#endif /* _FS_CACHED_BLOCK_DEVICE_H_ */
@@ -0,0 +1,751 @@
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fs/io-uring-linux.h"
+
+using namespace bblocks;
+
+//.................................................................... io_uring syscall wrapper ....
+
+static int
+io_uring_setup(unsigned entries, io_uring_params * p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			     /*sig=*/ NULL, /*sigsz=*/ 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+//......................................................................... IoUringBufferRegion ....
+
+IoUringBufferRegion::IoUringBufferRegion(const size_t size)
+	: log_("/iouringbufferregion")
+	, lock_(log_)
+	, base_(NULL)
+	, size_(Round(size))
+	, next_(0)
+{
+	void * ptr = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+			  /*fd=*/ -1, /*offset=*/ 0);
+	INVARIANT(ptr != MAP_FAILED);
+	base_ = (uint8_t *) ptr;
+}
+
+IoUringBufferRegion::~IoUringBufferRegion()
+{
+	int status = munmap(base_, size_);
+	INVARIANT(status == 0);
+}
+
+uint8_t *
+IoUringBufferRegion::Alloc(const size_t size)
+{
+	const size_t n = Round(size);
+
+	Guard _(&lock_);
+
+	auto it = free_.find(n);
+	if (it != free_.end() && !it->second.empty()) {
+		uint8_t * ptr = it->second.back();
+		it->second.pop_back();
+		return ptr;
+	}
+
+	if (next_ + n > size_) {
+		return NULL;
+	}
+
+	uint8_t * ptr = base_ + next_;
+	next_ += n;
+	return ptr;
+}
+
+void
+IoUringBufferRegion::Free(uint8_t * ptr, const size_t size)
+{
+	ASSERT(Contains(ptr, size));
+
+	Guard _(&lock_);
+	free_[size].push_back(ptr);
+}
+
+//......................................................................... IoUringAioProcessor ....
+
+bool
+IoUringAioProcessor::IsSupported()
+{
+	io_uring_params p;
+	memset(&p, /*ch=*/ 0, sizeof(p));
+
+	const int fd = io_uring_setup(/*entries=*/ 1, &p);
+	if (fd == -1) {
+		return false;
+	}
+
+	::close(fd);
+	return true;
+}
+
+IoUringAioProcessor::IoUringAioProcessor(const size_t nentries, const size_t regionSize,
+					 const bool sqpoll)
+	: log_("/iouringaioprocessor")
+	, lock_(log_)
+	, fd_(-1)
+	, nqueued_(0)
+	, nreqs_(0)
+	, ninflight_(0)
+	, exiting_(false)
+	, noverflow_(0)
+	, nwaiters_(0)
+	, flushing_(false)
+	, fixedFiles_(false)
+	, th_(NULL)
+{
+	for (size_t i = 0; i < MAX_FIXED_FILES; ++i) {
+		fixed_[i] = false;
+	}
+
+	SetupRing(nentries, sqpoll);
+	SetupFixedFiles();
+	SetupRegion(regionSize);
+
+	for (size_t i = 0; i < SysConf::NumCores(); ++i) {
+		batches_.push_back(new Batch(this));
+	}
+
+	INFO(log_) << "Starting io_uring completion thread. entries:" << params_.sq_entries
+		   << " sqpoll:" << sqpoll;
+
+	th_ = new CompletionThread(this);
+	th_->StartBlockingThread();
+}
+
+IoUringAioProcessor::~IoUringAioProcessor()
+{
+	for (auto b : batches_) {
+		INVARIANT(!b->n_ && !b->armed_);
+		delete b;
+	}
+	batches_.clear();
+
+	INVARIANT(!noverflow_ && waiters_.empty());
+
+	/*
+	 * A nop with no op attached tells the completion thread to exit. The ring completes
+	 * ops out of order, it stays on until the ops still in flight are reaped too.
+	 */
+	{
+		Guard _(&lock_);
+		Queue(IORING_OP_NOP, /*fd=*/ -1, /*buf=*/ NULL, /*size=*/ 0, /*off=*/ 0,
+		      /*data=*/ 0);
+	}
+
+	EnterQueued();
+
+	th_->Stop();
+	delete th_;
+	th_ = NULL;
+
+	INFO(log_) << "Destroyed io_uring completion thread.";
+
+	int status = munmap(sq_.sqes_, sqesSize_);
+	INVARIANT(status == 0);
+
+	if (cqmem_ != sqmem_) {
+		status = munmap(cqmem_, cqmemSize_);
+		INVARIANT(status == 0);
+	}
+
+	status = munmap(sqmem_, sqmemSize_);
+	INVARIANT(status == 0);
+
+	::close(fd_);
+}
+
+void
+IoUringAioProcessor::SetupRing(const size_t nentries, const bool sqpoll)
+{
+	memset(&params_, /*ch=*/ 0, sizeof(params_));
+
+	if (sqpoll) {
+		params_.flags |= IORING_SETUP_SQPOLL;
+		params_.sq_thread_idle = SQPOLL_IDLE_MS;
+	}
+
+	fd_ = io_uring_setup(nentries, &params_);
+	INVARIANT(fd_ != -1);
+
+	/*
+	 * An op in flight holds an entry of each ring at most, the submission ring is the
+	 * smaller one unless the kernel says otherwise
+	 */
+	nreqs_ = std::min(params_.sq_entries, params_.cq_entries);
+
+	sqmemSize_ = params_.sq_off.array + params_.sq_entries * sizeof(unsigned);
+	cqmemSize_ = params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe);
+
+	const bool single = params_.features & IORING_FEAT_SINGLE_MMAP;
+
+	if (single) {
+		sqmemSize_ = cqmemSize_ = std::max(sqmemSize_, cqmemSize_);
+	}
+
+	sqmem_ = mmap(NULL, sqmemSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      fd_, IORING_OFF_SQ_RING);
+	INVARIANT(sqmem_ != MAP_FAILED);
+
+	if (single) {
+		cqmem_ = sqmem_;
+	} else {
+		cqmem_ = mmap(NULL, cqmemSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      fd_, IORING_OFF_CQ_RING);
+		INVARIANT(cqmem_ != MAP_FAILED);
+	}
+
+	sqesSize_ = params_.sq_entries * sizeof(io_uring_sqe);
+	void * sqes = mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   fd_, IORING_OFF_SQES);
+	INVARIANT(sqes != MAP_FAILED);
+
+	uint8_t * sq = (uint8_t *) sqmem_;
+	sq_.head_ = (unsigned *) (sq + params_.sq_off.head);
+	sq_.tail_ = (unsigned *) (sq + params_.sq_off.tail);
+	sq_.mask_ = (unsigned *) (sq + params_.sq_off.ring_mask);
+	sq_.entries_ = (unsigned *) (sq + params_.sq_off.ring_entries);
+	sq_.flags_ = (unsigned *) (sq + params_.sq_off.flags);
+	sq_.array_ = (unsigned *) (sq + params_.sq_off.array);
+	sq_.sqes_ = (io_uring_sqe *) sqes;
+
+	uint8_t * cq = (uint8_t *) cqmem_;
+	cq_.head_ = (unsigned *) (cq + params_.cq_off.head);
+	cq_.tail_ = (unsigned *) (cq + params_.cq_off.tail);
+	cq_.mask_ = (unsigned *) (cq + params_.cq_off.ring_mask);
+	cq_.cqes_ = (io_uring_cqe *) (cq + params_.cq_off.cqes);
+}
+
+void
+IoUringAioProcessor::SetupFixedFiles()
+{
+	/*
+	 * Register an empty table, slot i is filled in with fd i on RegisterFile
+	 */
+	vector<int32_t> fds(MAX_FIXED_FILES, -1);
+
+	const int status = io_uring_register(fd_, IORING_REGISTER_FILES, &fds[0],
+					     MAX_FIXED_FILES);
+	if (status != 0) {
+		ERROR(log_) << "Fixed files unavailable. strerror: " << strerror(errno);
+		return;
+	}
+
+	fixedFiles_ = true;
+}
+
+void
+IoUringAioProcessor::SetupRegion(const size_t regionSize)
+{
+	if (!regionSize) {
+		return;
+	}
+
+	region_.reset(new IoUringBufferRegion(regionSize));
+
+	iovec iov;
+	iov.iov_base = region_->Base();
+	iov.iov_len = region_->Size();
+
+	const int status = io_uring_register(fd_, IORING_REGISTER_BUFFERS, &iov, /*nr=*/ 1);
+	if (status != 0) {
+		ERROR(log_) << "Fixed buffers unavailable. strerror: " << strerror(errno);
+		region_.reset();
+	}
+}
+
+void
+IoUringAioProcessor::RegisterHandle(CHandle *)
+{
+	DEADEND
+}
+
+void
+IoUringAioProcessor::UnregisterHandle(CHandle *, const AsyncProcessor::UnregisterDoneFn)
+{
+	DEADEND
+}
+
+IOBuffer
+IoUringAioProcessor::AllocBuffer(const size_t size)
+{
+	if (region_) {
+		uint8_t * ptr = region_->Alloc(size);
+		if (ptr) {
+			const size_t n = IoUringBufferRegion::Round(size);
+			return IOBuffer::Attach(ptr, size, RegionDalloc(region_, n));
+		}
+	}
+
+	/*
+	 * The region is exhausted or not there at all, do the IO from a regular buffer
+	 */
+	return AioProcessor::AllocBuffer(size);
+}
+
+bool
+IoUringAioProcessor::RegisterFile(const fd_t fd)
+{
+	if (!fixedFiles_ || fd < 0 || size_t(fd) >= MAX_FIXED_FILES) {
+		return false;
+	}
+
+	int32_t fds[1] = { fd };
+
+	io_uring_files_update up;
+	memset(&up, /*ch=*/ 0, sizeof(up));
+	up.offset = fd;
+	up.fds = (uint64_t) fds;
+
+	const int status = io_uring_register(fd_, IORING_REGISTER_FILES_UPDATE, &up, /*nr=*/ 1);
+	if (status != 1) {
+		ERROR(log_) << "Error registering file. fd: " << fd
+			    << " strerror: " << strerror(errno);
+		return false;
+	}
+
+	fixed_[fd] = true;
+	return true;
+}
+
+void
+IoUringAioProcessor::UnregisterFile(const fd_t fd)
+{
+	INVARIANT(fd >= 0 && size_t(fd) < MAX_FIXED_FILES && fixed_[fd]);
+
+	fixed_[fd] = false;
+
+	int32_t fds[1] = { -1 };
+
+	io_uring_files_update up;
+	memset(&up, /*ch=*/ 0, sizeof(up));
+	up.offset = fd;
+	up.fds = (uint64_t) fds;
+
+	const int status = io_uring_register(fd_, IORING_REGISTER_FILES_UPDATE, &up, /*nr=*/ 1);
+	INVARIANT(status == 1);
+}
+
+int
+IoUringAioProcessor::Write(Op * op)
+{
+	return Submit(op, IORING_OP_WRITE, IORING_OP_WRITE_FIXED, IORING_OP_WRITEV);
+}
+
+int
+IoUringAioProcessor::Read(Op * op)
+{
+	return Submit(op, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_READV);
+}
+
+int
+IoUringAioProcessor::Sync(Op * op)
+{
+	DEBUG(log_) << "Queue: fsync op:" << (uint64_t) op;
+
+	Admit(op, IORING_OP_FSYNC);
+
+	return 1;
+}
+
+int
+IoUringAioProcessor::Submit(Op * op, const uint8_t opcode, const uint8_t fixedOpcode,
+			    const uint8_t vecOpcode)
+{
+	ASSERT(op->buf_.Ptr());
+	ASSERT(op->size_);
+
+	if (op->iovcnt_) {
+		Admit(op, vecOpcode);
+		return 1;
+	}
+
+	const uint8_t * buf = op->buf_.Ptr();
+	const bool fixed = region_ && region_->Contains(buf, op->size_);
+
+	DEBUG(log_) << "Queue: opcode:" << int(fixed ? fixedOpcode : opcode)
+		    << " op:" << (uint64_t) op
+		    << " off: " << op->off_
+		    << " size: " << op->size_;
+
+	Admit(op, fixed ? fixedOpcode : opcode);
+
+	/*
+	 * Same as io_submit, the number of ops submitted
+	 */
+	return 1;
+}
+
+void
+IoUringAioProcessor::Admit(Op * op, const uint8_t opcode)
+{
+	{
+		Guard _(&lock_);
+
+		/*
+		 * Nobody gets ahead of the ops held back already
+		 */
+		if (!noverflow_.load() && ninflight_.load() < nreqs_) {
+			QueueOp(op, opcode);
+		} else {
+			op->slot_ = opcode;
+			overflow_.Push(op);
+			noverflow_++;
+			op = NULL;
+		}
+	}
+
+	if (op) {
+		Batched(op);
+	} else if (ninflight_.load() < nreqs_) {
+		/*
+		 * The ops in flight might have completed before this one was held back, with
+		 * nobody left to pick it up
+		 */
+		Drain();
+	}
+}
+
+void
+IoUringAioProcessor::Drain()
+{
+	size_t n = 0;
+
+	{
+		Guard _(&lock_);
+
+		while (!overflow_.IsEmpty() && ninflight_.load() < nreqs_) {
+			Op * op = overflow_.Pop();
+			noverflow_--;
+			QueueOp(op, op->slot_);
+			++n;
+		}
+	}
+
+	if (n) {
+		EnterQueued();
+	}
+}
+
+size_t
+IoUringAioProcessor::Credits()
+{
+	const size_t used = ninflight_.load() + noverflow_.load();
+	return used < nreqs_ ? nreqs_ - used : 0;
+}
+
+void
+IoUringAioProcessor::WaitCredits(const Fn<int> & ch)
+{
+	{
+		Guard _(&lock_);
+
+		waiters_.push_back(ch);
+		nwaiters_++;
+	}
+
+	/*
+	 * The ops might have completed before we got in line
+	 */
+	WakeWaiters();
+}
+
+void
+IoUringAioProcessor::WakeWaiters()
+{
+	vector<Fn<int> > waiters;
+
+	{
+		Guard _(&lock_);
+
+		if (Credits() < std::max<size_t>(nreqs_ / 4, 1)) {
+			return;
+		}
+
+		waiters.swap(waiters_);
+		nwaiters_ = 0;
+	}
+
+	for (auto & ch : waiters) {
+		ch.Wakeup(int(Credits()));
+	}
+}
+
+void
+IoUringAioProcessor::QueueOp(Op * op, const uint8_t opcode)
+{
+	if (opcode == IORING_OP_FSYNC) {
+		Queue(opcode, op->fd_, /*buf=*/ NULL, /*size=*/ 0, /*off=*/ 0, (uint64_t) op,
+		      IORING_FSYNC_DATASYNC);
+	} else if (op->iovcnt_) {
+		Queue(opcode, op->fd_, (const uint8_t *) op->iov_, op->iovcnt_, op->off_,
+		      (uint64_t) op);
+	} else {
+		Queue(opcode, op->fd_, op->buf_.Ptr(), op->size_, op->off_, (uint64_t) op);
+	}
+}
+
+void
+IoUringAioProcessor::Queue(const uint8_t opcode, const fd_t fd, const uint8_t * buf,
+			   const size_t size, const diskoff_t off, const uint64_t data,
+			   const uint32_t opFlags)
+{
+	const unsigned tail = *sq_.tail_;
+
+	/*
+	 * Every entry on the ring is an op in flight, the admission keeps them below the
+	 * ring size
+	 */
+	INVARIANT(tail - __atomic_load_n(sq_.head_, __ATOMIC_ACQUIRE) < *sq_.entries_);
+
+	const unsigned idx = tail & *sq_.mask_;
+	io_uring_sqe * sqe = &sq_.sqes_[idx];
+
+	memset(sqe, /*ch=*/ 0, sizeof(io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) buf;
+	sqe->len = size;
+	sqe->off = off;
+	sqe->user_data = data;
+	sqe->buf_index = 0;
+	sqe->rw_flags = opFlags;	/* fsync_flags for IORING_OP_FSYNC */
+
+	if (fd >= 0 && size_t(fd) < MAX_FIXED_FILES && fixed_[fd]) {
+		/* slot index is the fd itself */
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+
+	sq_.array_[idx] = idx;
+
+	if (data) {
+		ninflight_++;
+	}
+
+	__atomic_store_n(sq_.tail_, tail + 1, __ATOMIC_RELEASE);
+	nqueued_++;
+}
+
+void
+IoUringAioProcessor::Batched(const Op * op)
+{
+	NonBlockingThread * th = NonBlockingThread::current_;
+
+	if (!th || op->blocking_) {
+		/*
+		 * Not one of the pool threads, there is no routine end to flush at. Or the
+		 * thread is about to block on the op and would not get to the routine end.
+		 */
+		EnterQueued();
+		return;
+	}
+
+	Batch & b = *batches_[th->Id()];
+
+	if (++b.n_ == MAX_BATCH) {
+		FlushBatch(b);
+	} else {
+		th->AtRoutineEnd(&b);
+	}
+}
+
+void
+IoUringAioProcessor::FlushBatch(Batch & b)
+{
+	if (!b.n_) {
+		return;
+	}
+
+	b.n_ = 0;
+	EnterQueued();
+}
+
+void
+IoUringAioProcessor::Flush()
+{
+	NonBlockingThread * th = NonBlockingThread::current_;
+
+	if (th) {
+		FlushBatch(*batches_[th->Id()]);
+	}
+}
+
+void
+IoUringAioProcessor::EnterQueued()
+{
+	/*
+	 * One thread hands over everything queued, the others leave right away. The
+	 * flusher checks for more once it is done, so nothing queued meanwhile is left
+	 * behind.
+	 */
+	while (nqueued_.load()) {
+		bool expected = false;
+		if (!flushing_.compare_exchange_strong(expected, true)) {
+			return;
+		}
+
+		const unsigned n = nqueued_.exchange(0);
+
+		if (params_.flags & IORING_SETUP_SQPOLL) {
+			/*
+			 * The kernel thread picks up the entries on its own unless it went to
+			 * sleep
+			 */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(sq_.flags_, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+				Enter(/*nsubmit=*/ 0, /*nwait=*/ 0, IORING_ENTER_SQ_WAKEUP);
+			}
+		} else {
+			unsigned done = 0;
+			while (done < n) {
+				const int status = Enter(n - done, /*nwait=*/ 0, /*flags=*/ 0);
+
+				if (status <= 0) {
+					/*
+					 * The entries stay on the ring for the next one
+					 * entering, no use spinning on the kernel
+					 */
+					nqueued_ += n - done;
+					flushing_ = false;
+					return;
+				}
+
+				done += status;
+			}
+		}
+
+		flushing_ = false;
+	}
+}
+
+int
+IoUringAioProcessor::Enter(const unsigned nsubmit, const unsigned nwait, const unsigned flags)
+{
+	while (true) {
+		const int status = io_uring_enter(fd_, nsubmit, nwait, flags);
+
+		if (status >= 0) {
+			return status;
+		}
+
+		if (errno == EINTR) {
+			continue;
+		}
+
+		if (errno == EAGAIN || errno == EBUSY) {
+			/*
+			 * The kernel is short of resources for now, up to the caller when to
+			 * try again
+			 */
+			return -errno;
+		}
+
+		/*
+		 * We don't handle other errors at this point
+		 */
+		ERROR(log_) << "Error entering io_uring. strerror: " << strerror(errno);
+		DEADEND
+	}
+}
+
+bool
+IoUringAioProcessor::Reap()
+{
+	unsigned head = *cq_.head_;
+	const unsigned tail = __atomic_load_n(cq_.tail_, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		if (exiting_ && !ninflight_.load()) {
+			return false;
+		}
+
+		/*
+		 * Entries the kernel turned away. Blocking on completions could leave them
+		 * there for good, back off and try again instead.
+		 */
+		EnterQueued();
+
+		if (nqueued_.load()) {
+			usleep(/*usec=*/ 1000);
+			return true;
+		}
+
+		Enter(/*nsubmit=*/ 0, /*nwait=*/ 1, IORING_ENTER_GETEVENTS);
+		return true;
+	}
+
+	DEBUG(log_) << "Got events. n:" << (tail - head);
+
+	for (; head != tail; ++head) {
+		const io_uring_cqe & cqe = cq_.cqes_[head & *cq_.mask_];
+		Op * op = (Op *) cqe.user_data;
+		const int res = cqe.res;
+
+		/*
+		 * Hand the slot back before calling out, the handler might submit more
+		 */
+		__atomic_store_n(cq_.head_, head + 1, __ATOMIC_RELEASE);
+
+		if (!op) {
+			exiting_ = true;
+			continue;
+		}
+
+		DEBUG(log_) << "Event: data:" << (uint64_t) op << " res:" << res;
+
+		ninflight_--;
+
+		/*
+		 * Callback interrupt
+		 */
+		op->ch_.Interrupt(res, op);
+	}
+
+	/*
+	 * Room for the ops held back
+	 */
+	if (noverflow_.load()) {
+		Drain();
+	}
+
+	if (nwaiters_.load()) {
+		WakeWaiters();
+	}
+
+	EnterQueued();
+
+	return !exiting_ || ninflight_.load() != 0;
+}
+
+//....................................................... IoUringAioProcessor::CompletionThread ....
+
+void *
+IoUringAioProcessor::CompletionThread::ThreadMain()
+{
+	DisableThreadCancellation();
+
+	while (aio_->Reap()) {}
+
+	INFO(log_) << "Exiting poll loop.";
+
+	return NULL;
+}
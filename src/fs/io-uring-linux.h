@@ -0,0 +1,291 @@
+#ifndef _FS_IO_URING_LINUX_H_
+#define _FS_IO_URING_LINUX_H_
+
+#include <linux/io_uring.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <tr1/unordered_map>
+
+#include "fs/aio-linux.h"
+
+namespace bblocks {
+
+//......................................................................... IoUringBufferRegion ....
+
+/**
+ * @class IoUringBufferRegion
+ *
+ * A mapped memory region registered with the ring. IO to and from buffers carved out of
+ * the region is done with the fixed buffer ops, which saves the kernel from pinning and
+ * unpinning the pages on every op.
+ *
+ * Buffers are handed out in multiples of a page and recycled per size.
+ */
+class IoUringBufferRegion
+{
+public:
+
+	static const size_t PAGE_SIZE = 4096;
+
+	IoUringBufferRegion(const size_t size);
+	~IoUringBufferRegion();
+
+	/**
+	 * @return	buffer or NULL if the region is exhausted
+	 */
+	uint8_t * Alloc(const size_t size);
+
+	void Free(uint8_t * ptr, const size_t size);
+
+	bool Contains(const uint8_t * ptr, const size_t size) const
+	{
+		return ptr >= base_ && ptr + size <= base_ + size_;
+	}
+
+	uint8_t * Base() const { return base_; }
+	size_t Size() const { return size_; }
+
+	static size_t Round(const size_t size)
+	{
+		return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	}
+
+private:
+
+	typedef tr1::unordered_map<size_t, vector<uint8_t *> > free_map_t;
+
+	const string log_;
+	SpinMutex lock_;
+	uint8_t * base_;
+	const size_t size_;
+	size_t next_;		// Never allocated memory starts here
+	free_map_t free_;	// Returned buffers by size
+};
+
+//......................................................................... IoUringAioProcessor ....
+
+/**
+ * @class IoUringAioProcessor
+ *
+ * AioProcessor over io_uring. There is one submission ring shared by all threads, an op
+ * goes on it as soon as it is submitted. Handing the entries to the kernel is what gets
+ * batched, whoever finds nobody else submitting flushes everything on the ring so far with
+ * a single io_uring_enter, entries of other threads included. A pool thread puts off
+ * entering the ring until the submitting routine returns or it has queued a batch worth
+ * of ops, others enter right away. Completions are reaped by a dedicated thread and
+ * delivered the same way as LinuxAioProcessor does.
+ *
+ * No more ops are put on the ring than the completion ring has room for, the rest are
+ * held back in order and go out as the ops in flight complete. Neither ring overflows
+ * and nobody waits for room on them. When the kernel is short of resources the entries
+ * stay on the ring for the next one entering, the completion thread tries again once it
+ * has reaped.
+ *
+ * Fds registered with RegisterFile are submitted as fixed files, buffers allocated with
+ * AllocBuffer come from a registered region and are submitted as fixed buffers.
+ *
+ * In SQPOLL mode the kernel polls the submission ring from a thread of its own, and
+ * submitting needs no syscall while that thread is awake.
+ */
+class IoUringAioProcessor : public AioProcessor
+{
+public:
+
+	static const size_t DEFAULT_NENTRIES = 1024;
+	static const size_t DEFAULT_REGION_SIZE = 64 * 1024 * 1024; // 64 MiB
+	static const size_t MAX_FIXED_FILES = 1024;
+	static const uint32_t SQPOLL_IDLE_MS = 1000;
+	static const size_t MAX_BATCH = 64;
+
+	/**
+	 * Probe if the kernel lets us set up a ring
+	 */
+	static bool IsSupported();
+
+	//.... class CompletionThread ....//
+
+	class CompletionThread : public Thread
+	{
+	public:
+
+		CompletionThread(IoUringAioProcessor * aio)
+		    : Thread("/iouringaioprocessor/th/" + STR(this))
+		    , aio_(aio)
+		{
+		}
+
+		virtual void * ThreadMain() override;
+
+	private:
+
+		IoUringAioProcessor * aio_;
+	};
+
+	//.... create/destroy ....//
+
+	IoUringAioProcessor(const size_t nentries = DEFAULT_NENTRIES,
+			    const size_t regionSize = DEFAULT_REGION_SIZE,
+			    const bool sqpoll = false);
+	virtual ~IoUringAioProcessor();
+
+	//.... AioProcessor override ....//
+
+	virtual int Write(Op * op) override;
+	virtual int Read(Op * op) override;
+	virtual int Sync(Op * op) override;
+
+	virtual IOBuffer AllocBuffer(const size_t size) override;
+	virtual bool RegisterFile(const fd_t fd) override;
+	virtual void UnregisterFile(const fd_t fd) override;
+	virtual void Flush() override;
+	virtual size_t Credits() override;
+	virtual void WaitCredits(const Fn<int> & ch) override;
+
+	/**
+	 * Number of ops submitted and not reaped yet
+	 */
+	size_t InFlight() const
+	{
+		return ninflight_.load();
+	}
+
+	//.... AsyncProcessor ....//
+
+	void RegisterHandle(CHandle *);
+	void UnregisterHandle(CHandle *, const AsyncProcessor::UnregisterDoneFn);
+
+private:
+
+	/**
+	 * Return the buffer to the region it came from, the region is kept alive by the
+	 * buffers still around
+	 */
+	struct RegionDalloc
+	{
+		RegionDalloc(const shared_ptr<IoUringBufferRegion> & region, const size_t size)
+			: region_(region), size_(size)
+		{}
+
+		void operator()(uint8_t * data)
+		{
+			region_->Free(data, size_);
+		}
+
+		shared_ptr<IoUringBufferRegion> region_;
+		size_t size_;
+	};
+
+	/*
+	 * Pointers into the mapped rings
+	 */
+	struct SubmitRing
+	{
+		unsigned * head_;
+		unsigned * tail_;
+		unsigned * mask_;
+		unsigned * entries_;
+		unsigned * flags_;
+		unsigned * array_;
+		io_uring_sqe * sqes_;
+	};
+
+	struct CompletionRing
+	{
+		unsigned * head_;
+		unsigned * tail_;
+		unsigned * mask_;
+		io_uring_cqe * cqes_;
+	};
+
+	/*
+	 * Ops a pool thread queued on the ring and is yet to enter, only ever touched by
+	 * that thread
+	 */
+	struct Batch : NonBlockingThread::RoutineEndHook
+	{
+		Batch(IoUringAioProcessor * aio) : aio_(aio), n_(0) {}
+
+		virtual void RoutineEnd() override
+		{
+			aio_->FlushBatch(*this);
+		}
+
+		IoUringAioProcessor * aio_;
+		size_t n_;
+	};
+
+	void SetupRing(const size_t nentries, const bool sqpoll);
+	void SetupFixedFiles();
+	void SetupRegion(const size_t regionSize);
+
+	int Submit(Op * op, const uint8_t opcode, const uint8_t fixedOpcode,
+		   const uint8_t vecOpcode);
+
+	/*
+	 * Queue the op on the ring if there is room for it, else hold it back
+	 */
+	void Admit(Op * op, const uint8_t opcode);
+
+	/*
+	 * Queue the ops held back the rings have room for
+	 */
+	void Drain();
+	void WakeWaiters();
+
+	/*
+	 * Caller holds lock_
+	 */
+	void QueueOp(Op * op, const uint8_t opcode);
+	void Queue(const uint8_t opcode, const fd_t fd, const uint8_t * buf,
+		   const size_t size, const diskoff_t off, const uint64_t data,
+		   const uint32_t opFlags = 0);
+	/*
+	 * Enter the ring for the op just queued, now or when the routine returns
+	 */
+	void Batched(const Op * op);
+	void FlushBatch(Batch & b);
+
+	/*
+	 * Hand everything queued on the ring to the kernel
+	 */
+	void EnterQueued();
+	int Enter(const unsigned nsubmit, const unsigned nwait, const unsigned flags);
+
+	/**
+	 * Wait for and deliver completions, false once the processor is shutting down and
+	 * the last op is reaped
+	 */
+	bool Reap();
+
+	string log_;
+	SpinMutex lock_;		// Serializes the producers of the submission ring, protects
+					// the overflow queue and waiters
+	int fd_;
+	io_uring_params params_;
+	SubmitRing sq_;
+	CompletionRing cq_;
+	void * sqmem_;
+	size_t sqmemSize_;
+	void * cqmem_;
+	size_t cqmemSize_;
+	size_t sqesSize_;
+	atomic<unsigned> nqueued_;	// Queued and not handed to the kernel yet
+	size_t nreqs_;			// Ops the rings have room for
+	atomic<size_t> ninflight_;	// Ops queued and not reaped yet
+	bool exiting_;			// Reaped the exit nop, completion thread only
+	InList<Op> overflow_;		// Ops held back for lack of room
+	atomic<size_t> noverflow_;
+	vector<Fn<int> > waiters_;	// Waiting for credits
+	atomic<size_t> nwaiters_;
+	atomic<bool> flushing_;
+	bool fixedFiles_;
+	atomic<bool> fixed_[MAX_FIXED_FILES];
+	shared_ptr<IoUringBufferRegion> region_;
+	vector<Batch *> batches_;	// Indexed by pool thread id
+	CompletionThread * th_;
+};
+
+} // namespace bblocks {
+
+#endif /* _FS_IO_URING_LINUX_H_ */
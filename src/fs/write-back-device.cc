@@ -0,0 +1,511 @@
+#include <algorithm>
+
+#include "bblocks.h"
+#include "fs/write-back-device.h"
+
+using namespace bblocks;
+
+//............................................................................. WriteBackDevice ....
+
+WriteBackDevice::WriteBackDevice(BlockDevice * dev, const size_t highWater,
+				 const uint32_t writeBackMs)
+	: log_("/writebackdevice/" + STR(this))
+	, dev_(dev)
+	, highWater_(highWater)
+	, writeBackMs_(writeBackMs)
+	, lock_(log_)
+	, dirtyBytes_(0)
+	, busy_(false)
+	, npending_(0)
+	, status_(0)
+	, error_(0)
+	, armed_(false)
+	, statAbsorbed_(log_ + "/absorbed", "bytes", PerfCounter::BYTES)
+	, statWriteBack_(log_ + "/writeback", "bytes", PerfCounter::BYTES)
+	, statCommit_(log_ + "/commit", "flushes", PerfCounter::COUNTER)
+{
+	ASSERT(dev_);
+	ASSERT(highWater_);
+}
+
+WriteBackDevice::~WriteBackDevice()
+{
+	{
+		Guard _(&lock_);
+
+		INVARIANT(dirty_.empty() && flushing_.empty() && !busy_);
+		INVARIANT(waiters_.empty() && next_.empty());
+
+		if (armed_ && timer_.Cancel()) {
+			armed_ = false;
+			timers_.Done();
+		}
+	}
+
+	/*
+	 * The timer might have fired already, Expire has to be done with us
+	 */
+	timers_.Wait();
+
+	INFO(log_) << statAbsorbed_;
+	INFO(log_) << statWriteBack_;
+	INFO(log_) << statCommit_;
+}
+
+int
+WriteBackDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+		       const Fn<int> & ch)
+{
+	const int status = Write(buf, off, nblks);
+
+	/*
+	 * The caller is not expecting the completion before we return
+	 */
+	BBlocks::Schedule(this, &WriteBackDevice::Complete, ch, status);
+
+	return 1;
+}
+
+int
+WriteBackDevice::Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks)
+{
+	const size_t size = nblks * SpinningDevice::SECTOR_SIZE;
+
+	INVARIANT(off * SpinningDevice::SECTOR_SIZE + size <= dev_->GetDeviceSize());
+
+	bool start;
+
+	{
+		Guard _(&lock_);
+
+		Absorb(const_cast<IOBuffer &>(buf).Ptr(), off * SpinningDevice::SECTOR_SIZE, size);
+
+		start = !busy_ && dirtyBytes_ >= highWater_;
+
+		if (!start) {
+			ArmTimer();
+		}
+	}
+
+	statAbsorbed_.Update(size);
+
+	if (start) {
+		WriteBack();
+	}
+
+	return size;
+}
+
+void
+WriteBackDevice::Complete(Fn<int> ch, const int status)
+{
+	ch.Wakeup(status);
+}
+
+int
+WriteBackDevice::Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+		      const Fn<int> & ch)
+{
+	ReadCtx * ctx = new ReadCtx(buf, off * SpinningDevice::SECTOR_SIZE,
+				    nblks * SpinningDevice::SECTOR_SIZE, ch);
+
+	{
+		/*
+		 * Whatever is written back from here on may or may not make it to the
+		 * read, hold on to it
+		 */
+		Guard _(&lock_);
+
+		Snapshot(flushing_, ctx);
+		Snapshot(dirty_, ctx);
+	}
+
+	int status = dev_->Read(buf, off, nblks, intr_fn(this, &WriteBackDevice::ReadDone, ctx));
+
+	if (status != 1) {
+		delete ctx;
+	}
+
+	return status;
+}
+
+__interrupt__ void
+WriteBackDevice::ReadDone(int status, ReadCtx * ctx)
+{
+	if (status == int(ctx->size_)) {
+		for (auto & piece : ctx->pieces_) {
+			Overlay(piece, ctx);
+		}
+
+		/*
+		 * What is still around is the latest
+		 */
+		Guard _(&lock_);
+
+		Overlay(flushing_, ctx);
+		Overlay(dirty_, ctx);
+	}
+
+	ctx->ch_.Wakeup(status);
+	delete ctx;
+}
+
+int
+WriteBackDevice::Flush(const Fn<int> & ch)
+{
+	bool start;
+
+	{
+		Guard _(&lock_);
+
+		next_.push_back(ch);
+		start = !busy_;
+	}
+
+	if (start) {
+		WriteBack();
+	}
+
+	return 1;
+}
+
+//..................................................................... WriteBackDevice extents ....
+
+void
+WriteBackDevice::Absorb(const uint8_t * data, const diskoff_t off, const size_t size)
+{
+	ASSERT(lock_.IsOwner());
+
+	const diskoff_t end = off + size;
+	diskoff_t pos = off;
+
+	while (pos < end) {
+		auto it = dirty_.upper_bound(pos);
+		Extent * next = it != dirty_.end() ? it->second : NULL;
+		Extent * prev = it != dirty_.begin() ? std::prev(it)->second : NULL;
+
+		if (prev && prev->End() > pos) {
+			/*
+			 * Dirty already, overwrite in place
+			 */
+			const size_t n = std::min(end, prev->End()) - pos;
+			memcpy(prev->buf_.Ptr() + (pos - prev->off_), data + (pos - off), n);
+			pos += n;
+			continue;
+		}
+
+		/*
+		 * Clean up to the next extent
+		 */
+		const size_t n = (next ? std::min(end, next->off_) : end) - pos;
+
+		if (prev && prev->End() == pos && prev->size_ + n <= MAX_IO_SIZE) {
+			Grow(prev, prev->size_ + n);
+			memcpy(prev->buf_.Ptr() + prev->size_, data + (pos - off), n);
+			prev->size_ += n;
+		} else {
+			Extent * e = new Extent(pos, n, /*cap=*/ n);
+			memcpy(e->buf_.Ptr(), data + (pos - off), n);
+			dirty_.insert(make_pair(pos, e));
+		}
+
+		dirtyBytes_ += n;
+		pos += n;
+	}
+}
+
+void
+WriteBackDevice::Grow(Extent * e, const size_t size)
+{
+	if (e->buf_.Size() >= size) {
+		return;
+	}
+
+	/*
+	 * Double up, a stream of small appends copies each byte a couple of times
+	 */
+	const size_t cap = std::min<size_t>(std::max(size, 2 * e->buf_.Size()),
+					    size_t(MAX_IO_SIZE));
+
+	IOBuffer buf = IOBuffer::Alloc(cap);
+	memcpy(buf.Ptr(), e->buf_.Ptr(), e->size_);
+	e->buf_ = buf;
+}
+
+WriteBackDevice::extent_map_t::const_iterator
+WriteBackDevice::First(const extent_map_t & extents, const diskoff_t off)
+{
+	/*
+	 * The extents don't overlap, only the last one starting before off can reach it
+	 */
+	auto it = extents.upper_bound(off);
+
+	if (it != extents.begin()) {
+		--it;
+	}
+
+	return it;
+}
+
+void
+WriteBackDevice::Snapshot(const extent_map_t & extents, ReadCtx * ctx)
+{
+	const diskoff_t end = ctx->off_ + ctx->size_;
+
+	for (auto it = First(extents, ctx->off_); it != extents.end() && it->first < end; ++it) {
+		const Extent * e = it->second;
+
+		if (e->End() > ctx->off_) {
+			ctx->pieces_.push_back(Piece(e->off_, e->size_, e->buf_));
+		}
+	}
+}
+
+void
+WriteBackDevice::Overlay(const Piece & piece, ReadCtx * ctx)
+{
+	const diskoff_t from = std::max(piece.off_, ctx->off_);
+	const diskoff_t to = std::min(piece.off_ + piece.size_, ctx->off_ + ctx->size_);
+
+	if (from < to) {
+		memcpy(ctx->buf_.Ptr() + (from - ctx->off_),
+		       const_cast<IOBuffer &>(piece.buf_).Ptr() + (from - piece.off_), to - from);
+	}
+}
+
+void
+WriteBackDevice::Overlay(const extent_map_t & extents, ReadCtx * ctx)
+{
+	const diskoff_t end = ctx->off_ + ctx->size_;
+
+	for (auto it = First(extents, ctx->off_); it != extents.end() && it->first < end; ++it) {
+		const Extent * e = it->second;
+		Overlay(Piece(e->off_, e->size_, e->buf_), ctx);
+	}
+}
+
+//.................................................................. WriteBackDevice write-back ....
+
+void
+WriteBackDevice::WriteBack()
+{
+	{
+		Guard _(&lock_);
+
+		if (busy_ || (dirty_.empty() && next_.empty())) {
+			return;
+		}
+
+		INVARIANT(flushing_.empty());
+
+		busy_ = true;
+		flushing_.swap(dirty_);
+		dirtyBytes_ = 0;
+		waiters_.swap(next_);
+		status_ = 0;
+
+		/*
+		 * Held by us until all the writes are out
+		 */
+		npending_ = 1;
+	}
+
+	/*
+	 * Nobody touches the extents being written back, no need for the lock. Runs of
+	 * adjacent extents go out together.
+	 */
+	vector<Extent *> run;
+	diskoff_t off = 0;
+	size_t size = 0;
+
+	for (auto & it : flushing_) {
+		Extent * e = it.second;
+
+		if (!run.empty() && (off + size != e->off_ || size + e->size_ > MAX_IO_SIZE)) {
+			WriteRun(off, size, run);
+			run.clear();
+		}
+
+		if (run.empty()) {
+			off = e->off_;
+			size = 0;
+		}
+
+		run.push_back(e);
+		size += e->size_;
+	}
+
+	if (!run.empty()) {
+		WriteRun(off, size, run);
+	}
+
+	WrittenBack(/*status=*/ 0);
+}
+
+void
+WriteBackDevice::WriteRun(const diskoff_t off, const size_t size, vector<Extent *> & run)
+{
+	IOBuffer buf;
+
+	if (run.size() == 1) {
+		buf = run[0]->buf_;
+	} else {
+		buf = IOBuffer::Alloc(size);
+
+		size_t pos = 0;
+		for (auto e : run) {
+			memcpy(buf.Ptr() + pos, e->buf_.Ptr(), e->size_);
+			pos += e->size_;
+		}
+	}
+
+	{
+		Guard _(&lock_);
+		npending_++;
+	}
+
+	statWriteBack_.Update(size);
+
+	int status = dev_->Write(std::move(buf), off / SpinningDevice::SECTOR_SIZE,
+				 size / SpinningDevice::SECTOR_SIZE,
+				 intr_fn(this, &WriteBackDevice::WriteBackDone, size));
+
+	if (status != 1) {
+		ERROR(log_) << "Error writing back. off: " << off << " size: " << size;
+		WriteBackDone(/*status=*/ -1, size);
+	}
+}
+
+__interrupt__ void
+WriteBackDevice::WriteBackDone(int status, size_t size)
+{
+	WrittenBack(status == int(size) ? 0 : (status < 0 ? status : -EIO));
+}
+
+void
+WriteBackDevice::WrittenBack(const int status)
+{
+	bool sync;
+
+	{
+		Guard _(&lock_);
+
+		if (status && !status_) {
+			status_ = status;
+		}
+
+		if (--npending_) {
+			return;
+		}
+
+		sync = !waiters_.empty();
+
+		if (sync) {
+			/*
+			 * One device flush for every flush the write-back covers
+			 */
+			statCommit_.Update(waiters_.size());
+		}
+	}
+
+	if (!sync) {
+		Committed(/*status=*/ 0);
+		return;
+	}
+
+	int ret = dev_->Flush(intr_fn(this, &WriteBackDevice::SyncDone));
+
+	if (ret != 1) {
+		ERROR(log_) << "Error flushing device";
+		Committed(/*status=*/ -EIO);
+	}
+}
+
+__interrupt__ void
+WriteBackDevice::SyncDone(int status)
+{
+	Committed(status);
+}
+
+void
+WriteBackDevice::Committed(int status)
+{
+	vector<Fn<int> > waiters;
+	bool more;
+
+	{
+		Guard _(&lock_);
+
+		if (status_) {
+			status = status_;
+		}
+
+		if (waiters_.empty()) {
+			if (status) {
+				/*
+				 * Hold on to it for the next flush
+				 */
+				error_ = status;
+			}
+		} else {
+			if (error_) {
+				status = error_;
+				error_ = 0;
+			}
+		}
+
+		waiters.swap(waiters_);
+
+		for (auto & it : flushing_) {
+			delete it.second;
+		}
+
+		flushing_.clear();
+		busy_ = false;
+
+		more = !next_.empty() || dirtyBytes_ >= highWater_;
+
+		if (!more && !dirty_.empty()) {
+			ArmTimer();
+		}
+	}
+
+	for (auto & ch : waiters) {
+		ch.Wakeup(status);
+	}
+
+	if (more) {
+		WriteBack();
+	}
+}
+
+void
+WriteBackDevice::ArmTimer()
+{
+	ASSERT(lock_.IsOwner());
+
+	if (!armed_) {
+		armed_ = true;
+		timers_.Add();
+		timer_ = BBlocks::ScheduleIn(writeBackMs_, this, &WriteBackDevice::Expire);
+	}
+}
+
+void
+WriteBackDevice::Expire()
+{
+	{
+		Guard _(&lock_);
+		armed_ = false;
+	}
+
+	/*
+	 * No-op if a write-back is in progress, it checks for dirty extents once done
+	 */
+	WriteBack();
+
+	/*
+	 * The destructor might be waiting on this, we are not to touch anything after
+	 */
+	timers_.Done();
+}
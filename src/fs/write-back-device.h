@@ -0,0 +1,168 @@
+#ifndef _FS_WRITE_BACK_DEVICE_H_
+#define _FS_WRITE_BACK_DEVICE_H_
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include "fs/aio-linux.h"
+
+namespace bblocks {
+
+//............................................................................. WriteBackDevice ....
+
+/**
+ * @class WriteBackDevice
+ *
+ * Write-back buffer in front of a BlockDevice. A write is copied in to a dirty extent and
+ * completed right away. Writes landing on or right after a dirty extent are folded in to
+ * it, so a stream of small writes ends up as a few large ones.
+ *
+ * The dirty extents are written back once enough of them pile up, once they have been
+ * around for a while, or on Flush. Runs of adjacent extents go out as single IOs in offset
+ * order. Only one write-back is in progress at a time.
+ *
+ * Flush is a group commit. The write-back that follows a Flush is chased by a single
+ * device Flush, and every Flush that came in before that write-back started is done when
+ * it is. The ones that come in meanwhile ride the next one together.
+ *
+ * Reads see the dirty data. Errors writing back are reported by the Flush covering the
+ * writes.
+ */
+class WriteBackDevice : public CHandle, public BlockDevice
+{
+public:
+
+	static const size_t DEFAULT_HIGH_WATER = 4 * 1024 * 1024;	// 4 MiB
+	static const uint32_t DEFAULT_WRITE_BACK_MS = 10;
+	static const size_t MAX_IO_SIZE = 1024 * 1024;			// 1 MiB
+
+	/**
+	 * @param	highWater	Dirty bytes to start writing back at
+	 * @param	writeBackMs	Longest a dirty extent waits for a write-back
+	 */
+	WriteBackDevice(BlockDevice * dev, const size_t highWater = DEFAULT_HIGH_WATER,
+			const uint32_t writeBackMs = DEFAULT_WRITE_BACK_MS);
+
+	/**
+	 * Everything has to be flushed by now
+	 */
+	virtual ~WriteBackDevice();
+
+	//.... BlockDevice override ....//
+
+	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			  const Fn<int> & ch) override;
+	virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks) override;
+	virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+			 const Fn<int> & ch) override;
+	virtual int Flush(const Fn<int> & ch) override;
+
+	virtual disksize_t GetDeviceSize() override
+	{
+		return dev_->GetDeviceSize();
+	}
+
+private:
+
+	/*
+	 * Dirty range of the device. The buffer has room for the extent to grow at the end.
+	 */
+	struct Extent
+	{
+		Extent(const diskoff_t off, const size_t size, const size_t cap)
+			: off_(off), size_(size), buf_(IOBuffer::Alloc(cap))
+		{}
+
+		diskoff_t End() const { return off_ + size_; }
+
+		const diskoff_t off_;		// Bytes
+		size_t size_;			// Bytes
+		IOBuffer buf_;
+	};
+
+	typedef map<diskoff_t, Extent *> extent_map_t;
+
+	/*
+	 * Data overlaid on a read once the device is done with it
+	 */
+	struct Piece
+	{
+		Piece(const diskoff_t off, const size_t size, const IOBuffer & buf)
+			: off_(off), size_(size), buf_(buf)
+		{}
+
+		diskoff_t off_;
+		size_t size_;
+		IOBuffer buf_;
+	};
+
+	struct ReadCtx
+	{
+		ReadCtx(const IOBuffer & buf, const diskoff_t off, const size_t size,
+			const Fn<int> & ch)
+			: buf_(buf), off_(off), size_(size), ch_(ch)
+		{}
+
+		IOBuffer buf_;
+		const diskoff_t off_;		// Bytes
+		const size_t size_;		// Bytes
+		Fn<int> ch_;
+		vector<Piece> pieces_;		// Written back while the read was on the way
+	};
+
+	//.... dirty extents ....//
+
+	void Absorb(const uint8_t * data, const diskoff_t off, const size_t size);
+	void Grow(Extent * e, const size_t size);
+	static extent_map_t::const_iterator First(const extent_map_t & extents,
+						  const diskoff_t off);
+	void Snapshot(const extent_map_t & extents, ReadCtx * ctx);
+	static void Overlay(const Piece & piece, ReadCtx * ctx);
+	static void Overlay(const extent_map_t & extents, ReadCtx * ctx);
+
+	//.... write-back ....//
+
+	void WriteBack();
+	void WriteRun(const diskoff_t off, const size_t size, vector<Extent *> & run);
+	void WrittenBack(const int status);
+	void Committed(int status);
+	void Expire();
+	void ArmTimer();
+	void Complete(Fn<int> ch, const int status);
+
+	//.... completion handlers ....//
+
+	__interrupt__ void ReadDone(int status, ReadCtx * ctx);
+	__interrupt__ void WriteBackDone(int status, size_t size);
+	__interrupt__ void SyncDone(int status);
+
+	//.... members ....//
+
+	const string log_;
+	BlockDevice * dev_;
+	const size_t highWater_;
+	const uint32_t writeBackMs_;
+
+	SpinMutex lock_;
+	extent_map_t dirty_;		// Absorbed and not written back yet
+	size_t dirtyBytes_;
+	extent_map_t flushing_;		// Being written back
+	bool busy_;			// Write-back in progress
+	size_t npending_;		// Writes of the write-back in flight
+	int status_;			// Of the write-back in progress
+	int error_;			// Of a write-back nobody was waiting for
+	vector<Fn<int> > waiters_;	// Flushes covered by the write-back in progress
+	vector<Fn<int> > next_;		// Flushes waiting for the next write-back
+	bool armed_;			// Timer is on its way
+	TimerHandle timer_;
+	AsyncDrain timers_;		// Armed and not done expiring
+
+	PerfCounter statAbsorbed_;
+	PerfCounter statWriteBack_;
+	PerfCounter statCommit_;
+};
+
+} // namespace bblocks {
+
+#endif /* _FS_WRITE_BACK_DEVICE_H_ */
@@ -98,6 +98,66 @@ public:
 		return t;
 	}
 
+	/*
+	 * Put an element back to be popped next
+	 */
+	inline void Unpop(T * t)
+	{
+		ASSERT((!head_ && !tail_) || (head_ && tail_));
+
+		ASSERT(t);
+		ASSERT(!t->next_);
+		ASSERT(!t->prev_);
+
+		t->prev_ = tail_;
+		if (tail_) tail_->next_ = t;
+
+		tail_ = t;
+		if (!head_) head_ = tail_;
+	}
+
+	/*
+	 * Link an element in to be popped right after pos, first if pos is NULL
+	 */
+	inline void InsertAfter(T * pos, T * t)
+	{
+		if (!pos) {
+			Unpop(t);
+			return;
+		}
+
+		ASSERT(t);
+		ASSERT(!t->next_);
+		ASSERT(!t->prev_);
+
+		t->next_ = pos;
+		t->prev_ = pos->prev_;
+
+		if (pos->prev_) pos->prev_->next_ = t;
+		pos->prev_ = t;
+
+		if (head_ == pos) head_ = t;
+	}
+
+	/*
+	 * Last element pushed, next_ leads towards the pop end
+	 */
+	inline T * Head() const
+	{
+		return head_;
+	}
+
+	inline void Swap(InList<T> & other)
+	{
+		T * head = head_;
+		T * tail = tail_;
+
+		head_ = other.head_;
+		tail_ = other.tail_;
+		other.head_ = head;
+		other.tail_ = tail;
+	}
+
 	inline bool IsEmpty() const
 	{
 		return !head_ && !tail_;
@@ -109,137 +169,320 @@ private:
 	T * tail_; // push
 };
 
-// ................................................................................. InQueue<T> ....
+//................................................................................. QueueParker ....
+
+/**
+ * Lets the consumer of a MPSCQueue sleep on something other than the futex, so it can
+ * wait for the queue and other events (e.g. epoll) at the same time.
+ */
+class QueueParker
+{
+public:
+
+	virtual ~QueueParker() {}
+
+	/**
+	 * Sleep until Unpark() is called, the timeout expires or other events arrive. Can
+	 * return spuriously.
+	 *
+	 * @param	timeout		Relative time to wait for, NULL to wait forever
+	 * @return	true if the consumer has other events to process
+	 */
+	virtual bool Park(const timespec * timeout) = 0;
+
+	/**
+	 * Wake up the parked consumer. Can be called from any thread.
+	 */
+	virtual void Unpark() = 0;
+};
+
+//................................................................................ MPSCQueue<T> ....
 
 /**
- * In list used as queue. Provides all the same benefits and requirements of
- * inlist, but provide the interface for a queue.
+ * Multi producer single consumer intrusive queue.
+ *
+ * Producers push onto a lock free stack with a single CAS. The consumer detaches the
+ * whole stack with one exchange, reverses it to restore FIFO order and drains it from a
+ * private inlist, so the fast path never takes a lock or makes a system call.
  *
- * This is meant to be a fast queue, so we employ adaptive spinning.
+ * The consumer spins for a short while when the queue is empty and then parks on a
+ * futex, or with the QueueParker if one is set. Producers make the wake up system call
+ * only if the consumer is actually parked.
+ *
+ * Other threads can take elements with TryPop (e.g. to steal work). They are serialized
+ * with the consumer by a try lock on the consumer side, producers are never blocked.
  */
 template<class T>
-class InQueue
+class MPSCQueue
 {
 public:
 
-	static const unsigned int MAX_SPIN = 10000;
+	static const unsigned int MAX_SPIN = 1000;
 
-	InQueue(const string & name) : log_("/q/" + name), maxSpin_(1000) {}
+	MPSCQueue(const string & name)
+		: log_("/q/" + name)
+		, stack_(NULL)
+		, state_(RUNNING)
+		, wakeup_(false)
+		, consumerLock_(false)
+		, parker_(NULL)
+	{}
+
+	~MPSCQueue()
+	{
+		INVARIANT(!stack_);
+	}
 
 	inline void Push(T * t)
 	{
-		lock_.Lock();
-		q_.Push(t);
-		lock_.Unlock();
+		ASSERT(t);
+		ASSERT(!t->next_);
+		ASSERT(!t->prev_);
+
+		T * head = stack_.load(memory_order_relaxed);
+		do {
+			t->next_ = head;
+		} while (!stack_.compare_exchange_weak(head, t, memory_order_seq_cst,
+						       memory_order_relaxed));
 
-		conditionEmpty_.Signal();
+		WakeConsumer();
 	}
 
-	inline T * Pop()
+	/**
+	 * Park the consumer with the given parker instead of the futex. Must be set before
+	 * the queue is used.
+	 */
+	void SetParker(QueueParker * parker)
 	{
-		T * t = TryPop();
-
-		/*
-		 * Return T if the pop was successful.
-		 */
-		if (t) return t;
-
-		/*
-		 * Timeout.
-		 *
-		 * No objects were received while spinning. Apply traditional lock and wait
-		 * algorithm
-		 */
-		lock_.Lock();
+		parker_ = parker;
+	}
 
-		while (q_.IsEmpty()) {
-			conditionEmpty_.Wait(&lock_);
-		}
+	/**
+	 * Pop an element, wait if the queue is empty. Can be called only by the consumer.
+	 *
+	 * @param	timeout		Relative time to wait for, NULL to wait forever
+	 * @return	Element or NULL if the wait was interrupted by Wakeup(), timed out, or
+	 *		the parker has other events for the consumer
+	 */
+	inline T * Pop(const timespec * timeout = NULL)
+	{
+		while (true) {
+			T * t = PopLocked();
 
-		t = q_.Pop();
+			if (t) return t;
 
-		lock_.Unlock();
+			/*
+			 * Only producers can make the queue non-empty. Spin for a little bit
+			 * watching the stack before we pay the cost of sleeping.
+			 */
+			for (unsigned int i = 0; i < MAX_SPIN && !stack_.load(memory_order_relaxed)
+							    && !wakeup_.load(memory_order_relaxed); ++i) {
+				Cpu::Relax();
+			}
 
-		return t;
-	}
+			if (stack_.load(memory_order_relaxed)) {
+				continue;
+			}
 
-	inline T * Pop(const uint32_t ms)
-	{
-		T * t = TryPop();
-
-		/*
-		 * Return T if the pop was successful.
-		 */
-		if (t) return t;
-
-		/*
-		 * Timeout.
-		 *
-		 * No objects were received while spinning. Apply traditional lock and wait
-		 * algorithm
-		 */
-		if (!lock_.Lock(ms))
 			/*
-			 * Timeout
+			 * Announce that we are going to sleep and check one more time. The
+			 * producer pushes and then checks the state, we set the state and then
+			 * check the queue, so one of us is bound to see the other.
 			 */
-			return NULL;
+			state_.store(PARKED, memory_order_seq_cst);
+
+			/*
+			 * The queue is looked at with a relaxed load, which the store alone does
+			 * not keep from reading a stale stack
+			 */
+			atomic_thread_fence(memory_order_seq_cst);
 
-		while (q_.IsEmpty()) {
-			if (!conditionEmpty_.Wait(&lock_, ms)) {
-				/*
-				 * Timeout waiting for object
-				 */
-				lock_.Unlock();
+			if ((t = PopLocked())) {
+				state_.store(RUNNING, memory_order_relaxed);
+				return t;
+			}
+
+			if (wakeup_.exchange(false)) {
+				state_.store(RUNNING, memory_order_relaxed);
 				return NULL;
 			}
+
+			const bool interrupted = Park(timeout);
+
+			state_.store(RUNNING, memory_order_relaxed);
+
+			if (timeout || interrupted) {
+				return PopLocked();
+			}
 		}
+	}
 
-		t = q_.Pop();
+	/**
+	 * Pop an element without waiting. Can be called from any thread.
+	 *
+	 * @return	Element or NULL if the queue is empty or the consumer side is busy
+	 */
+	inline T * TryPop()
+	{
+		if (!TryLock()) {
+			return NULL;
+		}
 
-		lock_.Unlock();
+		T * t = PopUnlocked();
+
+		Unlock();
+
+		return t;
+	}
+
+	/**
+	 * Same as TryPop, but takes the next element only if it passes the filter. One that
+	 * does not stays where it is, the queue keeps its order.
+	 *
+	 * @return	Element or NULL if the queue is empty, the consumer side is busy or the
+	 *		next element is filtered out
+	 */
+	template<class Filter>
+	inline T * TryPopIf(Filter filter)
+	{
+		if (!TryLock()) {
+			return NULL;
+		}
+
+		T * t = PopUnlocked();
+
+		if (t && !filter(t)) {
+			q_.Unpop(t);
+			t = NULL;
+		}
+
+		Unlock();
 
 		return t;
 	}
 
+	/**
+	 * Interrupt the consumer waiting in Pop(). If there is no consumer waiting, the next
+	 * Pop() on an empty queue returns NULL right away.
+	 */
+	inline void Wakeup()
+	{
+		wakeup_.store(true, memory_order_seq_cst);
+		WakeConsumer();
+	}
+
 	inline bool IsEmpty() const
 	{
-		lock_.Lock();
-		const bool ret = q_.IsEmpty();
-		lock_.Unlock();
+		Lock();
+		const bool ret = q_.IsEmpty() && !stack_.load();
+		Unlock();
 
 		return ret;
 	}
 
 private:
 
-	inline T * TryPop()
+	enum State
 	{
-		/*
-		 * Spin for a little bit waiting for message. This increases the throughput rate on
-		 * a loaded system since the cost of sleeping and waking is fairly high for a job
-		 * scheduler algorithm
-		 */
-		for (unsigned int i = 0; i < maxSpin_; ++i) {
-			lock_.Lock();
-			if (!q_.IsEmpty()) {
-				T * t = q_.Pop();
-				lock_.Unlock();
-				return t;
+		RUNNING = 0,
+		PARKED
+	};
+
+	MPSCQueue();
+
+	inline void WakeConsumer()
+	{
+		if (state_.load(memory_order_seq_cst) == PARKED
+		    && state_.exchange(RUNNING) == PARKED) {
+			if (parker_) {
+				parker_->Unpark();
+			} else {
+				Futex::Wake(state_, /*n=*/ 1);
 			}
-			lock_.Unlock();
-			sched_yield();
 		}
+	}
 
-		return NULL;
-    }
+	inline bool Park(const timespec * timeout)
+	{
+		if (parker_) {
+			return parker_->Park(timeout);
+		}
+
+		Futex::Wait(state_, PARKED, timeout);
+		return false;
+	}
+
+	inline T * PopLocked()
+	{
+		Lock();
+		T * t = PopUnlocked();
+		Unlock();
+
+		return t;
+	}
+
+	inline T * PopUnlocked()
+	{
+		if (q_.IsEmpty() && !Refill()) {
+			return NULL;
+		}
+
+		return q_.Pop();
+	}
+
+	/*
+	 * Move the producer stack to the consumer list in the order it was pushed
+	 */
+	inline bool Refill()
+	{
+		if (!stack_.load(memory_order_relaxed)) {
+			return false;
+		}
 
-	InQueue();
+		T * t = stack_.exchange(NULL, memory_order_acquire);
+
+		T * prev = NULL;
+		while (t) {
+			T * next = t->next_;
+			t->next_ = prev;
+			prev = t;
+			t = next;
+		}
+
+		for (t = prev; t; t = prev) {
+			prev = t->next_;
+			t->next_ = NULL;
+			q_.Push(t);
+		}
+
+		return true;
+	}
+
+	inline bool TryLock() const
+	{
+		return !consumerLock_.load(memory_order_relaxed)
+		       && !consumerLock_.exchange(true, memory_order_acquire);
+	}
+
+	inline void Lock() const
+	{
+		while (!TryLock()) {
+			Cpu::Relax();
+		}
+	}
+
+	inline void Unlock() const
+	{
+		consumerLock_.store(false, memory_order_release);
+	}
 
 	string log_;
-	mutable PThreadMutex lock_;
-	WaitCondition conditionEmpty_;
+	atomic<T *> stack_;
+	atomic<int> state_;
+	atomic<bool> wakeup_;
+	mutable atomic<bool> consumerLock_;
 	InList<T> q_;
-	unsigned int maxSpin_;
+	QueueParker * parker_;
 };
 
 // ............................................................... Queue<T> ....
@@ -2,6 +2,8 @@
 #define _CORE_LOCK_H_
 
 #include <inttypes.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "perf/perf-counter.h"
 #include "logger.h"
@@ -297,6 +299,36 @@ protected:
     PerfCounter statSpinTime_;
 };
 
+// ...................................................................................... Futex ....
+
+/**
+ * Thin wrapper over linux futex for parking and waking threads without a mutex
+ */
+class Futex
+{
+public:
+
+    /**
+     * Sleep as long as the value at addr is val. Can return spuriously.
+     *
+     * @param   timeout     Relative timeout, NULL to wait forever
+     */
+    static void Wait(atomic<int> & addr, const int val, const timespec * timeout = NULL)
+    {
+        syscall(SYS_futex, (int *) &addr, FUTEX_WAIT_PRIVATE, val, timeout,
+                /*addr2=*/ NULL, /*val3=*/ 0);
+    }
+
+    /**
+     * Wake up to n threads sleeping on addr
+     */
+    static void Wake(atomic<int> & addr, const int n)
+    {
+        syscall(SYS_futex, (int *) &addr, FUTEX_WAKE_PRIVATE, n, /*timeout=*/ NULL,
+                /*addr2=*/ NULL, /*val3=*/ 0);
+    }
+};
+
 // ..................................................................................... RWLock ....
 
 class RWLock
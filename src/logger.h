@@ -127,18 +127,14 @@ public:
 
     LogMessage(const Logger::LogType & type, const string & path)
         : type_(type)
-        , path_(path)
+        , enabled_(IsEnabled(type, path))
+        , path_(enabled_ ? path : string())
     {}
 
     ~LogMessage()
     {
-	auto logger = Logger::Instance();
-
-	if (type_ == Logger::LogType::LEVEL_DEBUG
-	    || type_ == Logger::LogType::LEVEL_VERBOSE) {
-		if (logger.logrc_.find(path_) == logger.logrc_.end()) {
-			return;
-		}
+	if (!enabled_) {
+		return;
 	}
 
         ostringstream tmp;
@@ -153,13 +149,20 @@ public:
 
     LogMessage & operator<<(const string & t)
     {
-        msg_.push_back(t);
+        if (enabled_) {
+            msg_.push_back(t);
+        }
+
         return *this;
     }
 
     template<class T>
     LogMessage & operator<<(const T & t)
     {
+        if (!enabled_) {
+            return *this;
+        }
+
         ostringstream ss;
         ss << t;
         msg_.push_back(ss.str());
@@ -168,6 +171,20 @@ public:
 
 protected:
 
+    /*
+     * Debug and verbose messages are for the paths listed in ~/.bblogrc only. The ones
+     * that are not are dropped before anything is formatted, they cost nothing.
+     */
+    static bool IsEnabled(const Logger::LogType & type, const string & path)
+    {
+	if (type != Logger::LogType::LEVEL_DEBUG && type != Logger::LogType::LEVEL_VERBOSE) {
+		return true;
+	}
+
+	const Logger & logger = Logger::Instance();
+	return logger.logrc_.find(path) != logger.logrc_.end();
+    }
+
     const string Timestamp()
     {
         time_t secondsSinceEpoch = time(NULL);
@@ -180,7 +197,8 @@ protected:
     typedef list<string> StringListType;
 
     const Logger::LogType type_;
-    const string path_;
+    const bool enabled_;
+    const string path_;		// Copied only if the message is to be written
     StringListType msg_;
 };
 
@@ -9,10 +9,29 @@ using namespace bblocks;
 
 //....................................................................................... Epoll ....
 
+__thread Epoll * Epoll::dispatching_;
+
 Epoll::Epoll(const string & logPath)
 	: Thread("/epoll/" + STR(this))
 	, log_(logPath + "/epoll")
-	, lock_("/epoll" + logPath)
+	, nfds_(0)
+	, epoch_(0)
+	, retired_(NULL)
+	, limbo_(NULL)
+	, active_(NULL)
+	, windowCycles_(System::GetHz() / 1000 * LOAD_WINDOW_MS)
+	, window_(1)
+	, windowStart_(Rdtsc::rdtsc())
+	, windowBusy_(0)
+	, windowEvents_(0)
+	, hotFd_(-1)
+	, hotBusy_(0)
+	, polling_(false)
+	, loadStamp_(windowStart_)
+	, loadBusy_(0)
+	, loadEvents_(0)
+	, loadHotFd_(-1)
+	, loadHotBusy_(0)
 {
 	fd_ = epoll_create(/*size=*/ MAX_EPOLL_EVENT);
 
@@ -45,39 +64,38 @@ Epoll::~Epoll()
 	Thread::Cancel();
 	Thread::Stop();
 
-	{
-		/*
-		 * Empty trash can (fds marked for deletion)
-		 */
-		Guard _(&lock_);
-		INVARIANT(fdmap_.empty());
-		EmptyTrashcan();
-	}
+	INVARIANT(!nfds_);
+
+	/*
+	 * Nobody is polling any more, the retired records can all go
+	 */
+	Free(limbo_);
+	Free(retired_.exchange(NULL));
 }
 
 bool
 Epoll::Add(const fd_t fd, const uint32_t events, const fn_t & chandler)
 {
-	ASSERT(!lock_.IsOwner());
-
 	DEBUG(log_) << "Add. fd:" << fd << ", events:" << events;
 
 	FDRecord * fdrec = new FDRecord(fd, events, chandler);
 	INVARIANT(fdrec);
 
-	{
-		/*
-		 * Insert to fdmap
-		 */
-		Guard _(&lock_);
-		INVARIANT(fdmap_.find(fd) == fdmap_.end());
-		fdmap_.insert(make_pair(fd, fdrec));
-	}
+	/*
+	 * Insert to the table
+	 */
+	fd_table_t::slot_t * slot = fds_.Slot(fd, /*create=*/ true);
+
+	FDRecord * expected = NULL;
+	bool ok = slot->compare_exchange_strong(expected, fdrec);
+	INVARIANT(ok);
+
+	nfds_++;
 
 	/*
 	 * Notify the kernel
 	 */
-	epoll_event ee = fdrec->GetEpollEvent();
+	epoll_event ee = fdrec->GetEpollEvent(events);
 
 	int status = epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &ee);
 
@@ -89,6 +107,9 @@ Epoll::Add(const fd_t fd, const uint32_t events, const fn_t & chandler)
 		/*
 		 * It is safe to trash fdrec since the epoll add failed
 		 */
+		slot->store(NULL);
+		nfds_--;
+
 		delete fdrec;
 		return false;
 	}
@@ -99,30 +120,83 @@ Epoll::Add(const fd_t fd, const uint32_t events, const fn_t & chandler)
 bool
 Epoll::Remove(const fd_t fd)
 {
-	ASSERT(!lock_.IsOwner());
-
 	DEBUG(log_) << "Remove. fd:" << fd;
 
-	FDRecord * fdrec = NULL;
+	/*
+	 * The thread we would wait for could be waiting for us
+	 */
+	INVARIANT(!dispatching_ || dispatching_ == this);
+
+	bool ok;
+	FDRecord * fdrec = Unregister(fd, ok);
 
-	{
+	if (dispatching_ != this) {
 		/*
-		 * Remove from fdmap
+		 * Wait out the handler if the epoll thread is in it right now
 		 */
-		Guard _(&lock_);
+		while (active_.load(memory_order_seq_cst) == fdrec) {
+			Cpu::Relax();
+		}
+	}
+
+	/*
+	 * We don't delete the fd record here because we have tagged them as completion
+	 * token with the epoll. It could be in the events the epoll thread has collected.
+	 */
+	Retire(fdrec);
+
+	return ok;
+}
 
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end() && it->second);
-		fdrec = it->second;
-		fdmap_.erase(it);
+bool
+Epoll::Remove(const fd_t fd, const Fn<int> & done)
+{
+	DEBUG(log_) << "Remove. fd:" << fd;
 
+	bool ok;
+	FDRecord * fdrec = Unregister(fd, ok);
+
+	if (dispatching_ == this || active_.load(memory_order_seq_cst) != fdrec) {
 		/*
-		 * mute callbacks
+		 * The handler is not running, and muted it won't be invoked again
 		 */
-		INVARIANT(!fdrec->mute_);
-		fdrec->mute_ = true;
+		Retire(fdrec);
+
+		Fn<int> fn(done);
+		fn.Wakeup(/*status=*/ 0);
+		return ok;
 	}
 
+	/*
+	 * The epoll thread is in the handler. It frees the record once it is done with the
+	 * events it has collected, and the record tells the caller on the way out.
+	 */
+	fdrec->done_ = done;
+	Retire(fdrec);
+
+	return ok;
+}
+
+Epoll::FDRecord *
+Epoll::Unregister(const fd_t fd, bool & ok)
+{
+	/*
+	 * Remove from the table
+	 */
+	fd_table_t::slot_t * slot = fds_.Slot(fd, /*create=*/ false);
+	INVARIANT(slot);
+
+	FDRecord * fdrec = slot->exchange(NULL);
+	INVARIANT(fdrec);
+
+	nfds_--;
+
+	/*
+	 * mute callbacks
+	 */
+	INVARIANT(!fdrec->mute_);
+	fdrec->mute_.store(true, memory_order_seq_cst);
+
 	/*
 	 * Notify the kernel
 	 */
@@ -131,47 +205,25 @@ Epoll::Remove(const fd_t fd)
 	if (status == -1) {
 		ERROR(log_) << "Error removing." << " fd: " << fd
 			    << " errno: " << errno;
-		return false;
 	}
 
-	{
-		/*
-		 * Push into trash can. We don't delete the fd record here because we have
-		 * tagged them as completion token with the epoll. We safely remove after
-		 * being woken up by the epoll.
-		 */
-		Guard _(&lock_);
-		trashcan_.push_back(fdrec);
-	}
-
-	return true;
+	ok = (status != -1);
+	return fdrec;
 }
 
 bool
 Epoll::AddEvent(const fd_t fd, const uint32_t events)
 {
-	ASSERT(!lock_.IsOwner());
 	ASSERT(events & (EPOLLIN | EPOLLOUT));
 
 	DEBUG(log_) << "AddEvent. fd:" << fd << " events:" << events;
 
-	FDRecord * fdrec = NULL;
-
-	{
-		/*
-		 * Update fdmap
-		 */
-		Guard _(&lock_);
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end() && it->second);
-		fdrec = it->second;
-		fdrec->events_ |= events;
-	}
+	FDRecord * fdrec = Find(fd);
 
 	/*
 	 * Notify the kernel
 	 */
-	epoll_event ee = fdrec->GetEpollEvent();
+	epoll_event ee = fdrec->GetEpollEvent(fdrec->events_.fetch_or(events) | events);
 
 	int status = epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &ee);
 
@@ -187,28 +239,16 @@ Epoll::AddEvent(const fd_t fd, const uint32_t events)
 bool
 Epoll::RemoveEvent(const fd_t fd, const uint32_t events)
 {
-	ASSERT(!lock_.IsOwner());
 	ASSERT(events & (EPOLLIN | EPOLLOUT));
 
 	DEBUG(log_) << "RemoveEvent. fd=" << fd << " events=" << events;
 
-	FDRecord * fdrec = NULL;
-
-	{
-		/*
-		 * Update fdmap
-		 */
-		Guard _(&lock_);
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end() && it->second);
-		fdrec = it->second;
-		fdrec->events_ &= ~events;
-	}
+	FDRecord * fdrec = Find(fd);
 
 	/*
 	 * Notify the kernel
 	 */
-	epoll_event ee = fdrec->GetEpollEvent();
+	epoll_event ee = fdrec->GetEpollEvent(fdrec->events_.fetch_and(~events) & ~events);
 
 	int status = epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &ee);
 
@@ -221,16 +261,183 @@ Epoll::RemoveEvent(const fd_t fd, const uint32_t events)
 	return (status != -1);
 }
 
-void Epoll::EmptyTrashcan()
+bool
+Epoll::Detach(const fd_t fd, uint32_t & events, fn_t & fn)
 {
-	INVARIANT(lock_.IsOwner());
+	DEBUG(log_) << "Detach. fd:" << fd;
 
-	for (auto fdrec : trashcan_) {
-		INVARIANT(fdrec->mute_);
-		delete fdrec;
+	fd_table_t::slot_t * slot = fds_.Slot(fd, /*create=*/ false);
+	INVARIANT(slot);
+
+	FDRecord * fdrec = slot->load(memory_order_acquire);
+	INVARIANT(fdrec && !fdrec->mute_);
+
+	/*
+	 * Same handshake as Remove, except that we back off instead of waiting
+	 */
+	fdrec->mute_.store(true, memory_order_seq_cst);
+
+	if (active_.load(memory_order_seq_cst) == fdrec) {
+		fdrec->mute_.store(false, memory_order_seq_cst);
+
+		/*
+		 * The events skipped while it was muted would be lost to an edge triggered fd,
+		 * have the kernel look at the fd again
+		 */
+		epoll_event ee = fdrec->GetEpollEvent(fdrec->events_);
+		int status = epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &ee);
+		INVARIANT(status != -1);
+
+		return false;
+	}
+
+	slot->store(NULL, memory_order_release);
+	nfds_--;
+
+	int status = epoll_ctl(fd_, EPOLL_CTL_DEL, fd, /*ee=*/ NULL);
+	INVARIANT(status != -1);
+
+	/*
+	 * The fd is looked at afresh when added elsewhere, nothing is lost to the mute
+	 */
+	events = fdrec->events_;
+	fn = fdrec->fn_;
+
+	Retire(fdrec);
+
+	return true;
+}
+
+Epoll::LoadStats
+Epoll::GetLoad() const
+{
+	LoadStats load;
+
+	load.nfds_ = nfds_;
+
+	const uint64_t now = Rdtsc::rdtsc();
+
+	if (now - loadStamp_.load(memory_order_relaxed) > 2 * windowCycles_) {
+		/*
+		 * The window did not roll over in a while, the thread has been either idle
+		 * in epoll_wait or stuck on the events all along
+		 */
+		load.busy_ = polling_.load(memory_order_relaxed) ? 0 : 1000;
+		return load;
+	}
+
+	load.busy_ = loadBusy_.load(memory_order_relaxed);
+	load.eventsPerSec_ = loadEvents_.load(memory_order_relaxed);
+	load.hotFd_ = loadHotFd_.load(memory_order_relaxed);
+	load.hotBusy_ = loadHotBusy_.load(memory_order_relaxed);
+
+	return load;
+}
+
+void
+Epoll::Account(FDRecord * fdrec, const uint64_t cycles)
+{
+	if (fdrec->window_ != window_) {
+		fdrec->window_ = window_;
+		fdrec->busy_ = 0;
+	}
+
+	fdrec->busy_ += cycles;
+
+	if (fdrec->busy_ > hotBusy_) {
+		hotFd_ = fdrec->fd_;
+		hotBusy_ = fdrec->busy_;
 	}
+}
+
+void
+Epoll::RollWindow(const uint64_t now)
+{
+	const uint64_t elapsed = now - windowStart_;
 
-	trashcan_.clear();
+	if (elapsed < windowCycles_) {
+		return;
+	}
+
+	loadBusy_.store(uint32_t(std::min<uint64_t>(windowBusy_ * 1000 / elapsed, 1000)),
+			memory_order_relaxed);
+	loadEvents_.store(windowEvents_ * System::GetHz() / elapsed, memory_order_relaxed);
+	loadHotFd_.store(hotFd_, memory_order_relaxed);
+	loadHotBusy_.store(uint32_t(std::min<uint64_t>(hotBusy_ * 1000 / elapsed, 1000)),
+			   memory_order_relaxed);
+	loadStamp_.store(now, memory_order_relaxed);
+
+	++window_;
+	windowStart_ = now;
+	windowBusy_ = windowEvents_ = 0;
+	hotFd_ = -1;
+	hotBusy_ = 0;
+}
+
+Epoll::FDRecord *
+Epoll::Find(const fd_t fd)
+{
+	FDRecord * fdrec = fds_.Get(fd);
+
+	INVARIANT(fdrec);
+	return fdrec;
+}
+
+void
+Epoll::Retire(FDRecord * fdrec)
+{
+	/*
+	 * The events collected in this epoch and earlier might have the record, the ones
+	 * collected later can't, it is out of the kernel's set by now
+	 */
+	fdrec->epoch_ = epoch_.load(memory_order_seq_cst);
+
+	FDRecord * head = retired_.load(memory_order_relaxed);
+	do {
+		fdrec->next_ = head;
+	} while (!retired_.compare_exchange_weak(head, fdrec, memory_order_release,
+						 memory_order_relaxed));
+}
+
+void
+Epoll::Reclaim()
+{
+	/*
+	 * The events of the epochs before this one are all dispatched
+	 */
+	const uint64_t epoch = epoch_.load(memory_order_relaxed);
+
+	FDRecord * fdrec = retired_.exchange(NULL, memory_order_acquire);
+
+	while (fdrec) {
+		FDRecord * next = fdrec->next_;
+		fdrec->next_ = limbo_;
+		limbo_ = fdrec;
+		fdrec = next;
+	}
+
+	FDRecord ** prev = &limbo_;
+
+	while ((fdrec = *prev)) {
+		if (fdrec->epoch_ < epoch) {
+			INVARIANT(fdrec->mute_);
+			*prev = fdrec->next_;
+			delete fdrec;
+		} else {
+			prev = &fdrec->next_;
+		}
+	}
+}
+
+void
+Epoll::Free(FDRecord * list)
+{
+	while (list) {
+		FDRecord * next = list->next_;
+		INVARIANT(list->mute_);
+		delete list;
+		list = next;
+	}
 }
 
 //
@@ -243,7 +450,11 @@ Epoll::ThreadMain()
 	events.resize(MAX_EPOLL_EVENT);
 
 	while (true) {
+		polling_.store(true, memory_order_relaxed);
 		int nfds = epoll_wait(fd_, &events[0], MAX_EPOLL_EVENT, /*ms=*/ -1);
+		polling_.store(false, memory_order_relaxed);
+
+		const uint64_t start = Rdtsc::rdtsc();
 
 		DEBUG(log_) << "Woke up. nfds=" << nfds;
 
@@ -275,6 +486,8 @@ Epoll::ThreadMain()
 		/*
 		 * Wakeup completion handlers
 		 */
+		dispatching_ = this;
+
 		for (int i = 0; i < nfds; ++i) {
 			uint32_t events_mask = events[i].events;
 			FDRecord * fdrec = (FDRecord *) events[i].data.ptr;
@@ -283,22 +496,38 @@ Epoll::ThreadMain()
 			/*
 			 * Ignore callback if muted
 			 */
-			{
-				Guard _(&lock_);
-				if (fdrec->mute_) continue;
+			active_.store(fdrec, memory_order_seq_cst);
+
+			if (fdrec->mute_.load(memory_order_seq_cst)) {
+				active_.store(NULL, memory_order_release);
+				continue;
 			}
 
 			DEBUG(log_) << "Active fd. fd=" << fdrec->fd_
-				    << " events=" << fdrec->events_; 
+				    << " events=" << fdrec->events_;
+
+			const uint64_t begin = Rdtsc::rdtsc();
 
 			fdrec->fn_.Wakeup(fdrec->fd_, events_mask);
+
+			Account(fdrec, Rdtsc::rdtsc() - begin);
+
+			active_.store(NULL, memory_order_release);
 		}
 
+		dispatching_ = NULL;
+
 		/*
-		 * Take out the trash
+		 * Done with the events of this epoch, take out the trash
 		 */
-		Guard _(&lock_);
-		EmptyTrashcan();
+		epoch_.fetch_add(1, memory_order_seq_cst);
+		Reclaim();
+
+		const uint64_t now = Rdtsc::rdtsc();
+
+		windowBusy_ += now - start;
+		windowEvents_ += nfds;
+		RollWindow(now);
 
 		EnableThreadCancellation();
 	}
@@ -1,15 +1,15 @@
 #pragma once
 
-#include <map>
 #include <sys/epoll.h>
 #include <stdint.h>
-#include <tr1/unordered_map>
+#include <atomic>
 
 #include "util.h"
 #include "lock.h"
 #include "async.h"
 #include "schd/thread.h"
 #include "net/fdpoll.h"
+#include "net/fd-table.h"
 
 namespace bblocks {
 
@@ -23,6 +23,19 @@ namespace bblocks {
  *
  * Effectively the processing throughput will be what one can extract from a
  * single core.
+ *
+ * The records of the fds are kept in a flat table indexed by fd, read without a lock.
+ * The polling thread never takes a lock, it gets the record with the event and checks
+ * whether it is muted. A removed record is retired with the current epoch and freed by
+ * the polling thread once it is done with the events it had collected by then.
+ *
+ * Once Remove returns the handler of the fd is not running and won't be invoked again.
+ * Waiting for it from a handler of another Epoll could deadlock, with that Epoll's
+ * thread waiting for us the same way, so handlers remove the fds of the other Epolls
+ * with the Remove that takes a done callback.
+ *
+ * The polling thread keeps track of the time it spends on the events, and of the fd whose
+ * handlers take the most of it, over windows of LOAD_WINDOW_MS (see GetLoad).
  */
 class Epoll : public Thread, public FdPoll
 {
@@ -35,12 +48,38 @@ public:
 
 	virtual bool Add(const fd_t fd, const uint32_t events, const fn_t & fn) override;
 	virtual bool Remove(const fd_t fd) override;
+	virtual bool Remove(const fd_t fd, const Fn<int> & done) override;
 	virtual bool AddEvent(const fd_t fd, const uint32_t events) override;
 	virtual bool RemoveEvent(const fd_t fd, const uint32_t events) override;
 
+	/**
+	 * Load of the polling thread over the last window
+	 */
+	struct LoadStats
+	{
+		LoadStats()
+			: busy_(0), eventsPerSec_(0), nfds_(0), hotFd_(-1), hotBusy_(0)
+		{}
+
+		uint32_t busy_;			// Permille of the time spent on events
+		uint64_t eventsPerSec_;
+		size_t nfds_;			// Registered now
+		fd_t hotFd_;			// Busiest fd, -1 if none
+		uint32_t hotBusy_;		// Permille of the time spent in its handlers
+	};
+
+	LoadStats GetLoad() const;
+
+	/**
+	 * Take the fd out of the set without waiting for its handler, to add it to another
+	 * Epoll with the events and handler handed back. Fails if the handler is running.
+	 */
+	bool Detach(const fd_t fd, uint32_t & events, fn_t & fn);
+
 private:
 
 	static const int MAX_EPOLL_EVENT = 10 * 1024; // C10K
+	static const uint64_t LOAD_WINDOW_MS = 100;
 
 	/**
 	 *  Represent the Fd being polled on and its related information
@@ -48,42 +87,98 @@ private:
 	struct FDRecord
 	{
 		FDRecord(const fd_t fd, const uint32_t events, const fn_t & fn)
-			: fd_(fd), events_(events), fn_(fn), mute_(false)
+			: fd_(fd), events_(events), fn_(fn), mute_(false), epoch_(0), next_(NULL)
+			, window_(0), busy_(0)
 		{}
 
-		epoll_event GetEpollEvent()
+		~FDRecord()
+		{
+			if (done_) {
+				done_.Wakeup(/*status=*/ 0);
+			}
+		}
+
+		epoll_event GetEpollEvent(const uint32_t events)
 		{
 			epoll_event ee;
 			memset(&ee, /*ch=*/ 0, sizeof(ee));
 			ee.data.ptr = this;
-			ee.events = events_;
+			ee.events = events;
 			return ee;
 		}
 
-		fd_t fd_;               // Registered file descriptor
-		uint32_t events_;       // Registered events
-		fn_t fn_;		// Completion handler
-		bool mute_;             // Don't invoke handler
+		fd_t fd_;			// Registered file descriptor
+		atomic<uint32_t> events_;	// Registered events
+		fn_t fn_;			// Completion handler
+		atomic<bool> mute_;		// Don't invoke handler
+		uint64_t epoch_;		// Epoch the record was retired in
+		FDRecord * next_;		// Retired records
+		uint64_t window_;		// Load window busy_ is for
+		uint64_t busy_;			// Cycles in the handler this window
+		Fn<int> done_;			// Removed without waiting, call once done
 	};
 
-	typedef tr1::unordered_map<fd_t, FDRecord *> fd_map_t;
-	typedef list<FDRecord *> fdrec_list_t;
+	typedef FdTable<FDRecord *> fd_table_t;
 
 	/**
 	 * Epoll thread entry method
 	 */
 	virtual void * ThreadMain();
 
+	FDRecord * Find(const fd_t fd);
+
 	/**
-	 * Clear the fds that are marked for deletion
+	 * Take the fd out of the table and the kernel's set, and mute its handler
 	 */
-	void EmptyTrashcan();
+	FDRecord * Unregister(const fd_t fd, bool & ok);
 
-	string log_;		    // Log file
-	SpinMutex lock_;	    // Default lock
-	fd_t fd_;		    // Epoll fd
-	fd_map_t fdmap_;	    // fd <-> FDRecord map
-	fdrec_list_t trashcan_;	    // FDRecords to be trashed
+	/**
+	 * Hand a removed record over to the polling thread
+	 */
+	void Retire(FDRecord * fdrec);
+
+	/**
+	 * Free the retired records the polling thread is done with. Called by the polling
+	 * thread between the polls.
+	 */
+	void Reclaim();
+	void Free(FDRecord * list);
+
+	/**
+	 * Charge the time spent on an event to the window, and roll the window over once it
+	 * is over. Called by the polling thread.
+	 */
+	void Account(FDRecord * fdrec, const uint64_t cycles);
+	void RollWindow(const uint64_t now);
+
+	string log_;				// Log file
+	fd_t fd_;				// Epoll fd
+	fd_table_t fds_;			// fd -> FDRecord
+	atomic<size_t> nfds_;			// Registered fds
+	atomic<uint64_t> epoch_;		// Polls done
+	atomic<FDRecord *> retired_;		// Removed, on the way to the polling thread
+	FDRecord * limbo_;			// Retired, the polling thread might still see
+	atomic<FDRecord *> active_;		// FDRecord whose handler is running
+
+	/* Epoll whose events the current thread is dispatching */
+	static __thread Epoll * dispatching_;
+
+	/* load window, private to the polling thread */
+	const uint64_t windowCycles_;
+	uint64_t window_;
+	uint64_t windowStart_;
+	uint64_t windowBusy_;
+	uint64_t windowEvents_;
+	fd_t hotFd_;
+	uint64_t hotBusy_;
+
+	/* load of the last window, see LoadStats */
+	atomic<bool> polling_;			// In epoll_wait
+	atomic<uint64_t> loadStamp_;		// End of the window, cycles
+	atomic<uint32_t> loadBusy_;
+	atomic<uint64_t> loadEvents_;
+	atomic<fd_t> loadHotFd_;
+	atomic<uint32_t> loadHotBusy_;
 };
 
 }
@@ -1,13 +1,28 @@
 #pragma once
 
 #include <memory>
-#include <map>
 
 #include "net/fdpoll.h"
+#include "net/fd-table.h"
 #include "net/epoll/epoll.h"
+#include "perf/perf-counter.h"
 
 namespace bblocks {
 
+//.............................................................................. MultiPathEpoll ....
+
+/**
+ * @class MultiPathEpoll
+ *
+ * Spreads the fds across a number of Epoll instances, each with a polling thread of its
+ * own. The Epoll an fd went to is looked up in a flat table indexed by fd, without a
+ * lock, so the calls for fds on different Epolls never contend.
+ *
+ * A new fd goes to the Epoll whose thread was the least busy over the last load window,
+ * the one with the fewest fds among the ones about as busy. Rebalance moves the busiest
+ * fd of the busiest Epoll to the least busy one when they are far enough apart. It is up
+ * to the owner to call it, every load window or so.
+ */
 class MultiPathEpoll : public FdPoll
 {
 public:
@@ -15,10 +30,17 @@ public:
 	using FdPoll::fd_t;
 	using FdPoll::fn_t;
 
+	/* Busy permille within which the Epolls count as equally busy */
+	static const uint32_t BUSY_BAND = 50;
+	/* Busy permille between the busiest and the least busy to move an fd for */
+	static const uint32_t IMBALANCE = 250;
+
 	MultiPathEpoll(const size_t npollth, const string & logpath = "mp-epoll/")
-		: lock_(logpath)
-		, log_(logpath)
+		: log_(logpath)
+		, statMigrations_(logpath + "migrations", "fds", PerfCounter::COUNTER)
 	{
+		INVARIANT(npollth && npollth < MIGRATING);
+
 		for (size_t i = 0; i < npollth; ++i) {
 			auto epoll = shared_ptr<Epoll>(new Epoll(logpath + STR(i)));
 			epolls_.push_back(epoll);
@@ -27,67 +49,266 @@ public:
 
 	virtual ~MultiPathEpoll()
 	{
-		{
-			Guard _(&lock_);
-			epolls_.clear();
+		for (size_t i = 0; i < epolls_.size(); ++i) {
+			const Epoll::LoadStats load = epolls_[i]->GetLoad();
+
+			INFO(log_) << "Epoll " << i << " busy " << load.busy_ << " permille"
+				   << " events/s " << load.eventsPerSec_;
 		}
+
+		INFO(log_) << statMigrations_;
+
+		epolls_.clear();
 	}
 
 	virtual bool Add(const fd_t fd, const uint32_t events, const fn_t & fn) override
 	{
-		Guard _(&lock_);
+		const size_t id = Place();
+
+		DEBUG(log_) << "Add. fd:" << fd << " epoll:" << id;
 
-		INVARIANT(fdmap_.find(fd) == fdmap_.end());
+		route_t * route = routes_.Slot(fd, /*create=*/ true);
 
-		const size_t id = ++idx_ % epolls_.size();
+		uint64_t r = route->load();
+		do {
+			INVARIANT(!Id(r));
+		} while (!route->compare_exchange_weak(r, r | (id + 1)));
 
-		INFO(log_) << id;
+		if (!epolls_[id]->Add(fd, events, fn)) {
+			route->fetch_and(~ID_MASK);
+			return false;
+		}
 
-		fdmap_[fd] = id;
-		return epolls_[id]->Add(fd, events, fn);
+		return true;
 	}
 
 	virtual bool Remove(const fd_t fd) override
 	{
-		Guard _(&lock_);
-
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end());
+		return Unroute(fd)->Remove(fd);
+	}
 
-		const size_t id = it->second;
-		fdmap_.erase(it);
-		return epolls_[id]->Remove(fd);
+	virtual bool Remove(const fd_t fd, const Fn<int> & done) override
+	{
+		return Unroute(fd)->Remove(fd, done);
 	}
 
 	virtual bool AddEvent(const fd_t fd, const uint32_t events) override
 	{
-		Guard _(&lock_);
-
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end());
+		route_t & route = Route(fd);
+		const bool ok = Pin(route)->AddEvent(fd, events);
+		route.fetch_sub(PIN);
 
-		return epolls_[it->second]->AddEvent(fd, events);
+		return ok;
 	}
 
 	virtual bool RemoveEvent(const fd_t fd, const uint32_t events) override
 	{
-		Guard _(&lock_);
+		route_t & route = Route(fd);
+		const bool ok = Pin(route)->RemoveEvent(fd, events);
+		route.fetch_sub(PIN);
+
+		return ok;
+	}
+
+	/**
+	 * Move the busiest fd of the busiest Epoll to the least busy one, if they are more
+	 * than IMBALANCE apart and moving the fd narrows the gap
+	 *
+	 * @return	true if an fd was moved
+	 */
+	bool Rebalance()
+	{
+		size_t from = 0;
+		size_t to = 0;
+		vector<Epoll::LoadStats> loads = Loads();
+
+		for (size_t i = 1; i < loads.size(); ++i) {
+			if (loads[i].busy_ > loads[from].busy_) {
+				from = i;
+			}
 
-		auto it = fdmap_.find(fd);
-		INVARIANT(it != fdmap_.end());
+			if (loads[i].busy_ < loads[to].busy_) {
+				to = i;
+			}
+		}
 
-		return epolls_[it->second]->RemoveEvent(fd, events);
+		const Epoll::LoadStats & busiest = loads[from];
+		const uint32_t gap = busiest.busy_ - loads[to].busy_;
+
+		if (gap <= IMBALANCE || busiest.hotFd_ == -1 || busiest.nfds_ < 2) {
+			return false;
+		}
+
+		if (busiest.hotBusy_ >= gap) {
+			/*
+			 * It would only turn the tables
+			 */
+			return false;
+		}
+
+		if (!Migrate(busiest.hotFd_, from, to)) {
+			return false;
+		}
+
+		DEBUG(log_) << "Moved fd " << busiest.hotFd_ << " from " << from << " to " << to;
+
+		statMigrations_.Update(1);
+		return true;
+	}
+
+	/**
+	 * Load of the Epolls by index
+	 */
+	vector<Epoll::LoadStats> Loads() const
+	{
+		vector<Epoll::LoadStats> loads;
+
+		for (auto & epoll : epolls_) {
+			loads.push_back(epoll->GetLoad());
+		}
+
+		return loads;
+	}
+
+	/**
+	 * The Epolls, to shard across by hand. The fds added to them directly are neither
+	 * routed nor moved by this.
+	 */
+	vector<FdPoll *> Pollers() const
+	{
+		vector<FdPoll *> pollers;
+
+		for (auto & epoll : epolls_) {
+			pollers.push_back(epoll.get());
+		}
+
+		return pollers;
 	}
 
 private:
 
-	typedef map<fd_t, size_t> fdmap_t;
+	/*
+	 * Route of an fd. The low word is the index of the Epoll polling the fd plus one, zero
+	 * if the fd is not registered, MIGRATING while the fd is moved. The high word counts
+	 * the calls going to the Epoll, the fd is not moved from under them.
+	 */
+	typedef FdTable<uint64_t> route_table_t;
+	typedef route_table_t::slot_t route_t;
+
+	static const uint32_t MIGRATING = UINT32_MAX;
+	static const uint64_t ID_MASK = UINT32_MAX;
+	static const uint64_t PIN = 1ULL << 32;
+
+	static uint32_t Id(const uint64_t r)
+	{
+		return uint32_t(r & ID_MASK);
+	}
+
+	route_t & Route(const fd_t fd)
+	{
+		route_t * route = routes_.Slot(fd, /*create=*/ false);
+		INVARIANT(route);
+
+		return *route;
+	}
+
+	/*
+	 * Clear the route of the fd, and return the Epoll it was on
+	 */
+	Epoll * Unroute(const fd_t fd)
+	{
+		route_t * route = routes_.Slot(fd, /*create=*/ false);
+		INVARIANT(route);
+
+		/*
+		 * Wait out a move, the fd has to be where the route says when we take it out
+		 */
+		uint64_t r = route->load();
+		while (Id(r) == MIGRATING
+		       || !route->compare_exchange_weak(r, r & ~ID_MASK)) {
+			if (Id(r) == MIGRATING) {
+				Cpu::Relax();
+				r = route->load();
+			}
+		}
+
+		INVARIANT(Id(r));
+
+		return epolls_[Id(r) - 1].get();
+	}
+
+	/*
+	 * Epoll polling the fd, kept there until the pin is dropped
+	 */
+	Epoll * Pin(route_t & route)
+	{
+		while (true) {
+			const uint32_t id = Id(route.fetch_add(PIN));
+			INVARIANT(id);
+
+			if (id != MIGRATING) {
+				return epolls_[id - 1].get();
+			}
+
+			route.fetch_sub(PIN);
+			Cpu::Relax();
+		}
+	}
+
+	/*
+	 * Least busy Epoll, the one with the fewest fds among the ones about as busy
+	 */
+	size_t Place() const
+	{
+		size_t best = 0;
+		Epoll::LoadStats bestLoad = epolls_[0]->GetLoad();
+
+		for (size_t i = 1; i < epolls_.size(); ++i) {
+			const Epoll::LoadStats load = epolls_[i]->GetLoad();
+
+			const uint32_t band = load.busy_ / BUSY_BAND;
+			const uint32_t bestBand = bestLoad.busy_ / BUSY_BAND;
+
+			if (band < bestBand || (band == bestBand && load.nfds_ < bestLoad.nfds_)) {
+				best = i;
+				bestLoad = load;
+			}
+		}
+
+		return best;
+	}
+
+	/*
+	 * Move the fd unless somebody is in a call for it or its handler is running
+	 */
+	bool Migrate(const fd_t fd, const size_t from, const size_t to)
+	{
+		route_t * route = routes_.Slot(fd, /*create=*/ false);
+
+		uint64_t r = from + 1;
+		if (!route || !route->compare_exchange_strong(r, MIGRATING)) {
+			return false;
+		}
+
+		uint32_t events;
+		fn_t fn;
+
+		if (!epolls_[from]->Detach(fd, events, fn)) {
+			route->store(from + 1);
+			return false;
+		}
+
+		bool ok = epolls_[to]->Add(fd, events, fn);
+		INVARIANT(ok);
+
+		route->store(to + 1);
+		return true;
+	}
 
-	SpinMutex lock_;
 	string log_;
-	atomic<size_t> idx_;
 	vector<shared_ptr<Epoll> > epolls_;
-	fdmap_t fdmap_;
+	route_table_t routes_;
+	PerfCounter statMigrations_;
 };
 
 }
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+
+#include "net/fdpoll.h"
+#include "net/fd-table.h"
+#include "schd/reactor.h"
+#include "schd/thread-pool.h"
+
+namespace bblocks {
+
+//................................................................................ ReactorEpoll ....
+
+/**
+ * @class ReactorEpoll
+ *
+ * Polls fds on the threads of the pool, which has to be started in reactor mode (see
+ * BBlocks::Start). There is no polling thread of its own.
+ *
+ * A fd added from one of the pool threads is polled by that thread, fds added from
+ * elsewhere are spread across the threads. The handlers are invoked on the thread that
+ * polls the fd, so an intr_fn handler runs right where the event is picked up without a
+ * hop to another thread.
+ *
+ * The records of the fds are kept in a flat table indexed by fd, same as Epoll, nobody
+ * takes a lock to look them up.
+ */
+class ReactorEpoll : public FdPoll
+{
+public:
+
+	using FdPoll::fd_t;
+	using FdPoll::fn_t;
+
+	ReactorEpoll(const string & logPath = "/reactor-epoll")
+		: log_(logPath)
+		, nfds_(0)
+	{
+		INVARIANT(NonBlockingThreadPool::Instance().IsReactor());
+	}
+
+	virtual ~ReactorEpoll()
+	{
+		INVARIANT(!nfds_);
+	}
+
+	virtual bool Add(const fd_t fd, const uint32_t events, const fn_t & fn) override
+	{
+		DEBUG(log_) << "Add. fd:" << fd << ", events:" << events;
+
+		Reactor * reactor = NonBlockingThreadPool::Instance().PickReactor();
+		FDRecord * fdrec = new FDRecord(fd, events, fn, reactor);
+
+		fd_table_t::slot_t * slot = fds_.Slot(fd, /*create=*/ true);
+
+		FDRecord * expected = NULL;
+		bool ok = slot->compare_exchange_strong(expected, fdrec);
+		INVARIANT(ok);
+
+		nfds_++;
+
+		if (!reactor->Add(fd, events, fdrec)) {
+			slot->store(NULL);
+			nfds_--;
+
+			delete fdrec;
+			return false;
+		}
+
+		return true;
+	}
+
+	virtual bool Remove(const fd_t fd) override
+	{
+		DEBUG(log_) << "Remove. fd:" << fd;
+
+		FDRecord * fdrec = Take(fd);
+
+		/*
+		 * The reactor owns the record from now on, it could have events for it that are
+		 * yet to be dispatched
+		 */
+		return fdrec->reactor_->Remove(fd, fdrec);
+	}
+
+	virtual bool Remove(const fd_t fd, const Fn<int> & done) override
+	{
+		DEBUG(log_) << "Remove. fd:" << fd;
+
+		FDRecord * fdrec = Take(fd);
+
+		/*
+		 * The record goes away on the reactor's thread once the handler is done, and
+		 * tells the caller on the way out
+		 */
+		fdrec->done_ = done;
+		return fdrec->reactor_->Retire(fd, fdrec);
+	}
+
+	virtual bool AddEvent(const fd_t fd, const uint32_t events) override
+	{
+		ASSERT(events & (EPOLLIN | EPOLLOUT));
+
+		FDRecord * fdrec = Find(fd);
+		const uint32_t mask = fdrec->events_.fetch_or(events) | events;
+		return fdrec->reactor_->Modify(fd, mask, fdrec);
+	}
+
+	virtual bool RemoveEvent(const fd_t fd, const uint32_t events) override
+	{
+		ASSERT(events & (EPOLLIN | EPOLLOUT));
+
+		FDRecord * fdrec = Find(fd);
+		const uint32_t mask = fdrec->events_.fetch_and(~events) & ~events;
+		return fdrec->reactor_->Modify(fd, mask, fdrec);
+	}
+
+private:
+
+	/**
+	 * Represent the fd being polled on and its related information
+	 */
+	struct FDRecord : ReactorHandle
+	{
+		FDRecord(const fd_t fd, const uint32_t events, const fn_t & fn, Reactor * reactor)
+			: fd_(fd), events_(events), fn_(fn), reactor_(reactor)
+		{}
+
+		virtual ~FDRecord()
+		{
+			if (done_) {
+				done_.Wakeup(/*status=*/ 0);
+			}
+		}
+
+		virtual void HandleEvent(const uint32_t events) override
+		{
+			fn_.Wakeup(fd_, events);
+		}
+
+		fd_t fd_;			// Registered file descriptor
+		atomic<uint32_t> events_;	// Registered events
+		fn_t fn_;			// Completion handler
+		Reactor * reactor_;		// Reactor polling the fd
+		Fn<int> done_;			// Removed without waiting, call once done
+	};
+
+	typedef FdTable<FDRecord *> fd_table_t;
+
+	/*
+	 * Take the record of the fd out of the table
+	 */
+	FDRecord * Take(const fd_t fd)
+	{
+		fd_table_t::slot_t * slot = fds_.Slot(fd, /*create=*/ false);
+		INVARIANT(slot);
+
+		FDRecord * fdrec = slot->exchange(NULL);
+		INVARIANT(fdrec);
+
+		nfds_--;
+
+		return fdrec;
+	}
+
+	FDRecord * Find(const fd_t fd)
+	{
+		FDRecord * fdrec = fds_.Get(fd);
+
+		INVARIANT(fdrec);
+		return fdrec;
+	}
+
+	string log_;
+	fd_table_t fds_;		// fd -> FDRecord
+	atomic<size_t> nfds_;		// Registered fds
+};
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//..................................................................................... FdTable ....
+
+/**
+ * Flat table of T indexed by fd, read and written without a lock. A value of T() marks a
+ * free slot.
+ *
+ * The table is a fixed directory of chunks of FDS_PER_CHUNK slots. The chunks are
+ * allocated when the first fd in their range is looked up for a store, and never move or
+ * go away before the table does, so a slot can be held on to.
+ */
+template<class T>
+class FdTable
+{
+public:
+
+	static const size_t FDS_PER_CHUNK = 4096;
+	static const size_t MAX_CHUNKS = 1024;		// 4M fds
+
+	typedef atomic<T> slot_t;
+
+	FdTable()
+	{
+		for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+			chunks_[i].store(NULL, memory_order_relaxed);
+		}
+	}
+
+	~FdTable()
+	{
+		for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+			delete[] chunks_[i].load(memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Slot of the fd, NULL if there is none yet and create is not set
+	 */
+	slot_t * Slot(const int fd, const bool create)
+	{
+		INVARIANT(fd >= 0 && size_t(fd) < MAX_CHUNKS * FDS_PER_CHUNK);
+
+		atomic<slot_t *> & chunk = chunks_[fd / FDS_PER_CHUNK];
+		slot_t * slots = chunk.load(memory_order_acquire);
+
+		if (!slots) {
+			if (!create) {
+				return NULL;
+			}
+
+			/*
+			 * First fd in this range, whoever gets the chunk in first wins
+			 */
+			slot_t * fresh = new slot_t[FDS_PER_CHUNK];
+			for (size_t i = 0; i < FDS_PER_CHUNK; ++i) {
+				fresh[i].store(T(), memory_order_relaxed);
+			}
+
+			if (chunk.compare_exchange_strong(slots, fresh, memory_order_acq_rel)) {
+				slots = fresh;
+			} else {
+				delete[] fresh;
+			}
+		}
+
+		return &slots[fd % FDS_PER_CHUNK];
+	}
+
+	/**
+	 * Value of the fd, T() if there is none
+	 */
+	T Get(const int fd)
+	{
+		slot_t * slot = Slot(fd, /*create=*/ false);
+		return slot ? slot->load(memory_order_acquire) : T();
+	}
+
+private:
+
+	atomic<slot_t *> chunks_[MAX_CHUNKS];
+};
+
+}
@@ -29,6 +29,13 @@ public:
 	 */
 	virtual bool Remove(const fd_t fd) = 0;
 
+	/**
+	 * Same as Remove without waiting for the handler, which could be running on another
+	 * thread right now. done is called once the handler is not running and won't be
+	 * invoked again. Unlike Remove this can be called from a handler of any poller.
+	 */
+	virtual bool Remove(const fd_t fd, const Fn<int> & done) = 0;
+
 	/**
 	 * Remove a given event from the registered fd
 	 */
@@ -67,6 +67,26 @@ public:
 		INVARIANT(status != -1);
 		return size;
 	}
+
+	/**
+	 * Let sockets of the same user bind the same address and port, the kernel spreads
+	 * the incoming connections across the listeners
+	 */
+	static bool SetReusePort(const int fd, const bool enable)
+	{
+		const int flag = enable;
+		int status = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+		return status != -1;
+	}
+
+	/**
+	 * Prefer this listener of a SO_REUSEPORT group for the connections coming in on cpu
+	 */
+	static bool SetIncomingCpu(const int fd, const int cpu)
+	{
+		int status = setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+		return status != -1;
+	}
 };
 
 // .............................................................................. SocketAddress ....
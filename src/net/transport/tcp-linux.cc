@@ -11,9 +11,12 @@ TCPChannel::TCPChannel(const string & name, int fd, FdPoll & epoll)
 	, lock_(name_)
 	, fd_(fd)
 	, epoll_(epoll)
+	, rabufHead_(0)
+	, rabufTail_(0)
 	/* Perf Counters */
 	, statReadSize_("stat/read-io", "bytes", PerfCounter::BYTES)
 	, statWriteSize_("stat/write-io", "bytes", PerfCounter::BYTES)
+	, statRecvSaved_("stat/recv-saved", "syscalls", PerfCounter::COUNTER)
 {
 	ASSERT(fd_ >= 0);
 
@@ -32,6 +35,19 @@ TCPChannel::~TCPChannel()
 {
     VERBOSE(name_) << statReadSize_;
     VERBOSE(name_) << statWriteSize_;
+    VERBOSE(name_) << statRecvSaved_;
+}
+
+void
+TCPChannel::SetReadAhead(const size_t size)
+{
+	ASSERT(size);
+
+	Guard _(&lock_);
+
+	INVARIANT(!rabuf_ && !rpending_.buf_);
+
+	rabuf_ = IOBuffer::Alloc(size);
 }
 
 int
@@ -82,6 +98,10 @@ TCPChannel::Read(const IOBuffer & data, const ReadDoneHandle & h, const bool pee
     
 	rpending_ = ReadCtx(data, h, peek);
 
+	if (rabuf_ && peek && data.Size() > rabuf_.Size()) {
+		GrowBuffer(data.Size());
+	}
+
 	return ReadDataFromSocket(/*isasync=*/ false);
 }
 
@@ -90,17 +110,25 @@ TCPChannel::Stop(const StopDoneHandle & h)
 {
 	ASSERT(h)
 
-	const bool status = epoll_.Remove(fd_);
-	INVARIANT(status);
-
 	INVARIANT(!stoph_);
 	stoph_ = h;
 
-	BBlocks::ScheduleBarrier(this, &TCPChannel::BarrierDone, /*nonce=*/ 0);
+	/*
+	 * Not waiting for the handler here, Stop can be called from a handler of another
+	 * poller
+	 */
+	const bool status = epoll_.Remove(fd_, intr_fn(this, &TCPChannel::Removed));
+	INVARIANT(status);
 
 	return 0;
 }
 
+void
+TCPChannel::Removed(int)
+{
+	BBlocks::ScheduleBarrier(this, &TCPChannel::BarrierDone, /*nonce=*/ 0);
+}
+
 void
 TCPChannel::BarrierDone(int)
 {
@@ -180,41 +208,70 @@ TCPChannel::ReadDataFromSocket(const bool isasync)
 		return -1;
 	}
 
+	/*
+	 * Bytes in the read-ahead buffer when we got here were received by an earlier recv
+	 */
+	bool saved = (rabufTail_ > rabufHead_);
+
 	while (true)
 	{
 		ASSERT(rpending_.bytesRead_ < rpending_.buf_.Size());
 		uint8_t * p = rpending_.buf_.Ptr() + rpending_.bytesRead_;
 		size_t size = rpending_.buf_.Size() - rpending_.bytesRead_;
 
-		int status = recv(fd_, p, size, rpending_.isPeek_ ? MSG_PEEK : 0);
+		int status = rabuf_ ? ReadFromBuffer(p, size) : 0;
 
-		if (status == -1) {
-			if (errno == EAGAIN) {
-				/*
-				 * Transient error, try again
-				 */
-				return false;
-			}
-
-			ERROR(name_) << "Error reading from socket. " << strerror(errno);
+		if (status && saved) {
+			statRecvSaved_.Update(1);
+			saved = false;
+		}
 
+		if (!status) {
 			/*
-			 * notify error and return
+			 * Large reads go to the socket straight, peeks have to stay in the buffer
 			 */
-			if (isasync) {
-				rpending_.h_.Wakeup(/*status=*/ -1, IOBuffer());
+			const bool direct = !rabuf_
+					    || (!rpending_.isPeek_ && size >= rabuf_.Size() / 4);
+
+			status = direct ? recv(fd_, p, size, rpending_.isPeek_ ? MSG_PEEK : 0)
+					: FillBuffer();
+
+			if (status == -1) {
+				if (errno == EAGAIN) {
+					/*
+					 * Transient error, try again
+					 */
+					return false;
+				}
+
+				ERROR(name_) << "Error reading from socket. " << strerror(errno);
+
+				/*
+				 * notify error and return
+				 */
+				if (isasync) {
+					rpending_.h_.Wakeup(/*status=*/ -1, IOBuffer());
+				}
+
+				return -1;
 			}
 
-			return -1;
-		}
+			statReadSize_.Update(status);
 
-		statReadSize_.Update(status);
+			if (status == 0) {
+				/*
+				 * no bytes were read
+				 */
+				break;
+			}
 
-		if (status == 0) {
-			/*
-			 * no bytes were read
-			 */
-			break;
+			if (!direct) {
+				/*
+				 * Into the read-ahead buffer, copied out on the next round
+				 */
+				rabufTail_ += status;
+				continue;
+			}
 		}
 
 		DEFENSIVE_CHECK(status);
@@ -240,6 +297,63 @@ TCPChannel::ReadDataFromSocket(const bool isasync)
 	return rpending_.bytesRead_;
 }
 
+size_t
+TCPChannel::ReadFromBuffer(uint8_t * p, const size_t size)
+{
+	/*
+	 * A peek leaves the bytes in the buffer, it picks up after the ones it copied already
+	 */
+	const size_t skip = rpending_.isPeek_ ? rpending_.bytesRead_ : 0;
+
+	ASSERT(rabufHead_ + skip <= rabufTail_);
+
+	const size_t n = std::min(size, rabufTail_ - rabufHead_ - skip);
+
+	if (!n) {
+		return 0;
+	}
+
+	memcpy(p, rabuf_.Ptr() + rabufHead_ + skip, n);
+
+	if (!rpending_.isPeek_) {
+		rabufHead_ += n;
+	}
+
+	if (rabufHead_ == rabufTail_) {
+		rabufHead_ = rabufTail_ = 0;
+	}
+
+	return n;
+}
+
+int
+TCPChannel::FillBuffer()
+{
+	/*
+	 * Move what is left to the front to make room
+	 */
+	if (rabufHead_) {
+		memmove(rabuf_.Ptr(), rabuf_.Ptr() + rabufHead_, rabufTail_ - rabufHead_);
+		rabufTail_ -= rabufHead_;
+		rabufHead_ = 0;
+	}
+
+	ASSERT(rabufTail_ < rabuf_.Size());
+
+	return recv(fd_, rabuf_.Ptr() + rabufTail_, rabuf_.Size() - rabufTail_, /*flags=*/ 0);
+}
+
+void
+TCPChannel::GrowBuffer(const size_t size)
+{
+	IOBuffer rabuf = IOBuffer::Alloc(size);
+	memcpy(rabuf.Ptr(), rabuf_.Ptr() + rabufHead_, rabufTail_ - rabufHead_);
+
+	rabufTail_ -= rabufHead_;
+	rabufHead_ = 0;
+	rabuf_ = rabuf;
+}
+
 int
 TCPChannel::WriteDataToSocket(const bool isasync)
 {
@@ -347,103 +461,181 @@ TCPServer::Accept(const SocketAddress & addr, const AcceptDoneHandle & h)
 
 	h_ = h;
 
-	sockfd_ = socket(AF_INET, SOCK_STREAM, 0);
+	for (size_t i = 0; i < shards_.size(); ++i) {
+		shards_[i].sockfd_ = Listen(saddr, i);
+
+		if (shards_[i].sockfd_ == -1) {
+			/*
+			 * Give up the listeners opened so far
+			 */
+			for (size_t j = 0; j < i; ++j) {
+				::close(shards_[j].sockfd_);
+				shards_[j].sockfd_ = -1;
+			}
+
+			return -1;
+		}
+	}
+
+	/*
+	 * The listeners are all up before any connection is handed out
+	 */
+	for (size_t i = 0; i < shards_.size(); ++i) {
+		const bool ok = shards_[i].epoll_->Add(shards_[i].sockfd_, EPOLLIN,
+						       intr_fn(this, &TCPServer::HandleFdEvent));
+		INVARIANT(ok);
+	}
+
+	INFO(name_) << "TCP Server started. shards=" << shards_.size();
+
+	return 0;
+}
+
+TCPServer::socket_t
+TCPServer::Listen(const sockaddr_in & saddr, const size_t shard)
+{
+	socket_t sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
-	if (sockfd_ < 0) {
+	if (sockfd < 0) {
 		ERROR(name_) << "Socket error." << strerror(errno);
 		return -1;
 	}
 
-	int status = fcntl(sockfd_, F_SETFL, O_NONBLOCK);
+	int status = fcntl(sockfd, F_SETFL, O_NONBLOCK);
 
 	if (status != 0) {
 	    ERROR(name_) << "Socket error." << strerror(errno);
+	    ::close(sockfd);
 	    return -1;
 	}
 
-	status = ::bind(sockfd_, (struct sockaddr *) &saddr, sizeof(sockaddr_in));
+	if (shards_.size() > 1 && !SocketOptions::SetReusePort(sockfd, /*enable=*/ true)) {
+		ERROR(name_) << "Error setting SO_REUSEPORT. " << strerror(errno);
+		::close(sockfd);
+		return -1;
+	}
+
+	if (!cpus_.empty() && !SocketOptions::SetIncomingCpu(sockfd, cpus_[shard])) {
+		/*
+		 * Only a hint, the connections are spread across the shards all the same
+		 */
+		ERROR(name_) << "Error setting SO_INCOMING_CPU. " << strerror(errno);
+	}
+
+	status = ::bind(sockfd, (struct sockaddr *) &saddr, sizeof(sockaddr_in));
 
 	if (status != 0) {
 	    ERROR(name_) << "Error binding socket. " << strerror(errno);
+	    ::close(sockfd);
 	    return -1;
 	}
 
 #if 0
-	SocketOptions::SetTcpNoDelay(sockfd_, /*enable=*/ true);
-	SocketOptions::SetTcpWindow(sockfd_, /*size=*/ 85 * 1024);
+	SocketOptions::SetTcpNoDelay(sockfd, /*enable=*/ true);
+	SocketOptions::SetTcpWindow(sockfd, /*size=*/ 85 * 1024);
 #endif
 
-	status = listen(sockfd_, MAXBACKLOG);
+	status = listen(sockfd, MAXBACKLOG);
 
 	if (status != 0) {
 		ERROR(name_) << "Error listening. " << strerror(errno);
+		::close(sockfd);
 		return -1;
 	}
 
-	const bool ok = epoll_.Add(sockfd_, EPOLLIN,
-				   intr_fn(this, &TCPServer::HandleFdEvent));
+	return sockfd;
+}
 
-	if (!ok) {
-		ERROR(name_) << "Error registering socket with epoll.";
-		return -1;
+TCPServer::Shard &
+TCPServer::ShardOf(const socket_t sockfd)
+{
+	for (auto & shard : shards_) {
+		if (shard.sockfd_ == sockfd) {
+			return shard;
+		}
 	}
 
-	INFO(name_) << "TCP Server started. ";
-
-	return 0;
+	DEADEND
 }
 
 void
 TCPServer::HandleFdEvent(int fd, uint32_t events)
 {
-	Guard _(&lock_);
-
+	/*
+	 * No lock, the shards accept in parallel. The listeners and h_ do not change while
+	 * they are registered.
+	 */
 	INVARIANT(events == EPOLLIN);
-	INVARIANT(fd == sockfd_);
 
-	sockaddr_in addr;
-	socklen_t len = sizeof(sockaddr_in);
-	memset(&addr, 0, len);
+	Shard & shard = ShardOf(fd);
+
+	size_t naccepted = 0;
+
+	while (true) {
+		int clientfd = accept4(fd, /*addr=*/ NULL, /*len=*/ NULL, SOCK_NONBLOCK);
+
+		if (clientfd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/*
+				 * Backlog drained
+				 */
+				break;
+			}
+
+			if (errno == ECONNABORTED || errno == EINTR) {
+				/*
+				 * Gone before we got to it
+				 */
+				continue;
+			}
+
+			/*
+			 * error accepting connection, return error to client
+			 */
+			ERROR(name_) << "Error accepting client connection. " << strerror(errno);
+			h_.Wakeup(/*status=*/ -1, static_cast<UnicastTransportChannel *>(NULL));
+			break;
+		}
 
-	int clientfd = accept4(sockfd_, (sockaddr *) &addr, &len, SOCK_NONBLOCK);
-	if (clientfd == -1) {
 		/*
-		 * error accepting connection, return error to client
+		 * Accepted. Create a channel object on the accepting shard and return to client
 		 */
-		ERROR(name_) << "Error accepting client connection. " << strerror(errno);
-		h_.Wakeup(/*status=*/ -1, static_cast<UnicastTransportChannel *>(NULL));
-		return;
-	}
+		UnicastTransportChannel * ch = new TCPChannel(name(clientfd), clientfd,
+							      *shard.epoll_);
+		INVARIANT(ch);
 
-	DEFENSIVE_CHECK(clientfd != -1);
+		h_.Wakeup(/*status=*/ 0, ch);
 
-	/*
-	 * Accepted. Create a channel object and return to client
-	 */
-	UnicastTransportChannel * ch = new TCPChannel(name(clientfd), clientfd, epoll_);
-	INVARIANT(ch);
+		DEBUG(name_) << "Accepted. clientfd=" << clientfd;
 
-	h_.Wakeup(/*status=*/ 0, ch);
+		++naccepted;
+	}
 
-	DEBUG(name_) << "Accepted. clientfd=" << clientfd;
+	statAcceptBatch_.Update(naccepted);
 }
 
 int
 TCPServer::Stop(const StopDoneHandle & h)
 {
-	Guard _(&lock_);
-
 	/*
-	 * unregister from epoll so no new connections are delivered
+	 * unregister from epoll so no new connections are delivered. Not under the lock,
+	 * Remove waits for the handler if it is running.
 	 */
-	const bool ok = epoll_.Remove(sockfd_);
-	INVARIANT(ok);
+	for (auto & shard : shards_) {
+		const bool ok = shard.epoll_->Remove(shard.sockfd_);
+		INVARIANT(ok);
+	}
+
+	Guard _(&lock_);
 
 	/*
-	 * Tear down the socket safely
+	 * Tear down the sockets safely
 	 */
-	::shutdown(sockfd_, SHUT_RDWR);
-	::close(sockfd_);
+	for (auto & shard : shards_) {
+		::shutdown(shard.sockfd_, SHUT_RDWR);
+		::close(shard.sockfd_);
+		shard.sockfd_ = -1;
+	}
 
 	/*
 	 * Drain pending notifictions
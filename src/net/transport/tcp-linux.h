@@ -8,6 +8,7 @@
 
 #include <netdb.h>
 #include <list>
+#include <vector>
 
 #include "util.h"
 #include "async.h"
@@ -24,11 +25,19 @@ namespace bblocks {
 
 /**
  * @class TCPChannel
+ *
+ * With read-ahead on, reads smaller than a quarter of the read-ahead go through a
+ * read-ahead buffer. One recv fills the buffer as far as the socket allows and the reads
+ * after are served from it, a header and the body after it take a single syscall. Larger
+ * reads take what is left in the buffer and go to the socket straight in to the caller's
+ * buffer. Peeks are always served from the read-ahead buffer, it grows to fit them.
  */
 class TCPChannel : public CompletionHandle, public UnicastTransportChannel
 {
 public:
 
+	static const size_t DEFAULT_READ_AHEAD = 64 * 1024;	// 64 KiB
+
 	friend class TCPConnector;
 	friend class TCPServer;
 
@@ -46,6 +55,21 @@ public:
 	virtual int Write(IOBuffer & buf, const WriteDoneHandle & h) override;
 	virtual int Stop(const StopDoneHandle & cb) override;
 
+	/**
+	 * Turn read-ahead on, before the first read
+	 *
+	 * @param	size	Bytes to receive at a time
+	 */
+	void SetReadAhead(const size_t size = DEFAULT_READ_AHEAD);
+
+	/**
+	 * Reads served with bytes an earlier recv brought in, each one a recv saved
+	 */
+	uint64_t RecvSaved() const
+	{
+		return statRecvSaved_.Aggregate();
+	}
+
     private:
 
 	__DISABLE_ASSIGN_AND_COPY__(TCPChannel)
@@ -98,7 +122,11 @@ public:
 	int Read(const IOBuffer & buf, const ReadDoneHandle & h, const bool peek);
 	void HandleFdEvent(int fd, uint32_t events) __intr_fn__;
 	int ReadDataFromSocket(const bool isasync);
+	size_t ReadFromBuffer(uint8_t * p, const size_t size);
+	int FillBuffer();
+	void GrowBuffer(const size_t size);
 	int WriteDataToSocket(const bool isasync);
+	void Removed(int) __intr_fn__;
 	void BarrierDone(int);
 	void FailOps();
 	void Close();
@@ -112,8 +140,14 @@ public:
 	ReadCtx rpending_;
 	StopDoneHandle stoph_;
 
+	/* read-ahead */
+	IOBuffer rabuf_;		// Received and not read yet, none if off
+	size_t rabufHead_;		// First byte not read
+	size_t rabufTail_;		// End of the bytes received
+
 	PerfCounter statReadSize_;
 	PerfCounter statWriteSize_;
+	PerfCounter statRecvSaved_;
 };
 
 //................................................................................... TCPServer ....
@@ -125,6 +159,15 @@ public:
  *
  * Provides a TCP listener implementation. Helps accept connections
  * from clients asynchronously. Designed on the acceptor design pattern.
+ *
+ * A sharded server listens with one SO_REUSEPORT socket per poller and the kernel spreads
+ * the incoming connections across them, so a burst of connections is accepted on all the
+ * pollers at once. A connection is polled by the poller it was accepted on. The accept
+ * handler is called from all of the pollers, at the same time too. Given cpus, listener i
+ * asks for the connections coming in on cpus[i]. This only pays off when the caller has
+ * pinned poller i to cpus[i], the server does not pin anything.
+ *
+ * Every wakeup accepts until the backlog is empty.
  */
 class TCPServer : public CompletionHandle, public UnicastAcceptor
 {
@@ -136,8 +179,30 @@ public:
 	using UnicastAcceptor::StopDoneHandle;
 
 	TCPServer(FdPoll & epoll)
-		: name_(name()), lock_(name_), epoll_(epoll)
-	{}
+		: name_(name())
+		, lock_(name_)
+		, statAcceptBatch_("stat/accept-batch", "conns", PerfCounter::COUNTER)
+	{
+		shards_.push_back(Shard(&epoll));
+	}
+
+	/**
+	 * @param	pollers		Listener and connections of shard i go to pollers[i]
+	 * @param	cpus		Connections coming in on cpus[i] go to shard i, if not empty
+	 */
+	TCPServer(const vector<FdPoll *> & pollers, const vector<int> & cpus = vector<int>())
+		: name_(name())
+		, lock_(name_)
+		, cpus_(cpus)
+		, statAcceptBatch_("stat/accept-batch", "conns", PerfCounter::COUNTER)
+	{
+		INVARIANT(!pollers.empty());
+		INVARIANT(cpus.empty() || cpus.size() == pollers.size());
+
+		for (auto epoll : pollers) {
+			shards_.push_back(Shard(epoll));
+		}
+	}
 
 	virtual ~TCPServer() {}
 
@@ -156,6 +221,19 @@ public:
 
 	typedef int socket_t;
 
+	/**
+	 * Listener and the poller it and its connections go to
+	 */
+	struct Shard
+	{
+		Shard(FdPoll * epoll) : epoll_(epoll), sockfd_(-1) {}
+
+		FdPoll * epoll_;
+		socket_t sockfd_;
+	};
+
+	socket_t Listen(const sockaddr_in & saddr, const size_t shard);
+	Shard & ShardOf(const socket_t sockfd);
 	void HandleFdEvent(int fd, uint32_t events) __intr_fn__;
 	void BarrierDone(StopDoneHandle h);
 
@@ -164,9 +242,11 @@ public:
 
 	const string name_;
 	SpinMutex lock_;
-	FdPoll & epoll_;
-	socket_t sockfd_;
+	vector<Shard> shards_;
+	const vector<int> cpus_;
 	AcceptDoneHandle h_;
+
+	PerfCounter statAcceptBatch_;
 };
 
 //................................................................................ TCPConnector ....
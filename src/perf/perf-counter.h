@@ -63,6 +63,14 @@ public:
 		UpdateBucket(val);
 	}
 
+	/*
+	 * Sum of the values updated with
+	 */
+	uint64_t Aggregate() const
+	{
+		return val_.load();
+	}
+
 	friend ostream & operator<<(ostream & os, const PerfCounter & pc)
 	{
 		os << "Perfcoutner: " << pc.name_ << endl;
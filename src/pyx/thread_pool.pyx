@@ -6,8 +6,8 @@ cdef extern from "schd/thread-pool.h" namespace "dh_core":
     cdef cppclass ThreadRoutine:
         void Run()
 
-    cdef cppclass FnPtr1[T]:
-        FnPtr1(void (*fn)(T), T)
+    cdef cppclass FnPtr[T]:
+        FnPtr(void (*fn)(T), T)
 
     cdef cppclass NonBlockingThreadPool:
         NonBlockingThreadPool()
@@ -31,7 +31,7 @@ cdef object MakePyThreadRoutine(ThreadRoutine * fn):
     r.cthis = fn
     return r
 
-cdef AsyncSchedule(PyNonBlockingThreadPool pool, FnPtr1[int] * fn):
+cdef AsyncSchedule(PyNonBlockingThreadPool pool, FnPtr[int] * fn):
     pool.cthis.Schedule(<ThreadRoutine *>fn)
 
 cdef class PyThreadRoutine:
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+
+#include "defs.h"
+#include "logger.h"
+#include "lock.h"
+#include "inlist.hpp"
+
+namespace bblocks {
+
+using namespace std;
+
+//............................................................................... ReactorHandle ....
+
+/**
+ * File descriptor registered with a Reactor
+ */
+class ReactorHandle
+{
+public:
+
+	ReactorHandle() : mute_(false) {}
+
+	virtual ~ReactorHandle() {}
+
+	/**
+	 * Called on the reactor's thread when the fd is ready
+	 */
+	virtual void HandleEvent(const uint32_t events) = 0;
+
+	/* Don't invoke the handler, the fd is being removed */
+	atomic<bool> mute_;
+};
+
+//..................................................................................... Reactor ....
+
+/**
+ * Epoll set owned by a NonBlockingThread in reactor mode.
+ *
+ * The thread parks in epoll_wait instead of the futex, so it wakes up for socket events
+ * and routines alike (routines pushed from other threads poke an eventfd). Ready events
+ * are handled on the thread itself, so the handlers run on the thread that owns the fd
+ * without a hop through the run queue.
+ *
+ * Handles can be added and removed from any thread. A removed handle is muted and kept
+ * around until the thread is done with the events it has already collected. Once Remove
+ * returns the handler is not running and won't be invoked again, so the owner of the
+ * handler can go away.
+ *
+ * Remove waits for the handler if it is running on the reactor's thread. Two handlers of
+ * different reactors removing each other's handles would wait on each other for good, so
+ * a handler of another reactor has to use Retire instead, which does not wait.
+ */
+class Reactor : public QueueParker
+{
+public:
+
+	static const int MAX_EVENTS = 256;
+
+	Reactor(const string & log)
+		: log_(log + "/reactor")
+		, lock_(log_)
+		, nready_(0)
+		, next_(0)
+		, active_(NULL)
+	{
+		fd_ = epoll_create1(EPOLL_CLOEXEC);
+		INVARIANT(fd_ != -1);
+
+		evfd_ = eventfd(/*initval=*/ 0, EFD_NONBLOCK | EFD_CLOEXEC);
+		INVARIANT(evfd_ != -1);
+
+		epoll_event ee;
+		memset(&ee, /*ch=*/ 0, sizeof(ee));
+		ee.events = EPOLLIN;
+		ee.data.ptr = NULL;
+
+		int status = epoll_ctl(fd_, EPOLL_CTL_ADD, evfd_, &ee);
+		INVARIANT(!status);
+	}
+
+	~Reactor()
+	{
+		EmptyTrashcan();
+
+		::close(evfd_);
+		::close(fd_);
+	}
+
+	/**
+	 * Register a fd. Can be called from any thread.
+	 */
+	bool Add(const int fd, const uint32_t events, ReactorHandle * h)
+	{
+		epoll_event ee = Event(events, h);
+
+		if (epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &ee) == -1) {
+			ERROR(log_) << "Error adding to epoll. fd=" << fd << " errno: " << errno;
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Change the events of a registered fd. Can be called from any thread.
+	 */
+	bool Modify(const int fd, const uint32_t events, ReactorHandle * h)
+	{
+		epoll_event ee = Event(events, h);
+
+		if (epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &ee) == -1) {
+			ERROR(log_) << "Error modifying epoll. fd=" << fd << " errno: " << errno;
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Unregister a fd. The handle is muted right away and destroyed by the reactor once
+	 * it is safe to do so. Can be called from any thread but the handlers of the other
+	 * reactors.
+	 */
+	bool Remove(const int fd, ReactorHandle * h)
+	{
+		/*
+		 * The thread we would wait for could be waiting for us
+		 */
+		INVARIANT(!dispatching_ || dispatching_ == this);
+
+		const bool ok = Unregister(fd, h);
+
+		if (dispatching_ != this) {
+			/*
+			 * Wait out the handler if the reactor thread is in it right now
+			 */
+			while (active_.load(memory_order_seq_cst) == h) {
+				Cpu::Relax();
+			}
+		}
+
+		Guard _(&lock_);
+		trashcan_.push_back(h);
+
+		return ok;
+	}
+
+	/**
+	 * Same as Remove without waiting for the handler. The handle is destroyed on the
+	 * reactor's thread once the handler is not running, which is how the owner of the
+	 * handle gets to know. Can be called from any thread.
+	 */
+	bool Retire(const int fd, ReactorHandle * h)
+	{
+		const bool ok = Unregister(fd, h);
+
+		{
+			Guard _(&lock_);
+			trashcan_.push_back(h);
+		}
+
+		if (dispatching_ != this) {
+			/*
+			 * The thread could be asleep with nothing else to wake it up for
+			 */
+			Unpark();
+		}
+
+		return ok;
+	}
+
+	/**
+	 * Collect the ready events without waiting. Can be called only by the owner.
+	 *
+	 * @return	true if there are events to dispatch
+	 */
+	bool Poll()
+	{
+		return Wait(/*ms=*/ 0);
+	}
+
+	bool HasReady() const
+	{
+		return next_ < nready_;
+	}
+
+	/**
+	 * Invoke the handlers of the collected events. Can be called only by the owner.
+	 */
+	void Dispatch()
+	{
+		dispatching_ = this;
+
+		while (next_ < nready_) {
+			const epoll_event & e = events_[next_++];
+			ReactorHandle * h = (ReactorHandle *) e.data.ptr;
+
+			active_.store(h, memory_order_seq_cst);
+
+			if (!h->mute_.load(memory_order_seq_cst)) {
+				h->HandleEvent(e.events);
+			}
+
+			active_.store(NULL, memory_order_release);
+		}
+
+		dispatching_ = NULL;
+	}
+
+	virtual bool Park(const timespec * timeout) override
+	{
+		int ms = -1;
+
+		if (timeout) {
+			/*
+			 * Round up, epoll_wait has a millisecond resolution and we don't want to
+			 * wake up before the timer is due
+			 */
+			ms = SEC_TO_MSEC(timeout->tv_sec) + (timeout->tv_nsec + 999999) / 1000000;
+		}
+
+		return Wait(ms);
+	}
+
+	virtual void Unpark() override
+	{
+		const uint64_t val = 1;
+		ssize_t status = ::write(evfd_, &val, sizeof(val));
+		(void) status;
+	}
+
+private:
+
+	static epoll_event Event(const uint32_t events, ReactorHandle * h)
+	{
+		epoll_event ee;
+		memset(&ee, /*ch=*/ 0, sizeof(ee));
+		ee.events = events;
+		ee.data.ptr = h;
+		return ee;
+	}
+
+	/*
+	 * Mute the handle and take the fd out of the set
+	 */
+	bool Unregister(const int fd, ReactorHandle * h)
+	{
+		INVARIANT(!h->mute_);
+		h->mute_.store(true, memory_order_seq_cst);
+
+		const int status = epoll_ctl(fd_, EPOLL_CTL_DEL, fd, /*ee=*/ NULL);
+
+		if (status == -1) {
+			ERROR(log_) << "Error removing from epoll. fd=" << fd << " errno: " << errno;
+		}
+
+		return status != -1;
+	}
+
+	bool Wait(const int ms)
+	{
+		ASSERT(!HasReady());
+
+		/*
+		 * The events collected earlier are all dispatched, nobody is looking at the
+		 * removed handles any more
+		 */
+		EmptyTrashcan();
+
+		int n = epoll_wait(fd_, events_, MAX_EVENTS, ms);
+
+		if (n == -1) {
+			INVARIANT(errno == EINTR);
+			n = 0;
+		}
+
+		/*
+		 * Drop the wake up events, the run queue is checked anyway
+		 */
+		nready_ = next_ = 0;
+
+		for (int i = 0; i < n; ++i) {
+			if (!events_[i].data.ptr) {
+				uint64_t val;
+				ssize_t status = ::read(evfd_, &val, sizeof(val));
+				(void) status;
+				continue;
+			}
+
+			events_[nready_++] = events_[i];
+		}
+
+		return nready_;
+	}
+
+	void EmptyTrashcan()
+	{
+		vector<ReactorHandle *> trashcan;
+
+		{
+			Guard _(&lock_);
+
+			if (trashcan_.empty()) {
+				return;
+			}
+
+			trashcan.swap(trashcan_);
+		}
+
+		/*
+		 * Not under the lock, the destructor of a retired handle calls out to its owner
+		 */
+		for (auto h : trashcan) {
+			INVARIANT(h->mute_);
+			delete h;
+		}
+	}
+
+	const string log_;
+	SpinMutex lock_;
+	int fd_;
+	int evfd_;
+	epoll_event events_[MAX_EVENTS];
+	int nready_;
+	int next_;
+	atomic<ReactorHandle *> active_;
+	vector<ReactorHandle *> trashcan_;
+
+	/* Reactor whose events the current thread is dispatching */
+	static __thread Reactor * dispatching_;
+};
+
+}
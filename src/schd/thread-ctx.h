@@ -1,8 +1,10 @@
 #pragma once
 
 #include <inttypes.h>
+#include <atomic>
 
 #include "logger.h"
+#include "buf/size-class.h"
 #include "schd/thread.h"
 
 namespace bblocks {
@@ -11,29 +13,319 @@ using namespace std;
 
 class Thread;
 
-//............................................................................... ThreadContext ....
+struct BlockHeap;
 
-#define SLAB_DEPTH 4
+//.................................................................................... FreeList ....
 
-struct ThreadCtx
+/**
+ * Free list of blocks of one size class. Free blocks are linked through their own memory,
+ * so pushing and popping is O(1) and never allocates.
+ *
+ * A free list belongs to a thread. Every block records the free list that allocated it in
+ * its last word. Blocks freed on other threads are pushed on to a lock free return stack,
+ * which the owner reclaims in one go when it runs out of blocks. This way blocks don't
+ * drift from the threads that allocate to the threads that free.
+ */
+struct FreeList
 {
-	typedef list<uint8_t *> pool_t;
+	struct Block
+	{
+		Block * next_;
+	};
+
+	FreeList()
+		: heap_(NULL)
+		, head_(NULL)
+		, remote_(NULL)
+		, nfree_(0)
+		, ninuse_(0)
+		, highwater_(0)
+		, peak_(0)
+		, workingSet_(0)
+	{}
+
+	/**
+	 * Owner of a block of the given size
+	 */
+	static FreeList *& Owner(void * ptr, const size_t size)
+	{
+		return *(FreeList **) ((uint8_t *) ptr + size - sizeof(FreeList *));
+	}
 
-	/*
-	 * Per thread pool
+	/**
+	 * Get a block from the list, allocate a new one if the list is empty. Can be called
+	 * only by the owner.
 	 *
-	 * The slab sizes are
-	 * 0 : 0    - 512
-	 * 1 : 512  - 1024
-	 * 2 : 1024 - 1536
-	 * 3 : 1536 - 2048
+	 * @param	size	Size of the blocks in the list
+	 * @param	align	Alignment of the blocks in the list
+	 */
+	inline void * Alloc(const size_t size, const size_t align);
+
+	/**
+	 * Return a block to the list. Can be called only by the owner.
+	 */
+	void Dalloc(void * ptr)
+	{
+		Block * b = (Block *) ptr;
+		b->next_ = head_;
+		head_ = b;
+
+		++nfree_;
+		--ninuse_;
+	}
+
+	/**
+	 * Return a block to the list from another thread
+	 */
+	inline void RemoteDalloc(void * ptr);
+
+	/**
+	 * Free the blocks beyond the working set. The working set follows the peak usage
+	 * since the last trim and decays slowly when the usage drops. Can be called only by
+	 * the owner.
+	 *
+	 * @param	max	Most blocks to free
+	 * @return	Number of blocks freed
+	 */
+	inline size_t Trim(const size_t max);
+
+	/**
+	 * Free all the blocks in the list and send the blocks that are freed from now on
+	 * straight back to the system. Called when the owner exits.
+	 *
+	 * @return	Number of blocks freed
+	 */
+	inline size_t Shutdown();
+
+	BlockHeap * heap_;
+	Block * head_;
+	atomic<Block *> remote_;
+
+	/* Blocks in the list */
+	size_t nfree_;
+	/* Blocks allocated and not yet returned to this list */
+	int64_t ninuse_;
+	/* Most blocks ever in use at once */
+	int64_t highwater_;
+	/* Most blocks in use at once since the last trim */
+	int64_t peak_;
+	/* Blocks we hold on to, in use and free */
+	int64_t workingSet_;
+
+private:
+
+	/*
+	 * Working set shrinks by 1/WORKING_SET_DECAY every trim, and by at least one block
+	 * so that it gets to zero
+	 */
+	static const int64_t WORKING_SET_DECAY = 8;
+
+	/*
+	 * Marks the return stack of a list whose owner has exited
+	 */
+	static Block * Dead()
+	{
+		return (Block *) 1;
+	}
+
+	/*
+	 * Move the blocks returned by other threads to the list
 	 */
+	void Reclaim()
+	{
+		Block * b = remote_.exchange(NULL, memory_order_acquire);
+
+		ASSERT(b != Dead());
+
+		size_t count = 0;
+		while (b) {
+			Block * next = b->next_;
+			b->next_ = head_;
+			head_ = b;
+			b = next;
+			++count;
+		}
+
+		nfree_ += count;
+		ninuse_ -= count;
+	}
+};
+
+//................................................................................... BlockHeap ....
+
+/**
+ * Free lists of a thread, one for every size class in every alignment tier, indexed by
+ * SizeClass::Index.
+ *
+ * The heap can outlive the thread. It is referenced by the thread and by every block it
+ * allocated, and is destroyed when the thread has exited and all its blocks are freed.
+ */
+struct BlockHeap
+{
+	BlockHeap()
+		: refs_(1)
+		, nallocs_(0)
+		, nhits_(0)
+		, lastGCInMicroSec_(0)
+	{
+		for (size_t i = 0; i < SizeClass::NPOOLS; ++i) {
+			lists_[i].heap_ = this;
+		}
+	}
+
+	void Ref()
+	{
+		refs_.fetch_add(1, memory_order_relaxed);
+	}
+
+	void Release(const size_t n)
+	{
+		if (refs_.fetch_sub(n) == n) {
+			delete this;
+		}
+	}
+
+	FreeList lists_[SizeClass::NPOOLS];
+	atomic<size_t> refs_;
+
+	/* Allocations and pool hits since the last GC */
+	uint64_t nallocs_;
+	uint64_t nhits_;
+	uint64_t lastGCInMicroSec_;
+};
+
+void *
+FreeList::Alloc(const size_t size, const size_t align)
+{
+	if (!head_ && remote_.load(memory_order_relaxed)) {
+		Reclaim();
+	}
+
+	void * ptr = head_;
+
+	++heap_->nallocs_;
+
+	if (ptr) {
+		head_ = head_->next_;
+		--nfree_;
+		++heap_->nhits_;
+	} else {
+		int status = posix_memalign(&ptr, align, size);
+		INVARIANT(!status);
+
+		Owner(ptr, size) = this;
+		heap_->Ref();
+	}
+
+	if (++ninuse_ > peak_) {
+		peak_ = ninuse_;
+
+		if (peak_ > highwater_) {
+			highwater_ = peak_;
+		}
+	}
+
+	return ptr;
+}
+
+void
+FreeList::RemoteDalloc(void * ptr)
+{
+	Block * b = (Block *) ptr;
+	Block * head = remote_.load(memory_order_relaxed);
+
+	do {
+		if (head == Dead()) {
+			/*
+			 * Owner is gone, give the block back to the system
+			 */
+			::free(b);
+			heap_->Release(/*n=*/ 1);
+			return;
+		}
+
+		b->next_ = head;
+	} while (!remote_.compare_exchange_weak(head, b, memory_order_release,
+						memory_order_relaxed));
+}
+
+size_t
+FreeList::Trim(const size_t max)
+{
+	if (remote_.load(memory_order_relaxed)) {
+		Reclaim();
+	}
+
+	workingSet_ -= (workingSet_ + WORKING_SET_DECAY - 1) / WORKING_SET_DECAY;
+	if (workingSet_ < peak_) {
+		workingSet_ = peak_;
+	}
+
+	/*
+	 * Start the next window from the current usage
+	 */
+	peak_ = ninuse_;
+
+	const int64_t keep = workingSet_ > ninuse_ ? workingSet_ - ninuse_ : 0;
+
+	size_t count = 0;
+	while ((int64_t) nfree_ > keep && count < max) {
+		Block * b = head_;
+		head_ = b->next_;
+		::free(b);
+		--nfree_;
+		++count;
+	}
+
+	if (count) {
+		heap_->Release(count);
+	}
+
+	return count;
+}
+
+size_t
+FreeList::Shutdown()
+{
+	/*
+	 * Blocks that are returned from now on are freed by the threads returning them
+	 */
+	Block * b = remote_.exchange(Dead(), memory_order_acquire);
+
+	size_t count = nfree_;
+
+	while (head_) {
+		Block * next = head_->next_;
+		::free(head_);
+		head_ = next;
+	}
+
+	while (b) {
+		Block * next = b->next_;
+		::free(b);
+		b = next;
+		++count;
+	}
+
+	nfree_ = 0;
+
+	return count;
+}
+
+//............................................................................... ThreadContext ....
+
+struct ThreadCtx
+{
+	typedef BlockHeap pool_t;
+
+	/* Per thread pool */
 	static __thread pool_t * pool_;
 
 	/* Thread instance */
 	static __thread Thread * tinst_;
 
-	static const int GC_TIMEOUT_MS = 1000; // every 1s
+	static const int GC_INTERVAL_MS = 100; // every 100 ms
+	static const size_t GC_MAX_TRIM = 256; // blocks per GC
 
 	static void Init(Thread * tinst)
 	{
@@ -43,7 +335,7 @@ struct ThreadCtx
 		INVARIANT(!tinst_);
 
 		tinst_ = tinst;
-		pool_ = new pool_t[SLAB_DEPTH];
+		pool_ = new pool_t();
 
 		if (tinst_) {
 			tinst_->ctx_pool_ = pool_;
@@ -77,50 +369,71 @@ struct ThreadCtx
 
 	static void Cleanup(pool_t * pool)
 	{
-		for (int i = 0; i < SLAB_DEPTH; ++i) {
-			auto l = pool[i];
-			for (auto it = l.begin(); it != l.end(); ++it) {
-				::free(*it);
+		size_t count = 0;
+
+		for (size_t i = 0; i < SizeClass::NPOOLS; ++i) {
+			FreeList & l = pool->lists_[i];
+
+			if (l.highwater_) {
+				INFO(log_) << "Pool " << SizeClass::Size(i % SizeClass::NCLASSES) << " B"
+					   << " tier " << i / SizeClass::NCLASSES
+					   << " free " << l.nfree_
+					   << " in-use " << l.ninuse_
+					   << " high-water " << l.highwater_;
 			}
 
-			l.clear();
+			count += l.Shutdown();
 		}
 
-		delete[] pool;
+		/*
+		 * Blocks still out with other threads keep the heap around until they are
+		 * freed
+		 */
+		pool->Release(count + /*thread=*/ 1);
 	}
 
-	static void GarbageCollect()
+	/*
+	 * Trim the pools down to their working sets. This is meant to be called after every
+	 * routine, it does real work only every GC_INTERVAL_MS and then frees no more than
+	 * GC_MAX_TRIM blocks, so the excess goes away in small steps.
+	 */
+	static void GarbageCollect(const uint64_t nowInMicroSec)
 	{
 		INVARIANT(ThreadCtx::tinst_);
 		INVARIANT(ThreadCtx::pool_);
 
-		static __thread uint64_t lastInMilliSec = Rdtsc::NowInMilliSec();
+		const uint64_t elapsed = Rdtsc::Elapsed(nowInMicroSec, pool_->lastGCInMicroSec_);
 
-		uint64_t nowInMilliSec = Rdtsc::NowInMilliSec();
+		if (elapsed < MSEC_TO_MICROSEC((uint64_t) GC_INTERVAL_MS)) {
+			return;
+		}
 
-		if (Rdtsc::Elapsed(nowInMilliSec, lastInMilliSec) > GC_TIMEOUT_MS) {
-			DEBUG(log_) << "GC kicked for " << tinst_;
+		pool_->lastGCInMicroSec_ = nowInMicroSec;
 
-			/*
-			 * Timeout. Delete all unused memory
-			 */
-			size_t bytes = 0;
-			for (int i = 0; i < SLAB_DEPTH; ++i) {
-				pool_t & pool = ThreadCtx::pool_[i];
+		size_t bytes = 0;
+		size_t budget = GC_MAX_TRIM;
 
-				for (auto ptr : pool) {
-					::free((void *) ptr);
-					bytes += (i + 1) * 512; 
-				}
+		for (size_t i = 0; i < SizeClass::NPOOLS; ++i) {
+			FreeList & l = pool_->lists_[i];
 
-				pool.clear();
+			if (!l.workingSet_ && !l.peak_ && !l.nfree_) {
+				/* never used */
+				continue;
 			}
 
-			statGC_.Update(bytes);
+			const size_t count = l.Trim(budget);
+			budget -= count;
+			bytes += count * SizeClass::Size(i % SizeClass::NCLASSES);
+		}
 
-			lastInMilliSec = nowInMilliSec;
+		if (bytes) {
+			statGC_.Update(bytes);
+			DEBUG(log_) << bytes << " B trimmed by GC on thread " << tinst_;
+		}
 
-			DEBUG(log_) << bytes << " B reclaimed by GC on thread " << tinst_;
+		if (pool_->nallocs_) {
+			statHits_.Update((pool_->nhits_ * 100) / pool_->nallocs_);
+			pool_->nallocs_ = pool_->nhits_ = 0;
 		}
 	}
 
@@ -12,45 +12,52 @@ using namespace bblocks;
 //
 
 __thread Thread * ThreadCtx::tinst_;
-__thread list<uint8_t *> * ThreadCtx::pool_;
+__thread ThreadCtx::pool_t * ThreadCtx::pool_;
+__thread NonBlockingThread * NonBlockingThread::current_;
+__thread Reactor * Reactor::dispatching_;
 
 string ThreadCtx::log_("/threadctx");
 PerfCounter ThreadCtx::statGC_("/threadctx/gc", "B", PerfCounter::BYTES);
-PerfCounter ThreadCtx::statHits_("/threadctx/alloc", "hits", PerfCounter::COUNTER);
+PerfCounter ThreadCtx::statHits_("/threadctx/alloc", "% hits", PerfCounter::COUNTER);
 
 //
 // NonBlockingThread
 //
 NonBlockingThreadPool::NonBlockingThreadPool()
 	: nextTh_(0)
-	, timekeeper_("/NBTP/time-keeper")
+	, workStealing_(false)
+	, reactor_(false)
+	, nparked_(0)
 {
 	Watchdog::Init();
 }
 
 void
-NonBlockingThreadPool::Start(const uint32_t ncpu)
+NonBlockingThreadPool::Start(const uint32_t ncpu, const bool workStealing, const bool reactor)
 {
 	INVARIANT(ncpu <= SysConf::NumCores());
 
 	Guard _(&lock_);
 
-	//
-	// Start timer
-	//
-	bool status = timekeeper_.Init();
-
-	if (!status) {
-		ERROR("/NBTP") << "Unable to start timekeeper." << strerror(errno);
-		DEADEND
-	}
+	workStealing_ = workStealing;
+	reactor_ = reactor;
+	nparked_ = 0;
 
 	//
-	// Start the threads
+	// Start the threads. The thread list has to be complete before any thread starts,
+	// threads look at each other for work.
 	//
 	for (size_t i = 0; i < ncpu; ++i) {
 		NonBlockingThread * th = new NonBlockingThread("/th/" + STR(i), i);
+
+		if (reactor) {
+			th->EnableReactor();
+		}
+
 		threads_.push_back(th);
+	}
+
+	for (auto th : threads_) {
 		th->StartNonBlockingThread();
 	}
 
@@ -67,9 +74,6 @@ NonBlockingThreadPool::Shutdown()
 
 	Guard _(&lock_);
 
-	/* Shutdown timer service */
-	timekeeper_.Shutdown();
-
 	/* Kill async processors */
 	DestroyThreads();
 }
@@ -86,10 +90,12 @@ NonBlockingThread::ThreadMain()
 {
 	DisableThreadCancellation();
 
+	current_ = this;
+
 	try {
 		while (true)
 		{
-			ThreadRoutine * r = q_.Pop();
+			ThreadRoutine * r = Next();
 
 			const uint64_t & startInMicroSec = Rdtsc::NowInMicroSec();
 
@@ -109,6 +115,9 @@ NonBlockingThread::ThreadMain()
 			/* Execute */
 			r->Run();
 
+			/* Finish the work the routine deferred */
+			RunRoutineEndHooks();
+
 			const uint64_t & endInMicroSec = Rdtsc::NowInMicroSec();
 
 			/* Cancel watch */
@@ -119,8 +128,8 @@ NonBlockingThread::ThreadMain()
 									  startInMicroSec);
 			statWatchdogTime_.Update(elapsedInMicroSec);
 
-                        /* Cleanup thread ctx memory */
-                        ThreadCtx::GarbageCollect();
+			/* Trim thread ctx memory */
+			ThreadCtx::GarbageCollect(endInMicroSec);
 		}
 	} catch (ThreadExitException & e) {
 		/*
@@ -131,59 +140,214 @@ NonBlockingThread::ThreadMain()
 		Watchdog::Instance().CancelWatch(id_, Rdtsc::NowInMicroSec());
 	}
 
-	INVARIANT(q_.IsEmpty());
+	INVARIANT(IsEmpty());
+
+	DisposeTimers();
+
+	current_ = NULL;
 
 	return NULL;
 }
 
-bool
-NonBlockingThreadPool::ShouldYield()
+void
+NonBlockingThread::RunRoutineEndHooks()
 {
-	ASSERT(ThreadCtx::tinst_);
-
-	return Watchdog::Instance().ShouldYield();
+	/*
+	 * A hook can arm hooks of its own, they are run in the same go
+	 */
+	while (!routineEnd_.IsEmpty()) {
+		RoutineEndHook * h = routineEnd_.Pop();
+		h->armed_ = false;
+		h->RoutineEnd();
+	}
 }
 
-//
-// TimeKeeper
-//
-void *
-TimeKeeper::ThreadMain()
+ThreadRoutine *
+NonBlockingThread::Next()
 {
-	INVARIANT(fd_);
+	ThreadRoutine * r = NextTimer();
+
+	if (r) {
+		return r;
+	}
+
+	if (reactor_ && (reactor_->HasReady()
+			 || (!(++pollTick_ % REACTOR_POLL_INTERVAL) && reactor_->Poll()))) {
+		/*
+		 * There are fd events to handle. We also get here when the wait below is cut
+		 * short by fd events.
+		 */
+		return &reactorRoutine_;
+	}
 
+	if (!NonBlockingThreadPool::Instance().workStealing_) {
+		timespec t;
+		return q_.Pop(SleepTime(t));
+	}
+
+	return NextWithSteal();
+}
+
+ThreadRoutine *
+NonBlockingThread::NextTimer()
+{
 	while (true) {
-		uint64_t count;
-		int status = read(fd_, &count, sizeof(count));
+		if (expired_.IsEmpty()) {
+			if (timers_.IsEmpty()) {
+				return NULL;
+			}
 
-		if (status != sizeof(count)) {
-			ERROR(path_) << "Error proceesing timer events." << strerror(errno);
-			DEADEND
+			/*
+			 * Collect every timer that is due in one go, we will drain them before
+			 * we look at the clock again
+			 */
+			const size_t count = timers_.Advance(Time::NowInMicroSec(), expired_);
+
+			if (!count) {
+				return NULL;
+			}
+
+			statTimerBatch_.Update(count);
+		}
+
+		TimerEvent * t = expired_.Pop();
+
+		/*
+		 * The timer could have been cancelled from another thread, in which case the
+		 * routine is gone already
+		 */
+		ThreadRoutine * r = t->Fire() ? t->r_ : NULL;
+
+		ReleaseTimer(t);
+
+		if (r) {
+			statTimerFired_.Update(/*val=*/ 1);
+			return r;
 		}
+	}
+}
 
-		Guard _(&lock_);
+void
+NonBlockingThread::DisposeTimers()
+{
+	InList<TimerEvent> timers;
+	timers_.Clear(timers);
+
+	while (!expired_.IsEmpty()) {
+		timers.Push(expired_.Pop());
+	}
+
+	while (!timers.IsEmpty()) {
+		TimerEvent * t = timers.Pop();
+
+		/*
+		 * Since ThreadRoutine is opaque, we cannot assume anything about its
+		 * construction. We demand that user cancel all the timers before stopping.
+		 */
+		INVARIANT(t->state_ == TimerEvent::CANCELLED);
+
+		ReleaseTimer(t);
+	}
+}
+
+const timespec *
+NonBlockingThread::SleepTime(timespec & t) const
+{
+	const uint64_t at = timers_.NextExpiration();
+
+	if (at == UINT64_MAX) {
+		return NULL;
+	}
+
+	const uint64_t now = Time::NowInMicroSec();
+	const uint64_t us = at > now ? at - now : 0;
+
+	t.tv_sec = us / SEC_TO_MICROSEC(1);
+	t.tv_nsec = MICROSEC_TO_NSEC(us % SEC_TO_MICROSEC(1));
+
+	return &t;
+}
+
+ThreadRoutine *
+NonBlockingThread::NextWithSteal()
+{
+	ThreadRoutine * r = NULL;
+
+	/*
+	 * Local deque is LIFO, check the shared queue once in a while so it is not starved
+	 */
+	if (!(++tick_ % SHARED_QUEUE_INTERVAL) && (r = q_.TryPop())) {
+		return r;
+	}
 
-		INVARIANT(timers_.size() >= count);
-		INVARIANT(count == 1);
+	if ((r = deque_.Pop()) || (r = q_.TryPop()) || (r = Steal())) {
+		return r;
+	}
+
+	/*
+	 * There is no work anywhere. Announce that we are going to sleep and check one more
+	 * time before we sleep, so we don't miss work pushed while we were looking.
+	 */
+	NonBlockingThreadPool & tp = NonBlockingThreadPool::Instance();
 
+	parked_ = true;
+	++tp.nparked_;
+
+	r = Steal();
+
+	if (!r) {
 		/*
-		 * Timers are ordered by the wait times, so we can start kicking off
-		 * starting from the front
+		 * Sleep until we get work, a timer is due, or get woken up to steal
 		 */
-		const TimerEvent & t = *timers_.begin();
-		DEBUG(path_) << "Dispatching for time "
-			     << t.time_.tv_sec << "." << t.time_.tv_nsec;
+		timespec t;
+		r = q_.Pop(SleepTime(t));
+	}
 
-		NonBlockingThreadPool::Instance().Schedule(t.r_);
+	--tp.nparked_;
+	parked_ = false;
 
-		timers_.erase(timers_.begin());
+	return r;
+}
+
+ThreadRoutine *
+NonBlockingThread::Steal()
+{
+	NonBlockingThreadPool & tp = NonBlockingThreadPool::Instance();
+	const size_t n = tp.threads_.size();
+
+	/*
+	 * Start at a different victim every time so thieves don't all go after the same thread
+	 */
+	const size_t start = tick_;
 
-		if (!timers_.empty()) {
-			INVARIANT(SetTimer());
+	for (size_t i = 0; i < n; ++i) {
+		NonBlockingThread * th = tp.threads_[(start + i) % n];
+
+		if (th == this || th->exitMain_) continue;
+
+		ThreadRoutine * r = th->deque_.Steal();
+
+		if (!r) {
+			/*
+			 * A pinned routine is not meant for us. Pushing it back would put it
+			 * behind the ones after it, leave it be.
+			 */
+			r = th->q_.TryPopIf([](ThreadRoutine * t) { return !t->IsPinned(); });
+		}
+
+		if (r) {
+			statSteal_.Update(/*val=*/ 1);
+			return r;
 		}
 	}
 
-	DEADEND
+	return NULL;
 }
 
+bool
+NonBlockingThreadPool::ShouldYield()
+{
+	ASSERT(ThreadCtx::tinst_);
 
+	return Watchdog::Instance().ShouldYield();
+}
@@ -1,13 +1,16 @@
 #pragma once
 
 #include <stdexcept>
-#include <set>
 #include <atomic>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
-#include <sys/timerfd.h>
- 
 #include "buf/bufpool.h"
+#include "schd/reactor.h"
 #include "schd/thread.h"
+#include "schd/timer-wheel.h"
+#include "schd/work-deque.hpp"
 
 namespace bblocks {
 
@@ -21,68 +24,218 @@ public:
 
 	virtual void Run() = 0;
 	virtual ~ThreadRoutine() {}
+
+	/*
+	 * Pinned routines are never stolen by other threads in work stealing mode
+	 */
+	virtual bool IsPinned() const { return false; }
+};
+
+//.................................................................................... IndexSeq ....
+
+/*
+ * Compile time sequence 0, 1, ..., n-1 to unpack the arguments stored in a tuple
+ */
+template<size_t... I>
+struct IndexSeq {};
+
+template<size_t n, size_t... I>
+struct MakeIndexSeq : MakeIndexSeq<n - 1, n - 1, I...> {};
+
+template<size_t... I>
+struct MakeIndexSeq<0, I...>
+{
+	typedef IndexSeq<I...> type;
+};
+
+//.................................................................................... FnPtr<*> ....
+
+/**
+ * Routine that calls a function with the given arguments. The arguments are moved in
+ * to the routine when it is created, and moved out to the function when it is run,
+ * unless the function takes them by reference.
+ */
+template<class... Params>
+class FnPtr : public ThreadRoutine, public BufferPoolObject<FnPtr<Params...> >
+{
+public:
+
+	template<class... Args>
+	FnPtr(void (*fn)(Params...), Args &&... args)
+		: fn_(fn), args_(std::forward<Args>(args)...)
+	{}
+
+	virtual void Run()
+	{
+		Call(typename MakeIndexSeq<sizeof...(Params)>::type());
+		delete this;
+	}
+
+private:
+
+	template<size_t... I>
+	void Call(IndexSeq<I...>)
+	{
+		(*fn_)(std::forward<Params>(std::get<I>(args_))...);
+	}
+
+	void (*fn_)(Params...);
+	tuple<typename decay<Params>::type...> args_;
+};
+
+//.............................................................................. MemberFnPtr<*> ....
+
+/**
+ * Routine that calls a member function with the given arguments (see FnPtr)
+ */
+template<class _OBJ_, class... Params>
+class MemberFnPtr : public ThreadRoutine,
+		    public BufferPoolObject<MemberFnPtr<_OBJ_, Params...> >
+{
+public:
+
+	template<class... Args>
+	MemberFnPtr(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+		: obj_(obj), fn_(fn), args_(std::forward<Args>(args)...)
+	{}
+
+	virtual void Run()
+	{
+		Call(typename MakeIndexSeq<sizeof...(Params)>::type());
+		delete this;
+	}
+
+private:
+
+	template<size_t... I>
+	void Call(IndexSeq<I...>)
+	{
+		(obj_->*fn_)(std::forward<Params>(std::get<I>(args_))...);
+	}
+
+	_OBJ_ * obj_;
+	void (_OBJ_::*fn_)(Params...);
+	tuple<typename decay<Params>::type...> args_;
+};
+
+/**
+ * Create a routine for a member function in a pool allocated block
+ */
+template<class _OBJ_, class... Params, class... Args>
+ThreadRoutine *
+NewRoutine(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+{
+	static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments");
+
+	void * buf = BufferPool::Alloc<MemberFnPtr<_OBJ_, Params...> >();
+	return new (buf) MemberFnPtr<_OBJ_, Params...>(obj, fn, std::forward<Args>(args)...);
+}
+
+/**
+ * Create a routine for a function in a pool allocated block
+ */
+template<class... Params, class... Args>
+ThreadRoutine *
+NewRoutine(void (*fn)(Params...), Args &&... args)
+{
+	static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments");
+
+	void * buf = BufferPool::Alloc<FnPtr<Params...> >();
+	return new (buf) FnPtr<Params...>(fn, std::forward<Args>(args)...);
+}
+
+//................................................................................. Closure<F> ....
+
+/**
+ * Closures up to this size are kept inline in the routine
+ */
+static const size_t CLOSURE_INLINE_SIZE = 48;
+
+/**
+ * Routine that runs a closure (e.g. a lambda).
+ *
+ * Closures that fit in CLOSURE_INLINE_SIZE bytes are kept in a fixed size buffer inside the
+ * routine, so the routines of all small closures are of the same size and come from the
+ * same free list of the BufferPool, which stays warm no matter which lambdas a thread
+ * schedules. Running one costs the one virtual call to Run().
+ */
+template<class F, bool isInline = (sizeof(F) <= CLOSURE_INLINE_SIZE
+				   && alignof(F) <= alignof(void *))>
+class Closure : public ThreadRoutine, public BufferPoolObject<Closure<F, isInline> >
+{
+public:
+
+	template<class G>
+	explicit Closure(G && g)
+	{
+		new (buf_) F(std::forward<G>(g));
+	}
+
+	virtual ~Closure()
+	{
+		Fn().~F();
+	}
+
+	virtual void Run()
+	{
+		Fn()();
+		delete this;
+	}
+
+private:
+
+	F & Fn()
+	{
+		return *reinterpret_cast<F *>(buf_);
+	}
+
+	alignas(void *) uint8_t buf_[CLOSURE_INLINE_SIZE];
 };
 
-//................................................................................... FnPtr*<*> ....
-
-#define FNPTR(n)										\
-template<TDEF(T,n)>             								\
-class FnPtr##n : public ThreadRoutine,	        						\
-		 public BufferPoolObject<FnPtr##n<TENUM(T,n)> >					\
-{												\
-public:												\
-												\
-	FnPtr##n(void (*fn)(TENUM(T,n)), TPARAM(T,t,n))						\
-		: fn_(fn), TASSIGN(t,n)								\
-	{}											\
-												\
-	virtual void Run()									\
-	{											\
-		(*fn_)(TARGEX(t,_,n));							        \
-		delete this;									\
-	}											\
-												\
-private:											\
-												\
-	void (*fn_)(TENUM(T,n));								\
-	TMEMBERDEF(T,t,n);									\
-};												\
-
-FNPTR(1)  // FnPtr1<T1>
-FNPTR(2)  // FnPtr2<T1, T2>
-FNPTR(3)  // FnPtr3<T1, T2, T3>
-FNPTR(4)  // FnPtr4<T1, T2, T3, T4>
-
-//............................................................................. MemberFnPtr*<*> ....
-
-#define MEMBERFNPTR(n)										\
-template<class _OBJ_, TDEF(T,n)>								\
-class MemberFnPtr##n : public ThreadRoutine,							\
-		       public BufferPoolObject<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >		\
-{												\
-public:												\
-												\
-	MemberFnPtr##n(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))		\
-		: obj_(obj), fn_(fn), TASSIGN(t,n)						\
-	{}											\
-												\
-	virtual void Run()									\
-	{											\
-		(obj_->*fn_)(TARGEX(t,_,n));							\
-		delete this;									\
-	}											\
-												\
-private:											\
-												\
-	_OBJ_ * obj_;										\
-	void (_OBJ_::*fn_)(TENUM(T,n));								\
-	TMEMBERDEF(T,t,n);									\
-};												\
-
-MEMBERFNPTR(1)  // MemberFnPtr1<_OBJ_, T1>
-MEMBERFNPTR(2)  // MemberFnPtr2<_OBJ_, T1, T2>
-MEMBERFNPTR(3)  // MemberFnPtr3<_OBJ_, T1, T2, T3>
-MEMBERFNPTR(4)  // MemberFnPtr4<_OBJ_, T1, T2, T3, T4>
+/**
+ * Larger closures are kept as a member, the routine gets a block of its own size from the
+ * BufferPool
+ */
+template<class F>
+class Closure<F, /*isInline=*/ false> : public ThreadRoutine,
+				       public BufferPoolObject<Closure<F, false> >
+{
+public:
+
+	template<class G>
+	explicit Closure(G && g) : f_(std::forward<G>(g))
+	{}
+
+	virtual void Run()
+	{
+		f_();
+		delete this;
+	}
+
+private:
+
+	F f_;
+};
+
+/**
+ * Create a routine for a closure in a pool allocated block
+ */
+template<class F>
+ThreadRoutine *
+NewClosure(F && f)
+{
+	typedef Closure<typename decay<F>::type> routine_t;
+
+	void * buf = BufferPool::Alloc<routine_t>();
+	return new (buf) routine_t(std::forward<F>(f));
+}
+
+/**
+ * Only class types (lambdas and other function objects) are scheduled as closures, so the
+ * closure overloads never get in the way of the ThreadRoutine * and function pointer ones
+ */
+template<class F>
+using EnableIfClosure = typename enable_if<is_class<typename decay<F>::type>::value>::type;
 
 //........................................................................... NonBlockingThread ....
 
@@ -91,20 +244,54 @@ class NonBlockingThread : public Thread
 public:
 
 	friend class Watchdog;
+	friend class NonBlockingThreadPool;
 
 	NonBlockingThread(const string & path, const uint32_t id)
 		: Thread(path)
 		, id_(id)
 		, exitMain_(false)
 		, q_(path)
+		, parked_(false)
+		, tick_(0)
+		, pollTick_(0)
+		, reactor_(NULL)
+		, reactorRoutine_(this)
+		, timers_(Time::NowInMicroSec())
 		, statWatchdogTime_(path + "/watchdogtime", "microsec", PerfCounter::TIME)
+		, statSteal_(path + "/steal", "routines", PerfCounter::COUNTER)
+		, statTimerBatch_(path + "/timer-batch", "timers", PerfCounter::COUNTER)
+		, statTimerFired_(path + "/timer-fired", "timers", PerfCounter::COUNTER)
+		, statTimerCancelled_(path + "/timer-cancelled", "timers", PerfCounter::COUNTER)
 	{}
 
 	~NonBlockingThread()
 	{
+		INVARIANT(expired_.IsEmpty());
+
 		INFO(log_) << statWatchdogTime_;
+		INFO(log_) << statSteal_;
+		INFO(log_) << statTimerBatch_;
+		INFO(log_) << statTimerFired_;
+		INFO(log_) << statTimerCancelled_;
+
+		delete reactor_;
 	}
 
+	/**
+	 * Work deferred to the end of the routine running on the thread. Lets a routine batch
+	 * up requests (e.g. io submissions) and have them sent in one go once it returns.
+	 */
+	struct RoutineEndHook : InListElement<RoutineEndHook>
+	{
+		RoutineEndHook() : armed_(false) {}
+
+		virtual ~RoutineEndHook() {}
+
+		virtual void RoutineEnd() = 0;
+
+		bool armed_;
+	};
+
 	virtual void * ThreadMain();
 
 	void Push(ThreadRoutine * r)
@@ -112,9 +299,130 @@ public:
 		q_.Push(r);
 	}
 
+	uint32_t Id() const
+	{
+		return id_;
+	}
+
+	/*
+	 * Invoke the hook once the current routine returns. Arming an armed hook is a no-op.
+	 * Can be called only from this thread.
+	 */
+	void AtRoutineEnd(RoutineEndHook * h)
+	{
+		ASSERT(current_ == this);
+
+		if (h->armed_) {
+			return;
+		}
+
+		h->armed_ = true;
+		routineEnd_.Push(h);
+	}
+
+	/*
+	 * Give the thread an epoll set of its own. The thread waits for routines and fd events
+	 * together and handles the fd events itself. Must be called before the thread starts.
+	 */
+	void EnableReactor()
+	{
+		INVARIANT(!reactor_);
+
+		reactor_ = new Reactor(log_);
+		q_.SetParker(reactor_);
+	}
+
+	/*
+	 * Push to the local deque. Can be called only from this thread.
+	 */
+	void PushLocal(ThreadRoutine * r)
+	{
+		ASSERT(current_ == this);
+
+		if (!deque_.Push(r)) {
+			/*
+			 * Deque is full, fallback to the unbounded queue
+			 */
+			q_.Push(r);
+		}
+	}
+
+	/*
+	 * Arm a timer on this thread's wheel. Can be called from any thread.
+	 */
+	void AddTimer(TimerEvent * t)
+	{
+		if (current_ == this) {
+			timers_.Add(t);
+			return;
+		}
+
+		/*
+		 * Hand it over and wake the thread up, so it can account for the new timer in
+		 * the time it sleeps
+		 */
+		timers_.AddRemote(t);
+		q_.Wakeup();
+	}
+
+	/*
+	 * Cancel a timer armed on this thread. Can be called from any thread.
+	 *
+	 * The routine is destroyed right away. The timer itself is taken off the wheel right
+	 * away if we are on this thread, otherwise at the thread's next tick.
+	 */
+	bool CancelTimer(TimerEvent * t)
+	{
+		ASSERT(t->th_ == this);
+
+		if (!t->Cancel()) {
+			/*
+			 * Already fired or cancelled
+			 */
+			return false;
+		}
+
+		delete t->r_;
+
+		statTimerCancelled_.Update(/*val=*/ 1);
+
+		if (current_ == this) {
+			if (timers_.Remove(t)) {
+				ReleaseTimer(t);
+			}
+		} else {
+			/*
+			 * Rather than have the wheel hold on to it until the deadline
+			 */
+			t->Ref();
+			timers_.RemoveRemote(t);
+		}
+
+		return true;
+	}
+
+	/*
+	 * Timers on this thread's wheel. Can be called only from this thread.
+	 */
+	size_t NumTimers() const
+	{
+		ASSERT(current_ == this);
+		return timers_.Size();
+	}
+
+	/*
+	 * Drop a reference to the timer. Can be called from any thread.
+	 */
+	static void ReleaseTimer(TimerEvent * t)
+	{
+		if (t->Release()) {
+			delete t;
+		}
+	}
+
 	bool IsEmpty() const
 	{
-		return q_.IsEmpty();
+		return q_.IsEmpty() && deque_.IsEmpty();
 	}
 
 	virtual void Stop() override
@@ -122,7 +430,7 @@ public:
 		INVARIANT(!exitMain_);
 		exitMain_ = true;
 
-		INVARIANT(q_.IsEmpty());
+		INVARIANT(IsEmpty());
 
 		/*
 		 * Push a message so, we can wakeup the main thread and exit it
@@ -133,9 +441,25 @@ public:
 		INVARIANT(!status);
 	}
 
+	/*
+	 * NonBlockingThread instance of the current thread
+	 */
+	static __thread NonBlockingThread * current_;
+
 private:
 
-        static const int THREADCTX_MEMORY_THRESHOLD_MiB = 10; // 10 MiB 
+	static const int THREADCTX_MEMORY_THRESHOLD_MiB = 10; // 10 MiB 
+
+	/*
+	 * Every so many routines we check the shared queue ahead of the local deque so routines
+	 * scheduled from outside are not starved by a busy local deque
+	 */
+	static const uint32_t SHARED_QUEUE_INTERVAL = 61;
+
+	/*
+	 * Every so many routines a busy thread in reactor mode checks for fd events
+	 */
+	static const uint32_t REACTOR_POLL_INTERVAL = 32;
 
 	class ThreadExitException : public runtime_error
 	{
@@ -158,155 +482,151 @@ private:
 			 */
 			throw ThreadExitException("pthread_exit proxy");
 		}
+
+		virtual bool IsPinned() const override { return true; }
+	};
+
+	/*
+	 * Routine that dispatches the fd events collected by the reactor. It is run like any
+	 * other routine, so the watchdog keeps an eye on the handlers.
+	 */
+	struct ReactorRoutine : ThreadRoutine
+	{
+		ReactorRoutine(NonBlockingThread * th) : th_(th) {}
+
+		virtual void Run()
+		{
+			th_->reactor_->Dispatch();
+		}
+
+		virtual bool IsPinned() const override { return true; }
+
+		NonBlockingThread * th_;
 	};
 
+	/* Fetch next routine to execute, wait if there is none */
+	ThreadRoutine * Next();
+
+	/* Fetch next routine in work stealing mode */
+	ThreadRoutine * NextWithSteal();
+
+	/* Steal a routine from other threads */
+	ThreadRoutine * Steal();
+
+	/* Fetch next routine whose timer is due */
+	ThreadRoutine * NextTimer();
+
+	/* Time to sleep until the next timer is due, NULL if there are no timers */
+	const timespec * SleepTime(timespec & t) const;
+
+	/* Drop the timers left on the wheel when the thread exits */
+	void DisposeTimers();
+
+	/* Invoke the hooks armed by the routine that just ran */
+	void RunRoutineEndHooks();
+
         /* Cleanup thread ctx memory if it is passed the threshold */
         void CleanupThreadCtx();
 
 	const uint32_t id_;
-	bool exitMain_;
-	InQueue<ThreadRoutine> q_;
+	atomic<bool> exitMain_;
+	MPSCQueue<ThreadRoutine> q_;
+	WorkStealingDeque<ThreadRoutine> deque_;
+	atomic<bool> parked_;
+	uint32_t tick_;
+	uint32_t pollTick_;
+	Reactor * reactor_;
+	ReactorRoutine reactorRoutine_;
+	TimerWheel timers_;
+	InList<TimerEvent> expired_;
+	InList<RoutineEndHook> routineEnd_;
 
 	PerfCounter statWatchdogTime_;
+	PerfCounter statSteal_;
+	PerfCounter statTimerBatch_;
+	PerfCounter statTimerFired_;
+	PerfCounter statTimerCancelled_;
 };
 
-// ................................................................................ TimeKeeper ....
+//................................................................................. TimerHandle ....
 
-class TimeKeeper : public Thread
+/**
+ * Handle to a timer armed with ScheduleIn. Lets the timer be cancelled before it fires.
+ *
+ * The handle holds a reference on the timer, so it is safe to cancel at any time, even
+ * after the timer has fired. Handles can be moved but not copied.
+ */
+class TimerHandle
 {
 public:
 
-	using This = TimeKeeper;
+	TimerHandle() : t_(NULL) {}
 
-	TimeKeeper(const string & path)
-		: Thread(path + string("/timekeeper"))
-		, path_(path)
-		, lock_(path_)
-		, fd_(-1)
-	{}
+	explicit TimerHandle(TimerEvent * t) : t_(t) {}
 
-	~TimeKeeper()
+	TimerHandle(TimerHandle && rhs) : t_(rhs.t_)
 	{
-		INVARIANT(fd_ == -1);
-		INVARIANT(timers_.empty());
+		rhs.t_ = NULL;
 	}
 
-	bool Init()
+	~TimerHandle()
 	{
-		INVARIANT(fd_ == -1);
-		INVARIANT(timers_.empty());
-		INVARIANT(!ThreadCtx::tinst_);
-
-		/*
-		 * Create timer
-		 */
-		fd_ = timerfd_create(CLOCK_MONOTONIC, /*flags=*/ 0);
-
-		if (fd_ == -1) {
-			ERROR(path_) << "Unable to create timer";
-			return false;
-		}
-
-		Thread::StartBlockingThread();
-
-		INFO(path_) << "Created time keeper successfully";
-
-		return true;
+		Reset();
 	}
 
-	bool Shutdown()
+	TimerHandle & operator=(TimerHandle && rhs)
 	{
-		Guard _(&lock_);
-
-		Thread::Cancel();
-	    	Thread::Stop();
-
-		/*
-		 * We have to destroy the thread so BBlocks can be restarted
-		 */
-		Thread::Destroy();
-
-		INVARIANT(fd_ > 0);
-		close(fd_);
-		fd_ = -1;
-
-		/*
-		 * Since ThreadRoutine is opaque, we cannot assume anything about its construction
-		 * We demand that user clean up all timer events before stopping
-		 */
-		INVARIANT(timers_.empty());
+		if (this != &rhs) {
+			Reset();
+			t_ = rhs.t_;
+			rhs.t_ = NULL;
+		}
 
-		return true;
+		return *this;
 	}
 
-	bool ScheduleIn(const uint32_t msec, ThreadRoutine * r)
+	/**
+	 * Cancel the timer in O(1). The routine is destroyed without being run. Can be called
+	 * from any thread.
+	 *
+	 * @return	true if the timer was cancelled, false if it has already fired or the
+	 *		handle is empty
+	 */
+	bool Cancel()
 	{
-		Guard _(&lock_);
+		if (!t_) {
+			return false;
+		}
 
-		DEBUG(path_) << "ScheduleIn. msec=" << msec << " r=" << (uint64_t) r;
+		const bool status = t_->th_->CancelTimer(t_);
 
-		timers_.insert(TimerEvent(Time::GetTimeSpec(msec), r));
+		Reset();
 
-		return SetTimer();
+		return status;
 	}
 
-
-private:
-
-	bool SetTimer()
+	/**
+	 * Let go of the timer without cancelling it
+	 */
+	void Reset()
 	{
-		ASSERT(lock_.IsOwner());
-		INVARIANT(!timers_.empty());
-
-		const timespec time = timers_.begin()->time_;
-
-		itimerspec t;
-
-		t.it_value.tv_sec = time.tv_sec;
-		t.it_value.tv_nsec = time.tv_nsec;
-		t.it_interval.tv_sec = t.it_interval.tv_nsec = 0;
-
-		DEBUG(path_) << "Resetting timer to "
-			     << time.tv_sec << "." << time.tv_nsec;
-
-		int status = timerfd_settime(fd_, /*flags=*/ TFD_TIMER_ABSTIME, &t,
-					     /*old-value=*/ NULL);
-
-		if (status == -1) {
-			ERROR(path_) << "Error setting timer. " << strerror(errno);
-			return false;
+		if (t_) {
+			NonBlockingThread::ReleaseTimer(t_);
+			t_ = NULL;
 		}
-
-		return true;
 	}
 
-	virtual void * ThreadMain() override;
-
-	struct TimerEvent
+	bool IsEmpty() const
 	{
-		TimerEvent(const timespec time, ThreadRoutine * r)
-			: time_(time)
-			, r_(r)
-		{
-			INVARIANT(r_);
-		}
-
-		bool operator<(const TimerEvent & rhs)
-		{
-			return time_.tv_sec == rhs.time_.tv_sec ? time_.tv_nsec < rhs.time_.tv_nsec
-							        : time_.tv_sec < rhs.time_.tv_sec;
-		}
+		return !t_;
+	}
 
-		timespec time_;
-		ThreadRoutine * r_;
-	};
+private:
 
-	typedef multiset<TimerEvent> timer_set_t;
+	TimerHandle(const TimerHandle &);
+	TimerHandle & operator=(const TimerHandle &);
 
-	const string path_;
-	SpinMutex lock_;
-	int fd_;
-	timer_set_t timers_;
+	TimerEvent * t_;
 };
 
 //....................................................................... NonBlockingThreadPool ....
@@ -325,6 +645,24 @@ public:
 			: cb_(cb), pendingCalls_(count)
 		{}
 
+		/*
+		 * Per thread barrier call. It is pinned to the thread it is scheduled on.
+		 */
+		struct PinnedCall : ThreadRoutine, BufferPoolObject<PinnedCall>
+		{
+			PinnedCall(BarrierRoutine * br) : br_(br) {}
+
+			virtual void Run()
+			{
+				br_->Run(/*status=*/ 0);
+				delete this;
+			}
+
+			virtual bool IsPinned() const override { return true; }
+
+			BarrierRoutine * br_;
+		};
+
 		void Run(int)
 		{ 
 			const uint64_t count = --pendingCalls_;
@@ -347,7 +685,19 @@ public:
 
 	~NonBlockingThreadPool();
 
-	void Start(const uint32_t ncpu);
+	/**
+	 * Start the thread pool
+	 *
+	 * @param	ncpu		Number of threads
+	 * @param	workStealing	Enable work stealing. Routines scheduled from a pool thread
+	 *				are pushed to its local deque and idle threads steal
+	 *				from busy threads before they go to sleep.
+	 * @param	reactor		Enable reactor mode. Every thread owns an epoll set and
+	 *				handles the events of the fds registered with it (see
+	 *				ReactorEpoll).
+	 */
+	void Start(const uint32_t ncpu, const bool workStealing = false,
+		   const bool reactor = false);
 
 	size_t ncpu() const
 	{
@@ -356,6 +706,25 @@ public:
 
 	void Shutdown();
 
+	bool IsReactor() const
+	{
+		return reactor_;
+	}
+
+	/**
+	 * Reactor to register a fd with. Fds registered from one of our threads stay with that
+	 * thread, the others are spread across the threads.
+	 */
+	Reactor * PickReactor()
+	{
+		INVARIANT(reactor_);
+
+		NonBlockingThread * th = NonBlockingThread::current_;
+		if (!th) th = threads_[nextTh_++ % threads_.size()];
+
+		return th->reactor_;
+	}
+
 	void Wakeup()
 	{
 		Guard _(&lock_);
@@ -368,104 +737,140 @@ public:
 		condExit_.Wait(&lock_);
 	}
 
-	#define NBTP_SCHEDULE(n)								\
-	template<class _OBJ_, TDEF(T,n)>							\
-	void Schedule(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)),				\
-	              TPARAM(T,t,n))								\
-	{											\
-		ThreadRoutine * r;								\
-		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
-		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));		\
-		threads_[nextTh_++ % threads_.size()]->Push(r);					\
-	}											\
-												\
-	template<TDEF(T,n)>									\
-	void Schedule(void (*fn)(TENUM(T,n)), TPARAM(T,t,n))					\
-	{											\
-		ThreadRoutine * r;								\
-		void * buf = BufferPool::Alloc<FnPtr##n<TENUM(T,n)> >();			\
-		r = new (buf) FnPtr##n<TENUM(T,n)>(fn, TARG(t,n));				\
-		threads_[nextTh_++ % threads_.size()]->Push(r);					\
-	}											\
-												\
-	template<class _OBJ_, TDEF(T,n)>							\
-	void ScheduleIn(const uint32_t ms, _OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)),		\
-	                TPARAM(T,t,n))								\
-	{											\
-		ThreadRoutine * r;								\
-		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
-		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));		\
-		INVARIANT(timekeeper_.ScheduleIn(ms, r));					\
-	}											\
-												\
-	template<TDEF(T,n)>									\
-	void ScheduleIn(const uint32_t ms, void (*fn)(TENUM(T,n)), TPARAM(T,t,n))		\
-	{											\
-		ThreadRoutine * r;								\
-		void * buf = BufferPool::Alloc<FnPtr##n<TENUM(T,n)> >();			\
-		r = new (buf) FnPtr##n<TENUM(T,n)>(fn, TARG(t,n));				\
-		INVARIANT(timekeeper_.ScheduleIn(ms, r));					\
-	}											\
-	template<class _OBJ_, TDEF(T,n)>							\
-	void Yield(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))			\
-	{											\
-		ThreadRoutine * r;								\
-		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
-		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));		\
-		Yield(r);									\
-	}											\
-												\
-	template<TDEF(T,n)>									\
-	void Yield(void (*fn)(TENUM(T,n)), TPARAM(T,t,n))					\
-	{											\
-		ThreadRoutine * r;								\
-		void * buf = BufferPool::Alloc<FnPtr##n<TENUM(T,n)> >();			\
-		r = new (buf) FnPtr##n<TENUM(T,n)>(fn, TARG(t,n));				\
-		Yield(r);									\
-	}											\
-	
-
-	NBTP_SCHEDULE(1) // void Schedule<T1>(...)
-	NBTP_SCHEDULE(2) // void Schedule<T1,T2>(...)
-	NBTP_SCHEDULE(3) // void Schedule<T1,T2,T3>(...)
-	NBTP_SCHEDULE(4) // void Schedule<T1,T2,T3,T4>(...)
+	/*
+	 * Schedule obj->fn(args...) or fn(args...). The arguments are forwarded in to a pool
+	 * allocated routine, so temporaries and std::move'd arguments are not copied.
+	 */
+	template<class _OBJ_, class... Params, class... Args>
+	void Schedule(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		Schedule(NewRoutine(obj, fn, std::forward<Args>(args)...));
+	}
+
+	template<class... Params, class... Args>
+	void Schedule(void (*fn)(Params...), Args &&... args)
+	{
+		Schedule(NewRoutine(fn, std::forward<Args>(args)...));
+	}
+
+	template<class _OBJ_, class... Params, class... Args>
+	TimerHandle ScheduleIn(const uint32_t ms, _OBJ_ * obj, void (_OBJ_::*fn)(Params...),
+			       Args &&... args)
+	{
+		return ScheduleInMicroSec(MSEC_TO_MICROSEC((uint64_t) ms),
+					  NewRoutine(obj, fn, std::forward<Args>(args)...));
+	}
+
+	template<class... Params, class... Args>
+	TimerHandle ScheduleIn(const uint32_t ms, void (*fn)(Params...), Args &&... args)
+	{
+		return ScheduleInMicroSec(MSEC_TO_MICROSEC((uint64_t) ms),
+					  NewRoutine(fn, std::forward<Args>(args)...));
+	}
+
+	template<class _OBJ_, class... Params, class... Args>
+	TimerHandle ScheduleInMicroSec(const uint64_t us, _OBJ_ * obj,
+				       void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		return ScheduleInMicroSec(us, NewRoutine(obj, fn, std::forward<Args>(args)...));
+	}
+
+	template<class... Params, class... Args>
+	TimerHandle ScheduleInMicroSec(const uint64_t us, void (*fn)(Params...),
+				       Args &&... args)
+	{
+		return ScheduleInMicroSec(us, NewRoutine(fn, std::forward<Args>(args)...));
+	}
+
+	template<class _OBJ_, class... Params, class... Args>
+	void Yield(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		Yield(NewRoutine(obj, fn, std::forward<Args>(args)...));
+	}
+
+	template<class... Params, class... Args>
+	void Yield(void (*fn)(Params...), Args &&... args)
+	{
+		Yield(NewRoutine(fn, std::forward<Args>(args)...));
+	}
+
+	/*
+	 * Schedule a closure, e.g. BBlocks::Schedule([this] { ... })
+	 */
+	template<class F, class = EnableIfClosure<F> >
+	void Schedule(F && f)
+	{
+		Schedule(NewClosure(std::forward<F>(f)));
+	}
+
+	template<class F, class = EnableIfClosure<F> >
+	void Yield(F && f)
+	{
+		Yield(NewClosure(std::forward<F>(f)));
+	}
 
 	void Schedule(ThreadRoutine * r)
 	{
-		threads_[nextTh_++ % threads_.size()]->Push(r);
+		NonBlockingThread * th = NonBlockingThread::current_;
+
+		if (workStealing_ && th) {
+			/*
+			 * Scheduled from one of our threads, keep it local and let the idle threads
+			 * steal it if they have to
+			 */
+			th->PushLocal(r);
+			WakeupIdleThread();
+			return;
+		}
+
+		NextThread()->Push(r);
+	}
+
+	/**
+	 * Schedule a routine to run after the given time. Timers armed from one of our
+	 * threads are kept on that thread's timer wheel, others are spread across the threads.
+	 *
+	 * @param	us	Time from now in micro seconds
+	 * @param	r	Routine to run
+	 * @return	Handle to cancel the timer with
+	 */
+	TimerHandle ScheduleInMicroSec(const uint64_t us, ThreadRoutine * r)
+	{
+		NonBlockingThread * th = NonBlockingThread::current_;
+		if (!th) th = NextThread();
+
+		void * buf = BufferPool::Alloc<TimerEvent>();
+		TimerEvent * t = new (buf) TimerEvent(Time::NowInMicroSec() + us, r, th);
+
+		th->AddTimer(t);
+
+		return TimerHandle(t);
 	}
 
 	void Yield(ThreadRoutine * r)
 	{
-		INVARIANT(ThreadCtx::tinst_);
-		((NonBlockingThread *) ThreadCtx::tinst_)->Push(r);
+		/*
+		 * Yield goes to the back of the shared queue so other routines get to run
+		 */
+		INVARIANT(NonBlockingThread::current_);
+		NonBlockingThread::current_->Push(r);
 	}
 
 	bool ShouldYield();
 
-	#define NBTP_SCHEDULE_BARRIER(n)							\
-	template<class _OBJ_, TDEF(T,n)>							\
-	void ScheduleBarrier(_OBJ_ * obj, void (_OBJ_::*fn)(TENUM(T,n)), TPARAM(T,t,n))		\
-	{											\
-		ThreadRoutine * r;								\
-		void * buf = BufferPool::Alloc<MemberFnPtr##n<_OBJ_, TENUM(T,n)> >();		\
-		r = new (buf) MemberFnPtr##n<_OBJ_, TENUM(T,n)>(obj, fn, TARG(t,n));	    	\
-		threads_[nextTh_++ % threads_.size()]->Push(r);					\
-	}											\
-
-	NBTP_SCHEDULE_BARRIER(1) // void ScheduleBarrier<T1>(...)
-	NBTP_SCHEDULE_BARRIER(2) // void ScheduleBarrier<T1,T2>(...)
-	NBTP_SCHEDULE_BARRIER(3) // void ScheduleBarrier<T1,T2,T3>(...)
-	NBTP_SCHEDULE_BARRIER(4) // void ScheduleBarrier<T1,T2,T3,T4>(...)
+	template<class _OBJ_, class... Params, class... Args>
+	void ScheduleBarrier(_OBJ_ * obj, void (_OBJ_::*fn)(Params...), Args &&... args)
+	{
+		Schedule(NewRoutine(obj, fn, std::forward<Args>(args)...));
+	}
 
 	void ScheduleBarrier(ThreadRoutine * r)
 	{
 		BarrierRoutine * br = new BarrierRoutine(r, threads_.size());
 		for (size_t i = 0; i < threads_.size(); ++i) {
 			ThreadRoutine * r;
-			void * buf = BufferPool::Alloc<MemberFnPtr1<BarrierRoutine, int> >(); 
-			r = new (buf) MemberFnPtr1<BarrierRoutine, int>(br, &BarrierRoutine::Run,
-									/*status=*/ 0);
+			void * buf = BufferPool::Alloc<BarrierRoutine::PinnedCall>();
+			r = new (buf) BarrierRoutine::PinnedCall(br);
 			threads_[i]->Push(r);
 		}
 	}
@@ -476,24 +881,69 @@ private:
 
 	void DestroyThreads()
 	{
+		/*
+		 * Stop all threads before destroying any, the running threads might still be
+		 * looking at others to steal work
+		 */
 		for (auto it = threads_.begin(); it != threads_.end(); ++it) {
 			NonBlockingThread * th = *it;
-			/*
-			 * Stop and destroy the thread
-			 */
 			th->Stop();
+		}
+
+		for (auto it = threads_.begin(); it != threads_.end(); ++it) {
+			NonBlockingThread * th = *it;
 			delete th;
 		}
 
 		threads_.clear();
 	}
 
+	/*
+	 * Pick a thread to push routines scheduled from outside of the pool
+	 */
+	NonBlockingThread * NextThread()
+	{
+		if (workStealing_ && nparked_) {
+			/*
+			 * Prefer a thread that is sleeping, it will be woken up by the push
+			 */
+			for (auto th : threads_) {
+				if (th->parked_) return th;
+			}
+		}
+
+		return threads_[nextTh_++ % threads_.size()];
+	}
+
+	/*
+	 * Wakeup one sleeping thread so it can steal work
+	 */
+	void WakeupIdleThread()
+	{
+		/*
+		 * The push is not to be ordered after the load of nparked_. The parking thread
+		 * bumps nparked_ and then looks for work, one of the two sides sees the other.
+		 */
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (!nparked_.load(memory_order_relaxed)) return;
+
+		for (auto th : threads_) {
+			bool parked = true;
+			if (th->parked_.compare_exchange_strong(parked, false)) {
+				th->q_.Wakeup();
+				return;
+			}
+		}
+	}
 
 	PThreadMutex lock_;
 	threads_t threads_;
 	WaitCondition condExit_;
 	uint32_t nextTh_;
-	TimeKeeper timekeeper_;
+	bool workStealing_;
+	bool reactor_;
+	atomic<size_t> nparked_;
 };
 
 } // namespace bblocks
@@ -11,6 +11,8 @@ namespace bblocks {
 
 using namespace std;
 
+struct BlockHeap;
+
 //...................................................................................... Thread ....
 
 class Thread
@@ -108,7 +110,7 @@ protected:
 
 	virtual void * ThreadMain() = 0;
 
-	typedef list<uint8_t *> pool_t;
+	typedef BlockHeap pool_t;
 
 	string log_;
 	pthread_t tid_;
@@ -0,0 +1,451 @@
+#pragma once
+
+#include <inttypes.h>
+#include <string.h>
+#include <atomic>
+
+#include "buf/bufpool.h"
+#include "inlist.hpp"
+
+namespace bblocks {
+
+using namespace std;
+
+class ThreadRoutine;
+class NonBlockingThread;
+
+//.................................................................................. TimerEvent ....
+
+/**
+ * Timer armed on a TimerWheel. The deadline is in the Time::NowInMicroSec() clock.
+ *
+ * A timer is either fired or cancelled, whichever gets to it first. It is referenced by
+ * the wheel and by the TimerHandle given out to the user, and is freed when both let go.
+ */
+struct TimerEvent : InListElement<TimerEvent>, BufferPoolObject<TimerEvent>
+{
+	enum State
+	{
+		ARMED = 0,
+		FIRED,
+		CANCELLED,
+	};
+
+	static const uint8_t NOT_PLACED = UINT8_MAX;
+
+	TimerEvent(const uint64_t deadlineInMicroSec, ThreadRoutine * r, NonBlockingThread * th)
+		: deadlineInMicroSec_(deadlineInMicroSec)
+		, r_(r)
+		, th_(th)
+		, state_(ARMED)
+		, refs_(2)
+		, level_(NOT_PLACED)
+		, slot_(0)
+		, cancelNext_(NULL)
+	{
+		INVARIANT(r_);
+	}
+
+	bool Fire()
+	{
+		uint8_t state = ARMED;
+		return state_.compare_exchange_strong(state, FIRED);
+	}
+
+	bool Cancel()
+	{
+		uint8_t state = ARMED;
+		return state_.compare_exchange_strong(state, CANCELLED);
+	}
+
+	void Ref()
+	{
+		refs_.fetch_add(1);
+	}
+
+	/*
+	 * Drop a reference, returns true if it was the last one
+	 */
+	bool Release()
+	{
+		return refs_.fetch_sub(1) == 1;
+	}
+
+	const uint64_t deadlineInMicroSec_;
+	ThreadRoutine * r_;
+	NonBlockingThread * th_;
+	atomic<uint8_t> state_;
+	atomic<uint8_t> refs_;
+	uint8_t level_;
+	uint8_t slot_;
+	TimerEvent * cancelNext_;	// Cancelled from another thread, on the way to the owner
+};
+
+//.................................................................................. TimerWheel ....
+
+/**
+ * Hierarchical timing wheel with microsecond resolution.
+ *
+ * There are NLEVELS wheels of NSLOTS slots each. A slot on level n spans NSLOTS^n
+ * microseconds. A timer is placed on the lowest level on which its deadline falls in the
+ * current rotation, so insertion is O(1). When the wheel reaches a slot on a higher level
+ * the timers in it are cascaded to the lower levels, and the timers in a level 0 slot are
+ * due. Timers beyond the range of the top level wait on an overflow list and are placed
+ * back on the wheel every top level rotation.
+ *
+ * Empty slots are skipped using a bitmap per level, so advancing over a long idle period
+ * costs no more than advancing over a busy one.
+ *
+ * The wheel belongs to a single thread. Other threads can hand over timers with AddRemote,
+ * they are moved to the wheel when it is advanced next. Same for the timers they cancel
+ * with RemoveRemote, which are taken off the wheel when it is advanced next.
+ */
+class TimerWheel
+{
+public:
+
+	static const uint32_t SLOT_BITS = 6;
+	static const uint32_t NSLOTS = 1 << SLOT_BITS;
+	static const uint32_t NLEVELS = 6; // 2^36 us, ~19 hours
+
+	TimerWheel(const uint64_t nowInMicroSec)
+		: now_(nowInMicroSec)
+		, size_(0)
+		, remote_(NULL)
+		, cancelled_(NULL)
+	{
+		memset(occupied_, 0, sizeof(occupied_));
+	}
+
+	~TimerWheel()
+	{
+		/*
+		 * Since ThreadRoutine is opaque, we cannot assume anything about its construction
+		 * We demand that user clean up all timer events before stopping
+		 */
+		INVARIANT(IsEmpty());
+	}
+
+	/**
+	 * Add a timer. Can be called only by the owner.
+	 */
+	void Add(TimerEvent * t)
+	{
+		++size_;
+		Place(t);
+	}
+
+	/**
+	 * Add a timer from any thread. The timer is moved to the wheel by the next Advance.
+	 */
+	void AddRemote(TimerEvent * t)
+	{
+		ASSERT(!t->next_);
+		ASSERT(!t->prev_);
+
+		TimerEvent * head = remote_.load(memory_order_relaxed);
+		do {
+			t->next_ = head;
+		} while (!remote_.compare_exchange_weak(head, t, memory_order_release,
+							memory_order_relaxed));
+	}
+
+	/**
+	 * Take a cancelled timer off the wheel from any thread, when the wheel is advanced
+	 * next. The caller hands over a reference for the timer to stay around until then.
+	 */
+	void RemoveRemote(TimerEvent * t)
+	{
+		ASSERT(t->state_ == TimerEvent::CANCELLED);
+
+		TimerEvent * head = cancelled_.load(memory_order_relaxed);
+		do {
+			t->cancelNext_ = head;
+		} while (!cancelled_.compare_exchange_weak(head, t, memory_order_release,
+							   memory_order_relaxed));
+	}
+
+	/**
+	 * Remove a timer in O(1). Can be called only by the owner.
+	 *
+	 * @return	false if the timer is not on the wheel, either it is still in transit
+	 *		from another thread or it has already expired
+	 */
+	bool Remove(TimerEvent * t)
+	{
+		if (t->level_ == TimerEvent::NOT_PLACED) {
+			return false;
+		}
+
+		if (t->level_ == NLEVELS) {
+			overflow_.Unlink(t);
+		} else {
+			InList<TimerEvent> & timers = slots_[t->level_][t->slot_];
+			timers.Unlink(t);
+
+			if (timers.IsEmpty()) {
+				occupied_[t->level_] &= ~(1ULL << t->slot_);
+			}
+		}
+
+		t->level_ = TimerEvent::NOT_PLACED;
+		--size_;
+
+		return true;
+	}
+
+	/**
+	 * Remove all timers, including the ones in transit from other threads
+	 *
+	 * @param	timers		List to append the timers to
+	 */
+	void Clear(InList<TimerEvent> & timers)
+	{
+		DrainRemote();
+		DrainCancelled();
+
+		uint32_t level, slot;
+		uint64_t at;
+
+		while (NextSlot(level, slot, at)) {
+			InList<TimerEvent> & l = level < NLEVELS ? slots_[level][slot] : overflow_;
+
+			while (!l.IsEmpty()) {
+				TimerEvent * t = l.Pop();
+				t->level_ = TimerEvent::NOT_PLACED;
+				timers.Push(t);
+				--size_;
+			}
+
+			if (level < NLEVELS) {
+				occupied_[level] &= ~(1ULL << slot);
+			}
+		}
+
+		INVARIANT(!size_);
+	}
+
+	/**
+	 * Advance the wheel and collect all the timers that are due, in deadline order.
+	 *
+	 * @param	nowInMicroSec	Current time
+	 * @param	expired		List to append the due timers to
+	 * @return	Number of timers that are due
+	 */
+	size_t Advance(const uint64_t nowInMicroSec, InList<TimerEvent> & expired)
+	{
+		DrainRemote();
+		DrainCancelled();
+
+		size_t count = 0;
+		uint32_t level, slot;
+		uint64_t at;
+
+		while (NextSlot(level, slot, at) && at <= nowInMicroSec) {
+			now_ = at;
+
+			InList<TimerEvent> pending;
+			InList<TimerEvent> & timers = level < NLEVELS ? slots_[level][slot]
+								      : overflow_;
+
+			if (level < NLEVELS) {
+				occupied_[level] &= ~(1ULL << slot);
+			}
+
+			/*
+			 * Detach the slot first, timers on the overflow list can land right back
+			 * on the overflow list
+			 */
+			while (!timers.IsEmpty()) {
+				pending.Push(timers.Pop());
+			}
+
+			while (!pending.IsEmpty()) {
+				TimerEvent * t = pending.Pop();
+
+				if (t->deadlineInMicroSec_ <= now_) {
+					t->level_ = TimerEvent::NOT_PLACED;
+					expired.Push(t);
+					--size_;
+					++count;
+				} else {
+					Place(t);
+				}
+			}
+		}
+
+		if (nowInMicroSec > now_) {
+			now_ = nowInMicroSec;
+		}
+
+		return count;
+	}
+
+	/**
+	 * Time at which the wheel needs to be advanced next. This can be earlier than the
+	 * earliest deadline when timers are due to cascade.
+	 *
+	 * @return	Time in micro seconds, 0 if there are timers from other threads pending
+	 *		and UINT64_MAX if there are no timers
+	 */
+	uint64_t NextExpiration() const
+	{
+		if (remote_.load(memory_order_relaxed)) {
+			return 0;
+		}
+
+		uint32_t level, slot;
+		uint64_t at;
+
+		return NextSlot(level, slot, at) ? at : UINT64_MAX;
+	}
+
+	size_t Size() const
+	{
+		return size_;
+	}
+
+	bool IsEmpty() const
+	{
+		return !size_ && !remote_.load(memory_order_relaxed)
+		       && !cancelled_.load(memory_order_relaxed);
+	}
+
+private:
+
+	static const uint64_t SLOT_MASK = NSLOTS - 1;
+	static const uint64_t RANGE = 1ULL << (SLOT_BITS * NLEVELS);
+
+	TimerWheel(const TimerWheel &);
+	TimerWheel & operator=(const TimerWheel &);
+
+	void Place(TimerEvent * t)
+	{
+		const uint64_t deadline = t->deadlineInMicroSec_ > now_ ? t->deadlineInMicroSec_
+								       : now_;
+		const uint64_t diff = deadline ^ now_;
+
+		if (diff >= RANGE) {
+			t->level_ = NLEVELS;
+			overflow_.Push(t);
+			return;
+		}
+
+		const uint32_t level = diff ? (63 - __builtin_clzll(diff)) / SLOT_BITS : 0;
+		const uint32_t slot = (deadline >> (level * SLOT_BITS)) & SLOT_MASK;
+
+		t->level_ = level;
+		t->slot_ = slot;
+		slots_[level][slot].Push(t);
+		occupied_[level] |= 1ULL << slot;
+	}
+
+	/*
+	 * Find the earliest non empty slot. Timers on level n are all in the current rotation
+	 * of level n + 1, so the lowest level with a non empty slot has the earliest one.
+	 */
+	bool NextSlot(uint32_t & level, uint32_t & slot, uint64_t & at) const
+	{
+		for (level = 0; level < NLEVELS; ++level) {
+			const uint32_t shift = level * SLOT_BITS;
+			const uint64_t cur = (now_ >> shift) & SLOT_MASK;
+			const uint64_t bits = occupied_[level] & (~0ULL << cur);
+
+			if (!bits) continue;
+
+			slot = __builtin_ctzll(bits);
+
+			const uint64_t rotation = 1ULL << (shift + SLOT_BITS);
+			at = (now_ & ~(rotation - 1)) + ((uint64_t) slot << shift);
+			if (at < now_) at = now_;
+
+			return true;
+		}
+
+		if (!overflow_.IsEmpty()) {
+			/*
+			 * Revisit the overflow list at the start of the next top level rotation
+			 */
+			slot = 0;
+			at = (now_ | (RANGE - 1)) + 1;
+			return true;
+		}
+
+		return false;
+	}
+
+	void DrainRemote()
+	{
+		if (!remote_.load(memory_order_relaxed)) {
+			return;
+		}
+
+		TimerEvent * t = remote_.exchange(NULL, memory_order_acquire);
+
+		/*
+		 * Restore the order in which they were added, so timers with the same deadline
+		 * fire in that order
+		 */
+		TimerEvent * prev = NULL;
+		while (t) {
+			TimerEvent * next = t->next_;
+			t->next_ = prev;
+			prev = t;
+			t = next;
+		}
+
+		t = prev;
+		while (t) {
+			TimerEvent * next = t->next_;
+			t->next_ = NULL;
+			Add(t);
+			t = next;
+		}
+	}
+
+	/*
+	 * Take the timers cancelled by other threads off the wheel. The ones not on it have
+	 * come due already, or are still on their way here, and are dropped when they expire.
+	 */
+	void DrainCancelled()
+	{
+		if (!cancelled_.load(memory_order_relaxed)) {
+			return;
+		}
+
+		TimerEvent * t = cancelled_.exchange(NULL, memory_order_acquire);
+
+		while (t) {
+			TimerEvent * next = t->cancelNext_;
+			t->cancelNext_ = NULL;
+
+			if (Remove(t)) {
+				Release(t);
+			}
+
+			/*
+			 * The reference handed over with it
+			 */
+			Release(t);
+
+			t = next;
+		}
+	}
+
+	static void Release(TimerEvent * t)
+	{
+		if (t->Release()) {
+			delete t;
+		}
+	}
+
+	uint64_t now_;
+	size_t size_;
+	uint64_t occupied_[NLEVELS];
+	InList<TimerEvent> slots_[NLEVELS][NSLOTS];
+	InList<TimerEvent> overflow_;
+	atomic<TimerEvent *> remote_;
+	atomic<TimerEvent *> cancelled_;
+};
+
+}
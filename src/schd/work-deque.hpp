@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+
+#include "defs.h"
+
+namespace bblocks {
+
+using namespace std;
+
+//........................................................................ WorkStealingDeque<T> ....
+
+/**
+ * Bounded work stealing deque (Chase-Lev).
+ *
+ * The owner thread pushes and pops at the bottom (LIFO) without any locks. Other threads
+ * steal from the top (FIFO) using a single CAS. The memory ordering follows "Correct and
+ * Efficient Work-Stealing for Weak Memory Models", Le et al., PPoPP 2013.
+ *
+ * The deque does not grow. Push returns false when it is full and the caller is expected
+ * to fallback to an unbounded queue.
+ */
+template<class T>
+class WorkStealingDeque
+{
+public:
+
+	static const size_t DEFAULT_CAPACITY = 1024;
+
+	WorkStealingDeque(const size_t capacity = DEFAULT_CAPACITY)
+		: mask_(capacity - 1)
+		, top_(0)
+		, bottom_(0)
+		, buf_(new atomic<T *>[capacity])
+	{
+		INVARIANT(capacity && !(capacity & mask_));
+	}
+
+	~WorkStealingDeque()
+	{
+		INVARIANT(IsEmpty());
+		delete[] buf_;
+	}
+
+	/**
+	 * Push an element at the bottom. Can be called only by the owner.
+	 *
+	 * @param	t	Element to push
+	 * @return	false if the deque is full
+	 */
+	bool Push(T * t)
+	{
+		const int64_t b = bottom_.load(memory_order_relaxed);
+		const int64_t top = top_.load(memory_order_acquire);
+
+		if (b - top > (int64_t) mask_) {
+			/*
+			 * Deque is full
+			 */
+			return false;
+		}
+
+		buf_[b & mask_].store(t, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		bottom_.store(b + 1, memory_order_relaxed);
+
+		return true;
+	}
+
+	/**
+	 * Pop the most recently pushed element. Can be called only by the owner.
+	 *
+	 * @return	Element or NULL if the deque is empty
+	 */
+	T * Pop()
+	{
+		const int64_t b = bottom_.load(memory_order_relaxed) - 1;
+		bottom_.store(b, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		int64_t top = top_.load(memory_order_relaxed);
+
+		if (top > b) {
+			/*
+			 * Deque is empty
+			 */
+			bottom_.store(b + 1, memory_order_relaxed);
+			return NULL;
+		}
+
+		T * t = buf_[b & mask_].load(memory_order_relaxed);
+
+		if (top == b) {
+			/*
+			 * Last element, we are racing with the thieves for it
+			 */
+			if (!top_.compare_exchange_strong(top, top + 1, memory_order_seq_cst,
+							  memory_order_relaxed)) {
+				t = NULL;
+			}
+
+			bottom_.store(b + 1, memory_order_relaxed);
+		}
+
+		return t;
+	}
+
+	/**
+	 * Steal the oldest element. Can be called from any thread.
+	 *
+	 * @return	Element or NULL if the deque is empty or we lost the race
+	 */
+	T * Steal()
+	{
+		int64_t top = top_.load(memory_order_acquire);
+		atomic_thread_fence(memory_order_seq_cst);
+		const int64_t b = bottom_.load(memory_order_acquire);
+
+		if (top >= b) {
+			return NULL;
+		}
+
+		T * t = buf_[top & mask_].load(memory_order_relaxed);
+
+		if (!top_.compare_exchange_strong(top, top + 1, memory_order_seq_cst,
+						  memory_order_relaxed)) {
+			/*
+			 * Lost the race to the owner or another thief
+			 */
+			return NULL;
+		}
+
+		return t;
+	}
+
+	size_t Size() const
+	{
+		const int64_t b = bottom_.load(memory_order_relaxed);
+		const int64_t top = top_.load(memory_order_relaxed);
+		return b > top ? b - top : 0;
+	}
+
+	bool IsEmpty() const
+	{
+		return !Size();
+	}
+
+private:
+
+	WorkStealingDeque(const WorkStealingDeque &);
+	WorkStealingDeque & operator=(const WorkStealingDeque &);
+
+	const size_t mask_;
+	atomic<int64_t> top_;
+	atomic<int64_t> bottom_;
+	atomic<T *> * buf_;
+};
+
+}
@@ -138,6 +138,23 @@ public:
 	}
 };
 
+//......................................................................................... Cpu ....
+
+class Cpu
+{
+public:
+
+	/**
+	 * Hint the processor that we are in a spin wait loop
+	 */
+	static inline void Relax()
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		__asm__ __volatile__ ("pause" ::: "memory");
+#endif
+	}
+};
+
 //........................................................................................ Time ....
 
 class Time
@@ -6,6 +6,7 @@
 #include <memory>
 
 #include "fs/aio-linux.h"
+#include "fs/io-uring-linux.h"
 #include "test/unit/unit-test.h"
 #include "util.h"
 #include "perf/perf-counter.h"
@@ -32,7 +33,7 @@ struct Stats
 //................................................................................ AIOBenchamrk ....
 
 /**
- * Benchmarking devices using LinuxAioProcessor implementation
+ * Benchmarking devices using one of the AioProcessor implementations
  */
 class AIOBenchmark : public CompletionHandle
 {
@@ -52,9 +53,10 @@ public:
 		RANDOM,
 	};
 
-	AIOBenchmark(const string & devname, const disksize_t devsize,
+	AIOBenchmark(AioProcessor * aio, const string & devname, const disksize_t devsize,
 	             const size_t iosize, const IOType iotype,
-		     const IOPattern iopattern, const size_t qdepth)
+		     const IOPattern iopattern, const size_t qdepth,
+		     const bool async = false)
 		: log_("/aiobmark")
 		, devname_(devname)
 		, devsize_(devsize)
@@ -62,9 +64,10 @@ public:
 		, iotype_(iotype)
 		, iopattern_(iopattern)
 		, qdepth_(qdepth)
-		, aio_(new LinuxAioProcessor())
+		, async_(async)
+		, aio_(aio)
 		, dev_(devname_, devsize_ / 512, aio_.Ptr())
-		, buf_(IOBuffer::AllocMappedMem(iosize_))
+		, buf_(aio_->AllocBuffer(iosize_))
 		, nextOff_(UINT64_MAX)
 		, pendingOps_(0)
 		/* perf counters */
@@ -81,6 +84,11 @@ public:
 		INFO(log_) << statLatency_;
 	}
 
+	double OpsPerSec()
+	{
+		return div(stats_.count_, stats_.ms_.Elapsed() / 1000);
+	}
+
 	void Start(int)
 	{
 		int status = dev_.OpenDevice();
@@ -171,11 +179,21 @@ private:
 		ctx->start_usec_ = Time::NowInMicroSec();
 
 		if (iotype_ == READ) {
-			auto fn = intr_fn(this, &AIOBenchmark::ReadDone, ctx);
-			dev_.Read(buf_, off / 512, iosize_ / 512, fn);
+			if (async_) {
+				auto fn = async_fn(this, &AIOBenchmark::ReadDone, ctx);
+				dev_.Read(buf_, off / 512, iosize_ / 512, fn);
+			} else {
+				auto fn = intr_fn(this, &AIOBenchmark::ReadDone, ctx);
+				dev_.Read(buf_, off / 512, iosize_ / 512, fn);
+			}
 		} else {
-			auto fn = intr_fn(this, &AIOBenchmark::WriteDone, ctx);
-			dev_.Write(buf_, off / 512, iosize_ / 512, fn);
+			if (async_) {
+				auto fn = async_fn(this, &AIOBenchmark::WriteDone, ctx);
+				dev_.Write(buf_, off / 512, iosize_ / 512, fn);
+			} else {
+				auto fn = intr_fn(this, &AIOBenchmark::WriteDone, ctx);
+				dev_.Write(buf_, off / 512, iosize_ / 512, fn);
+			}
 		}
 	}
 
@@ -232,6 +250,7 @@ private:
 	const IOType iotype_;
 	const IOPattern iopattern_;
 	const size_t qdepth_;
+	const bool async_;		// Completions run on the pool threads
 	AutoPtr<AioProcessor> aio_;
 	SpinningDevice dev_;
 	IOBuffer buf_;
@@ -244,6 +263,52 @@ private:
 
 //........................................................................................ Main ....
 
+static AioProcessor *
+NewAioProcessor(const string & backend)
+{
+	if (backend == "aio") {
+		return new LinuxAioProcessor();
+	}
+
+	return new IoUringAioProcessor(IoUringAioProcessor::DEFAULT_NENTRIES,
+				       IoUringAioProcessor::DEFAULT_REGION_SIZE,
+				       /*sqpoll=*/ backend == "uring-sqpoll");
+}
+
+/**
+ * Run the benchmark on a pool of ncpu threads
+ *
+ * @return	ops/sec
+ */
+static double
+RunBenchmark(const size_t ncpu, const string & backend, const string & devname,
+	     const disksize_t devsize, const size_t iosize, const string & iotype,
+	     const string & iopattern, const size_t qdepth, const bool async,
+	     const bool reactor)
+{
+	double opsPerSec = 0;
+
+	BBlocks::Start(ncpu, /*workStealing=*/ false, reactor);
+
+	{
+	    AIOBenchmark bmark(NewAioProcessor(backend), devname, devsize * 1024 * 1024 * 1024,
+			   iosize,
+			   iotype == "read" ? AIOBenchmark::READ
+					    : AIOBenchmark::WRITE,
+			   iopattern == "random" ? AIOBenchmark::RANDOM
+						 : AIOBenchmark::SEQUENTIAL, qdepth, async);
+
+	    BBlocks::Schedule(&bmark, &AIOBenchmark::Start, /*status=*/ 0);
+	    BBlocks::Wait();
+
+	    opsPerSec = bmark.OpsPerSec();
+	}
+
+	BBlocks::Shutdown();
+
+	return opsPerSec;
+}
+
 int
 main(int argc, char ** argv)
 {
@@ -254,6 +319,9 @@ main(int argc, char ** argv)
 	string iopattern;
 	size_t qdepth;
 	size_t ncpu = SysConf::NumCores();
+	string backend = "aio";
+	bool scale = false;
+	bool reactor = false;
 
 	po::options_description desc("Options:");
 	desc.add_options()
@@ -266,13 +334,27 @@ main(int argc, char ** argv)
 		("iopattern", po::value<string>(&iopattern)->required(), "seq/random")
 		("qdepth", po::value<size_t>(&qdepth)->required(), "Queue depth")
 		("ncpu", po::value<size_t>(&ncpu), "Number of cores")
-		("s", po::value<size_t>(&_time_s), "Test time in s");
+		("backend", po::value<string>(&backend), "aio/uring/uring-sqpoll (default aio)")
+		("scale", po::bool_switch(&scale),
+		 "Run with 1, 2, 4 .. ncpu threads, completions handled on the pool threads")
+		("reactor", po::bool_switch(&reactor),
+		 "Run the pool in reactor mode, aio completions are reaped by the pool threads")
+		("s", po::value<size_t>(&_time_s), "Test time in s")
+		("uring-supported", "Exit with 0 if io_uring is supported by the kernel, 1 if not");
 
 	po::variables_map parg;
 
 	try
 	{
 		po::store(po::parse_command_line(argc, argv, desc), parg);
+
+		if (parg.count("uring-supported")) {
+			/*
+			 * For the scripts to pick the backends with, nothing else is required
+			 */
+			return IoUringAioProcessor::IsSupported() ? 0 : 1;
+		}
+
 		po::notify(parg);
 	} catch (...) {
 		cout << desc << endl;
@@ -293,9 +375,19 @@ main(int argc, char ** argv)
 		return -1;
 	}
 
+	if (backend != "aio" && backend != "uring" && backend != "uring-sqpoll") {
+		cerr << "unknown backend" << endl;
+		cerr << desc << endl;
+		return -1;
+	}
+
+	if (backend != "aio" && !IoUringAioProcessor::IsSupported()) {
+		cerr << "io_uring is not supported by the kernel" << endl;
+		return -1;
+	}
+
 	// run benchamark
 	InitTestSetup();
-	BBlocks::Start(ncpu);
 
 	cout << "Running benchmark for"
 	     << " devname " << devname << endl
@@ -303,20 +395,33 @@ main(int argc, char ** argv)
 	     << " iosize " << iosize << endl
 	     << " iotype " << iotype << endl
 	     << " iopattern " << iopattern << endl
-	     << " qdepth " << qdepth << endl;
+	     << " qdepth " << qdepth << endl
+	     << " backend " << backend << endl
+	     << " reactor " << reactor << endl;
+
+	if (!scale) {
+		RunBenchmark(ncpu, backend, devname, devsize, iosize, iotype, iopattern, qdepth,
+			     /*async=*/ false, reactor);
+	} else {
+		vector<pair<size_t, double> > results;
+
+		for (size_t n = 1; ; n = std::min(n * 2, ncpu)) {
+			const double opsPerSec = RunBenchmark(n, backend, devname, devsize, iosize,
+							      iotype, iopattern, qdepth,
+							      /*async=*/ true, reactor);
+			results.push_back(make_pair(n, opsPerSec));
+
+			if (n == ncpu) break;
+		}
 
-	{
-	    AIOBenchmark bmark(devname, devsize * 1024 * 1024 * 1024, iosize,
-			   iotype == "read" ? AIOBenchmark::READ
-					    : AIOBenchmark::WRITE,
-			   iopattern == "random" ? AIOBenchmark::RANDOM
-						 : AIOBenchmark::SEQUENTIAL, qdepth);
+		cout << "Scaling :" << endl
+		     << "=========" << endl;
 
-	    BBlocks::Schedule(&bmark, &AIOBenchmark::Start, /*status=*/ 0);
-	    BBlocks::Wait();
+		for (auto & r : results) {
+			cout << " ncpu " << r.first << " Ops/sec " << r.second << endl;
+		}
 	}
 
-	BBlocks::Shutdown();
 	TeardownTestSetup();
 
 	return 0;
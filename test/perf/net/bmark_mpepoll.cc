@@ -0,0 +1,183 @@
+#include <boost/program_options.hpp>
+#include <sys/eventfd.h>
+#include <string>
+#include <iostream>
+#include <atomic>
+
+#include "net/epoll/mpio-epoll.h"
+#include "test/unit/unit-test.h"
+#include "util.h"
+
+using namespace std;
+using namespace bblocks;
+
+namespace po = boost::program_options;
+
+//..................................................................................... Toggler ....
+
+/**
+ * Flips EPOLLIN on a set of fds as fast as it can, the way a channel flips EPOLLOUT as its
+ * writes block and drain. The eventfds never become readable, so nothing is dispatched and
+ * only the registry and epoll_ctl are measured.
+ */
+class Toggler : public Thread
+{
+public:
+
+	Toggler(FdPoll & epoll, const size_t nfds, const atomic<bool> & stop)
+		: Thread("/bmark_mpepoll/toggler")
+		, epoll_(epoll)
+		, stop_(stop)
+		, ops_(0)
+	{
+		for (size_t i = 0; i < nfds; ++i) {
+			const int fd = eventfd(/*initval=*/ 0, EFD_NONBLOCK);
+			INVARIANT(fd != -1);
+
+			bool ok = epoll_.Add(fd, EPOLLIN, fn_t());
+			INVARIANT(ok);
+
+			fds_.push_back(fd);
+		}
+	}
+
+	virtual ~Toggler()
+	{
+		for (auto fd : fds_) {
+			bool ok = epoll_.Remove(fd);
+			INVARIANT(ok);
+
+			::close(fd);
+		}
+	}
+
+	uint64_t Ops() const
+	{
+		return ops_;
+	}
+
+protected:
+
+	typedef FdPoll::fn_t fn_t;
+
+	virtual void * ThreadMain() override
+	{
+		while (!stop_.load(memory_order_relaxed)) {
+			for (auto fd : fds_) {
+				bool ok = epoll_.RemoveEvent(fd, EPOLLIN)
+					  && epoll_.AddEvent(fd, EPOLLIN);
+				INVARIANT(ok);
+			}
+
+			ops_ += 2 * fds_.size();
+		}
+
+		return NULL;
+	}
+
+private:
+
+	FdPoll & epoll_;
+	const atomic<bool> & stop_;
+	vector<int> fds_;
+	uint64_t ops_;
+};
+
+/**
+ * Run npollth togglers against a MultiPathEpoll with npollth polling threads
+ *
+ * @return	AddEvent/RemoveEvent calls per sec
+ */
+static double
+RunBenchmark(const size_t npollth, const size_t nfds, const size_t seconds)
+{
+	MultiPathEpoll epoll(npollth, "/bmark_mpepoll/");
+	atomic<bool> stop(false);
+	vector<Toggler *> togglers;
+
+	for (size_t i = 0; i < npollth; ++i) {
+		togglers.push_back(new Toggler(epoll, nfds, stop));
+	}
+
+	Timer timer;
+
+	for (auto t : togglers) {
+		t->StartBlockingThread();
+	}
+
+	sleep(seconds);
+	stop = true;
+
+	uint64_t ops = 0;
+
+	for (auto t : togglers) {
+		t->Stop();
+		ops += t->Ops();
+	}
+
+	const double opsPerSec = ops / MS2SEC(double(timer.Elapsed()));
+
+	for (auto t : togglers) {
+		delete t;
+	}
+
+	cout << " npollth " << npollth << " Ops/sec " << opsPerSec << endl;
+
+	return opsPerSec;
+}
+
+//........................................................................................ Main ....
+
+int
+main(int argc, char ** argv)
+{
+	size_t npollth = SysConf::NumCores();
+	size_t nfds = 64;
+	size_t seconds = 2;
+
+	po::options_description desc("Options:");
+	desc.add_options()
+		("help", "Print usage")
+		("npollth", po::value<size_t>(&npollth),
+		 "Run with 1, 2, 4 .. npollth polling threads (default ncpu)")
+		("nfds", po::value<size_t>(&nfds), "fds per polling thread (default 64)")
+		("s", po::value<size_t>(&seconds), "Time in s per run (default 2)");
+
+	po::variables_map parg;
+
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), parg);
+		po::notify(parg);
+	} catch (...) {
+		cout << desc << endl;
+		throw;
+	}
+
+	if (parg.count("help")) {
+	    cout << desc << endl;
+	    return 0;
+	}
+
+	InitTestSetup();
+
+	vector<pair<size_t, double> > results;
+
+	for (size_t n = 1; ; n = std::min(n * 2, npollth)) {
+		results.push_back(make_pair(n, RunBenchmark(n, nfds, seconds)));
+
+		if (n == npollth) break;
+	}
+
+	cout << "Scaling :" << endl
+	     << "=========" << endl;
+
+	for (auto & r : results) {
+		cout << " npollth " << r.first << " Ops/sec " << r.second
+		     << " x" << r.second / results[0].second << endl;
+	}
+
+	TeardownTestSetup();
+
+	return 0;
+}
@@ -43,11 +43,12 @@ public:
 
 	typedef TCPServerBenchmark This;
 
-	TCPServerBenchmark(const size_t iosize)
+	TCPServerBenchmark(const size_t iosize, const size_t readAhead)
 		: lock_("/server")
 		, epoll_(/*threads=*/ 2, "/server")
 		, server_(epoll_)
 		, buf_(IOBuffer::Alloc(iosize))
+		, readAhead_(readAhead)
 	{
 		buf_.FillRandom();
 	}
@@ -80,6 +81,10 @@ public:
 
 		INFO(_log) << "Got ch " << ch;
 
+		if (readAhead_) {
+			ch->SetReadAhead(readAhead_);
+		}
+
 		/*
 		 * Create channel stat node
 		 */
@@ -147,6 +152,7 @@ private:
 	TCPServer server_;
 	chstats_map_t chstats_;
 	IOBuffer buf_;
+	const size_t readAhead_;
 };
 
 //.......................................................................... TCPClientBenchmark ....
@@ -363,6 +369,7 @@ main(int argc, char ** argv)
 	string laddr = "0.0.0.0:0";
 	string raddr;
 	int iosize = 4 * 1024;
+	int readAhead = 0;
 	int nconn = 1;
 	int seconds = 60;
 	int ncpu = SysConf::NumCores();
@@ -378,6 +385,8 @@ main(int argc, char ** argv)
 			    "Remote address")
 		("iosize",  po::value<int>(&iosize),
 			    "IO size in bytes")
+		("readahead", po::value<int>(&readAhead),
+			    "Server read-ahead in bytes (Default off)")
 		("conn",    po::value<int>(&nconn),
 			    "Client connections (Default 1)")
 		("s",	    po::value(&seconds),
@@ -425,10 +434,11 @@ main(int argc, char ** argv)
 		BBlocks::Wait();
 	} else {
 		INFO(_log) << "Running server at " << laddr
-			   << " ncpu " << ncpu;
+			   << " ncpu " << ncpu
+			   << " readahead " << readAhead << " bytes";
 
 		ASSERT(!laddr.empty());
-		TCPServerBenchmark s(iosize);
+		TCPServerBenchmark s(iosize, readAhead);
 		BBlocks::Schedule(&s, &TCPServerBenchmark::Start, SocketAddress::GetAddr(laddr));
 		BBlocks::Wait();
 	}
@@ -6,11 +6,36 @@
 #include "test/unit/unit-test.h"
 #include "util.h"
 #include "fs/aio-linux.h"
+#include "fs/io-uring-linux.h"
 #include "async.h"
 
 using namespace std;
 using namespace bblocks;
 
+/*
+ * Heap allocations made by the calling thread
+ */
+static __thread size_t nallocs = 0;
+
+void *
+operator new(size_t size)
+{
+    ++nallocs;
+
+    void * ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw bad_alloc();
+    }
+
+    return ptr;
+}
+
+void
+operator delete(void * ptr) noexcept
+{
+    free(ptr);
+}
+
 //............................................................ basicaiotest ....
 
 class BasicAioTest : public CompletionHandle
@@ -31,12 +56,16 @@ public:
         IOBuffer buf_;
     };
 
-    BasicAioTest()
+    BasicAioTest(AioProcessor & aio, const bool elevator = false)
         : log_("testaio/")
+        , aio_(aio)
 		/* TODO: Fix this dependency */
         , dev_("obj/test.out", /*size=*/ 10 * 1024 * 1024, &aio_)
 	, count_(0)
     {
+        if (elevator) {
+            dev_.EnableElevator();
+        }
     }
 
     ~BasicAioTest()
@@ -53,7 +82,7 @@ public:
         for (int i = 0; i < 1000; ++i) {
             count_ += 1;
 
-            IOBuffer buf = IOBuffer::Alloc(WBUFFERSIZE);
+            IOBuffer buf = aio_.AllocBuffer(WBUFFERSIZE);
             IOCtx * ctx = new IOCtx(i, buf);
             buf.Fill('a' + (i % 26));
             const int status = dev_.Write(ctx->buf_, (i * WBUFFERSIZE) / 512, WBUFFERSIZE / 512,
@@ -98,23 +127,685 @@ public:
 private: 
 
     string log_;
-    LinuxAioProcessor aio_;
+    AioProcessor & aio_;
     SpinningDevice dev_;
     atomic<int> count_;
 };
 
+void
+RunBasicAioTest(AioProcessor & aio, const bool elevator = false)
+{
+    BBlocks::Start();
+
+    {
+        BasicAioTest test(aio, elevator);
+        BBlocks::Schedule(&test, &BasicAioTest::Start, /*nonce=*/ 0);
+
+        BBlocks::Wait();
+    }
+
+    BBlocks::Shutdown();
+}
+
 void
 test_aio_basic()
 {
+    LinuxAioProcessor aio;
+    RunBasicAioTest(aio);
+}
+
+/*
+ * Counts the ops that make it to the processor underneath. Vectored ops, the ones the
+ * elevator merges requests in to, can be failed or cut short instead of sent.
+ */
+class CountingAioProcessor : public AioProcessor
+{
+public:
+
+    CountingAioProcessor(AioProcessor & aio)
+        : aio_(aio), nops_(0), nmerged_(0), refuse_(false), error_(0), shortBy_(0)
+    {}
+
+    virtual int Write(Op * op) override
+    {
+        return Submit(op, /*write=*/ true);
+    }
+
+    virtual int Read(Op * op) override
+    {
+        return Submit(op, /*write=*/ false);
+    }
+
+    virtual int Sync(Op * op) override
+    {
+        return aio_.Sync(op);
+    }
+
+    virtual IOBuffer AllocBuffer(const size_t size) override
+    {
+        return aio_.AllocBuffer(size);
+    }
+
+    virtual bool RegisterFile(const fd_t fd) override
+    {
+        return aio_.RegisterFile(fd);
+    }
+
+    virtual void UnregisterFile(const fd_t fd) override
+    {
+        aio_.UnregisterFile(fd);
+    }
+
+    virtual void Flush() override
+    {
+        aio_.Flush();
+    }
+
+    virtual void RegisterHandle(CHandle *) override
+    {
+        DEADEND
+    }
+
+    virtual void UnregisterHandle(CHandle *, const AsyncProcessor::UnregisterDoneFn) override
+    {
+        DEADEND
+    }
+
+    AioProcessor & aio_;
+    atomic<size_t> nops_;
+    atomic<size_t> nmerged_;
+    bool refuse_;               // Refuse the merged ops
+    int error_;                 // Complete the merged ops with
+    size_t shortBy_;            // Complete the merged ops this many bytes short
+
+private:
+
+    int Submit(Op * op, const bool write)
+    {
+        nops_++;
+
+        if (!op->iovcnt_) {
+            return write ? aio_.Write(op) : aio_.Read(op);
+        }
+
+        nmerged_++;
+
+        if (refuse_) {
+            return -1;
+        }
+
+        if (error_ || shortBy_) {
+            const int res = error_ ? error_ : int(op->size_ - shortBy_);
+            BBlocks::Schedule(this, &CountingAioProcessor::Complete, op, res);
+            return 1;
+        }
+
+        return write ? aio_.Write(op) : aio_.Read(op);
+    }
+
+    void Complete(Op * op, const int res)
+    {
+        op->ch_.Interrupt(res, op);
+    }
+};
+
+/*
+ * Adjacent writes held by the elevator and let go together by a flush
+ */
+class ElevatorTest : public CompletionHandle
+{
+public:
+
+    static const size_t NREQS = 8;
+    static const size_t REQSIZE = 4096;
+
+    ElevatorTest(AioProcessor & aio, const bool reverse = false)
+        : aio_(aio), dev_("obj/test.out", /*nsectors=*/ 1024, &aio), reverse_(reverse)
+        , pending_(NREQS)
+    {
+        INVARIANT(dev_.OpenDevice() != -1);
+        dev_.EnableElevator(/*windowUs=*/ 1000 * 1000);
+    }
+
+    void Run()
+    {
+        for (size_t n = 0; n < NREQS; ++n) {
+            const size_t i = reverse_ ? NREQS - 1 - n : n;
+
+            bufs_[i] = aio_.AllocBuffer(REQSIZE);
+            bufs_[i].Fill('a' + i);
+
+            int status = dev_.Write(bufs_[i], /*off=*/ i * REQSIZE / 512, REQSIZE / 512,
+                                    intr_fn(this, &ElevatorTest::WriteDone, i));
+            INVARIANT(status == 1);
+        }
+
+        AsyncWait<int> flushed;
+        INVARIANT(dev_.Flush(intr_fn(&flushed, &AsyncWait<int>::Done)) == 1);
+        INVARIANT(flushed.Wait() == 0);
+
+        INVARIANT(done_.Wait() == 0);
+    }
+
+    __interrupt__ void WriteDone(int status, size_t i)
+    {
+        status_[i] = status;
+
+        if (--pending_ == 0) {
+            done_.Done(/*status=*/ 0);
+        }
+    }
+
+    int status_[NREQS];
+
+private:
+
+    AioProcessor & aio_;
+    SpinningDevice dev_;
+    const bool reverse_;
+    IOBuffer bufs_[NREQS];
+    atomic<int> pending_;
+    AsyncWait<int> done_;
+};
+
+void
+test_aio_elevator()
+{
+    /*
+     * The writes are all adjacent and go out merged
+     */
+    {
+        LinuxAioProcessor aio;
+        CountingAioProcessor counter(aio);
+        RunBasicAioTest(counter, /*elevator=*/ true);
+
+        cout << "requests: 2000 ops: " << counter.nops_ << endl;
+        INVARIANT(counter.nops_ < 2000);
+        INVARIANT(counter.nmerged_);
+    }
+
+    if (IoUringAioProcessor::IsSupported()) {
+        IoUringAioProcessor aio;
+        CountingAioProcessor counter(aio);
+        RunBasicAioTest(counter, /*elevator=*/ true);
+
+        INVARIANT(counter.nops_ < 2000);
+    }
+
     BBlocks::Start();
 
-    BasicAioTest test;
-    BBlocks::Schedule(&test, &BasicAioTest::Start, /*nonce=*/ 0);
+    {
+        LinuxAioProcessor aio;
+        const int size = ElevatorTest::REQSIZE;
+
+        /*
+         * One op for the lot
+         */
+        {
+            CountingAioProcessor counter(aio);
+            ElevatorTest test(counter);
+            test.Run();
+
+            INVARIANT(counter.nops_ == 1 && counter.nmerged_ == 1);
+
+            for (size_t i = 0; i < ElevatorTest::NREQS; ++i) {
+                INVARIANT(test.status_[i] == size);
+            }
+        }
+
+        /*
+         * Issued backwards, sorted back in to one op
+         */
+        {
+            CountingAioProcessor counter(aio);
+            ElevatorTest test(counter, /*reverse=*/ true);
+            test.Run();
+
+            INVARIANT(counter.nops_ == 1 && counter.nmerged_ == 1);
+
+            for (size_t i = 0; i < ElevatorTest::NREQS; ++i) {
+                INVARIANT(test.status_[i] == size);
+            }
+        }
+
+        /*
+         * A short op, the requests past the end of what made it get what is theirs of it
+         */
+        {
+            CountingAioProcessor counter(aio);
+            counter.shortBy_ = size + 512;
+
+            ElevatorTest test(counter);
+            test.Run();
+
+            const size_t n = ElevatorTest::NREQS;
+            for (size_t i = 0; i < n - 2; ++i) {
+                INVARIANT(test.status_[i] == size);
+            }
+
+            INVARIANT(test.status_[n - 2] == size - 512);
+            INVARIANT(test.status_[n - 1] == 0);
+        }
+
+        /*
+         * A failed op fails every request in it, whether it is refused or completed
+         * with an error
+         */
+        {
+            CountingAioProcessor counter(aio);
+            counter.error_ = -EIO;
+
+            ElevatorTest test(counter);
+            test.Run();
+
+            for (size_t i = 0; i < ElevatorTest::NREQS; ++i) {
+                INVARIANT(test.status_[i] == -EIO);
+            }
+        }
+
+        {
+            CountingAioProcessor counter(aio);
+            counter.refuse_ = true;
+
+            ElevatorTest test(counter);
+            test.Run();
+
+            for (size_t i = 0; i < ElevatorTest::NREQS; ++i) {
+                INVARIANT(test.status_[i] == -1);
+            }
+        }
+    }
+
+    BBlocks::Shutdown();
+}
+
+void
+FlushTest(AioProcessor & aio)
+{
+    SpinningDevice dev("obj/test.out", /*nsectors=*/ 1024, &aio);
+    INVARIANT(dev.OpenDevice() != -1);
+
+    IOBuffer buf = aio.AllocBuffer(BasicAioTest::WBUFFERSIZE);
+    buf.Fill('x');
+    INVARIANT(dev.Write(buf, /*off=*/ 0, BasicAioTest::WBUFFERSIZE / 512) == int(BasicAioTest::WBUFFERSIZE));
+
+    AsyncWait<int> waiter;
+    INVARIANT(dev.Flush(intr_fn(&waiter, &AsyncWait<int>::Done)) == 1);
+    INVARIANT(waiter.Wait() == 0);
+}
+
+void
+test_aio_flush()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        FlushTest(aio);
+    }
+
+    if (IoUringAioProcessor::IsSupported()) {
+        IoUringAioProcessor aio;
+        FlushTest(aio);
+    }
+
+    BBlocks::Shutdown();
+}
+
+void
+test_aio_reactor()
+{
+    BBlocks::Start(SysConf::NumCores(), /*workStealing=*/ false, /*reactor=*/ true);
+
+    {
+        /*
+         * The completions are reaped by the pool threads, the processor has to go
+         * before the pool
+         */
+        LinuxAioProcessor aio;
+
+        {
+            BasicAioTest test(aio);
+            BBlocks::Schedule(&test, &BasicAioTest::Start, /*nonce=*/ 0);
+
+            BBlocks::Wait();
+        }
+
+        INVARIANT(!aio.InFlight());
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * Blocking writes from a pool thread. The thread is not going to get to the end of the
+ * routine, nor to reaping the completion, until the write is done.
+ */
+class BlockingWriteTest : public CompletionHandle
+{
+public:
+
+    static const int NWRITES = 16;
+
+    BlockingWriteTest(AioProcessor & aio, const bool elevator)
+        : aio_(aio), dev_("obj/test.out", /*nsectors=*/ 1024, &aio)
+    {
+        INVARIANT(dev_.OpenDevice() != -1);
+
+        if (elevator) {
+            dev_.EnableElevator();
+        }
+    }
+
+    void Run(int nonce)
+    {
+        for (int i = 0; i < NWRITES; ++i) {
+            IOBuffer buf = aio_.AllocBuffer(BasicAioTest::WBUFFERSIZE);
+            buf.Fill('a' + i);
+
+            const size_t nblks = BasicAioTest::WBUFFERSIZE / 512;
+            INVARIANT(dev_.Write(buf, i * nblks, nblks) == int(BasicAioTest::WBUFFERSIZE));
+        }
+
+        BBlocks::Wakeup();
+    }
+
+private:
+
+    AioProcessor & aio_;
+    SpinningDevice dev_;
+};
+
+void
+RunBlockingWriteTest(AioProcessor & aio, const bool elevator)
+{
+    BlockingWriteTest test(aio, elevator);
+    BBlocks::Schedule(&test, &BlockingWriteTest::Run, /*nonce=*/ 0);
 
     BBlocks::Wait();
+}
+
+void
+test_aio_blocking_write()
+{
+    for (int reactor = 0; reactor < 2; ++reactor) {
+        BBlocks::Start(SysConf::NumCores(), /*workStealing=*/ false, reactor);
+
+        {
+            LinuxAioProcessor aio;
+            RunBlockingWriteTest(aio, /*elevator=*/ false);
+            RunBlockingWriteTest(aio, /*elevator=*/ true);
+
+            INVARIANT(!aio.InFlight());
+        }
+
+        if (IoUringAioProcessor::IsSupported()) {
+            IoUringAioProcessor aio;
+            RunBlockingWriteTest(aio, /*elevator=*/ false);
+            RunBlockingWriteTest(aio, /*elevator=*/ true);
+
+            INVARIANT(!aio.InFlight());
+        }
+
+        BBlocks::Shutdown();
+    }
+}
+
+void
+test_aio_overflow()
+{
+    /*
+     * A context with room for a handful of ops, the rest wait their turn
+     */
+    {
+        LinuxAioProcessor aio(/*nrthreads=*/ 1, /*nreqs=*/ 8);
+        RunBasicAioTest(aio);
+    }
+
+    if (IoUringAioProcessor::IsSupported()) {
+        IoUringAioProcessor aio(/*nentries=*/ 8);
+        RunBasicAioTest(aio);
+
+        INVARIANT(!aio.InFlight());
+    }
+
+    BBlocks::Start(SysConf::NumCores(), /*workStealing=*/ false, /*reactor=*/ true);
+
+    {
+        LinuxAioProcessor aio(/*nrthreads=*/ 1, /*nreqs=*/ 8);
+
+        {
+            BasicAioTest test(aio);
+            BBlocks::Schedule(&test, &BasicAioTest::Start, /*nonce=*/ 0);
+
+            BBlocks::Wait();
+        }
+
+        INVARIANT(!aio.InFlight());
+    }
+
+    BBlocks::Shutdown();
+}
+
+class CreditsTest : public CompletionHandle
+{
+public:
+
+    static const int NWRITES = 64;
+
+    CreditsTest(AioProcessor & aio)
+        : aio_(aio), dev_("obj/test.out", /*nsectors=*/ 1024, &aio), pending_(NWRITES)
+    {
+        INVARIANT(dev_.OpenDevice() != -1);
+    }
+
+    void Run(const size_t nreqs)
+    {
+        INVARIANT(aio_.Credits() == nreqs);
+
+        for (int i = 0; i < NWRITES; ++i) {
+            bufs_[i] = aio_.AllocBuffer(512);
+            bufs_[i].Fill('a' + (i % 26));
+
+            int status = dev_.Write(bufs_[i], /*off=*/ i, /*nblks=*/ 1,
+                                    intr_fn(this, &CreditsTest::WriteDone));
+            INVARIANT(status == 1);
+            INVARIANT(aio_.Credits() <= nreqs);
+        }
+
+        INVARIANT(done_.Wait() == 0);
+
+        /*
+         * All of it is back
+         */
+        AsyncWait<int> credits;
+        aio_.WaitCredits(intr_fn(&credits, &AsyncWait<int>::Done));
+        INVARIANT(size_t(credits.Wait()) == nreqs);
+        INVARIANT(aio_.Credits() == nreqs);
+    }
+
+    __interrupt__ void WriteDone(int status)
+    {
+        INVARIANT(status == 512);
+
+        if (--pending_ == 0) {
+            done_.Done(/*status=*/ 0);
+        }
+    }
+
+private:
+
+    AioProcessor & aio_;
+    SpinningDevice dev_;
+    IOBuffer bufs_[NWRITES];
+    atomic<int> pending_;
+    AsyncWait<int> done_;
+};
+
+void
+test_aio_credits()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio(/*nrthreads=*/ 1, /*nreqs=*/ 8);
+
+        CreditsTest test(aio);
+        test.Run(/*nreqs=*/ 8);
+    }
+
+    if (IoUringAioProcessor::IsSupported()) {
+        IoUringAioProcessor aio(/*nentries=*/ 8);
+
+        CreditsTest test(aio);
+        test.Run(/*nreqs=*/ 8);
+    }
+
     BBlocks::Shutdown();
 }
 
+/*
+ * Every IO is issued by the completion of the one before. Either right from the poll
+ * thread, or from a routine the completion schedules, which batches the IO on the pool
+ * thread and submits it at the routine end.
+ */
+class ZeroAllocTest : public CompletionHandle
+{
+public:
+
+    static const size_t WARMUP = 100;
+    static const size_t NIOS = 1000;
+    static const size_t NSLOTS = 64;
+
+    ZeroAllocTest(AioProcessor & aio, const bool pool = false)
+        : dev_("obj/test.out", /*nsectors=*/ NSLOTS * 8, &aio)
+        , buf_(aio.AllocBuffer(BasicAioTest::WBUFFERSIZE))
+        , pool_(pool), n_(0), mark_(0), allocs_(0)
+    {
+        INVARIANT(dev_.OpenDevice() != -1);
+        buf_.Fill('z');
+    }
+
+    size_t Run()
+    {
+        Next();
+        INVARIANT(!waiter_.Wait());
+
+        return allocs_;
+    }
+
+    __interrupt__ void Done(int status)
+    {
+        INVARIANT(status == int(buf_.Size()));
+
+        ++n_;
+
+        if (n_ == WARMUP) {
+            mark_ = nallocs;
+        }
+
+        if (n_ == WARMUP + NIOS) {
+            allocs_ = nallocs - mark_;
+            waiter_.Done(/*status=*/ 0);
+            return;
+        }
+
+        Next();
+    }
+
+private:
+
+    void Next()
+    {
+        if (pool_) {
+            BBlocks::Schedule(this, &ZeroAllocTest::Issue);
+        } else {
+            Issue();
+        }
+    }
+
+    void Issue()
+    {
+        INVARIANT(!pool_ || NonBlockingThread::current_);
+
+        const diskoff_t off = (n_ % NSLOTS) * (buf_.Size() / 512);
+        const Fn<int> ch = intr_fn(this, &ZeroAllocTest::Done);
+
+        int status = (n_ % 2) ? dev_.Read(buf_, off, buf_.Size() / 512, ch)
+                              : dev_.Write(buf_, off, buf_.Size() / 512, ch);
+        INVARIANT(status == 1);
+    }
+
+    SpinningDevice dev_;
+    IOBuffer buf_;
+    const bool pool_;
+    size_t n_;
+    size_t mark_;
+    size_t allocs_;
+    AsyncWait<int> waiter_;
+};
+
+void
+test_aio_zero_alloc()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio(/*nrthreads=*/ 1);
+
+        ZeroAllocTest test(aio);
+        const size_t allocs = test.Run();
+
+        cout << "allocations: " << allocs << " ios: " << ZeroAllocTest::NIOS << endl;
+        INVARIANT(!allocs);
+    }
+
+    /*
+     * Issued from pool routines, batched and flushed at the routine end
+     */
+    {
+        LinuxAioProcessor aio(/*nrthreads=*/ 1);
+
+        ZeroAllocTest test(aio, /*pool=*/ true);
+        const size_t allocs = test.Run();
+
+        cout << "allocations: " << allocs << " ios: " << ZeroAllocTest::NIOS
+             << " (pool)" << endl;
+        INVARIANT(!allocs);
+    }
+
+    BBlocks::Shutdown();
+}
+
+void
+test_aio_uring()
+{
+    if (!IoUringAioProcessor::IsSupported()) {
+        cout << "io_uring not supported, skipping" << endl;
+        return;
+    }
+
+    IoUringAioProcessor aio;
+    RunBasicAioTest(aio);
+
+    INVARIANT(!aio.InFlight());
+}
+
+void
+test_aio_uring_sqpoll()
+{
+    if (!IoUringAioProcessor::IsSupported()) {
+        cout << "io_uring not supported, skipping" << endl;
+        return;
+    }
+
+    IoUringAioProcessor aio(IoUringAioProcessor::DEFAULT_NENTRIES,
+                            IoUringAioProcessor::DEFAULT_REGION_SIZE, /*sqpoll=*/ true);
+    RunBasicAioTest(aio);
+
+    INVARIANT(!aio.InFlight());
+}
+
 //.................................................................... main ....
 
 int
@@ -125,6 +816,15 @@ main(int argc, char ** argv)
     InitTestSetup();
 
     TEST(test_aio_basic);
+    TEST(test_aio_elevator);
+    TEST(test_aio_flush);
+    TEST(test_aio_reactor);
+    TEST(test_aio_blocking_write);
+    TEST(test_aio_overflow);
+    TEST(test_aio_credits);
+    TEST(test_aio_zero_alloc);
+    TEST(test_aio_uring);
+    TEST(test_aio_uring_sqpoll);
 
     TeardownTestSetup();
 
@@ -0,0 +1,414 @@
+#include <iostream>
+#include <atomic>
+
+#include "test/unit/unit-test.h"
+#include "util.h"
+#include "fs/aio-linux.h"
+#include "fs/cached-block-device.h"
+#include "async.h"
+
+using namespace std;
+using namespace bblocks;
+
+static const size_t DEVSIZE = 4 * 1024 * 1024; // 4 MiB
+static const size_t SECTOR = SpinningDevice::SECTOR_SIZE;
+
+//.................................................................. helpers ....
+
+/*
+ * Count the reads that make it to the device
+ */
+class CountingDevice : public BlockDevice
+{
+public:
+
+    CountingDevice(BlockDevice & dev) : dev_(dev), nreads_(0) {}
+
+    virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+                      const Fn<int> & ch) override
+    {
+        return dev_.Write(buf, off, nblks, ch);
+    }
+
+    virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks) override
+    {
+        return dev_.Write(buf, off, nblks);
+    }
+
+    virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+                     const Fn<int> & ch) override
+    {
+        nreads_++;
+        return dev_.Read(buf, off, nblks, ch);
+    }
+
+    virtual int Flush(const Fn<int> & ch) override
+    {
+        return dev_.Flush(ch);
+    }
+
+    virtual disksize_t GetDeviceSize() override
+    {
+        return dev_.GetDeviceSize();
+    }
+
+    BlockDevice & dev_;
+    atomic<size_t> nreads_;
+};
+
+static uint8_t
+Pattern(const size_t off, const uint8_t gen)
+{
+    return uint8_t((off / SECTOR) * 7 + off + gen);
+}
+
+static void
+Fill(IOBuffer & buf, const size_t off, const uint8_t gen)
+{
+    for (size_t i = 0; i < buf.Size(); ++i) {
+        buf.Ptr()[i] = Pattern(off + i, gen);
+    }
+}
+
+static void
+Verify(IOBuffer & buf, const size_t off, const uint8_t gen)
+{
+    for (size_t i = 0; i < buf.Size(); ++i) {
+        INVARIANT(buf.Ptr()[i] == Pattern(off + i, gen));
+    }
+}
+
+static int
+Read(BlockDevice & dev, IOBuffer & buf, const size_t off)
+{
+    AsyncWait<int> waiter;
+
+    int status = dev.Read(buf, off / SECTOR, buf.Size() / SECTOR,
+                          intr_fn(&waiter, &AsyncWait<int>::Done));
+    INVARIANT(status == 1);
+
+    return waiter.Wait();
+}
+
+static void
+WriteAll(BlockDevice & dev, const uint8_t gen)
+{
+    const size_t size = 256 * 1024;
+
+    for (size_t off = 0; off < DEVSIZE; off += size) {
+        IOBuffer buf = IOBuffer::Alloc(size);
+        Fill(buf, off, gen);
+
+        int status = dev.Write(buf, off / SECTOR, size / SECTOR);
+        INVARIANT(size_t(status) == size);
+    }
+}
+
+//................................................................... tests ....
+
+/*
+ * Reads of all sizes and alignments, twice over so the second pass is mostly hits
+ */
+void
+test_cache_read()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-cache.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        WriteAll(dev, /*gen=*/ 0);
+
+        CountingDevice counter(dev);
+        CachedBlockDevice cache(&counter, /*capacity=*/ DEVSIZE);
+
+        for (int pass = 0; pass < 2; ++pass) {
+            srand(/*seed=*/ 1);
+
+            const size_t nreads = counter.nreads_;
+
+            for (int i = 0; i < 500; ++i) {
+                const size_t size = ((rand() % 32) + 1) * SECTOR;
+                const size_t off = (rand() % ((DEVSIZE - size) / SECTOR)) * SECTOR;
+
+                IOBuffer buf = IOBuffer::Alloc(size);
+                INVARIANT(size_t(Read(cache, buf, off)) == size);
+                Verify(buf, off, /*gen=*/ 0);
+            }
+
+            cout << "pass: " << pass << " device reads: " << counter.nreads_ - nreads
+                 << endl;
+
+            /*
+             * The cache holds the whole device, the second pass is all hits
+             */
+            INVARIANT(pass == 0 || counter.nreads_ == nreads);
+        }
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * Sequential small reads, served mostly by read-ahead
+ */
+void
+test_cache_sequential()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-cache.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        WriteAll(dev, /*gen=*/ 1);
+
+        CountingDevice counter(dev);
+        CachedBlockDevice cache(&counter, /*capacity=*/ DEVSIZE);
+
+        for (size_t off = 0; off < DEVSIZE; off += 2 * SECTOR) {
+            IOBuffer buf = IOBuffer::Alloc(2 * SECTOR);
+            INVARIANT(size_t(Read(cache, buf, off)) == buf.Size());
+            Verify(buf, off, /*gen=*/ 1);
+        }
+
+        const size_t npages = DEVSIZE / CachedBlockDevice::PAGE_SIZE;
+
+        cout << "pages: " << npages << " device reads: " << counter.nreads_ << endl;
+
+        /*
+         * The pages are read ahead in runs, not one at a time as they are asked for
+         */
+        INVARIANT(counter.nreads_ <= npages / CachedBlockDevice::MIN_READ_AHEAD_PAGES);
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * A cache a fraction of the device size, pages come and go
+ */
+void
+test_cache_eviction()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-cache.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        WriteAll(dev, /*gen=*/ 2);
+
+        CachedBlockDevice cache(&dev, /*capacity=*/ 64 * CachedBlockDevice::PAGE_SIZE);
+
+        for (int i = 0; i < 2000; ++i) {
+            /*
+             * A small hot set and a scan running through the device
+             */
+            const size_t off = (i % 2) ? (rand() % 32) * CachedBlockDevice::PAGE_SIZE
+                                       : (i * CachedBlockDevice::PAGE_SIZE) % DEVSIZE;
+
+            IOBuffer buf = IOBuffer::Alloc(CachedBlockDevice::PAGE_SIZE);
+            INVARIANT(size_t(Read(cache, buf, off)) == buf.Size());
+            Verify(buf, off, /*gen=*/ 2);
+        }
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * A hot set read over and over with scans running through the device in between. The
+ * scans are read once and are not to push the hot set out of the cache.
+ */
+void
+test_cache_scan()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-cache.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        WriteAll(dev, /*gen=*/ 6);
+
+        const size_t PAGE = CachedBlockDevice::PAGE_SIZE;
+        const size_t capacity = 4 * CachedBlockDevice::NSHARDS;   // Pages
+        const size_t nhot = capacity / 2;
+
+        CountingDevice counter(dev);
+        CachedBlockDevice cache(&counter, capacity * PAGE);
+
+        IOBuffer buf = IOBuffer::Alloc(PAGE);
+
+        /*
+         * Backwards, so nothing is read ahead
+         */
+        auto readhot = [&] () {
+            for (size_t pageno = nhot; pageno-- > 0;) {
+                INVARIANT(size_t(Read(cache, buf, pageno * PAGE)) == PAGE);
+                Verify(buf, pageno * PAGE, /*gen=*/ 6);
+            }
+        };
+
+        /*
+         * Twice over, so the hot pages are known to be
+         */
+        readhot();
+        readhot();
+
+        size_t scan = nhot;
+        size_t nhotreads = 0;
+
+        for (int round = 0; round < 2; ++round) {
+            /*
+             * Twice the capacity of the cache. Every third page, so it covers all shards.
+             */
+            for (size_t i = 0; i < 2 * capacity; ++i, scan += 3) {
+                INVARIANT(size_t(Read(cache, buf, scan * PAGE)) == PAGE);
+                Verify(buf, scan * PAGE, /*gen=*/ 6);
+            }
+
+            const size_t nreads = counter.nreads_;
+            readhot();
+            nhotreads += counter.nreads_ - nreads;
+        }
+
+        INVARIANT(scan <= DEVSIZE / PAGE);
+
+        cout << "hot set device reads: " << nhotreads << endl;
+        INVARIANT(!nhotreads);
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * Many reads of the same cold pages at once, they share the IO
+ */
+class SharedMissTest : public CompletionHandle
+{
+public:
+
+    static const int NREADS = 64;
+
+    SharedMissTest(BlockDevice & dev) : dev_(dev), pending_(NREADS) {}
+
+    void Run()
+    {
+        for (int i = 0; i < NREADS; ++i) {
+            bufs_[i] = IOBuffer::Alloc(8 * SECTOR);
+            int status = dev_.Read(bufs_[i], /*off=*/ 0, /*nblks=*/ 8,
+                                   intr_fn(this, &SharedMissTest::ReadDone));
+            INVARIANT(status == 1);
+        }
+
+        waiter_.Wait();
+
+        for (int i = 0; i < NREADS; ++i) {
+            Verify(bufs_[i], /*off=*/ 0, /*gen=*/ 3);
+        }
+    }
+
+    __interrupt__ void ReadDone(int status)
+    {
+        INVARIANT(status == int(8 * SECTOR));
+
+        if (--pending_ == 0) {
+            waiter_.Done(/*status=*/ 0);
+        }
+    }
+
+private:
+
+    BlockDevice & dev_;
+    IOBuffer bufs_[NREADS];
+    atomic<int> pending_;
+    AsyncWait<int> waiter_;
+};
+
+void
+test_cache_shared_miss()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-cache.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        WriteAll(dev, /*gen=*/ 3);
+
+        CountingDevice counter(dev);
+        CachedBlockDevice cache(&counter, /*capacity=*/ DEVSIZE);
+
+        SharedMissTest test(cache);
+        test.Run();
+
+        /*
+         * The first miss reads the page, the rest wait for it
+         */
+        INVARIANT(counter.nreads_ == 1);
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * Writes through the cache are seen by the reads that follow
+ */
+void
+test_cache_write()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-cache.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        CachedBlockDevice cache(&dev, /*capacity=*/ DEVSIZE);
+
+        WriteAll(cache, /*gen=*/ 4);
+
+        for (size_t off = 0; off < DEVSIZE; off += 64 * 1024) {
+            IOBuffer buf = IOBuffer::Alloc(64 * 1024);
+            INVARIANT(size_t(Read(cache, buf, off)) == buf.Size());
+            Verify(buf, off, /*gen=*/ 4);
+        }
+
+        WriteAll(cache, /*gen=*/ 5);
+
+        for (size_t off = 0; off < DEVSIZE; off += 64 * 1024) {
+            IOBuffer buf = IOBuffer::Alloc(64 * 1024);
+            INVARIANT(size_t(Read(cache, buf, off)) == buf.Size());
+            Verify(buf, off, /*gen=*/ 5);
+        }
+    }
+
+    BBlocks::Shutdown();
+}
+
+//.................................................................... main ....
+
+int
+main(int argc, char ** argv)
+{
+    InitTestSetup();
+
+    TEST(test_cache_read);
+    TEST(test_cache_sequential);
+    TEST(test_cache_eviction);
+    TEST(test_cache_scan);
+    TEST(test_cache_shared_miss);
+    TEST(test_cache_write);
+
+    TeardownTestSetup();
+
+    return 0;
+}
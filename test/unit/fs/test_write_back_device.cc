@@ -0,0 +1,323 @@
+#include <iostream>
+#include <atomic>
+
+#include "test/unit/unit-test.h"
+#include "util.h"
+#include "fs/aio-linux.h"
+#include "fs/write-back-device.h"
+#include "async.h"
+
+using namespace std;
+using namespace bblocks;
+
+static const size_t DEVSIZE = 4 * 1024 * 1024; // 4 MiB
+static const size_t SECTOR = SpinningDevice::SECTOR_SIZE;
+
+//.................................................................. helpers ....
+
+/*
+ * Count what makes it to the device
+ */
+class CountingDevice : public BlockDevice
+{
+public:
+
+    CountingDevice(BlockDevice & dev) : dev_(dev), nwrites_(0), nflushes_(0) {}
+
+    virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks,
+                      const Fn<int> & ch) override
+    {
+        nwrites_++;
+        return dev_.Write(buf, off, nblks, ch);
+    }
+
+    virtual int Write(const IOBuffer & buf, const diskoff_t off, const size_t nblks) override
+    {
+        nwrites_++;
+        return dev_.Write(buf, off, nblks);
+    }
+
+    virtual int Read(IOBuffer & buf, const diskoff_t off, const size_t nblks,
+                     const Fn<int> & ch) override
+    {
+        return dev_.Read(buf, off, nblks, ch);
+    }
+
+    virtual int Flush(const Fn<int> & ch) override
+    {
+        nflushes_++;
+        return dev_.Flush(ch);
+    }
+
+    virtual disksize_t GetDeviceSize() override
+    {
+        return dev_.GetDeviceSize();
+    }
+
+    BlockDevice & dev_;
+    atomic<size_t> nwrites_;
+    atomic<size_t> nflushes_;
+};
+
+static int
+Read(BlockDevice & dev, IOBuffer & buf, const size_t off)
+{
+    AsyncWait<int> waiter;
+
+    int status = dev.Read(buf, off / SECTOR, buf.Size() / SECTOR,
+                          intr_fn(&waiter, &AsyncWait<int>::Done));
+    INVARIANT(status == 1);
+
+    return waiter.Wait();
+}
+
+static int
+Flush(BlockDevice & dev)
+{
+    AsyncWait<int> waiter;
+
+    int status = dev.Flush(intr_fn(&waiter, &AsyncWait<int>::Done));
+    INVARIANT(status == 1);
+
+    return waiter.Wait();
+}
+
+static void
+Verify(BlockDevice & dev, const vector<uint8_t> & image)
+{
+    IOBuffer buf = IOBuffer::Alloc(DEVSIZE);
+    INVARIANT(size_t(Read(dev, buf, /*off=*/ 0)) == DEVSIZE);
+    INVARIANT(!memcmp(buf.Ptr(), &image[0], DEVSIZE));
+}
+
+static void
+Write(BlockDevice & dev, vector<uint8_t> & image, const size_t off, const size_t size)
+{
+    IOBuffer buf = IOBuffer::Alloc(size);
+    buf.FillRandom();
+
+    INVARIANT(size_t(dev.Write(buf, off / SECTOR, size / SECTOR)) == size);
+    memcpy(&image[off], buf.Ptr(), size);
+}
+
+//................................................................... tests ....
+
+/*
+ * A stream of small appends goes to the device as a few large writes
+ */
+void
+test_wb_append()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-wb.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        CountingDevice counter(dev);
+        vector<uint8_t> image(DEVSIZE, 0);
+
+        Write(dev, image, /*off=*/ 0, DEVSIZE);
+
+        {
+            WriteBackDevice wb(&counter, /*highWater=*/ DEVSIZE, /*writeBackMs=*/ 1000);
+
+            for (size_t off = 0; off < 1024 * 1024; off += SECTOR) {
+                Write(wb, image, off, SECTOR);
+            }
+
+            /*
+             * Dirty data is read back
+             */
+            Verify(wb, image);
+
+            INVARIANT(!Flush(wb));
+            INVARIANT(counter.nwrites_ == 1);
+            INVARIANT(counter.nflushes_ == 1);
+        }
+
+        Verify(dev, image);
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * Overlapping writes all over the device, written back as they pile up
+ */
+void
+test_wb_overlap()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-wb.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        vector<uint8_t> image(DEVSIZE, 0);
+        Write(dev, image, /*off=*/ 0, DEVSIZE);
+
+        {
+            WriteBackDevice wb(&dev, /*highWater=*/ 256 * 1024, /*writeBackMs=*/ 1);
+
+            for (int i = 0; i < 2000; ++i) {
+                const size_t size = ((rand() % 64) + 1) * SECTOR;
+                const size_t off = (rand() % ((DEVSIZE - size) / SECTOR)) * SECTOR;
+
+                Write(wb, image, off, size);
+
+                if (!(i % 500)) {
+                    Verify(wb, image);
+                }
+            }
+
+            Verify(wb, image);
+            INVARIANT(!Flush(wb));
+        }
+
+        Verify(dev, image);
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * Writers committing at the same time share the device flushes
+ */
+class GroupCommitTest : public CompletionHandle
+{
+public:
+
+    static const int NWRITERS = 256;
+
+    GroupCommitTest(BlockDevice & dev) : dev_(dev), pending_(NWRITERS) {}
+
+    void Run()
+    {
+        for (int i = 0; i < NWRITERS; ++i) {
+            bufs_[i] = IOBuffer::Alloc(SECTOR);
+            bufs_[i].Fill('a' + (i % 26));
+
+            int status = dev_.Write(bufs_[i], /*off=*/ i, /*nblks=*/ 1,
+                                    intr_fn(this, &GroupCommitTest::WriteDone));
+            INVARIANT(status == 1);
+        }
+
+        waiter_.Wait();
+    }
+
+    __interrupt__ void WriteDone(int status)
+    {
+        INVARIANT(status == int(SECTOR));
+
+        int ret = dev_.Flush(intr_fn(this, &GroupCommitTest::FlushDone));
+        INVARIANT(ret == 1);
+    }
+
+    __interrupt__ void FlushDone(int status)
+    {
+        INVARIANT(!status);
+
+        if (--pending_ == 0) {
+            waiter_.Done(/*status=*/ 0);
+        }
+    }
+
+private:
+
+    BlockDevice & dev_;
+    IOBuffer bufs_[NWRITERS];
+    atomic<int> pending_;
+    AsyncWait<int> waiter_;
+};
+
+void
+test_wb_group_commit()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-wb.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        CountingDevice counter(dev);
+
+        {
+            WriteBackDevice wb(&counter);
+
+            GroupCommitTest test(wb);
+            test.Run();
+        }
+
+        cout << "flushes: " << GroupCommitTest::NWRITERS
+             << " device flushes: " << counter.nflushes_ << endl;
+
+        INVARIANT(counter.nflushes_ < size_t(GroupCommitTest::NWRITERS));
+
+        for (int i = 0; i < GroupCommitTest::NWRITERS; ++i) {
+            IOBuffer buf = IOBuffer::Alloc(SECTOR);
+            INVARIANT(size_t(Read(dev, buf, i * SECTOR)) == SECTOR);
+
+            for (size_t j = 0; j < SECTOR; ++j) {
+                INVARIANT(buf.Ptr()[j] == uint8_t('a' + (i % 26)));
+            }
+        }
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * Torn down around the time the write-back timer fires
+ */
+void
+test_wb_expire_teardown()
+{
+    BBlocks::Start();
+
+    {
+        LinuxAioProcessor aio;
+        SpinningDevice dev("obj/test-wb.out", DEVSIZE / SECTOR, &aio);
+        INVARIANT(dev.OpenDevice() != -1);
+
+        vector<uint8_t> image(DEVSIZE, 0);
+
+        Write(dev, image, /*off=*/ 0, DEVSIZE);
+
+        for (int i = 0; i < 100; ++i) {
+            WriteBackDevice wb(&dev, /*highWater=*/ DEVSIZE, /*writeBackMs=*/ 1);
+
+            /*
+             * The write arms the timer, the flush leaves it be
+             */
+            Write(wb, image, /*off=*/ i * SECTOR, SECTOR);
+            INVARIANT(!Flush(wb));
+
+            usleep(/*usec=*/ (i * 50) % 2000);
+        }
+
+        Verify(dev, image);
+    }
+
+    BBlocks::Shutdown();
+}
+
+//.................................................................... main ....
+
+int
+main(int argc, char ** argv)
+{
+    InitTestSetup();
+
+    TEST(test_wb_append);
+    TEST(test_wb_overlap);
+    TEST(test_wb_group_commit);
+    TEST(test_wb_expire_teardown);
+
+    TeardownTestSetup();
+
+    return 0;
+}
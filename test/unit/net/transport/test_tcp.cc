@@ -1,11 +1,14 @@
 #include <iostream>
 #include <boost/pointer_cast.hpp>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "test/unit/unit-test.h"
 #include "util.h"
 #include "net/transport/tcp-linux.h"
 #include "net/epoll/mpio-epoll.h"
+#include "net/epoll/reactor-epoll.h"
 #include "async.h"
 
 using namespace std;
@@ -23,11 +26,10 @@ public:
     static const uint32_t WBUFFERSIZE = 4 * 1024;  // 4 KiB
     static const uint32_t TIMEINTERVAL_MS = 1 * 1000;   // 1 s
 
-    BasicTCPTest()
+    BasicTCPTest(FdPoll & epoll)
         : lock_("/tcptest/")
 	, log_("/testtcp/")
-        , epoll_("/epoll")
-	, mpepoll_(/*nth=*/ 2)
+        , epoll_(epoll)
         , tcpServer_(epoll_)
         , tcpClient_(epoll_)
         , addr_(SocketAddress::GetAddr("127.0.0.1", 9999 + (rand() % 100)))
@@ -103,7 +105,12 @@ public:
         ASSERT((size_t) status == rbuf_.Size());
         ASSERT(buf == rbuf_);
 
-        VerifyData(rbuf_);
+        if (!VerifyData(rbuf_)) {
+		/*
+		 * We are shutting down, the server channel can be stopped anytime now
+		 */
+		return;
+	}
 
 	ReadUntilBlocked();
    }
@@ -149,7 +156,12 @@ public:
 
 private: 
 
-    void VerifyData(IOBuffer & buf)
+    /*
+     * Verify the data read and stop the client once all the data is received
+     *
+     * @return  false if we are done reading
+     */
+    bool VerifyData(IOBuffer & buf)
     {
 	Guard _(&lock_);
 
@@ -165,8 +177,10 @@ private:
 	    INFO(log_) << "Stopping client";
             int status = client_ch_->Stop(async_fn(this, &This::ClientStopped));
             INVARIANT(status == 0);
-	    return;
+	    return false;
         }
+
+        return true;
     }
 
     int MBps(uint64_t bytes, uint64_t ms)
@@ -204,8 +218,7 @@ private:
 
     SpinMutex lock_;
     string log_;
-    Epoll epoll_;
-    MultiPathEpoll mpepoll_;
+    FdPoll & epoll_;
     TCPServer tcpServer_;
     TCPConnector tcpClient_;
     sockaddr_in addr_;
@@ -223,7 +236,39 @@ test_tcp_basic()
 {
     BBlocks::Start();
 
-    BasicTCPTest test;
+    Epoll epoll("/epoll");
+    BasicTCPTest test(epoll);
+
+    BBlocks::Schedule(&test, &BasicTCPTest::Start, /*nonce=*/ 0);
+
+    BBlocks::Wait();
+    BBlocks::Shutdown();
+}
+
+void
+test_tcp_multipath()
+{
+    BBlocks::Start();
+
+    MultiPathEpoll epoll(/*nth=*/ 2);
+    BasicTCPTest test(epoll);
+
+    BBlocks::Schedule(&test, &BasicTCPTest::Start, /*nonce=*/ 0);
+
+    BBlocks::Wait();
+    BBlocks::Shutdown();
+}
+
+void
+test_tcp_reactor()
+{
+    BBlocks::Start(SysConf::NumCores(), /*workStealing=*/ false, /*reactor=*/ true);
+
+    /*
+     * The fds are polled by the pool threads
+     */
+    ReactorEpoll epoll;
+    BasicTCPTest test(epoll);
 
     BBlocks::Schedule(&test, &BasicTCPTest::Start, /*nonce=*/ 0);
 
@@ -231,6 +276,779 @@ test_tcp_basic()
     BBlocks::Shutdown();
 }
 
+//............................................................... readahead ....
+
+/*
+ * Messages of a header and a body of any size, read through the read-ahead buffer. Every
+ * third header is peeked at first. The small reads are served from the buffer, the large
+ * bodies go around it.
+ */
+class ReadAheadTest : public CompletionHandle
+{
+public:
+
+    typedef ReadAheadTest This;
+
+    static const uint32_t NMSGS = 500;
+    static const uint32_t MAX_BODY = 3000;
+    static const size_t READ_AHEAD = 4096;
+
+    ReadAheadTest(FdPoll & epoll)
+        : epoll_(epoll)
+        , tcpServer_(epoll_)
+        , tcpClient_(epoll_)
+        , addr_(SocketAddress::GetAddr("127.0.0.1", 10299 + (rand() % 100)))
+        , server_ch_(NULL)
+        , client_ch_(NULL)
+        , hdr_(IOBuffer::Alloc(HDR_SIZE))
+        , state_(PEEK)
+        , nmsgs_(0)
+        , pending_(2)
+    {
+    }
+
+    void Run()
+    {
+        int status = tcpServer_.Accept(SocketAddress::ServerSocketAddr(addr_),
+                                       async_fn(this, &This::HandleServerConn));
+        INVARIANT(status == 0);
+
+        status = tcpClient_.Connect(SocketAddress(addr_),
+                                    async_fn(this, &This::HandleClientConn));
+        INVARIANT(status == 0);
+
+        INVARIANT(!done_.Wait());
+
+        /*
+         * Most of the small reads find their bytes brought in by the recv of a read before
+         */
+        cout << "recv saved: " << server_ch_->RecvSaved() << " msgs: " << NMSGS << endl;
+        INVARIANT(server_ch_->RecvSaved() > NMSGS);
+
+        INVARIANT(!client_ch_->Stop(async_fn(this, &This::ChannelStopped)));
+        INVARIANT(!server_ch_->Stop(async_fn(this, &This::ChannelStopped)));
+        INVARIANT(!stopped_.Wait());
+
+        tcpServer_.Stop(intr_fn(&serverStopped_, &AsyncWait<int>::Done));
+        INVARIANT(!serverStopped_.Wait());
+
+        tcpClient_.Stop(intr_fn(&clientStopped_, &AsyncWait<int>::Done));
+        INVARIANT(!clientStopped_.Wait());
+    }
+
+    void DeleteChannels()
+    {
+        delete client_ch_;
+        delete server_ch_;
+    }
+
+    __completion_handler__
+    void HandleServerConn(int status, UnicastTransportChannel * ch)
+    {
+        INVARIANT(status == 0);
+
+        server_ch_ = dynamic_cast<TCPChannel *>(ch);
+        server_ch_->SetReadAhead(READ_AHEAD);
+
+        ReadNext();
+    }
+
+    __completion_handler__
+    void HandleClientConn(int status, UnicastTransportChannel * ch)
+    {
+        INVARIANT(status == 0);
+
+        client_ch_ = dynamic_cast<TCPChannel *>(ch);
+
+        /*
+         * All the messages with one write, the reads are to cut them up
+         */
+        vector<uint8_t> data;
+
+        for (uint32_t seq = 0; seq < NMSGS; ++seq) {
+            const uint32_t len = (rand() % MAX_BODY) + 1;
+
+            data.insert(data.end(), (uint8_t *) &len, (uint8_t *) &len + sizeof(len));
+            data.insert(data.end(), (uint8_t *) &seq, (uint8_t *) &seq + sizeof(seq));
+
+            for (uint32_t i = 0; i < len; ++i) {
+                data.push_back(uint8_t(seq + i));
+            }
+        }
+
+        wbuf_ = IOBuffer::Alloc(data.size());
+        memcpy(wbuf_.Ptr(), &data[0], data.size());
+
+        status = client_ch_->Write(wbuf_, async_fn(this, &This::WriteDone));
+        INVARIANT(status >= 0 && status <= (int) wbuf_.Size());
+    }
+
+    __completion_handler__
+    void WriteDone(int status, IOBuffer buf)
+    {
+        INVARIANT(status == (int) wbuf_.Size());
+    }
+
+    __completion_handler__
+    void ReadDone(int status, IOBuffer buf)
+    {
+        INVARIANT(status == (int) buf.Size());
+
+        Consume(buf);
+        ReadNext();
+    }
+
+    __completion_handler__
+    void ChannelStopped(int status)
+    {
+        if (--pending_ == 0) {
+            stopped_.Done(/*status=*/ 0);
+        }
+    }
+
+private:
+
+    static const size_t HDR_SIZE = 2 * sizeof(uint32_t);
+
+    enum State
+    {
+        PEEK = 0,
+        HEADER,
+        BODY,
+    };
+
+    void ReadNext()
+    {
+        while (nmsgs_ < NMSGS) {
+            IOBuffer & buf = (state_ == BODY) ? body_ : hdr_;
+
+            auto h = async_fn(this, &This::ReadDone);
+            int status = (state_ == PEEK) ? server_ch_->Peek(buf, h)
+                                          : server_ch_->Read(buf, h);
+            INVARIANT(status >= 0 && status <= (int) buf.Size());
+
+            if (status != (int) buf.Size()) {
+                /*
+                 * Continues in ReadDone
+                 */
+                return;
+            }
+
+            Consume(buf);
+        }
+
+        done_.Done(/*status=*/ 0);
+    }
+
+    void Consume(IOBuffer & buf)
+    {
+        uint32_t len;
+        uint32_t seq;
+
+        switch (state_) {
+        case PEEK:
+            memcpy(&peeked_, buf.Ptr(), HDR_SIZE);
+            state_ = HEADER;
+            return;
+
+        case HEADER:
+            memcpy(&len, buf.Ptr(), sizeof(len));
+            memcpy(&seq, buf.Ptr() + sizeof(len), sizeof(seq));
+
+            INVARIANT(seq == nmsgs_ && len && len <= MAX_BODY);
+            INVARIANT((nmsgs_ % 3) || !memcmp(&peeked_, buf.Ptr(), HDR_SIZE));
+
+            body_ = IOBuffer::Alloc(len);
+            state_ = BODY;
+            return;
+
+        case BODY:
+            for (size_t i = 0; i < buf.Size(); ++i) {
+                INVARIANT(buf.Ptr()[i] == uint8_t(nmsgs_ + i));
+            }
+
+            ++nmsgs_;
+            state_ = (nmsgs_ % 3) ? HEADER : PEEK;
+            return;
+        }
+
+        DEADEND
+    }
+
+    FdPoll & epoll_;
+    TCPServer tcpServer_;
+    TCPConnector tcpClient_;
+    sockaddr_in addr_;
+    TCPChannel * server_ch_;
+    TCPChannel * client_ch_;
+    IOBuffer wbuf_;
+    IOBuffer hdr_;
+    IOBuffer body_;
+    State state_;
+    uint64_t peeked_;
+    uint32_t nmsgs_;
+    atomic<int> pending_;
+    AsyncWait<int> done_;
+    AsyncWait<int> stopped_;
+    AsyncWait<int> serverStopped_;
+    AsyncWait<int> clientStopped_;
+};
+
+void
+test_tcp_read_ahead()
+{
+    BBlocks::Start();
+
+    Epoll epoll("/epoll");
+    ReadAheadTest test(epoll);
+
+    test.Run();
+
+    BBlocks::Shutdown();
+
+    test.DeleteChannels();
+}
+
+//............................................................... shardedtcp ....
+
+/*
+ * A burst of connections against a listener per poller. The connections stay on the
+ * poller they were accepted on. With no cpus the kernel spreads them across all of the
+ * listeners, else by the cpu they come in on.
+ */
+class ShardedTCPTest : public CompletionHandle
+{
+public:
+
+    typedef ShardedTCPTest This;
+
+    static const int NCONNS = 64;
+    static const size_t NPOLLTH = 4;
+
+    ShardedTCPTest(MultiPathEpoll & epoll, FdPoll & clientEpoll,
+                   const vector<int> & cpus = vector<int>())
+        : lock_("/shardedtcptest/")
+        , epoll_(epoll)
+        , tcpServer_(epoll.Pollers(), cpus)
+        , tcpClient_(clientEpoll)
+        , addr_(SocketAddress::GetAddr("127.0.0.1", 10199 + (rand() % 100)))
+        , pending_(2 * NCONNS)
+    {
+    }
+
+    void Run()
+    {
+        int status = tcpServer_.Accept(SocketAddress::ServerSocketAddr(addr_),
+                                       async_fn(this, &This::HandleServerConn));
+        INVARIANT(status == 0);
+
+        for (int i = 0; i < NCONNS; ++i) {
+            status = tcpClient_.Connect(SocketAddress(addr_),
+                                        async_fn(this, &This::HandleClientConn));
+            INVARIANT(status == 0);
+        }
+
+        INVARIANT(!waiter_.Wait());
+
+        /*
+         * Listener and connections of every shard
+         */
+        size_t nfds = 0;
+
+        for (auto & load : epoll_.Loads()) {
+            cout << "shard fds: " << load.nfds_ << endl;
+
+            nfds += load.nfds_;
+            shardFds_.push_back(load.nfds_);
+        }
+
+        INVARIANT(nfds == NPOLLTH + NCONNS);
+
+        pending_ = 2 * NCONNS;
+
+        for (auto ch : channels_) {
+            status = ch->Stop(async_fn(this, &This::ChannelStopped));
+            INVARIANT(status == 0);
+        }
+
+        INVARIANT(!stopped_.Wait());
+
+        tcpServer_.Stop(intr_fn(&serverStopped_, &AsyncWait<int>::Done));
+        INVARIANT(!serverStopped_.Wait());
+
+        tcpClient_.Stop(intr_fn(&clientStopped_, &AsyncWait<int>::Done));
+        INVARIANT(!clientStopped_.Wait());
+    }
+
+    /*
+     * The channels can be on their way out of the stop barrier until the threads are gone
+     */
+    void DeleteChannels()
+    {
+        for (auto ch : channels_) {
+            delete ch;
+        }
+
+        channels_.clear();
+    }
+
+    /*
+     * Fds on each shard once all of the connections are up
+     */
+    vector<size_t> shardFds_;
+
+    __completion_handler__
+    void HandleServerConn(int status, UnicastTransportChannel * ch)
+    {
+        INVARIANT(status == 0);
+        Done(ch);
+    }
+
+    __completion_handler__
+    void HandleClientConn(int status, UnicastTransportChannel * ch)
+    {
+        INVARIANT(status == 0);
+        Done(ch);
+    }
+
+    __completion_handler__
+    void ChannelStopped(int status)
+    {
+        if (--pending_ == 0) {
+            stopped_.Done(/*status=*/ 0);
+        }
+    }
+
+private:
+
+    void Done(UnicastTransportChannel * ch)
+    {
+        {
+            Guard _(&lock_);
+            channels_.push_back(ch);
+        }
+
+        if (--pending_ == 0) {
+            waiter_.Done(/*status=*/ 0);
+        }
+    }
+
+    SpinMutex lock_;
+    MultiPathEpoll & epoll_;
+    TCPServer tcpServer_;
+    TCPConnector tcpClient_;
+    sockaddr_in addr_;
+    vector<UnicastTransportChannel *> channels_;
+    atomic<int> pending_;
+    AsyncWait<int> waiter_;
+    AsyncWait<int> stopped_;
+    AsyncWait<int> serverStopped_;
+    AsyncWait<int> clientStopped_;
+};
+
+void
+test_tcp_sharded()
+{
+    BBlocks::Start();
+
+    MultiPathEpoll epoll(ShardedTCPTest::NPOLLTH, "/sharded/");
+    Epoll clientEpoll("/sharded/client");
+    ShardedTCPTest test(epoll, clientEpoll);
+
+    test.Run();
+
+    size_t nshards = 0;
+
+    for (auto nfds : test.shardFds_) {
+        nshards += (nfds > 1);
+    }
+
+    INVARIANT(nshards > 1);
+
+    BBlocks::Shutdown();
+
+    test.DeleteChannels();
+}
+
+/*
+ * The connections are made from this thread pinned to a cpu, which only the listener of
+ * shard 1 asks for. They all land there, unless there is no other cpu to tell it apart.
+ */
+void
+test_tcp_steer_cpu()
+{
+    cpu_set_t saved;
+    int status = pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+    INVARIANT(!status);
+
+    vector<int> usable;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &saved)) {
+            usable.push_back(cpu);
+        }
+    }
+
+    INVARIANT(!usable.empty());
+
+    const int cpu = usable.front();
+    const int other = usable.back();
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    status = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    INVARIANT(!status);
+
+    BBlocks::Start();
+
+    vector<int> cpus(ShardedTCPTest::NPOLLTH, other);
+    cpus[1] = cpu;
+
+    MultiPathEpoll epoll(ShardedTCPTest::NPOLLTH, "/steered/");
+    Epoll clientEpoll("/steered/client");
+    ShardedTCPTest test(epoll, clientEpoll, cpus);
+
+    test.Run();
+
+    if (cpu != other) {
+        INVARIANT(test.shardFds_[1] == 1 + ShardedTCPTest::NCONNS);
+    }
+
+    BBlocks::Shutdown();
+
+    test.DeleteChannels();
+
+    status = pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    INVARIANT(!status);
+}
+
+//................................................................... epoll ....
+
+/*
+ * Routines adding and removing fds that fire all the time. No handler is to run once
+ * Remove returns.
+ */
+class EpollChurnTest : public CompletionHandle
+{
+public:
+
+    static const int NROUTINES = 4;
+    static const int NITERATIONS = 2000;
+    static const int MAX_FD = 64 * 1024;
+
+    EpollChurnTest(FdPoll & epoll)
+        : epoll_(epoll), pending_(NROUTINES), nevents_(0)
+    {
+        for (int i = 0; i < MAX_FD; ++i) {
+            live_[i] = false;
+        }
+    }
+
+    void Run()
+    {
+        for (int i = 0; i < NROUTINES; ++i) {
+            BBlocks::Schedule(this, &EpollChurnTest::Churn, /*nonce=*/ i);
+        }
+
+        INVARIANT(!waiter_.Wait());
+
+        cout << "events: " << nevents_ << endl;
+    }
+
+    void Churn(int nonce)
+    {
+        for (int i = 0; i < NITERATIONS; ++i) {
+            const int fd = eventfd(/*initval=*/ 1, EFD_NONBLOCK);
+            INVARIANT(fd != -1 && fd < MAX_FD);
+
+            live_[fd] = true;
+            INVARIANT(epoll_.Add(fd, EPOLLIN, intr_fn(this, &EpollChurnTest::Handle)));
+
+            if (i % 2) {
+                INVARIANT(epoll_.RemoveEvent(fd, EPOLLIN));
+                INVARIANT(epoll_.AddEvent(fd, EPOLLIN));
+            }
+
+            INVARIANT(epoll_.Remove(fd));
+            live_[fd] = false;
+
+            ::close(fd);
+        }
+
+        if (--pending_ == 0) {
+            waiter_.Done(/*status=*/ 0);
+        }
+    }
+
+    __interrupt__ void Handle(int fd, uint32_t events)
+    {
+        INVARIANT(live_[fd]);
+        nevents_++;
+    }
+
+private:
+
+    FdPoll & epoll_;
+    atomic<bool> live_[MAX_FD];
+    atomic<int> pending_;
+    atomic<size_t> nevents_;
+    AsyncWait<int> waiter_;
+};
+
+void
+test_epoll_churn()
+{
+    BBlocks::Start();
+
+    {
+        Epoll epoll("/epoll");
+        EpollChurnTest * test = new EpollChurnTest(epoll);
+        test->Run();
+        delete test;
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * The handlers of two pollers remove each other's fds while both of them fire. Neither
+ * is to wait for the other.
+ */
+class CrossRemoveTest : public CompletionHandle
+{
+public:
+
+    static const int NROUNDS = 500;
+
+    CrossRemoveTest(FdPoll & a, FdPoll & b)
+        : pending_(0), round_(NULL)
+    {
+        pollers_[0] = &a;
+        pollers_[1] = &b;
+    }
+
+    void Run()
+    {
+        for (int i = 0; i < NROUNDS; ++i) {
+            AsyncWait<int> round;
+
+            round_ = &round;
+            pending_ = 2;
+
+            for (int j = 0; j < 2; ++j) {
+                claimed_[j] = false;
+                fds_[j] = eventfd(/*initval=*/ 0, EFD_NONBLOCK);
+                INVARIANT(fds_[j] != -1);
+            }
+
+            for (int j = 0; j < 2; ++j) {
+                INVARIANT(pollers_[j]->Add(fds_[j], EPOLLIN,
+                                           intr_fn(this, &CrossRemoveTest::Handle)));
+            }
+
+            /*
+             * Both of them are in before either fires
+             */
+            for (int j = 0; j < 2; ++j) {
+                const uint64_t val = 1;
+                INVARIANT(::write(fds_[j], &val, sizeof(val)) == sizeof(val));
+            }
+
+            INVARIANT(!round.Wait());
+
+            for (int j = 0; j < 2; ++j) {
+                ::close(fds_[j]);
+            }
+        }
+    }
+
+    __interrupt__ void Handle(int fd, uint32_t events)
+    {
+        const int self = (fd == fds_[1]);
+
+        Claim(1 - self);
+        Claim(self);
+    }
+
+    __interrupt__ void Removed(int status)
+    {
+        INVARIANT(!status);
+
+        if (--pending_ == 0) {
+            round_->Done(/*status=*/ 0);
+        }
+    }
+
+private:
+
+    void Claim(const int j)
+    {
+        if (!claimed_[j].exchange(true)) {
+            INVARIANT(pollers_[j]->Remove(fds_[j], intr_fn(this, &CrossRemoveTest::Removed)));
+        }
+    }
+
+    FdPoll * pollers_[2];
+    int fds_[2];
+    atomic<bool> claimed_[2];
+    atomic<int> pending_;
+    AsyncWait<int> * round_;
+};
+
+void
+test_epoll_cross_remove()
+{
+    BBlocks::Start();
+
+    {
+        Epoll a("/cross/a");
+        Epoll b("/cross/b");
+
+        CrossRemoveTest test(a, b);
+        test.Run();
+    }
+
+    BBlocks::Shutdown();
+
+    BBlocks::Start(SysConf::NumCores(), /*workStealing=*/ false, /*reactor=*/ true);
+
+    {
+        ReactorEpoll epoll;
+
+        CrossRemoveTest test(epoll, epoll);
+        test.Run();
+    }
+
+    BBlocks::Shutdown();
+}
+
+/*
+ * New fds go to the idle Epoll, a busy fd is moved off an overloaded one and keeps
+ * firing where it lands
+ */
+class EpollPlacementTest : public CompletionHandle
+{
+public:
+
+    static const int MAX_FD = 64 * 1024;
+    static const int PERIOD_US = 2000;
+    static const int SPIN_US = 800;
+
+    EpollPlacementTest(MultiPathEpoll & epoll) : epoll_(epoll)
+    {
+        for (int i = 0; i < MAX_FD; ++i) {
+            nevents_[i] = 0;
+        }
+    }
+
+    void Run()
+    {
+        /*
+         * Busy fds end up on Epoll 0, quiet ones on Epoll 1
+         */
+        const int hot1 = AddFd();
+        AddFd();
+        const int hot2 = AddFd();
+        AddFd();
+
+        Kick(hot1);
+        Kick(hot2);
+
+        usleep(300 * 1000);
+
+        vector<Epoll::LoadStats> loads = epoll_.Loads();
+        cout << "busy: " << loads[0].busy_ << " " << loads[1].busy_ << endl;
+        INVARIANT(loads[0].busy_ > loads[1].busy_ + MultiPathEpoll::IMBALANCE);
+
+        AddFd();
+        AddFd();
+
+        loads = epoll_.Loads();
+        INVARIANT(loads[0].nfds_ == 2 && loads[1].nfds_ == 4);
+
+        /*
+         * One of the busy fds moves, the handler could be running at any one attempt
+         */
+        int attempts = 0;
+        while (!epoll_.Rebalance()) {
+            INVARIANT(++attempts < 1000);
+            usleep(1000);
+        }
+
+        loads = epoll_.Loads();
+        INVARIANT(loads[0].nfds_ == 1 && loads[1].nfds_ == 5);
+
+        const size_t n1 = nevents_[hot1];
+        const size_t n2 = nevents_[hot2];
+
+        usleep(100 * 1000);
+
+        INVARIANT(nevents_[hot1] > n1 && nevents_[hot2] > n2);
+
+        for (auto fd : fds_) {
+            INVARIANT(epoll_.Remove(fd));
+            ::close(fd);
+        }
+    }
+
+    __interrupt__ void Handle(int fd, uint32_t events)
+    {
+        uint64_t expirations;
+        if (::read(fd, &expirations, sizeof(expirations)) == -1) {
+            INVARIANT(errno == EAGAIN);
+            return;
+        }
+
+        nevents_[fd]++;
+
+        const uint64_t end = Rdtsc::rdtsc() + System::GetHz() / (1000 * 1000) * SPIN_US;
+        while (Rdtsc::rdtsc() < end);
+    }
+
+private:
+
+    int AddFd()
+    {
+        const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        INVARIANT(fd != -1 && fd < MAX_FD);
+
+        INVARIANT(epoll_.Add(fd, EPOLLIN, intr_fn(this, &EpollPlacementTest::Handle)));
+        fds_.push_back(fd);
+
+        return fd;
+    }
+
+    void Kick(const int fd)
+    {
+        struct itimerspec ts;
+        ts.it_interval.tv_sec = 0;
+        ts.it_interval.tv_nsec = PERIOD_US * 1000;
+        ts.it_value = ts.it_interval;
+
+        INVARIANT(timerfd_settime(fd, /*flags=*/ 0, &ts, /*old=*/ NULL) != -1);
+    }
+
+    MultiPathEpoll & epoll_;
+    vector<int> fds_;
+    atomic<size_t> nevents_[MAX_FD];
+};
+
+void
+test_mpepoll_placement()
+{
+    BBlocks::Start();
+
+    {
+        MultiPathEpoll epoll(/*npollth=*/ 2, "/mpepoll/");
+        EpollPlacementTest * test = new EpollPlacementTest(epoll);
+        test->Run();
+        delete test;
+    }
+
+    BBlocks::Shutdown();
+}
+
 //.................................................................... main ....
 
 int
@@ -241,6 +1059,14 @@ main(int argc, char ** argv)
     InitTestSetup();
 
     TEST(test_tcp_basic);
+    TEST(test_tcp_multipath);
+    TEST(test_tcp_reactor);
+    TEST(test_tcp_sharded);
+    TEST(test_tcp_steer_cpu);
+    TEST(test_tcp_read_ahead);
+    TEST(test_epoll_churn);
+    TEST(test_epoll_cross_remove);
+    TEST(test_mpepoll_placement);
 
     TeardownTestSetup();
 
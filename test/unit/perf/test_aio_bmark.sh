@@ -6,21 +6,40 @@ LOGFILE=/tmp/log
 
 iosizes=( 512 8192 )
 qdepths=( 16 32 )
+backends=( aio )
+
+if $BMARK --uring-supported; then
+	backends+=( uring )
+else
+	echo "** io_uring not supported by the kernel, skipping backend uring"
+fi
 
 rm -f $LOGFILE
 fallocate -l 1G /tmp/disk
 
-for iosize in ${iosizes[@]}; do
-	for qdepth in ${qdepths[@]}; do
-		echo "** Testing iosize $iosize B qdepth $qdepth"
-
-		$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype write \
-			--iopattern seq --qdepth $qdepth --s 5 >> $LOGFILE 2>&1 || exit -1
-		$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype write \
-			--iopattern random --qdepth $qdepth --s 5 >> $LOGFILE 2>&1 || exit -1
-		$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype read \
-			--iopattern seq --qdepth $qdepth --s 5 >> $LOGFILE 2>&1 || exit -1
-		$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype read \
-			--iopattern random --qdepth $qdepth --s 5 >> $LOGFILE 2>&1 || exit -1
+for backend in ${backends[@]}; do
+	for iosize in ${iosizes[@]}; do
+		for qdepth in ${qdepths[@]}; do
+			echo "** Testing backend $backend iosize $iosize B qdepth $qdepth"
+
+			$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype write \
+				--iopattern seq --qdepth $qdepth --s 5 --backend $backend >> $LOGFILE 2>&1 || exit -1
+			$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype write \
+				--iopattern random --qdepth $qdepth --s 5 --backend $backend >> $LOGFILE 2>&1 || exit -1
+			$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype read \
+				--iopattern seq --qdepth $qdepth --s 5 --backend $backend >> $LOGFILE 2>&1 || exit -1
+			$BMARK --devpath /tmp/disk --devsize 1 --iosize $iosize --iotype read \
+				--iopattern random --qdepth $qdepth --s 5 --backend $backend >> $LOGFILE 2>&1 || exit -1
+		done
 	done
 done
+
+echo "** Testing scaling with ncpu"
+
+$BMARK --devpath /tmp/disk --devsize 1 --iosize 4096 --iotype write \
+	--iopattern random --qdepth 64 --s 5 --scale >> $LOGFILE 2>&1 || exit -1
+
+echo "** Testing reactor mode"
+
+$BMARK --devpath /tmp/disk --devsize 1 --iosize 4096 --iotype read \
+	--iopattern random --qdepth 64 --s 5 --reactor >> $LOGFILE 2>&1 || exit -1
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+OBJDIR=obj
+BMARK=$OBJDIR/test/perf/net/bmark_mpepoll
+LOGFILE=/tmp/log
+
+rm -f $LOGFILE
+
+echo "** Testing scaling with npollth"
+
+$BMARK --nfds 64 --s 2 >> $LOGFILE 2>&1 || exit -1
+
+tail -n 20 $LOGFILE
@@ -7,8 +7,8 @@ from logger import *
 from thread_pool import *
 
 cdef extern from "schd/thread-pool.h" namespace "dh_core":
-    cdef cppclass FnPtr1[T]:
-        FnPtr1(void (*fn)(T), T)
+    cdef cppclass FnPtr[T]:
+        FnPtr(void (*fn)(T), T)
 
     cdef cppclass ThreadRoutine:
         void Run()
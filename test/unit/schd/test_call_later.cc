@@ -110,6 +110,143 @@ public:
 	int prevmsec_;
 };
 
+// ............................................................................. TestMicroSec ....
+
+class TestMicroSec
+{
+public:
+
+	static const int MAX_MSG = 5000;
+	static const int STEP_US = 37;
+
+	TestMicroSec() : prevusec_(0) {}
+
+	void Start(int)
+	{
+		/*
+		 * Arm the timers from the worker, so they go on its own wheel
+		 */
+		for (int i = 1; i <= MAX_MSG; i++) {
+			BBlocks::ScheduleInMicroSec(/*usec=*/ i * STEP_US, this,
+						    &TestMicroSec::Called, Time::NowInMicroSec(),
+						    /*arg=*/ i * STEP_US);
+		}
+	}
+
+	void Called(uint64_t start, int usec)
+	{
+		DEBUG(_log) << "Called. usec=" << usec;
+
+		INVARIANT(Time::NowInMicroSec() >= start + usec);
+		INVARIANT(prevusec_ + STEP_US == usec);
+
+		prevusec_ = usec;
+
+		if (usec == MAX_MSG * STEP_US) {
+		    BBlocks::Wakeup();
+		}
+	}
+
+	static void Run()
+	{
+		BBlocks::Start(/*ncpu=*/ 1);
+
+		TestMicroSec t;
+		BBlocks::Schedule(&t, &TestMicroSec::Start, /*nonce=*/ 0);
+
+		BBlocks::Wait();
+		BBlocks::Shutdown();
+	}
+
+	int prevusec_;
+};
+
+// ............................................................................... TestCancel ....
+
+class TestCancel
+{
+public:
+
+	static const int MAX_MSG = 1000;
+
+	TestCancel() : count_(0) {}
+
+	void Start(int)
+	{
+		for (int i = 0; i < MAX_MSG; i++) {
+			handles_[i] = BBlocks::ScheduleIn(/*msec=*/ 1 + (i % 10), this,
+							  &TestCancel::Called, i);
+		}
+
+		/*
+		 * Cancel every other timer
+		 */
+		for (int i = 1; i < MAX_MSG; i += 2) {
+			INVARIANT(handles_[i].Cancel());
+			INVARIANT(!handles_[i].Cancel());
+		}
+
+		BBlocks::ScheduleIn(/*msec=*/ 50, this, &TestCancel::Done, /*nonce=*/ 0);
+	}
+
+	void Called(int i)
+	{
+		INVARIANT(!(i % 2));
+		count_++;
+	}
+
+	void Done(int)
+	{
+		INVARIANT(count_ == MAX_MSG / 2);
+
+		/*
+		 * Fired timers can't be cancelled
+		 */
+		for (int i = 0; i < MAX_MSG; i += 2) {
+			INVARIANT(!handles_[i].Cancel());
+		}
+
+		BBlocks::Wakeup();
+	}
+
+	static void Run()
+	{
+		BBlocks::Start(/*ncpu=*/ 1);
+
+		TestCancel t;
+		BBlocks::Schedule(&t, &TestCancel::Start, /*nonce=*/ 0);
+		BBlocks::Wait();
+
+		/*
+		 * Cancel from outside of the pool, the timer is still in flight or on the wheel
+		 */
+		for (int i = 0; i < MAX_MSG; i++) {
+			t.handles_[i] = BBlocks::ScheduleIn(/*msec=*/ 60 * 1000, &t,
+							    &TestCancel::Called, i);
+		}
+
+		for (int i = 0; i < MAX_MSG; i++) {
+			INVARIANT(t.handles_[i].Cancel());
+		}
+
+		/*
+		 * They are taken off the wheel at its next tick, not when they come due
+		 */
+		BBlocks::ScheduleIn(/*msec=*/ 10, &t, &TestCancel::CheckWheel, /*nonce=*/ 0);
+		BBlocks::Wait();
+
+		BBlocks::Shutdown();
+	}
+
+	void CheckWheel(int)
+	{
+		INVARIANT(!NonBlockingThread::current_->NumTimers());
+		BBlocks::Wakeup();
+	}
+
+	TimerHandle handles_[MAX_MSG];
+	atomic<int> count_;
+};
 
 //........................................................................................ main ....
 
@@ -120,6 +257,8 @@ main(int argc, char ** argv)
 
     TEST(TestBasicCase::Run);
     TEST(TestParallel::Run);
+    TEST(TestMicroSec::Run);
+    TEST(TestCancel::Run);
 
     TeardownTestSetup();
 
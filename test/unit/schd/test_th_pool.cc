@@ -1,6 +1,8 @@
 #include <iostream>
+#include <set>
 
 #include "bblocks.h"
+#include "async.h"
 #include "buf/bufpool.h"
 #include "test/unit/unit-test.h"
 
@@ -56,6 +58,189 @@ bufferpool_test()
     BBlocks::Shutdown();
 }
 
+void
+sizeclass_test()
+{
+    /*
+     * Every size maps to the smallest class it fits in
+     */
+    for (size_t size = 1; size <= SizeClass::MAX_SIZE; ++size) {
+	const size_t cls = SizeClass::Class(size);
+
+	INVARIANT(cls < SizeClass::NCLASSES);
+	INVARIANT(SizeClass::Size(cls) >= size);
+	INVARIANT(!cls || SizeClass::Size(cls - 1) < size);
+	INVARIANT(cls < 4 || SizeClass::Size(cls) * 4 <= SizeClass::Size(cls - 1) * 5);
+    }
+
+    INVARIANT(SizeClass::Class(SizeClass::MAX_SIZE + 1) == SizeClass::NCLASSES);
+
+    /*
+     * Blocks honour the default and the requested alignment
+     */
+    BBlocks::Start();
+
+    struct alignas(512) SectorObject { uint8_t data_[100]; };
+    struct alignas(4096) PageObject { uint8_t data_[100]; };
+
+    for (int i = 0; i < 10; ++i) {
+	void * o = BufferPool::Alloc<TestObject>();
+	void * s = BufferPool::Alloc<SectorObject>();
+	void * p = BufferPool::Alloc<PageObject>();
+
+	INVARIANT(!((uintptr_t) o % SizeClass::Align(BufferPool::Class<TestObject>(), 0)));
+	INVARIANT(!((uintptr_t) s % 512));
+	INVARIANT(!((uintptr_t) p % 4096));
+
+	BufferPool::Dalloc((TestObject *) o);
+	BufferPool::Dalloc((SectorObject *) s);
+	BufferPool::Dalloc((PageObject *) p);
+    }
+
+    BBlocks::Shutdown();
+}
+
+void
+freelist_test()
+{
+    static const int MAX_OBJECTS = 100;
+
+    BBlocks::Start();
+
+    const FreeList & pool = BufferPool::Pool<TestObject>();
+    const int64_t inuse = pool.ninuse_;
+
+    TestObject * o[MAX_OBJECTS];
+    for (int i = 0; i < MAX_OBJECTS; ++i) {
+	o[i] = new (BufferPool::Alloc<TestObject>()) TestObject();
+    }
+
+    INVARIANT(pool.ninuse_ == inuse + MAX_OBJECTS);
+    INVARIANT(pool.highwater_ >= pool.ninuse_);
+
+    for (int i = 0; i < MAX_OBJECTS; ++i) {
+	BufferPool::Dalloc(o[i]);
+    }
+
+    INVARIANT(pool.ninuse_ == inuse);
+    INVARIANT(pool.nfree_ >= (size_t) MAX_OBJECTS);
+
+    /*
+     * The blocks are reused in LIFO order
+     */
+    for (int i = MAX_OBJECTS - 1; i >= 0; --i) {
+	TestObject * p = new (BufferPool::Alloc<TestObject>()) TestObject();
+	INVARIANT(p == o[i]);
+    }
+
+    for (int i = 0; i < MAX_OBJECTS; ++i) {
+	BufferPool::Dalloc(o[i]);
+    }
+
+    BBlocks::Shutdown();
+}
+
+struct RemoteFreeTest
+{
+    static const int MAX_OBJECTS = 100;
+
+    void Dalloc(int)
+    {
+	/*
+	 * Free on a pool thread, the blocks go back to the main thread
+	 */
+	for (int i = 0; i < MAX_OBJECTS; ++i) {
+	    BufferPool::Dalloc(o_[i]);
+	}
+
+	BBlocks::Wakeup();
+    }
+
+    TestObject * o_[MAX_OBJECTS];
+};
+
+void
+remotefree_test()
+{
+    BBlocks::Start();
+
+    const FreeList & pool = BufferPool::Pool<TestObject>();
+    const int64_t inuse = pool.ninuse_;
+
+    RemoteFreeTest test;
+    set<TestObject *> blocks;
+    for (int i = 0; i < RemoteFreeTest::MAX_OBJECTS; ++i) {
+	test.o_[i] = new (BufferPool::Alloc<TestObject>()) TestObject();
+	blocks.insert(test.o_[i]);
+    }
+
+    BBlocks::Schedule(&test, &RemoteFreeTest::Dalloc, /*nonce=*/ 0);
+    BBlocks::Wait();
+
+    /*
+     * Allocations are served from the blocks that came back
+     */
+    for (int i = 0; i < RemoteFreeTest::MAX_OBJECTS; ++i) {
+	TestObject * o = new (BufferPool::Alloc<TestObject>()) TestObject();
+	INVARIANT(blocks.erase(o));
+	test.o_[i] = o;
+    }
+
+    INVARIANT(pool.ninuse_ == inuse + RemoteFreeTest::MAX_OBJECTS);
+
+    for (int i = 0; i < RemoteFreeTest::MAX_OBJECTS; ++i) {
+	BufferPool::Dalloc(test.o_[i]);
+    }
+
+    INVARIANT(pool.ninuse_ == inuse);
+
+    BBlocks::Shutdown();
+}
+
+void
+trim_test()
+{
+    static const int MAX_OBJECTS = 100;
+
+    BlockHeap * heap = new BlockHeap();
+    FreeList & l = heap->lists_[0];
+
+    void * o[MAX_OBJECTS];
+    for (int i = 0; i < MAX_OBJECTS; ++i) {
+	o[i] = l.Alloc(/*size=*/ 16, /*align=*/ 16);
+    }
+
+    for (int i = 0; i < MAX_OBJECTS / 2; ++i) {
+	l.Dalloc(o[i]);
+    }
+
+    /*
+     * Nothing is trimmed while we are within the working set
+     */
+    INVARIANT(!l.Trim(/*max=*/ MAX_OBJECTS));
+    INVARIANT(l.nfree_ == MAX_OBJECTS / 2);
+
+    for (int i = MAX_OBJECTS / 2; i < MAX_OBJECTS; ++i) {
+	l.Dalloc(o[i]);
+    }
+
+    /*
+     * With nothing in use the working set decays, the excess goes away a little at a time
+     * and never more than asked for
+     */
+    size_t prev = l.nfree_;
+    while (l.nfree_) {
+	INVARIANT(l.Trim(/*max=*/ 4) <= 4);
+	INVARIANT(l.nfree_ <= prev);
+	prev = l.nfree_;
+    }
+
+    INVARIANT(!l.ninuse_);
+    INVARIANT(l.highwater_ == MAX_OBJECTS);
+
+    heap->Release(/*thread=*/ 1);
+}
+
 //.................................................................................. SimpleTest ....
 
 struct PingPong
@@ -165,14 +350,366 @@ parallel_test()
     slaves.clear();
 }
 
+//........................................................................... WorkStealingTest ....
+
+struct FanOut
+{
+	typedef FanOut This;
+
+	static const int MAX_CALLS = 4 * 1024;
+
+	static const uint32_t WORK_US = 20;
+
+	FanOut() : count_(0), origin_(0), nstolen_(0) {}
+
+	void Start(int)
+	{
+		origin_ = NonBlockingThread::current_->Id();
+
+		/*
+		 * Scheduled from a pool thread, so they land in the local deque and overflow
+		 * to the shared queue
+		 */
+		for (int i = 0; i < MAX_CALLS; ++i) {
+			BBlocks::Schedule(this, &This::Run, i);
+		}
+	}
+
+	void Run(int)
+	{
+		/*
+		 * Only the thread that scheduled it runs it unless it was stolen
+		 */
+		if (NonBlockingThread::current_->Id() != origin_) {
+			++nstolen_;
+		}
+
+		/*
+		 * Keep the thread busy for long enough for the others to get a go at the deque
+		 */
+		const uint64_t end = Rdtsc::rdtsc() + System::GetHz() / (1000 * 1000) * WORK_US;
+		while (Rdtsc::rdtsc() < end);
+
+		if (++count_ == MAX_CALLS) {
+			done_.Done(nstolen_);
+		}
+	}
+
+	atomic<int> count_;
+	uint32_t origin_;
+	atomic<int> nstolen_;
+	AsyncWait<int> done_;
+};
+
+void
+workstealing_test()
+{
+	BBlocks::Start(SysConf::NumCores(), /*workStealing=*/ true);
+
+	PingPong ping;
+	PingPong pong;
+
+	BBlocks::Schedule(&ping, &PingPong::Run, &pong);
+	BBlocks::Wait();
+
+	/*
+	 * Waited on by itself, a pool that is still busy can finish before we get to
+	 * BBlocks::Wait()
+	 */
+	FanOut fanout;
+	BBlocks::Schedule(&fanout, &FanOut::Start, /*nonce=*/ 0);
+	const int nstolen = fanout.done_.Wait();
+
+	INVARIANT(fanout.count_ == FanOut::MAX_CALLS);
+
+	/*
+	 * Somebody has to be around to steal
+	 */
+	INVARIANT(SysConf::NumCores() == 1 || nstolen > 0);
+
+	BBlocks::Shutdown();
+}
+
+//................................................................................ ForwardTest ....
+
+struct CopyCounter
+{
+	CopyCounter() {}
+	CopyCounter(const CopyCounter &) { ++ncopies_; }
+	CopyCounter(CopyCounter &&) {}
+
+	static atomic<int> ncopies_;
+};
+
+atomic<int> CopyCounter::ncopies_(0);
+
+struct ForwardTest
+{
+	typedef ForwardTest This;
+
+	void Run(int a, int b, int c, int d, int e, unique_ptr<int> p, CopyCounter cc)
+	{
+		INVARIANT(a + b + c + d + e == 15);
+		INVARIANT(*p == 6);
+
+		BBlocks::Schedule(this, &This::Done);
+	}
+
+	void Done()
+	{
+		BBlocks::Wakeup();
+	}
+};
+
+void
+forward_test()
+{
+	BBlocks::Start();
+
+	ForwardTest test;
+
+	/*
+	 * More than four arguments, a move only argument and no copies on the way
+	 */
+	BBlocks::Schedule(&test, &ForwardTest::Run, 1, 2, 3, 4, 5,
+			  unique_ptr<int>(new int(6)), CopyCounter());
+	BBlocks::Wait();
+
+	INVARIANT(!CopyCounter::ncopies_);
+
+	/*
+	 * Lvalues are copied in to the routine once
+	 */
+	CopyCounter cc;
+	BBlocks::Schedule(&test, &ForwardTest::Run, 1, 2, 3, 4, 5,
+			  unique_ptr<int>(new int(6)), cc);
+	BBlocks::Wait();
+
+	INVARIANT(CopyCounter::ncopies_ == 1);
+
+	BBlocks::Shutdown();
+}
+
+//................................................................................ ClosureTest ....
+
+struct ClosureTest
+{
+	typedef ClosureTest This;
+
+	static const int MAX_CALLS = 1000;
+
+	ClosureTest() : count_(0) {}
+
+	void Run(int i)
+	{
+		if (i == MAX_CALLS) {
+			/*
+			 * Too big to be kept inline
+			 */
+			char big[2 * CLOSURE_INLINE_SIZE];
+			memset(big, 'x', sizeof(big));
+
+			BBlocks::Schedule([this, big] {
+				INVARIANT(big[sizeof(big) - 1] == 'x');
+				BBlocks::Wakeup();
+			});
+			return;
+		}
+
+		++count_;
+
+		if (i % 2) {
+			BBlocks::Schedule([this, i] { Run(i + 1); });
+		} else {
+			BBlocks::Yield([this, i] { Run(i + 1); });
+		}
+	}
+
+	atomic<int> count_;
+};
+
+void
+closure_test()
+{
+	/*
+	 * Small closures share one size class whatever they capture
+	 */
+	int a = 0;
+	uint64_t b[4] = { 0 };
+	auto fa = [a] { (void) a; };
+	auto fb = [a, b] { (void) a; (void) b; };
+
+	static_assert(BufferPool::Class<Closure<decltype(fa)> >()
+		      == BufferPool::Class<Closure<decltype(fb)> >(), "Inline closures differ");
+
+	BBlocks::Start();
+
+	ClosureTest test;
+	BBlocks::Schedule([&test] { test.Run(/*i=*/ 0); });
+	BBlocks::Wait();
+
+	INVARIANT(test.count_ == ClosureTest::MAX_CALLS);
+
+	BBlocks::Shutdown();
+}
+
+//................................................................................. RoutineEnd ....
+
+struct RoutineEndTest : NonBlockingThread::RoutineEndHook
+{
+	RoutineEndTest() : queued_(0), flushed_(0), nflush_(0) {}
+
+	void Queue(const int n)
+	{
+		for (int i = 0; i < n; ++i) {
+			++queued_;
+			NonBlockingThread::current_->AtRoutineEnd(this);
+		}
+
+		/*
+		 * Nothing is flushed until we return
+		 */
+		INVARIANT(!flushed_);
+	}
+
+	virtual void RoutineEnd() override
+	{
+		flushed_ = queued_;
+		++nflush_;
+	}
+
+	int queued_;
+	int flushed_;
+	atomic<int> nflush_;
+};
+
+void
+routine_end_test()
+{
+	BBlocks::Start(/*ncpu=*/ 1);
+
+	RoutineEndTest test;
+	BBlocks::Schedule(&test, &RoutineEndTest::Queue, /*n=*/ 10);
+
+	while (!test.nflush_) {
+		usleep(/*usec=*/ 1000);
+	}
+
+	INVARIANT(test.flushed_ == 10);
+	INVARIANT(test.nflush_ == 1);
+
+	BBlocks::Shutdown();
+}
+
+//................................................................................... MPSCQueue ....
+
+struct MPSCItem : InListElement<MPSCItem>
+{
+	int producer_;
+	int seq_;
+};
+
+struct MPSCProducer : Thread
+{
+	static const int NITEMS = 100 * 1000;
+
+	MPSCProducer(MPSCQueue<MPSCItem> & q, const int id)
+		: Thread("/mpscproducer/" + STR(id)), q_(q), items_(NITEMS)
+	{
+		for (int i = 0; i < NITEMS; ++i) {
+			items_[i].producer_ = id;
+			items_[i].seq_ = i;
+		}
+	}
+
+	virtual void * ThreadMain() override
+	{
+		for (int i = 0; i < NITEMS; ++i) {
+			q_.Push(&items_[i]);
+
+			if (!(i % 1000)) {
+				/*
+				 * Give the consumer a chance to park
+				 */
+				usleep(/*usec=*/ 100);
+			}
+		}
+
+		return NULL;
+	}
+
+	MPSCQueue<MPSCItem> & q_;
+	vector<MPSCItem> items_;
+};
+
+/*
+ * Producers pushing as fast as they can with the consumer parking now and then. Nothing
+ * is lost, a lost wakeup hangs the consumer, and every producer's items come out in the
+ * order they went in.
+ */
+void
+mpsc_test()
+{
+	static const int NPRODUCERS = 4;
+
+	MPSCQueue<MPSCItem> q("mpsc-test");
+	vector<MPSCProducer *> producers;
+
+	for (int i = 0; i < NPRODUCERS; ++i) {
+		producers.push_back(new MPSCProducer(q, i));
+	}
+
+	for (auto p : producers) {
+		p->StartBlockingThread();
+	}
+
+	vector<int> next(NPRODUCERS, 0);
+
+	for (int n = 0; n < NPRODUCERS * MPSCProducer::NITEMS; ++n) {
+		MPSCItem * item = q.Pop();
+		INVARIANT(item);
+		INVARIANT(item->seq_ == next[item->producer_]++);
+	}
+
+	/*
+	 * An element the filter turns down stays at the front
+	 */
+	MPSCItem items[2];
+	items[0].seq_ = 0;
+	items[1].seq_ = 1;
+
+	q.Push(&items[0]);
+	q.Push(&items[1]);
+
+	INVARIANT(!q.TryPopIf([](MPSCItem * item) { return item->seq_ != 0; }));
+	INVARIANT(q.Pop() == &items[0]);
+	INVARIANT(q.TryPopIf([](MPSCItem * item) { return item->seq_ != 0; }) == &items[1]);
+
+	for (auto p : producers) {
+		p->Stop();
+		delete p;
+	}
+
+	INVARIANT(q.IsEmpty());
+}
+
 int
 main(int argc, char ** argv)
 {
     InitTestSetup();
 
+    TEST(sizeclass_test);
+    TEST(freelist_test);
+    TEST(remotefree_test);
+    TEST(trim_test);
     TEST(bufferpool_test);
     TEST(pingpong_test);
     TEST(parallel_test);
+    TEST(workstealing_test);
+    TEST(forward_test);
+    TEST(closure_test);
+    TEST(routine_end_test);
+    TEST(mpsc_test);
 
     TeardownTestSetup();
 